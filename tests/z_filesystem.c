@@ -1,5 +1,36 @@
+// Before picotest includes system headers, for the POSIX functions z_filesystem.h and the tests use
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include "picotest_logger.h"
 
+#include <stdlib.h>
+
+// Allocator that can be made to run out of memory
+static int test_allocations_left = -1; // -1 for no limit
+
+static void *test_malloc(size_t size)
+{
+	if (test_allocations_left == 0)
+		return NULL;
+	if (test_allocations_left > 0)
+		--test_allocations_left;
+	return malloc(size);
+}
+
+static void *test_realloc(void *memory, size_t size)
+{
+	if (test_allocations_left == 0)
+		return NULL;
+	if (test_allocations_left > 0)
+		--test_allocations_left;
+	return realloc(memory, size);
+}
+
+#define ZFS_MALLOC(size, context) ((void)(context), test_malloc(size))
+#define ZFS_REALLOC(memory, size, context) ((void)(context), test_realloc(memory, size))
+#define ZFS_FREE(memory, context) ((void)(context), free(memory))
+
 #define Z_FS_IMPLEMENTATION
 //#define Z_FS_NO_PATH
 //#define Z_FS_NO_FILE
@@ -201,6 +232,84 @@ PICOTEST_CASE(path_buffer_left)
 	zfs_path_set_extension(buffer, sizeof(buffer), buffer, ".bmp");
 	assert_normalized_strcmp(buffer, "/root/another/path.bmp");
 }
+
+PICOTEST_CASE(path_view)
+{
+	char buffer[16];
+	ZFSPathView parts[4];
+	parts[0] = zfs_path_view("/usr");
+	parts[1] = zfs_path_view("/local/");
+	parts[2] = zfs_path_view("bin");
+	parts[3] = zfs_path_view("file.txt");
+
+	// Sized first, then written, like snprintf
+	PICOTEST_ASSERT(zfs_path_view_join(NULL, 0, parts, 4) == 23);
+	PICOTEST_ASSERT(zfs_path_view_join(buffer, sizeof(buffer), parts, 4) == 23);
+	assert_normalized_strcmp(buffer, "/usr/local/bin/");
+	char large[32];
+	PICOTEST_ASSERT(zfs_path_view_join(large, sizeof(large), parts, 4) == 23);
+	assert_normalized_strcmp(large, "/usr/local/bin/file.txt");
+
+	// Views need no '\0'
+	ZFSPathView path = zfs_path_view("/usr/bin/file.txt.gz");
+	path.length -= 3;
+	ZFSPathView part = zfs_path_view_extension(path);
+	PICOTEST_ASSERT(part.length == 4 && memcmp(part.data, ".txt", 4) == 0);
+	part = zfs_path_view_basename(path);
+	PICOTEST_ASSERT(part.length == 8 && memcmp(part.data, "file.txt", 8) == 0);
+	part = zfs_path_view_basename_without_extension(path);
+	PICOTEST_ASSERT(part.length == 4 && memcmp(part.data, "file", 4) == 0);
+	part = zfs_path_view_directory(path);
+	PICOTEST_ASSERT(part.length == 9 && memcmp(part.data, "/usr/bin/", 9) == 0);
+	PICOTEST_ASSERT(zfs_path_view_set_extension(buffer, sizeof(buffer), path, zfs_path_view(".bmp")) == 17);
+	assert_strcmp(buffer, "/usr/bin/file.b");
+	PICOTEST_ASSERT(zfs_path_view_copy(buffer, sizeof(buffer), part) == 9);
+	assert_strcmp(buffer, "/usr/bin/");
+
+	ZFSPathBuilder builder;
+	zfs_path_builder_begin(&builder);
+	PICOTEST_ASSERT(zfs_path_builder_push(&builder, zfs_path_view("/root")) == ZFS_TRUE);
+	zfs_ll length = builder.length;
+	PICOTEST_ASSERT(zfs_path_builder_push(&builder, zfs_path_view("dir")) == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_path_builder_push(&builder, zfs_path_view("file")) == ZFS_TRUE);
+	assert_normalized_strcmp(builder.path, "/root/dir/file");
+	zfs_path_builder_pop(&builder);
+	assert_normalized_strcmp(builder.path, "/root/dir");
+	zfs_path_builder_truncate(&builder, length);
+	assert_normalized_strcmp(builder.path, "/root");
+	zfs_path_builder_pop(&builder);
+	assert_normalized_strcmp(builder.path, "/");
+
+	// Long paths move to the heap
+	int i;
+	for (i = 0; i < 100; ++i)
+		PICOTEST_ASSERT(zfs_path_builder_push(&builder, zfs_path_view("segment")) == ZFS_TRUE);
+	PICOTEST_ASSERT(builder.length == 800 && builder.path != builder.inline_path);
+	PICOTEST_ASSERT(builder.path[builder.length] == '\0');
+	zfs_path_builder_end(&builder);
+	PICOTEST_ASSERT(builder.length == 0 && builder.path == builder.inline_path);
+}
+
+static void assert_canonical(const char *path, const char *expected)
+{
+	char buffer[64];
+	strcpy(buffer, path);
+	PICOTEST_ASSERT(zfs_path_canonicalize(buffer) == (zfs_ll)strlen(expected));
+	assert_normalized_strcmp(buffer, expected);
+}
+
+PICOTEST_CASE(path_canonicalize)
+{
+	assert_canonical("a//b/./c/../d", "a/b/d");
+	assert_canonical("/usr/local/../bin/", "/usr/bin");
+	assert_canonical("/../x", "/x");
+	assert_canonical("//", "/");
+	assert_canonical("../a/../../b", "../../b");
+	assert_canonical("a/..", ".");
+	assert_canonical("./", ".");
+	assert_canonical("", ".");
+	assert_canonical("a\\b\\..", "a");
+}
 #endif
 
 #ifndef Z_FS_NO_FILE
@@ -236,6 +345,1124 @@ PICOTEST_CASE(directory)
 }
 #endif
 
+#if !defined(Z_FS_NO_DIRECTORY) && defined(__linux)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// walk_test/{a/{b/{c.txt, loop -> ..}, e.txt}, d.txt, skip/f.txt}
+static void create_walk_tree(void)
+{
+	mkdir("walk_test", 0755);
+	mkdir("walk_test/a", 0755);
+	mkdir("walk_test/a/b", 0755);
+	mkdir("walk_test/skip", 0755);
+	zfs_file_touch("walk_test/a/b/c.txt");
+	zfs_file_touch("walk_test/a/e.txt");
+	zfs_file_touch("walk_test/d.txt");
+	zfs_file_touch("walk_test/skip/f.txt");
+	PICOTEST_ASSERT(symlink("..", "walk_test/a/b/loop") == 0);
+}
+
+typedef struct WalkCounts
+{
+	int entries;
+	int directories;
+	int posts;
+	int loops;
+	int max_depth;
+	int a_post_order; // Order of the post callbacks for "a/b" and "a"
+	int b_post_order;
+	int errors;       // Other than loops
+} WalkCounts;
+
+static ZFSWalkAction count_pre(const ZFSWalkEntry *entry, void *user_data)
+{
+	WalkCounts *counts = (WalkCounts*)user_data;
+	++counts->entries;
+	if (entry->type == ZFS_TYPE_DIRECTORY)
+		++counts->directories;
+	if (entry->depth > counts->max_depth)
+		counts->max_depth = entry->depth;
+	PICOTEST_ASSERT(strlen(entry->path) == (size_t)entry->path_length);
+	PICOTEST_ASSERT(strcmp(entry->name, "a") != 0 || entry->type == ZFS_TYPE_DIRECTORY);
+	PICOTEST_ASSERT(strcmp(entry->name, "loop") != 0 || strcmp(entry->path, "a/b/loop") == 0);
+	return (strcmp(entry->path, "skip") == 0 ? ZFS_WALK_SKIP : ZFS_WALK_CONTINUE);
+}
+
+static ZFSWalkAction count_post(const ZFSWalkEntry *entry, void *user_data)
+{
+	WalkCounts *counts = (WalkCounts*)user_data;
+	++counts->posts;
+	if (entry->error == ELOOP)
+		++counts->loops;
+	else if (entry->error != 0)
+		++counts->errors;
+	if (strcmp(entry->path, "a") == 0)
+		counts->a_post_order = counts->posts;
+	if (strcmp(entry->path, "a/b") == 0)
+		counts->b_post_order = counts->posts;
+	return ZFS_WALK_CONTINUE;
+}
+
+static ZFSWalkAction delete_entry(const ZFSWalkEntry *entry, void *user_data)
+{
+	(void)user_data;
+	PICOTEST_ASSERT(unlinkat(entry->dir_fd, entry->name, entry->type == ZFS_TYPE_DIRECTORY ? AT_REMOVEDIR : 0) == 0);
+	return ZFS_WALK_CONTINUE;
+}
+
+static ZFSWalkAction delete_file(const ZFSWalkEntry *entry, void *user_data)
+{
+	return (entry->type == ZFS_TYPE_DIRECTORY ? ZFS_WALK_CONTINUE : delete_entry(entry, user_data));
+}
+
+PICOTEST_CASE(walk)
+{
+	create_walk_tree();
+
+	ZFSWalkOptions options;
+	memset(&options, 0, sizeof(options));
+	options.pre = count_pre;
+	options.post = count_post;
+
+	WalkCounts counts;
+	memset(&counts, 0, sizeof(counts));
+	options.user_data = &counts;
+	PICOTEST_ASSERT(zfs_walk("walk_test", &options) == ZFS_TRUE);
+	PICOTEST_ASSERT(counts.entries == 7); // Not skip/f.txt
+	PICOTEST_ASSERT(counts.directories == 3);
+	PICOTEST_ASSERT(counts.posts == 2); // Not skip
+	PICOTEST_ASSERT(counts.b_post_order < counts.a_post_order);
+	PICOTEST_ASSERT(counts.max_depth == 3);
+	PICOTEST_ASSERT(counts.loops == 0);
+
+	memset(&counts, 0, sizeof(counts));
+	options.max_depth = 1;
+	PICOTEST_ASSERT(zfs_walk("walk_test", &options) == ZFS_TRUE);
+	PICOTEST_ASSERT(counts.entries == 3);
+	PICOTEST_ASSERT(counts.max_depth == 1);
+	PICOTEST_ASSERT(counts.posts == 1);
+
+	// "loop" leads back to "a", which has been visited already
+	memset(&counts, 0, sizeof(counts));
+	options.max_depth = 0;
+	options.flags = ZFS_WALK_FOLLOW_SYMLINKS;
+	PICOTEST_ASSERT(zfs_walk("walk_test", &options) == ZFS_TRUE);
+	PICOTEST_ASSERT(counts.entries == 7);
+	PICOTEST_ASSERT(counts.directories == 4);
+	PICOTEST_ASSERT(counts.loops == 1);
+
+	PICOTEST_ASSERT(zfs_walk("walk_test_missing", &options) == ZFS_FALSE);
+
+	// Running out of memory fails the walk, even where it only kept a directory from being entered
+	options.flags = 0;
+	int allocations;
+	for (allocations = 0;; ++allocations)
+	{
+		memset(&counts, 0, sizeof(counts));
+		test_allocations_left = allocations;
+		zfs_bool ok = zfs_walk("walk_test", &options);
+		test_allocations_left = -1;
+		PICOTEST_ASSERT(!ok || (counts.entries == 7 && counts.errors == 0));
+		if (ok)
+			break;
+	}
+
+	// Delete files before and directories after their contents
+	memset(&options, 0, sizeof(options));
+	options.pre = delete_file;
+	options.post = delete_entry;
+	PICOTEST_ASSERT(zfs_walk("walk_test", &options) == ZFS_TRUE);
+	PICOTEST_ASSERT(rmdir("walk_test") == 0);
+}
+
+typedef struct ParallelWalkCounts
+{
+	int entries;
+	int directories;
+	long long path_lengths;
+	int stop_after;
+} ParallelWalkCounts;
+
+static ZFSWalkAction count_batch(const ZFSWalkEntry *entries, int count, void *user_data)
+{
+	ParallelWalkCounts *counts = (ParallelWalkCounts*)user_data;
+	int i, directories = 0;
+	long long path_lengths = 0;
+	for (i = 0; i < count; ++i)
+	{
+		PICOTEST_ASSERT(strlen(entries[i].path) == (size_t)entries[i].path_length);
+		PICOTEST_ASSERT(entries[i].name[0] != '/' && strstr(entries[i].path, entries[i].name) != NULL);
+		if (entries[i].type == ZFS_TYPE_DIRECTORY)
+			++directories;
+		path_lengths += entries[i].path_length;
+	}
+	__atomic_add_fetch(&counts->directories, directories, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&counts->path_lengths, path_lengths, __ATOMIC_RELAXED);
+	int entries_seen = __atomic_add_fetch(&counts->entries, count, __ATOMIC_RELAXED);
+	return (counts->stop_after > 0 && entries_seen >= counts->stop_after ? ZFS_WALK_STOP : ZFS_WALK_CONTINUE);
+}
+
+static ZFSWalkAction count_serial(const ZFSWalkEntry *entry, void *user_data)
+{
+	return count_batch(entry, 1, user_data);
+}
+
+static ZFSWalkAction skip_first_directory(const ZFSWalkEntry *entry, void *user_data)
+{
+	(void)user_data;
+	return (strcmp(entry->path, "d0") == 0 ? ZFS_WALK_SKIP : ZFS_WALK_CONTINUE);
+}
+
+PICOTEST_CASE(walk_parallel)
+{
+	// More directories in one place than are queued with open fds
+	char path[64];
+	int i, j;
+	mkdir("pwalk_test", 0755);
+	for (i = 0; i < 300; ++i)
+	{
+		sprintf(path, "pwalk_test/d%i", i);
+		mkdir(path, 0755);
+		for (j = 0; j < 2; ++j)
+		{
+			sprintf(path, "pwalk_test/d%i/e%i", i, j);
+			mkdir(path, 0755);
+			sprintf(path, "pwalk_test/d%i/e%i/f", i, j);
+			zfs_file_touch(path);
+		}
+	}
+
+	ParallelWalkCounts serial;
+	memset(&serial, 0, sizeof(serial));
+	ZFSWalkOptions options;
+	memset(&options, 0, sizeof(options));
+	options.pre = count_serial;
+	options.user_data = &serial;
+	PICOTEST_ASSERT(zfs_walk("pwalk_test", &options) == ZFS_TRUE);
+	PICOTEST_ASSERT(serial.entries == 300 + 600 + 600);
+
+	ParallelWalkCounts counts;
+	memset(&counts, 0, sizeof(counts));
+	ZFSParallelWalkOptions parallel_options;
+	memset(&parallel_options, 0, sizeof(parallel_options));
+	parallel_options.batch = count_batch;
+	parallel_options.user_data = &counts;
+	parallel_options.thread_count = 4;
+	parallel_options.batch_size = 7;
+	PICOTEST_ASSERT(zfs_walk_parallel("pwalk_test", &parallel_options) == ZFS_TRUE);
+	PICOTEST_ASSERT(counts.entries == serial.entries);
+	PICOTEST_ASSERT(counts.directories == serial.directories);
+	PICOTEST_ASSERT(counts.path_lengths == serial.path_lengths);
+
+	memset(&counts, 0, sizeof(counts));
+	parallel_options.filter = skip_first_directory;
+	parallel_options.max_depth = 2;
+	PICOTEST_ASSERT(zfs_walk_parallel("pwalk_test", &parallel_options) == ZFS_TRUE);
+	PICOTEST_ASSERT(counts.entries == 300 + 598);
+
+	memset(&counts, 0, sizeof(counts));
+	counts.stop_after = 100;
+	PICOTEST_ASSERT(zfs_walk_parallel("pwalk_test", &parallel_options) == ZFS_TRUE);
+	PICOTEST_ASSERT(counts.entries < serial.entries);
+
+	PICOTEST_ASSERT(zfs_walk_parallel("pwalk_test_missing", &parallel_options) == ZFS_FALSE);
+
+	memset(&options, 0, sizeof(options));
+	options.pre = delete_file;
+	options.post = delete_entry;
+	PICOTEST_ASSERT(zfs_walk("pwalk_test", &options) == ZFS_TRUE);
+	PICOTEST_ASSERT(rmdir("pwalk_test") == 0);
+}
+
+PICOTEST_CASE(directory_batch)
+{
+	// Long names so the smallest buffer needs many refills
+	char path[128];
+	int i;
+	mkdir("batch_test", 0755);
+	mkdir("batch_test/subdirectory", 0755);
+	for (i = 0; i < 200; ++i)
+	{
+		sprintf(path, "batch_test/a_rather_long_file_name_to_fill_the_buffer_%03i", i);
+		zfs_file_touch(path);
+	}
+
+	char buffer[ZFS_DIRECTORY_MIN_BUFFER_SIZE];
+	ZFSDirEntry entries[5];
+	ZFSDirBatch batch;
+	PICOTEST_ASSERT(zfs_directory_batch_begin(&batch, "batch_test", buffer, sizeof(buffer) - 1) == ZFS_FALSE);
+	PICOTEST_ASSERT(zfs_directory_batch_begin(&batch, "batch_test", buffer, sizeof(buffer)) == ZFS_TRUE);
+	int files = 0, directories = 0, count;
+	while ((count = zfs_directory_batch_next(&batch, entries, 5)) > 0)
+	{
+		PICOTEST_ASSERT(count <= 5);
+		for (i = 0; i < count; ++i)
+		{
+			struct stat st;
+			PICOTEST_ASSERT(fstatat(batch.fd, entries[i].name, &st, AT_SYMLINK_NOFOLLOW) == 0);
+			PICOTEST_ASSERT((zfs_ll)st.st_ino == entries[i].inode);
+			if (entries[i].type == ZFS_TYPE_DIRECTORY)
+				++directories;
+			else if (entries[i].type == ZFS_TYPE_FILE)
+				++files;
+		}
+	}
+	PICOTEST_ASSERT(count == 0);
+	zfs_directory_batch_end(&batch);
+	PICOTEST_ASSERT(files == 200 && directories == 1);
+
+	ZFSDir dir;
+	int dir_count = 0, dir_directories = 0;
+	PICOTEST_ASSERT(zfs_directory_begin(&dir, "batch_test") == ZFS_TRUE);
+	do
+	{
+		++dir_count;
+		if (zfs_directory_is_directory(&dir))
+			++dir_directories;
+	} while (zfs_directory_next(&dir));
+	zfs_directory_end(&dir);
+	PICOTEST_ASSERT(dir_count == 201 && dir_directories == 1);
+
+	PICOTEST_ASSERT(zfs_directory_batch_begin(&batch, "batch_test_missing", buffer, sizeof(buffer)) == ZFS_FALSE);
+
+	for (i = 0; i < 200; ++i)
+	{
+		sprintf(path, "batch_test/a_rather_long_file_name_to_fill_the_buffer_%03i", i);
+		zfs_file_delete(path);
+	}
+	rmdir("batch_test/subdirectory");
+	PICOTEST_ASSERT(rmdir("batch_test") == 0);
+}
+
+PICOTEST_CASE(directory_info)
+{
+	mkdir("info_test", 0755);
+	mkdir("info_test/subdirectory", 0755);
+	FILE *file = fopen("info_test/file", "wb");
+	fwrite("0123456789", 1, 10, file);
+	fclose(file);
+	chmod("info_test/file", 0640);
+	struct timespec times[2];
+	times[0].tv_sec = times[1].tv_sec = 1500000000;
+	times[0].tv_nsec = times[1].tv_nsec = 123456789;
+	utimensat(AT_FDCWD, "info_test/file", times, 0);
+	struct stat st;
+	stat("info_test/file", &st);
+
+	ZFSDir dir;
+	ZFSEntryInfo info;
+	int seen = 0;
+	PICOTEST_ASSERT(zfs_directory_begin(&dir, "info_test") == ZFS_TRUE);
+	do
+	{
+		PICOTEST_ASSERT(zfs_directory_current_info(&dir, ZFS_INFO_TYPE | ZFS_INFO_INODE, &info) == ZFS_TRUE);
+		if (info.type != ZFS_TYPE_FILE)
+			continue;
+		++seen;
+		PICOTEST_ASSERT(info.inode == (zfs_ll)st.st_ino);
+		PICOTEST_ASSERT(zfs_directory_current_info(&dir, ZFS_INFO_SIZE | ZFS_INFO_MTIME, &info) == ZFS_TRUE);
+		PICOTEST_ASSERT((info.fields & ZFS_INFO_TYPE) && info.type == ZFS_TYPE_FILE);
+		PICOTEST_ASSERT(info.size == 10);
+		PICOTEST_ASSERT(info.mtime_seconds == 1500000000 && info.mtime_nanoseconds == 123456789);
+		PICOTEST_ASSERT(zfs_directory_current_info(&dir, ZFS_INFO_MODE, &info) == ZFS_TRUE);
+		PICOTEST_ASSERT(info.mode == 0640);
+	} while (zfs_directory_next(&dir));
+	zfs_directory_end(&dir);
+	PICOTEST_ASSERT(seen == 1);
+
+	char buffer[ZFS_DIRECTORY_MIN_BUFFER_SIZE];
+	ZFSDirEntry entries[4];
+	ZFSDirBatch batch;
+	PICOTEST_ASSERT(zfs_directory_batch_begin(&batch, "info_test", buffer, sizeof(buffer)) == ZFS_TRUE);
+	int i, count = zfs_directory_batch_next(&batch, entries, 4);
+	PICOTEST_ASSERT(count == 2);
+	for (i = 0; i < count; ++i)
+	{
+		PICOTEST_ASSERT(zfs_directory_batch_info(&batch, &entries[i], ZFS_INFO_ALL, &info) == ZFS_TRUE);
+		PICOTEST_ASSERT(info.fields == ZFS_INFO_ALL);
+		if (strcmp(entries[i].name, "subdirectory") == 0)
+		{
+			PICOTEST_ASSERT(info.type == ZFS_TYPE_DIRECTORY && (info.mode & 0700) == 0700);
+		}
+		else
+		{
+			PICOTEST_ASSERT(info.type == ZFS_TYPE_FILE && info.size == 10 && info.mode == 0640);
+		}
+	}
+
+	PICOTEST_ASSERT(zfs_entry_info_at(batch.fd, "file", ZFS_INFO_MTIME, &info) == ZFS_TRUE);
+	PICOTEST_ASSERT(info.mtime_nanoseconds == 123456789);
+	PICOTEST_ASSERT(zfs_entry_info_at(batch.fd, "missing", ZFS_INFO_SIZE, &info) == ZFS_FALSE);
+	zfs_directory_batch_end(&batch);
+
+	zfs_file_delete("info_test/file");
+	rmdir("info_test/subdirectory");
+	PICOTEST_ASSERT(rmdir("info_test") == 0);
+}
+
+PICOTEST_CASE(directory_list)
+{
+	// Names share long prefixes so the sort has to look deep
+	char path[128];
+	int i;
+	mkdir("list_test", 0755);
+	mkdir("list_test/prefix_directory", 0755);
+	for (i = 199; i >= 0; --i)
+	{
+		sprintf(path, "list_test/prefix_%i", i);
+		FILE *file = fopen(path, "wb");
+		fwrite("0123456789", 1, i % 10, file);
+		fclose(file);
+	}
+
+	// Too small for the listing, so the arena has to grow
+	char memory[256];
+	ZFSArena arena;
+	ZFSDirList list;
+	zfs_arena_begin(&arena, memory, sizeof(memory));
+	PICOTEST_ASSERT(zfs_directory_list(&arena, "list_test", ZFS_LIST_SORT | ZFS_LIST_SIZES, &list) == ZFS_TRUE);
+	PICOTEST_ASSERT(list.count == 201);
+	PICOTEST_ASSERT(arena.blocks != NULL);
+	int directories = 0;
+	for (i = 0; i < list.count; ++i)
+	{
+		const char *name = list.names + list.name_offsets[i];
+		if (i > 0)
+			PICOTEST_ASSERT(strcmp(list.names + list.name_offsets[i - 1], name) < 0, "\"%s\" sorted before \"%s\"", list.names + list.name_offsets[i - 1], name);
+		if (list.types[i] == ZFS_TYPE_DIRECTORY)
+		{
+			++directories;
+			assert_strcmp(name, "prefix_directory");
+		}
+		else
+		{
+			PICOTEST_ASSERT(list.types[i] == ZFS_TYPE_FILE);
+			PICOTEST_ASSERT(list.sizes[i] == atoi(name + 7) % 10);
+		}
+	}
+	PICOTEST_ASSERT(directories == 1);
+
+	PICOTEST_ASSERT(zfs_directory_list(&arena, "list_test", 0, &list) == ZFS_TRUE);
+	PICOTEST_ASSERT(list.count == 201 && list.sizes == NULL);
+
+	PICOTEST_ASSERT(zfs_directory_list(&arena, "list_test/prefix_directory", ZFS_LIST_SORT, &list) == ZFS_TRUE);
+	PICOTEST_ASSERT(list.count == 0);
+	PICOTEST_ASSERT(zfs_directory_list(&arena, "list_test_missing", ZFS_LIST_SORT, &list) == ZFS_FALSE);
+	zfs_arena_end(&arena);
+	PICOTEST_ASSERT(arena.blocks == NULL);
+
+	for (i = 0; i < 200; ++i)
+	{
+		sprintf(path, "list_test/prefix_%i", i);
+		zfs_file_delete(path);
+	}
+	rmdir("list_test/prefix_directory");
+	PICOTEST_ASSERT(rmdir("list_test") == 0);
+}
+
+PICOTEST_CASE(glob)
+{
+	const char *patterns[] = { "src/**/*.{c,h}", "docs/[a-c]?.txt", "*.md", "\\*" };
+	ZFSGlob glob;
+	PICOTEST_ASSERT(zfs_glob_compile(&glob, patterns, 4) == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "src/main.c") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "src/deep/er/main.h") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "./src//x.c") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "src/main.cpp") == ZFS_FALSE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "src") == ZFS_FALSE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "docs/b1.txt") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "docs/d1.txt") == ZFS_FALSE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "docs/b12.txt") == ZFS_FALSE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "README.md") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "docs/README.md") == ZFS_FALSE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "*") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "x") == ZFS_FALSE);
+
+	// Directories that can not lead to a match are pruned
+	int state;
+	PICOTEST_ASSERT(zfs_glob_step(&glob, ZFS_GLOB_START, "build", &state) == 0);
+	PICOTEST_ASSERT(zfs_glob_step(&glob, ZFS_GLOB_START, "src", &state) == ZFS_GLOB_DESCEND);
+	PICOTEST_ASSERT(zfs_glob_step(&glob, state, "a.c", &state) == (ZFS_GLOB_MATCH | ZFS_GLOB_DESCEND));
+	zfs_glob_free(&glob);
+
+	const char *generic[] = { "a*b?c*[!x]", "**", "[]a]" };
+	PICOTEST_ASSERT(zfs_glob_compile(&glob, generic, 1) == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "aXXbYcZZy") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "abbcccd") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "abcx") == ZFS_FALSE);
+	zfs_glob_free(&glob);
+	PICOTEST_ASSERT(zfs_glob_compile(&glob, generic + 1, 2) == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "any/thing") == ZFS_TRUE);
+	zfs_glob_free(&glob);
+	PICOTEST_ASSERT(zfs_glob_compile(&glob, generic + 2, 1) == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "]") == ZFS_TRUE && zfs_glob_match(&glob, "a") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_glob_match(&glob, "b") == ZFS_FALSE);
+	zfs_glob_free(&glob);
+
+	mkdir("glob_test", 0755);
+	mkdir("glob_test/src", 0755);
+	mkdir("glob_test/src/sub", 0755);
+	mkdir("glob_test/build", 0755);
+	zfs_file_touch("glob_test/src/main.c");
+	zfs_file_touch("glob_test/src/main.o");
+	zfs_file_touch("glob_test/src/sub/util.h");
+	zfs_file_touch("glob_test/build/main.c");
+	zfs_file_touch("glob_test/README.md");
+
+	ZFSArena arena;
+	ZFSGlobResult result;
+	zfs_arena_begin(&arena, NULL, 0);
+	PICOTEST_ASSERT(zfs_glob(&arena, "glob_test", patterns, 4, &result) == ZFS_TRUE);
+	PICOTEST_ASSERT(result.count == 3);
+	assert_strcmp(result.paths[0], "README.md");
+	assert_strcmp(result.paths[1], "src/main.c");
+	assert_strcmp(result.paths[2], "src/sub/util.h");
+	PICOTEST_ASSERT(zfs_glob(&arena, "glob_test_missing", patterns, 4, &result) == ZFS_FALSE);
+
+	// Running out of memory anywhere, stepping the glob included, never gives part of the matches
+	int allocations;
+	for (allocations = 0;; ++allocations)
+	{
+		test_allocations_left = allocations;
+		zfs_bool ok = zfs_glob(&arena, "glob_test", patterns, 4, &result);
+		test_allocations_left = -1;
+		PICOTEST_ASSERT(ok ? result.count == 3 : result.count == 0);
+		if (ok)
+			break;
+	}
+	zfs_arena_end(&arena);
+
+	zfs_file_delete("glob_test/src/main.c");
+	zfs_file_delete("glob_test/src/main.o");
+	zfs_file_delete("glob_test/src/sub/util.h");
+	zfs_file_delete("glob_test/build/main.c");
+	zfs_file_delete("glob_test/README.md");
+	rmdir("glob_test/src/sub");
+	rmdir("glob_test/src");
+	rmdir("glob_test/build");
+	PICOTEST_ASSERT(rmdir("glob_test") == 0);
+}
+
+PICOTEST_CASE(glob_many_patterns)
+{
+	// Enough patterns for several words per state, with literal, suffix and generic segments
+	static char texts[300][32];
+	const char *patterns[300];
+	int i, round;
+	for (i = 0; i < 100; ++i)
+	{
+		sprintf(texts[i * 3], "dir%i/*.e%i", i, i);
+		sprintf(texts[i * 3 + 1], "**/name%i", i);
+		sprintf(texts[i * 3 + 2], "gen%i/?x*", i);
+	}
+	for (i = 0; i < 300; ++i)
+		patterns[i] = texts[i];
+	ZFSGlob glob;
+	PICOTEST_ASSERT(zfs_glob_compile(&glob, patterns, 300) == ZFS_TRUE);
+
+	// The second round steps through cached transitions
+	char path[64];
+	for (round = 0; round < 2; ++round)
+	{
+		for (i = 0; i < 100; ++i)
+		{
+			sprintf(path, "dir%i/file.e%i", i, i);
+			PICOTEST_ASSERT(zfs_glob_match(&glob, path) == ZFS_TRUE);
+			sprintf(path, "dir%i/file.e%i", i, (i + 1) % 100);
+			PICOTEST_ASSERT(zfs_glob_match(&glob, path) == ZFS_FALSE);
+			sprintf(path, "dir%i/deep/name%i", i, 99 - i);
+			PICOTEST_ASSERT(zfs_glob_match(&glob, path) == ZFS_TRUE);
+			sprintf(path, "dir%i/name%i.e%i", i, i, i);
+			PICOTEST_ASSERT(zfs_glob_match(&glob, path) == ZFS_TRUE);
+			sprintf(path, "gen%i/axe", i);
+			PICOTEST_ASSERT(zfs_glob_match(&glob, path) == ZFS_TRUE);
+			sprintf(path, "gen%i/xa", i);
+			PICOTEST_ASSERT(zfs_glob_match(&glob, path) == ZFS_FALSE);
+		}
+	}
+
+	zfs_glob_free(&glob);
+
+	// A name can end with suffixes of several lengths
+	const char *suffixes[] = { "*.c", "*.tar.gz", "*gz", "a/*.gz" };
+	PICOTEST_ASSERT(zfs_glob_compile(&glob, suffixes, 4) == ZFS_TRUE);
+	int state;
+	for (round = 0; round < 2; ++round)
+	{
+		PICOTEST_ASSERT(zfs_glob_step(&glob, ZFS_GLOB_START, "x.tar.gz", &state) == ZFS_GLOB_MATCH);
+		PICOTEST_ASSERT(zfs_glob_step(&glob, ZFS_GLOB_START, "x.gz", &state) == ZFS_GLOB_MATCH);
+		PICOTEST_ASSERT(zfs_glob_step(&glob, ZFS_GLOB_START, "x.z", &state) == 0);
+		PICOTEST_ASSERT(zfs_glob_step(&glob, ZFS_GLOB_START, "a", &state) == ZFS_GLOB_DESCEND);
+		PICOTEST_ASSERT(zfs_glob_step(&glob, state, "b.gz", &state) == ZFS_GLOB_MATCH);
+	}
+	zfs_glob_free(&glob);
+}
+
+typedef struct WalkPaths
+{
+	char paths[32][64];
+	int count;
+} WalkPaths;
+
+static ZFSWalkAction collect_path(const ZFSWalkEntry *entry, void *user_data)
+{
+	WalkPaths *paths = (WalkPaths*)user_data;
+	PICOTEST_ASSERT(paths->count < 32);
+	strcpy(paths->paths[paths->count++], entry->path);
+	return ZFS_WALK_CONTINUE;
+}
+
+static zfs_bool has_path(const WalkPaths *paths, const char *path)
+{
+	int i;
+	for (i = 0; i < paths->count; ++i)
+	{
+		if (strcmp(paths->paths[i], path) == 0)
+			return ZFS_TRUE;
+	}
+	return ZFS_FALSE;
+}
+
+static void write_file(const char *filename, const char *text)
+{
+	FILE *file = fopen(filename, "wb");
+	fputs(text, file);
+	fclose(file);
+}
+
+PICOTEST_CASE(walk_ignore)
+{
+	mkdir("ignore_test", 0755);
+	mkdir("ignore_test/build", 0755);
+	mkdir("ignore_test/logs", 0755);
+	mkdir("ignore_test/sub", 0755);
+	write_file("ignore_test/.gitignore", "# Output\nbuild/\n*.o\n!keep.o\n/top.txt\nlogs/**  \n\n");
+	write_file("ignore_test/sub/.gitignore", "!a.o\r\n");
+	zfs_file_touch("ignore_test/build/main.o");
+	zfs_file_touch("ignore_test/logs/today.txt");
+	zfs_file_touch("ignore_test/top.txt");
+	zfs_file_touch("ignore_test/a.o");
+	zfs_file_touch("ignore_test/keep.o");
+	zfs_file_touch("ignore_test/sub/top.txt");
+	zfs_file_touch("ignore_test/sub/build");
+	zfs_file_touch("ignore_test/sub/a.o");
+	zfs_file_touch("ignore_test/sub/b.o");
+
+	WalkPaths paths;
+	paths.count = 0;
+	WalkCounts counts;
+	memset(&counts, 0, sizeof(counts));
+	ZFSWalkOptions options;
+	memset(&options, 0, sizeof(options));
+	options.pre = collect_path;
+	options.user_data = &paths;
+	options.ignore_file = ".gitignore";
+	PICOTEST_ASSERT(zfs_walk("ignore_test", &options) == ZFS_TRUE);
+	PICOTEST_ASSERT(paths.count == 8, "%i entries", paths.count);
+	PICOTEST_ASSERT(has_path(&paths, ".gitignore"));
+	PICOTEST_ASSERT(has_path(&paths, "keep.o"));
+	PICOTEST_ASSERT(has_path(&paths, "logs"));
+	PICOTEST_ASSERT(has_path(&paths, "sub"));
+	PICOTEST_ASSERT(has_path(&paths, "sub/.gitignore"));
+	PICOTEST_ASSERT(has_path(&paths, "sub/top.txt"));
+	PICOTEST_ASSERT(has_path(&paths, "sub/build"));
+	PICOTEST_ASSERT(has_path(&paths, "sub/a.o"));
+	PICOTEST_ASSERT(has_path(&paths, "ignore_test") == ZFS_FALSE);
+
+	options.pre = count_pre;
+	options.post = count_post;
+	options.user_data = &counts;
+	PICOTEST_ASSERT(zfs_walk("ignore_test", &options) == ZFS_TRUE);
+	PICOTEST_ASSERT(counts.entries == 8 && counts.posts == 2);
+
+	memset(&options, 0, sizeof(options));
+	options.pre = delete_file;
+	options.post = delete_entry;
+	PICOTEST_ASSERT(zfs_walk("ignore_test", &options) == ZFS_TRUE);
+	PICOTEST_ASSERT(rmdir("ignore_test") == 0);
+}
+
+PICOTEST_CASE(watch)
+{
+	mkdir("watch_test", 0755);
+	mkdir("watch_test/old", 0755);
+	ZFSWatch watch;
+	PICOTEST_ASSERT(zfs_watch_begin(&watch, "watch_test_missing", 0) == ZFS_FALSE);
+	PICOTEST_ASSERT(zfs_watch_begin(&watch, "watch_test", 200) == ZFS_TRUE);
+
+	// A burst of changes to one file, and a directory that is filled before it can be watched
+	write_file("watch_test/file", "a");
+	write_file("watch_test/file", "b");
+	mkdir("watch_test/new", 0755);
+	zfs_file_touch("watch_test/new/inner");
+	zfs_file_touch("watch_test/old/deep");
+
+	ZFSWatchEvent events[16];
+	PICOTEST_ASSERT(zfs_watch_read(&watch, events, 16) == 0);
+
+	int file_events = 0, file_flags = 0, new_flags = 0, inner_flags = 0, deep_flags = 0;
+	struct pollfd poll_fd;
+	poll_fd.fd = watch.fd;
+	poll_fd.events = POLLIN;
+	int polls;
+	for (polls = 0; polls < 20 && !(file_flags && new_flags && inner_flags && deep_flags); ++polls)
+	{
+		poll(&poll_fd, 1, 100);
+		int i, count = zfs_watch_read(&watch, events, 16);
+		for (i = 0; i < count; ++i)
+		{
+			if (strcmp(events[i].path, "file") == 0)
+			{
+				++file_events;
+				file_flags = events[i].flags;
+			}
+			else if (strcmp(events[i].path, "new") == 0)
+			{
+				PICOTEST_ASSERT(events[i].is_directory == ZFS_TRUE);
+				new_flags = events[i].flags;
+			}
+			else if (strcmp(events[i].path, "new/inner") == 0)
+				inner_flags = events[i].flags;
+			else if (strcmp(events[i].path, "old/deep") == 0)
+				deep_flags = events[i].flags;
+		}
+	}
+	PICOTEST_ASSERT(file_events == 1 && file_flags == (ZFS_WATCH_CREATED | ZFS_WATCH_MODIFIED));
+	PICOTEST_ASSERT(new_flags & ZFS_WATCH_CREATED);
+	PICOTEST_ASSERT(inner_flags & ZFS_WATCH_CREATED);
+	PICOTEST_ASSERT(deep_flags & ZFS_WATCH_CREATED);
+
+	// The new directory is watched too
+	zfs_file_delete("watch_test/new/inner");
+	int deleted = 0;
+	for (polls = 0; polls < 20 && !deleted; ++polls)
+	{
+		poll(&poll_fd, 1, 100);
+		int i, count = zfs_watch_read(&watch, events, 16);
+		for (i = 0; i < count; ++i)
+			deleted |= (strcmp(events[i].path, "new/inner") == 0 && (events[i].flags & ZFS_WATCH_DELETED));
+	}
+	PICOTEST_ASSERT(deleted);
+	zfs_watch_end(&watch);
+
+	zfs_file_delete("watch_test/file");
+	zfs_file_delete("watch_test/old/deep");
+	rmdir("watch_test/new");
+	rmdir("watch_test/old");
+	PICOTEST_ASSERT(rmdir("watch_test") == 0);
+}
+
+typedef struct SnapshotChanges
+{
+	int added;
+	int removed;
+	int modified;
+	char last[64];
+} SnapshotChanges;
+
+static void count_change(const char *path, ZFSSnapshotChange change, ZFSType type, void *user_data)
+{
+	(void)type;
+	SnapshotChanges *changes = (SnapshotChanges*)user_data;
+	if (change == ZFS_SNAPSHOT_ADDED)
+		++changes->added;
+	else if (change == ZFS_SNAPSHOT_REMOVED)
+		++changes->removed;
+	else
+		++changes->modified;
+	strcpy(changes->last, path);
+}
+
+// Moves the mtime of a directory out of the window where it would be listed again anyway
+static void age_directory(const char *path)
+{
+	struct timespec times[2];
+	times[0].tv_sec = times[1].tv_sec = 1500000000;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	utimensat(AT_FDCWD, path, times, 0);
+}
+
+PICOTEST_CASE(snapshot)
+{
+	mkdir("snapshot_test", 0755);
+	mkdir("snapshot_test/a", 0755);
+	mkdir("snapshot_test/a/b", 0755);
+	write_file("snapshot_test/a/file", "0123");
+	zfs_file_touch("snapshot_test/a/b/c");
+	zfs_file_touch("snapshot_test/d");
+	age_directory("snapshot_test/a/b");
+	age_directory("snapshot_test/a");
+	age_directory("snapshot_test");
+
+	ZFSSnapshot snapshot;
+	memset(&snapshot, 0, sizeof(snapshot));
+	SnapshotChanges changes;
+	memset(&changes, 0, sizeof(changes));
+	PICOTEST_ASSERT(zfs_snapshot_update(&snapshot, "snapshot_test", "snapshot_test.bin", 0, count_change, &changes) == ZFS_TRUE);
+	PICOTEST_ASSERT(changes.added == 5 && changes.removed == 0 && changes.modified == 0);
+	PICOTEST_ASSERT(zfs_snapshot_open(&snapshot, "snapshot_test.bin") == ZFS_TRUE);
+	PICOTEST_ASSERT(snapshot.directory_count == 3 && snapshot.entry_count == 5);
+
+	memset(&changes, 0, sizeof(changes));
+	PICOTEST_ASSERT(zfs_snapshot_update(&snapshot, "snapshot_test", "snapshot_test.bin", 0, count_change, &changes) == ZFS_TRUE);
+	PICOTEST_ASSERT(changes.added == 0 && changes.removed == 0 && changes.modified == 0);
+	zfs_snapshot_close(&snapshot);
+
+	// Modified in place, which leaves the directory as it was
+	write_file("snapshot_test/a/file", "01234");
+	age_directory("snapshot_test/a");
+	PICOTEST_ASSERT(zfs_snapshot_open(&snapshot, "snapshot_test.bin") == ZFS_TRUE);
+	memset(&changes, 0, sizeof(changes));
+	PICOTEST_ASSERT(zfs_snapshot_update(&snapshot, "snapshot_test", "snapshot_test.bin", 0, count_change, &changes) == ZFS_TRUE);
+	PICOTEST_ASSERT(changes.added == 0 && changes.removed == 0 && changes.modified == 0);
+	PICOTEST_ASSERT(zfs_snapshot_update(&snapshot, "snapshot_test", "snapshot_test.bin", ZFS_SNAPSHOT_STAT_FILES, count_change, &changes) == ZFS_TRUE);
+	PICOTEST_ASSERT(changes.modified == 1);
+	assert_strcmp(changes.last, "a/file");
+	zfs_snapshot_close(&snapshot);
+
+	zfs_file_delete("snapshot_test/a/b/c");
+	rmdir("snapshot_test/a/b");
+	zfs_file_touch("snapshot_test/a/new");
+	PICOTEST_ASSERT(zfs_snapshot_open(&snapshot, "snapshot_test.bin") == ZFS_TRUE);
+	memset(&changes, 0, sizeof(changes));
+	PICOTEST_ASSERT(zfs_snapshot_update(&snapshot, "snapshot_test", "snapshot_test.bin", 0, count_change, &changes) == ZFS_TRUE);
+	PICOTEST_ASSERT(changes.added == 1 && changes.removed == 2 && changes.modified == 0);
+	zfs_snapshot_close(&snapshot);
+
+	PICOTEST_ASSERT(zfs_snapshot_open(&snapshot, "snapshot_test/d") == ZFS_FALSE);
+	PICOTEST_ASSERT(zfs_snapshot_update(&snapshot, "snapshot_test_missing", "snapshot_test.bin", 0, count_change, &changes) == ZFS_FALSE);
+
+	zfs_file_delete("snapshot_test.bin");
+	zfs_file_delete("snapshot_test/a/file");
+	zfs_file_delete("snapshot_test/a/new");
+	zfs_file_delete("snapshot_test/d");
+	rmdir("snapshot_test/a");
+	PICOTEST_ASSERT(rmdir("snapshot_test") == 0);
+}
+
+#ifndef Z_FS_NO_FILE
+PICOTEST_CASE(tree_copy)
+{
+	mkdir("copy_test", 0755);
+	mkdir("copy_test/source", 0755);
+	mkdir("copy_test/source/sub", 0750);
+	mkdir("copy_test/source/sub/many", 0755);
+	write_file("copy_test/source/a.txt", "hello");
+	write_file("copy_test/source/sub/b.txt", "world");
+	chmod("copy_test/source/a.txt", 0640);
+	PICOTEST_ASSERT(symlink("a.txt", "copy_test/source/link") == 0);
+	char path[64];
+	int i;
+	for (i = 0; i < 40; ++i)
+	{
+		sprintf(path, "copy_test/source/sub/many/%i", i);
+		zfs_file_touch(path);
+	}
+	age_directory("copy_test/source/sub/b.txt");
+	age_directory("copy_test/source/sub");
+
+	ZFSTreeCopyOptions options;
+	memset(&options, 0, sizeof(options));
+	options.thread_count = 4;
+	PICOTEST_ASSERT(zfs_tree_copy("copy_test/source", "copy_test/destination", &options) == ZFS_TRUE);
+
+	struct stat st;
+	char buffer[16];
+	PICOTEST_ASSERT(stat("copy_test/destination/a.txt", &st) == 0 && (st.st_mode & 0777) == 0640 && st.st_size == 5);
+	PICOTEST_ASSERT(stat("copy_test/destination/sub/b.txt", &st) == 0 && st.st_mtime == 1500000000);
+	PICOTEST_ASSERT(stat("copy_test/destination/sub", &st) == 0 && st.st_mtime == 1500000000 && (st.st_mode & 0777) == 0750);
+	PICOTEST_ASSERT(stat("copy_test/destination/sub/many/39", &st) == 0);
+	PICOTEST_ASSERT(readlink("copy_test/destination/link", buffer, sizeof(buffer)) == 5 && memcmp(buffer, "a.txt", 5) == 0);
+	FILE *file = fopen("copy_test/destination/sub/b.txt", "rb");
+	PICOTEST_ASSERT(file && fread(buffer, 1, sizeof(buffer), file) == 5 && memcmp(buffer, "world", 5) == 0);
+	fclose(file);
+
+	// Copying again overwrites, and a tree copied into itself is not copied into the copy
+	PICOTEST_ASSERT(zfs_tree_copy("copy_test/source", "copy_test/destination", NULL) == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_tree_copy("copy_test/source", "copy_test/source/sub/inner", NULL) == ZFS_FALSE);
+	PICOTEST_ASSERT(stat("copy_test/source/sub/inner/sub/b.txt", &st) == 0);
+	PICOTEST_ASSERT(stat("copy_test/source/sub/inner/sub/inner/a.txt", &st) != 0);
+	PICOTEST_ASSERT(zfs_tree_copy("copy_test/missing", "copy_test/other", NULL) == ZFS_FALSE);
+
+	// Copying again over a read-only copy
+	chmod("copy_test/source/sub/b.txt", 0444);
+	chmod("copy_test/source/sub", 0555);
+	PICOTEST_ASSERT(zfs_tree_copy("copy_test/source", "copy_test/destination", NULL) == ZFS_TRUE);
+	chmod("copy_test/source/sub/b.txt", 0644);
+	write_file("copy_test/source/sub/b.txt", "again");
+	chmod("copy_test/source/sub/b.txt", 0444);
+	PICOTEST_ASSERT(zfs_tree_copy("copy_test/source", "copy_test/destination", NULL) == ZFS_TRUE);
+	PICOTEST_ASSERT(stat("copy_test/destination/sub", &st) == 0 && (st.st_mode & 0777) == 0555);
+	file = fopen("copy_test/destination/sub/b.txt", "rb");
+	PICOTEST_ASSERT(file && fread(buffer, 1, sizeof(buffer), file) == 5 && memcmp(buffer, "again", 5) == 0);
+	fclose(file);
+	chmod("copy_test/source/sub", 0755);
+	chmod("copy_test/destination/sub", 0755);
+
+	PICOTEST_ASSERT(zfs_tree_delete("copy_test", NULL) == ZFS_TRUE);
+}
+#endif
+
+typedef struct DeleteErrors
+{
+	int count;
+	char last[64];
+} DeleteErrors;
+
+static void count_delete_error(const char *path, int error, void *user_data)
+{
+	(void)error;
+	DeleteErrors *errors = (DeleteErrors*)user_data;
+	__atomic_add_fetch(&errors->count, 1, __ATOMIC_SEQ_CST);
+	snprintf(errors->last, sizeof(errors->last), "%s", path);
+}
+
+PICOTEST_CASE(tree_delete)
+{
+	char path[64];
+	int i, j;
+	mkdir("delete_test", 0755);
+	mkdir("delete_kept", 0755);
+	zfs_file_touch("delete_kept/file");
+	for (i = 0; i < 8; ++i)
+	{
+		sprintf(path, "delete_test/%i", i);
+		mkdir(path, 0755);
+		sprintf(path, "delete_test/%i/sub", i);
+		mkdir(path, 0755);
+		for (j = 0; j < 20; ++j)
+		{
+			sprintf(path, "delete_test/%i/sub/%i", i, j);
+			zfs_file_touch(path);
+		}
+	}
+	// Only the link goes
+	PICOTEST_ASSERT(symlink("../delete_kept", "delete_test/link") == 0);
+
+	DeleteErrors errors;
+	memset(&errors, 0, sizeof(errors));
+	ZFSTreeDeleteOptions options;
+	memset(&options, 0, sizeof(options));
+	options.error = count_delete_error;
+	options.user_data = &errors;
+	options.thread_count = 4;
+	PICOTEST_ASSERT(zfs_tree_delete("delete_test", &options) == ZFS_TRUE);
+	PICOTEST_ASSERT(errors.count == 0);
+	PICOTEST_ASSERT(zfs_file_exists("delete_test") == ZFS_FALSE);
+	PICOTEST_ASSERT(zfs_file_exists("delete_kept/file") == ZFS_TRUE);
+
+	PICOTEST_ASSERT(zfs_tree_delete("delete_test", &options) == ZFS_FALSE);
+	PICOTEST_ASSERT(errors.count == 1);
+	assert_strcmp(errors.last, "delete_test");
+
+	// In the background, through a trash directory
+	mkdir("delete_test", 0755);
+	mkdir("delete_test/sub", 0755);
+	zfs_file_touch("delete_test/sub/file");
+	mkdir("delete_trash", 0755);
+	options.trash_directory = "delete_trash";
+	PICOTEST_ASSERT(zfs_tree_delete("delete_test", &options) == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_file_exists("delete_test") == ZFS_FALSE);
+	for (i = 0; i < 500 && rmdir("delete_trash") != 0; ++i)
+		usleep(10000);
+	PICOTEST_ASSERT(zfs_file_exists("delete_trash") == ZFS_FALSE);
+	PICOTEST_ASSERT(errors.count == 1);
+
+	// Single files too
+	options.trash_directory = NULL;
+	PICOTEST_ASSERT(zfs_tree_delete("delete_kept", &options) == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_file_exists("delete_kept") == ZFS_FALSE);
+	zfs_file_touch("delete_file");
+	PICOTEST_ASSERT(zfs_tree_delete("delete_file", NULL) == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_file_exists("delete_file") == ZFS_FALSE);
+}
+#endif
+
+#if !defined(Z_FS_NO_FILE) && defined(__linux)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+PICOTEST_CASE(file_copy)
+{
+	// 8 MB with 3 bytes of data in the middle
+	int fd = open("copy_source.bin", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	PICOTEST_ASSERT(fd >= 0);
+	PICOTEST_ASSERT(pwrite(fd, "abc", 3, 4 << 20) == 3);
+	PICOTEST_ASSERT(ftruncate(fd, 8 << 20) == 0);
+	close(fd);
+
+	ZFSCopyMethod method;
+	PICOTEST_ASSERT(zfs_file_copy_ex("copy_source.bin", "copy_destination.bin", ZFS_COPY_NO_REFLINK, &method) == ZFS_TRUE);
+	PICOTEST_ASSERT(method == ZFS_COPY_METHOD_RANGE || method == ZFS_COPY_METHOD_SENDFILE || method == ZFS_COPY_METHOD_BUFFER);
+
+	struct stat source, destination;
+	PICOTEST_ASSERT(stat("copy_source.bin", &source) == 0);
+	PICOTEST_ASSERT(stat("copy_destination.bin", &destination) == 0);
+	PICOTEST_ASSERT(destination.st_size == 8 << 20);
+	if (source.st_blocks * 512 < source.st_size)
+		PICOTEST_ASSERT(destination.st_blocks * 512 < destination.st_size); // The holes were kept
+
+	char buffer[4];
+	fd = open("copy_destination.bin", O_RDONLY);
+	PICOTEST_ASSERT(fd >= 0);
+	PICOTEST_ASSERT(pread(fd, buffer, 4, (4 << 20) - 1) == 4);
+	PICOTEST_ASSERT(memcmp(buffer, "\0abc", 4) == 0);
+	close(fd);
+
+	PICOTEST_ASSERT(zfs_file_copy_ex("copy_source.bin", "copy_destination.bin", ZFS_COPY_PREALLOCATE, &method) == ZFS_TRUE);
+	PICOTEST_ASSERT(method != ZFS_COPY_METHOD_NONE);
+	PICOTEST_ASSERT(stat("copy_destination.bin", &destination) == 0 && destination.st_size == 8 << 20);
+
+	// Nothing to copy from an empty file
+	PICOTEST_ASSERT(truncate("copy_source.bin", 0) == 0);
+	PICOTEST_ASSERT(zfs_file_copy_ex("copy_source.bin", "copy_destination.bin", 0, &method) == ZFS_TRUE);
+	PICOTEST_ASSERT(method == ZFS_COPY_METHOD_NONE);
+	PICOTEST_ASSERT(stat("copy_destination.bin", &destination) == 0 && destination.st_size == 0);
+
+	// A source that shrank after its size was taken is copied as it is now
+	write_file("copy_source.bin", "hello");
+	int in = open("copy_source.bin", O_RDONLY);
+	int out = open("copy_destination.bin", O_WRONLY | O_TRUNC);
+	PICOTEST_ASSERT(in >= 0 && out >= 0);
+	PICOTEST_ASSERT(zfs__file_copy_regular(in, out, 1 << 20, ZFS_COPY_NO_REFLINK, &method) == ZFS_TRUE);
+	close(in);
+	close(out);
+	PICOTEST_ASSERT(stat("copy_destination.bin", &destination) == 0 && destination.st_size == 5);
+
+	// Files in /sys claim a page but hold a few bytes
+	char online[4096];
+	fd = open("/sys/devices/system/cpu/online", O_RDONLY);
+	ssize_t online_size = (fd >= 0 ? read(fd, online, sizeof(online)) : -1);
+	if (fd >= 0)
+		close(fd);
+	if (online_size > 0 && stat("/sys/devices/system/cpu/online", &source) == 0 && source.st_size > online_size)
+	{
+		PICOTEST_ASSERT(zfs_file_copy_ex("/sys/devices/system/cpu/online", "copy_destination.bin", 0, &method) == ZFS_TRUE);
+		PICOTEST_ASSERT(stat("copy_destination.bin", &destination) == 0 && destination.st_size == online_size);
+	}
+
+	PICOTEST_ASSERT(zfs_file_copy_ex("copy_missing.bin", "copy_destination.bin", 0, &method) == ZFS_FALSE);
+	PICOTEST_ASSERT(zfs_file_delete("copy_source.bin") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_file_delete("copy_destination.bin") == ZFS_TRUE);
+}
+
+PICOTEST_CASE(file_at)
+{
+	mkdir("root_test", 0755);
+	mkdir("root_test/sub", 0755);
+	ZFSRoot root, sub;
+	PICOTEST_ASSERT(zfs_root_begin(&root, NULL, "root_test") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_root_begin(&sub, &root, "sub") == ZFS_TRUE);
+
+	PICOTEST_ASSERT(zfs_file_touch_at(&root, "a.txt") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_file_touch_at(&root, "a.txt") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_file_exists("root_test/a.txt") == ZFS_TRUE);
+	int fd = zfs_file_open_at(&root, "a.txt", O_WRONLY | O_TRUNC);
+	PICOTEST_ASSERT(fd >= 0 && write(fd, "hello", 5) == 5);
+	close(fd);
+
+	PICOTEST_ASSERT(zfs_file_copy_at(&root, "a.txt", &sub, "b.txt", 0, NULL) == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_file_rename_at(&sub, "b.txt", &root, "c.txt") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_file_exists_at(&sub, "b.txt") == ZFS_FALSE);
+
+	// Names keep resolving in the same directory after it is moved
+	PICOTEST_ASSERT(zfs_file_rename("root_test", "root_test_moved") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_file_exists_at(&root, "c.txt") == ZFS_TRUE);
+	fd = zfs_file_open_at(&root, "c.txt", O_RDONLY);
+	char buffer[8];
+	PICOTEST_ASSERT(fd >= 0 && read(fd, buffer, sizeof(buffer)) == 5 && memcmp(buffer, "hello", 5) == 0);
+	close(fd);
+	PICOTEST_ASSERT(zfs_file_open_at(&root, "missing.txt", O_RDONLY) == -1);
+
+	PICOTEST_ASSERT(zfs_file_delete_at(&root, "a.txt") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_file_delete_at(&root, "c.txt") == ZFS_TRUE);
+	PICOTEST_ASSERT(zfs_file_delete_at(&root, "c.txt") == ZFS_FALSE);
+	zfs_root_end(&sub);
+	PICOTEST_ASSERT(zfs_file_delete_at(&root, "sub") == ZFS_TRUE);
+	zfs_root_end(&root);
+	PICOTEST_ASSERT(zfs_file_delete("root_test_moved") == ZFS_TRUE);
+}
+#endif
+
+#if !defined(Z_FS_NO_PATH) && !defined(Z_FS_NO_DIRECTORY) && defined(__linux)
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void assert_resolves(ZFSPathCache *cache, const char *path)
+{
+	char expected[PATH_MAX];
+	char buffer[PATH_MAX];
+	PICOTEST_ASSERT(realpath(path, expected) != NULL);
+	PICOTEST_ASSERT(zfs_path_resolve(cache, buffer, sizeof(buffer), path) == (zfs_ll)strlen(expected));
+	assert_strcmp(buffer, expected);
+}
+
+PICOTEST_CASE(path_resolve)
+{
+	mkdir("resolve_test", 0755);
+	mkdir("resolve_test/real", 0755);
+	mkdir("resolve_test/real/sub", 0755);
+	FILE *file = fopen("resolve_test/real/sub/file", "wb");
+	PICOTEST_ASSERT(file != NULL);
+	if (file)
+		fclose(file);
+	PICOTEST_ASSERT(symlink("real", "resolve_test/link") == 0);
+	PICOTEST_ASSERT(symlink("../link/sub", "resolve_test/real/up") == 0);
+	PICOTEST_ASSERT(symlink("file", "resolve_test/real/sub/file_link") == 0);
+	PICOTEST_ASSERT(symlink("loop", "resolve_test/loop") == 0);
+
+	ZFSPathCache cache;
+	PICOTEST_ASSERT(zfs_path_cache_begin(&cache, 3) == ZFS_TRUE);
+	PICOTEST_ASSERT(cache.slot_count == 4);
+	int round;
+	for (round = 0; round < 2; ++round)
+	{
+		// The second round starts from the cached directories
+		assert_resolves(&cache, "resolve_test/link/sub/file");
+		assert_resolves(&cache, "resolve_test//link/./sub/../sub/file_link");
+		assert_resolves(&cache, "resolve_test/real/up/file");
+		assert_resolves(&cache, "resolve_test/link/up/..");
+		assert_resolves(NULL, "resolve_test/link/up/file_link");
+	}
+
+	// Only the size is returned when it does not fit
+	char small[4];
+	PICOTEST_ASSERT(zfs_path_resolve(&cache, small, sizeof(small), "/") == 1);
+	assert_strcmp(small, "/");
+	PICOTEST_ASSERT(zfs_path_resolve(&cache, NULL, 0, "resolve_test/link") > (zfs_ll)sizeof(small));
+
+	errno = 0;
+	PICOTEST_ASSERT(zfs_path_resolve(&cache, small, sizeof(small), "resolve_test/loop") == -1);
+	PICOTEST_ASSERT(errno == ELOOP);
+	PICOTEST_ASSERT(zfs_path_resolve(&cache, small, sizeof(small), "resolve_test/link/missing") == -1);
+	PICOTEST_ASSERT(errno == ENOENT);
+	PICOTEST_ASSERT(zfs_path_resolve(&cache, small, sizeof(small), "resolve_test/link/sub/file/..") == -1);
+	PICOTEST_ASSERT(errno == ENOTDIR);
+
+	// Cached directories stay until cleared
+	char before[PATH_MAX];
+	char after[PATH_MAX];
+	PICOTEST_ASSERT(zfs_path_resolve(&cache, before, sizeof(before), "resolve_test/link/sub") > 0);
+	PICOTEST_ASSERT(mkdir("resolve_test/sub", 0755) == 0);
+	PICOTEST_ASSERT(unlink("resolve_test/link") == 0);
+	PICOTEST_ASSERT(symlink(".", "resolve_test/link") == 0);
+	PICOTEST_ASSERT(zfs_path_resolve(&cache, after, sizeof(after), "resolve_test/link/sub") > 0);
+	assert_strcmp(after, before);
+	zfs_path_cache_clear(&cache);
+	assert_resolves(&cache, "resolve_test/link/sub");
+	zfs_path_cache_end(&cache);
+	PICOTEST_ASSERT(cache.slots == NULL);
+
+	PICOTEST_ASSERT(zfs_tree_delete("resolve_test", NULL) == ZFS_TRUE);
+}
+#endif
+
 int main(void)
 {
 	int fails = 0;
@@ -243,12 +1470,37 @@ int main(void)
 	fails += path(NULL);
 	fails += path_tiny_buffer(NULL);
 	fails += path_buffer_left(NULL);
+	fails += path_view(NULL);
+	fails += path_canonicalize(NULL);
+#endif
+#if !defined(Z_FS_NO_PATH) && !defined(Z_FS_NO_DIRECTORY) && defined(__linux)
+	fails += path_resolve(NULL);
 #endif
 #ifndef Z_FS_NO_FILE
 	fails += file(NULL);
 #endif
+#if !defined(Z_FS_NO_FILE) && defined(__linux)
+	fails += file_copy(NULL);
+	fails += file_at(NULL);
+#endif
 #ifndef Z_FS_NO_DIRECTORY
 	fails += directory(NULL);
+#endif
+#if !defined(Z_FS_NO_DIRECTORY) && defined(__linux)
+	fails += walk(NULL);
+	fails += walk_parallel(NULL);
+	fails += directory_batch(NULL);
+	fails += directory_info(NULL);
+	fails += directory_list(NULL);
+	fails += glob(NULL);
+	fails += glob_many_patterns(NULL);
+	fails += walk_ignore(NULL);
+	fails += watch(NULL);
+	fails += snapshot(NULL);
+#ifndef Z_FS_NO_FILE
+	fails += tree_copy(NULL);
+#endif
+	fails += tree_delete(NULL);
 #endif
 	return fails;
 }
@@ -0,0 +1,118 @@
+// Compares walking a source tree with a large ignored output directory using ignore files,
+// with walking everything and filtering the paths afterwards.
+
+#define Z_FS_IMPLEMENTATION
+#include "z_filesystem.h"
+
+#include <fnmatch.h>
+#include <stdio.h>
+#include <time.h>
+
+#define BENCH_DIR "bench_tree"
+#define SOURCE_DIRS 50
+#define SOURCE_FILES 20
+#define OUTPUT_DIRS 200
+#define OUTPUT_FILES 100
+#define ROUNDS 5
+
+static const char *const ignored_patterns[] = { "build", "build/*", "*.o" };
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static ZFSWalkAction count_entry(const ZFSWalkEntry *entry, void *user_data)
+{
+	(void)entry;
+	++*(long*)user_data;
+	return ZFS_WALK_CONTINUE;
+}
+
+static ZFSWalkAction count_unignored_entry(const ZFSWalkEntry *entry, void *user_data)
+{
+	int i;
+	for (i = 0; i < (int)(sizeof(ignored_patterns) / sizeof(ignored_patterns[0])); ++i)
+	{
+		if (fnmatch(ignored_patterns[i], entry->path, 0) == 0)
+			return ZFS_WALK_CONTINUE;
+	}
+	++*(long*)user_data;
+	return ZFS_WALK_CONTINUE;
+}
+
+static ZFSWalkAction delete_entry(const ZFSWalkEntry *entry, void *user_data)
+{
+	(void)user_data;
+	unlinkat(entry->dir_fd, entry->name, entry->type == ZFS_TYPE_DIRECTORY ? AT_REMOVEDIR : 0);
+	return ZFS_WALK_CONTINUE;
+}
+
+static ZFSWalkAction delete_file(const ZFSWalkEntry *entry, void *user_data)
+{
+	return (entry->type == ZFS_TYPE_DIRECTORY ? ZFS_WALK_CONTINUE : delete_entry(entry, user_data));
+}
+
+static void create_files(const char *directory, int directories, int files, const char *extension)
+{
+	char path[128];
+	int i, j;
+	for (i = 0; i < directories; ++i)
+	{
+		sprintf(path, BENCH_DIR "/%s/d%i", directory, i);
+		mkdir(path, 0755);
+		for (j = 0; j < files; ++j)
+		{
+			sprintf(path, BENCH_DIR "/%s/d%i/f%i%s", directory, i, j, extension);
+			zfs_file_touch(path);
+		}
+	}
+}
+
+int main(void)
+{
+	// Create the tree, the runs below read it from the dentry cache
+	mkdir(BENCH_DIR, 0755);
+	mkdir(BENCH_DIR "/src", 0755);
+	mkdir(BENCH_DIR "/build", 0755);
+	create_files("src", SOURCE_DIRS, SOURCE_FILES, ".c");
+	create_files("build", OUTPUT_DIRS, OUTPUT_FILES, ".o");
+	FILE *file = fopen(BENCH_DIR "/.gitignore", "wb");
+	if (!file)
+		return 1;
+	fputs("/build/\n*.o\n", file);
+	fclose(file);
+
+	ZFSWalkOptions options;
+	memset(&options, 0, sizeof(options));
+	long filtered = 0;
+	options.pre = count_unignored_entry;
+	options.user_data = &filtered;
+	double start = now_seconds();
+	int round;
+	for (round = 0; round < ROUNDS; ++round)
+		zfs_walk(BENCH_DIR, &options);
+	double elapsed = now_seconds() - start;
+	printf("walk everything, filter after: %8.2f ms, %ld entries\n", elapsed * 1000.0 / ROUNDS, filtered / ROUNDS);
+
+	long ignored = 0;
+	options.pre = count_entry;
+	options.user_data = &ignored;
+	options.ignore_file = ".gitignore";
+	start = now_seconds();
+	for (round = 0; round < ROUNDS; ++round)
+		zfs_walk(BENCH_DIR, &options);
+	elapsed = now_seconds() - start;
+	printf("walk with ignore files:        %8.2f ms, %ld entries\n", elapsed * 1000.0 / ROUNDS, ignored / ROUNDS);
+	if (filtered != ignored)
+		printf("entry count mismatch\n");
+
+	memset(&options, 0, sizeof(options));
+	options.pre = delete_file;
+	options.post = delete_entry;
+	zfs_walk(BENCH_DIR, &options);
+	rmdir(BENCH_DIR);
+	return 0;
+}
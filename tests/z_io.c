@@ -1,9 +1,65 @@
+// Before picotest includes system headers, for the POSIX functions z_io.h and the tests use
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include "picotest_logger.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Counting allocator, to test the allocator hooks
+typedef struct TestAllocator
+{
+	long long allocations;
+	long long frees;
+} TestAllocator;
+
+static TestAllocator test_allocator;
+
+static void *test_malloc(size_t size, TestAllocator *allocator)
+{
+	__atomic_fetch_add(&allocator->allocations, 1, __ATOMIC_RELAXED);
+	return malloc(size);
+}
+
+static void *test_realloc(void *memory, size_t size, TestAllocator *allocator)
+{
+	(void)allocator;
+	return realloc(memory, size);
+}
+
+static void test_free(void *memory, TestAllocator *allocator)
+{
+	__atomic_fetch_add(&allocator->frees, 1, __ATOMIC_RELAXED);
+	free(memory);
+}
+
+#define ZIO_MALLOC(size, context) test_malloc(size, context)
+#define ZIO_REALLOC(memory, size, context) test_realloc(memory, size, context)
+#define ZIO_FREE(memory, context) test_free(memory, context)
+#define ZIO_ALLOC_CONTEXT (&test_allocator)
+
 #define Z_IO_IMPLEMENTATION
 #include "z_io.h"
 
-#include <stdio.h>
+static double seconds_now(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long file_size(const char *filename)
+{
+	FILE *file = fopen(filename, "rb");
+	if (!file)
+		return -1;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fclose(file);
+	return size;
+}
 
 const char TEST_TEXT[] = "This is a test\n";
 
@@ -62,6 +118,28 @@ PICOTEST_CASE(file)
 	remove("test.txt");
 }
 
+#if defined(__linux)
+#include <fcntl.h>
+
+PICOTEST_CASE(file_fd)
+{
+	ZIOHandle handle;
+	PICOTEST_ASSERT(zio_open_fd(&handle, open("test.txt", O_RDWR | O_CREAT | O_TRUNC, 0644), ZIOM_WRITE | ZIOM_READ) == ZIO_OK);
+	write_test(&handle);
+	PICOTEST_ASSERT(zio_seek(&handle, 0, ZIO_SEEK_SET) == ZIO_OK);
+	read_test(&handle);
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+
+	PICOTEST_ASSERT(zio_open_fd(&handle, open("test.txt", O_RDONLY), ZIOM_READ) == ZIO_OK);
+	read_test(&handle);
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+
+	PICOTEST_ASSERT(zio_open_fd(&handle, open("missing.txt", O_RDONLY), ZIOM_READ) == ZIO_ERROR);
+	PICOTEST_ASSERT(handle.last_error != NULL);
+	remove("test.txt");
+}
+#endif
+
 PICOTEST_CASE(memory)
 {
 	char mem[100];
@@ -86,11 +164,900 @@ PICOTEST_CASE(const_memory)
 	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
 }
 
+#ifndef Z_IO_NO_BITSTREAM
+static const int BIT_COUNTS[] = { 1, 7, 0, 13, ZIO_BIT_MAX_READ, 3, 32, ZIO_BIT_MAX_WRITE, 8, 5 };
+#define BIT_VALUE(i) (0x9E3779B97F4A7C15ULL * (zio_u64)((i) + 1))
+
+static void bit_write_test(ZIOHandle *handle, int msb_first)
+{
+	ZIOBitWriter writer;
+	PICOTEST_ASSERT(zio_bit_writer_begin(&writer, handle) == ZIO_OK);
+	for (int i = 0; i < 100; ++i)
+	{
+		int count = BIT_COUNTS[i % 10];
+		if (msb_first)
+			zio_bit_put_msb(&writer, BIT_VALUE(i), count);
+		else
+			zio_bit_put_lsb(&writer, BIT_VALUE(i), count);
+	}
+	PICOTEST_ASSERT(zio_bit_writer_end(&writer) == ZIO_OK);
+}
+
+static void bit_read_test(ZIOHandle *handle, int msb_first)
+{
+	ZIOBitReader reader;
+	PICOTEST_ASSERT(zio_bit_reader_begin(&reader, handle) == ZIO_OK);
+	for (int i = 0; i < 100; ++i)
+	{
+		int count = BIT_COUNTS[i % 10];
+		zio_u64 expected = BIT_VALUE(i) & ((1ULL << count) - 1);
+		zio_u64 value = (msb_first ? zio_bit_read_msb(&reader, count) : zio_bit_read_lsb(&reader, count));
+		PICOTEST_ASSERT(value == expected, "bit value %i does not match", i);
+	}
+	PICOTEST_ASSERT(!zio_bit_reader_overrun(&reader));
+	PICOTEST_ASSERT(zio_bit_reader_end(&reader) == ZIO_OK);
+}
+
+PICOTEST_CASE(bitstream)
+{
+	char mem[400];
+	ZIOHandle handle;
+
+	for (int msb_first = 0; msb_first <= 1; ++msb_first)
+	{
+		memset(mem, 0xAA, sizeof(mem));
+		PICOTEST_ASSERT(zio_open_memory(&handle, mem, sizeof(mem)) == ZIO_OK);
+		bit_write_test(&handle, msb_first);
+		zio_ll written = zio_tell(&handle);
+		PICOTEST_ASSERT(written == (1810 + 7) / 8);
+		PICOTEST_ASSERT(zio_seek(&handle, 0, ZIO_SEEK_SET) == 0);
+		bit_read_test(&handle, msb_first);
+		PICOTEST_ASSERT(zio_tell(&handle) == written);
+		PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+
+		// Exactly sized memory goes through the tail buffer at the end
+		PICOTEST_ASSERT(zio_open_memory(&handle, mem, written) == ZIO_OK);
+		bit_write_test(&handle, msb_first);
+		PICOTEST_ASSERT(zio_tell(&handle) == written);
+		PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+
+		PICOTEST_ASSERT(zio_open_file(&handle, "test.bin", ZIOM_WRITE) == ZIO_OK);
+		bit_write_test(&handle, msb_first);
+		PICOTEST_ASSERT(zio_size(&handle) == written);
+		PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+
+		PICOTEST_ASSERT(zio_open_file(&handle, "test.bin", ZIOM_READ) == ZIO_OK);
+		bit_read_test(&handle, msb_first);
+		PICOTEST_ASSERT(zio_tell(&handle) == written);
+		PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+	}
+
+	// Refilling again after a refill from the buffer keeps the count below 64
+	ZIOBitReader reader;
+	PICOTEST_ASSERT(zio_open_file(&handle, "test.bin", ZIOM_READ) == ZIO_OK);
+	PICOTEST_ASSERT(zio_bit_reader_begin(&reader, &handle) == ZIO_OK);
+	zio_bit_refill_lsb(&reader);
+	zio_bit_refill_lsb(&reader);
+	PICOTEST_ASSERT(reader.count >= ZIO_BIT_MAX_READ && reader.count < 64);
+	zio_bit_consume_lsb(&reader, ZIO_BIT_MAX_READ);
+	zio_bit_refill_lsb(&reader);
+	PICOTEST_ASSERT(reader.count >= ZIO_BIT_MAX_READ && reader.count < 64);
+	PICOTEST_ASSERT(zio_bit_reader_end(&reader) == ZIO_OK);
+	PICOTEST_ASSERT(zio_tell(&handle) == ZIO_BIT_MAX_READ / 8);
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+
+	// Reading past the end gives zeros and is detected
+	mem[0] = 0x5A;
+	PICOTEST_ASSERT(zio_open_const_memory(&handle, mem, 1) == ZIO_OK);
+	PICOTEST_ASSERT(zio_bit_reader_begin(&reader, &handle) == ZIO_OK);
+	PICOTEST_ASSERT(zio_bit_read_msb(&reader, 4) == 0x5);
+	PICOTEST_ASSERT(zio_bit_read_msb(&reader, 4) == 0xA);
+	PICOTEST_ASSERT(!zio_bit_reader_overrun(&reader));
+	PICOTEST_ASSERT(zio_bit_read_msb(&reader, 8) == 0);
+	PICOTEST_ASSERT(zio_bit_reader_overrun(&reader));
+	PICOTEST_ASSERT(zio_bit_reader_end(&reader) == ZIO_OK);
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+
+	remove("test.bin");
+}
+#endif
+
+#ifndef Z_IO_NO_FRAME
+static void frame_write_test(ZIOHandle *handle, int flags)
+{
+	ZIOFramer framer;
+	PICOTEST_ASSERT(zio_framer_begin(&framer, handle, 64, flags) == ZIO_OK);
+	PICOTEST_ASSERT(zio_frame_write(&framer, TEST_TEXT, sizeof(TEST_TEXT) - 1) == ZIO_OK);
+	PICOTEST_ASSERT(zio_frame_write(&framer, "", 0) == ZIO_OK);
+	PICOTEST_ASSERT(zio_frame_write(&framer, TEST_TEXT, 5) == ZIO_OK);
+	PICOTEST_ASSERT(zio_frame_write(&framer, TEST_TEXT, 65) == ZIO_ERROR);
+	zio_framer_end(&framer);
+}
+
+static void frame_read_test(ZIOHandle *handle, int flags)
+{
+	ZIOFramer framer;
+	ZIOFrame frame;
+	PICOTEST_ASSERT(zio_framer_begin(&framer, handle, 64, flags) == ZIO_OK);
+	PICOTEST_ASSERT(zio_frame_read(&framer, &frame) == ZIO_OK);
+	PICOTEST_ASSERT(frame.size == sizeof(TEST_TEXT) - 1 && memcmp(frame.data, TEST_TEXT, frame.size) == 0);
+	PICOTEST_ASSERT(zio_frame_read(&framer, &frame) == ZIO_OK);
+	PICOTEST_ASSERT(frame.size == 0);
+	PICOTEST_ASSERT(zio_frame_read(&framer, &frame) == ZIO_OK);
+	PICOTEST_ASSERT(frame.size == 5 && memcmp(frame.data, TEST_TEXT, frame.size) == 0);
+	PICOTEST_ASSERT(zio_frame_read(&framer, &frame) == ZIO_EOF);
+	zio_framer_end(&framer);
+}
+
+PICOTEST_CASE(frame)
+{
+	PICOTEST_ASSERT(zio_crc32c(0, "123456789", 9) == 0xE3069283);
+
+	for (int flags = 0; flags <= ZIOF_CRC32C; flags += ZIOF_CRC32C)
+	{
+		char mem[100];
+		ZIOHandle handle;
+		PICOTEST_ASSERT(zio_open_memory(&handle, mem, sizeof(mem)) == ZIO_OK);
+		frame_write_test(&handle, flags);
+		zio_ll size = zio_tell(&handle);
+
+		// Frames are read in place from memory
+		PICOTEST_ASSERT(zio_open_const_memory(&handle, mem, size) == ZIO_OK);
+		frame_read_test(&handle, flags);
+		PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+
+		PICOTEST_ASSERT(zio_open_file(&handle, "test.bin", ZIOM_WRITE) == ZIO_OK);
+		frame_write_test(&handle, flags);
+		PICOTEST_ASSERT(zio_size(&handle) == size);
+		PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+
+		PICOTEST_ASSERT(zio_open_file(&handle, "test.bin", ZIOM_READ) == ZIO_OK);
+		frame_read_test(&handle, flags);
+		PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+	}
+
+	// Corrupted payload
+	char mem[100];
+	ZIOHandle handle;
+	ZIOFramer framer;
+	ZIOFrame frame;
+	PICOTEST_ASSERT(zio_open_memory(&handle, mem, sizeof(mem)) == ZIO_OK);
+	frame_write_test(&handle, ZIOF_CRC32C);
+	mem[9] ^= 1;
+	PICOTEST_ASSERT(zio_seek(&handle, 0, ZIO_SEEK_SET) == 0);
+	PICOTEST_ASSERT(zio_framer_begin(&framer, &handle, 64, ZIOF_CRC32C) == ZIO_OK);
+	PICOTEST_ASSERT(zio_frame_read(&framer, &frame) == ZIO_ERROR);
+	zio_framer_end(&framer);
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+
+	remove("test.bin");
+}
+#endif
+
+#ifndef Z_IO_NO_LOG
+PICOTEST_CASE(log_sink)
+{
+	ZIOHandle handle;
+	ZIOLogSink sink;
+	ZIOLogWriter writers[3];
+	PICOTEST_ASSERT(zio_open_file(&handle, "test.bin", ZIOM_WRITE) == ZIO_OK);
+	PICOTEST_ASSERT(zio_log_sink_begin(&sink, &handle, 256, 10) == ZIO_OK);
+	for (int w = 0; w < 3; ++w)
+		zio_log_writer_begin(&writers[w], &sink);
+
+	// Records are "<writer><index>", small blocks make every writer hand over many blocks
+	for (int i = 0; i < 1000; ++i)
+	{
+		char record[16];
+		int w = i % 3;
+		int size = sprintf(record, "%i%i", w, i);
+		PICOTEST_ASSERT(zio_log_write(&writers[w], record, size) == ZIO_OK);
+	}
+	PICOTEST_ASSERT(zio_log_write(&writers[0], TEST_TEXT, 256) == ZIO_ERROR);
+
+	for (int w = 0; w < 3; ++w)
+		zio_log_writer_end(&writers[w]);
+	PICOTEST_ASSERT(zio_log_sink_end(&sink) == ZIO_OK);
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+
+	PICOTEST_ASSERT(zio_open_file(&handle, "test.bin", ZIOM_READ) == ZIO_OK);
+	static char seen[1000];
+	memset(seen, 0, sizeof(seen));
+	int last_index[3] = { -1, -1, -1 };
+	unsigned char header[ZIO_LOG_RECORD_HEADER_SIZE];
+	int count = 0;
+	while (zio_read(&handle, header, sizeof(header)) == sizeof(header))
+	{
+		zio_u64 sequence = 0;
+		for (int i = 7; i >= 0; --i)
+			sequence = (sequence << 8) | header[i];
+		int size = header[8] | (header[9] << 8);
+		char record[16] = { 0 };
+		PICOTEST_ASSERT(size < 16 && zio_read(&handle, record, size) == size);
+
+		// Sequence numbers follow the order records were appended in
+		PICOTEST_ASSERT(sequence < 1000 && !seen[sequence]);
+		seen[sequence] = 1;
+		int w = record[0] - '0';
+		int index = atoi(record + 1);
+		PICOTEST_ASSERT(index == (int)sequence && index % 3 == w);
+		PICOTEST_ASSERT(index > last_index[w]);
+		last_index[w] = index;
+		++count;
+	}
+	PICOTEST_ASSERT(count == 1000);
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+
+	remove("test.bin");
+}
+
+PICOTEST_CASE(log_sink_partial_block)
+{
+	ZIOHandle handle;
+	ZIOLogSink sink;
+	ZIOLogWriter writer;
+	PICOTEST_ASSERT(zio_open_file(&handle, "test.bin", ZIOM_WRITE) == ZIO_OK);
+	PICOTEST_ASSERT(zio_log_sink_begin(&sink, &handle, 0, 10) == ZIO_OK);
+	zio_log_writer_begin(&writer, &sink);
+
+	// A record far from filling its block is still written on the next interval
+	PICOTEST_ASSERT(zio_log_write(&writer, "hello", 5) == ZIO_OK);
+	double start = seconds_now();
+	while (file_size("test.bin") < ZIO_LOG_RECORD_HEADER_SIZE + 5 && seconds_now() - start < 1.0)
+		;
+	PICOTEST_ASSERT(file_size("test.bin") == ZIO_LOG_RECORD_HEADER_SIZE + 5);
+	PICOTEST_ASSERT(seconds_now() - start < 0.5);
+
+	// The writer keeps going with a new block
+	PICOTEST_ASSERT(zio_log_write(&writer, "world", 5) == ZIO_OK);
+	zio_log_writer_end(&writer);
+	PICOTEST_ASSERT(zio_log_sink_end(&sink) == ZIO_OK);
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+	PICOTEST_ASSERT(file_size("test.bin") == 2 * (ZIO_LOG_RECORD_HEADER_SIZE + 5));
+	remove("test.bin");
+}
+#endif
+
+#ifndef Z_IO_NO_ROTATE
+static int rotated_count = 0;
+static void on_rotated(const char *rotated_filename, void *user_data)
+{
+	(void)rotated_filename;
+	(void)user_data;
+	__atomic_fetch_add(&rotated_count, 1, __ATOMIC_RELEASE);
+}
+
+// The background thread works on its own, wait for what it does to show
+static int wait_for_rotations(int count)
+{
+	double start = seconds_now();
+	while (__atomic_load_n(&rotated_count, __ATOMIC_ACQUIRE) < count && seconds_now() - start < 5.0)
+		;
+	return (__atomic_load_n(&rotated_count, __ATOMIC_ACQUIRE) == count);
+}
+
+PICOTEST_CASE(rotate)
+{
+	ZIORotateConfig config;
+	memset(&config, 0, sizeof(config));
+	config.filename = "test.log";
+	config.max_size = 30;
+	config.rotated = on_rotated;
+
+	ZIOHandle handle;
+	PICOTEST_ASSERT(zio_open_rotating(&handle, &config) == ZIO_OK);
+	zio_ll size = sizeof(TEST_TEXT) - 1;
+
+	// The next file is open before the handle is returned and before each callback,
+	// so the first write past 'max_size' always moves to it
+	int writes = 0;
+	for (int rotation = 1; rotation <= 2; ++rotation)
+	{
+		while (zio_size(&handle) < config.max_size)
+		{
+			PICOTEST_ASSERT(zio_write(&handle, TEST_TEXT, size) == size);
+			++writes;
+		}
+		PICOTEST_ASSERT(zio_write(&handle, TEST_TEXT, size) == size);
+		++writes;
+		PICOTEST_ASSERT(zio_size(&handle) == size);
+		PICOTEST_ASSERT(wait_for_rotations(rotation));
+	}
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+
+	// Every line ends up in exactly one file
+	zio_ll total = 0;
+	char filename[32];
+	PICOTEST_ASSERT(zio_open_file(&handle, "test.log", ZIOM_READ) == ZIO_OK);
+	total += zio_size(&handle);
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+	remove("test.log");
+	for (int i = 1; i <= rotated_count; ++i)
+	{
+		sprintf(filename, "test.log.%i", i);
+		PICOTEST_ASSERT(zio_open_file(&handle, filename, ZIOM_READ) == ZIO_OK);
+		total += zio_size(&handle);
+		PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+		remove(filename);
+	}
+	PICOTEST_ASSERT(rotated_count == 2);
+	PICOTEST_ASSERT(total == writes * size);
+	PICOTEST_ASSERT(zio_open_file(&handle, "test.log.next", ZIOM_READ) == ZIO_ERROR);
+}
+
+#if defined(__linux)
+#include <sys/stat.h>
+#include <unistd.h>
+
+PICOTEST_CASE(rotate_rename_failure)
+{
+	ZIORotateConfig config;
+	memset(&config, 0, sizeof(config));
+	config.filename = "test.log";
+	config.max_size = 30;
+	config.rotated = on_rotated;
+	__atomic_store_n(&rotated_count, 0, __ATOMIC_RELEASE);
+
+	ZIOHandle handle;
+	PICOTEST_ASSERT(zio_open_rotating(&handle, &config) == ZIO_OK);
+	zio_ll size = sizeof(TEST_TEXT) - 1;
+
+	// A directory where the full file goes makes moving it aside fail
+	PICOTEST_ASSERT(mkdir("test.log.1", 0755) == 0);
+	int writes = 1;
+	while (zio_size(&handle) < config.max_size)
+	{
+		PICOTEST_ASSERT(zio_write(&handle, TEST_TEXT, size) == size);
+		++writes;
+	}
+	PICOTEST_ASSERT(zio_write(&handle, TEST_TEXT, size) == size);
+	double start = seconds_now();
+	while (seconds_now() - start < 0.2)
+		;
+
+	// The writer stays on the file it moved to until the rename works
+	for (int i = 0; i < 4; ++i)
+	{
+		PICOTEST_ASSERT(zio_write(&handle, TEST_TEXT, size) == size);
+		++writes;
+	}
+	PICOTEST_ASSERT(zio_size(&handle) == 5 * size);
+	PICOTEST_ASSERT(__atomic_load_n(&rotated_count, __ATOMIC_ACQUIRE) == 0);
+	PICOTEST_ASSERT(rmdir("test.log.1") == 0);
+	PICOTEST_ASSERT(wait_for_rotations(1));
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+
+	PICOTEST_ASSERT(zio_open_file(&handle, "test.log", ZIOM_READ) == ZIO_OK);
+	PICOTEST_ASSERT(zio_size(&handle) == 5 * size);
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+	PICOTEST_ASSERT(zio_open_file(&handle, "test.log.1", ZIOM_READ) == ZIO_OK);
+	PICOTEST_ASSERT(zio_size(&handle) == (writes - 5) * size);
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+	PICOTEST_ASSERT(zio_open_file(&handle, "test.log.next", ZIOM_READ) == ZIO_ERROR);
+	remove("test.log");
+	remove("test.log.1");
+}
+#endif
+#endif
+
+#ifndef Z_IO_NO_THROTTLE
+static double throttled_write_time(ZIOThrottleGroup *group, int writes, zio_ll size)
+{
+	char mem[100];
+	ZIOHandle inner;
+	ZIOHandle handle;
+	PICOTEST_ASSERT(zio_open_memory(&inner, mem, sizeof(mem)) == ZIO_OK);
+	PICOTEST_ASSERT(zio_open_throttled(&handle, &inner, group) == ZIO_OK);
+
+	double start = seconds_now();
+	for (int i = 0; i < writes; ++i)
+	{
+		PICOTEST_ASSERT(zio_seek(&handle, 0, ZIO_SEEK_SET) == 0);
+		PICOTEST_ASSERT(zio_write(&handle, mem, size) == size);
+	}
+	double elapsed = seconds_now() - start;
+
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+	PICOTEST_ASSERT(zio_close(&inner) == ZIO_OK);
+	return elapsed;
+}
+
+PICOTEST_CASE(throttle)
+{
+	ZIOThrottleGroup group;
+
+	zio_throttle_group_init(&group, 0, 0, 0);
+	PICOTEST_ASSERT(throttled_write_time(&group, 1000, 100) < 0.1);
+
+	// 20 writes of 100 bytes at 100000 bytes/s
+	zio_throttle_group_init(&group, 100000, 0, 0);
+	double elapsed = throttled_write_time(&group, 20, 100);
+	PICOTEST_ASSERT(elapsed > 0.015 && elapsed < 0.5, "took %f seconds", elapsed);
+
+	// 20 writes at 1000 ops/s
+	zio_throttle_group_init(&group, 0, 1000, 0);
+	elapsed = throttled_write_time(&group, 20, 1);
+	PICOTEST_ASSERT(elapsed > 0.015 && elapsed < 0.5, "took %f seconds", elapsed);
+
+	// The burst covers everything, 200 writes at 100 ops/s would take 2 seconds without it
+	zio_throttle_group_init(&group, 0, 100, 2000);
+	elapsed = throttled_write_time(&group, 200, 1);
+	PICOTEST_ASSERT(elapsed < 0.5, "took %f seconds", elapsed);
+}
+#endif
+
+#ifndef Z_IO_NO_SCHEDULER
+PICOTEST_CASE(scheduler)
+{
+	ZIOScheduler scheduler;
+	PICOTEST_ASSERT(zio_scheduler_begin(&scheduler, 2, NULL) == ZIO_OK);
+
+	char mem[100];
+	ZIOHandle inner;
+	ZIOHandle interactive;
+	ZIOHandle background;
+	PICOTEST_ASSERT(zio_open_memory(&inner, mem, sizeof(mem)) == ZIO_OK);
+	PICOTEST_ASSERT(zio_open_scheduled(&interactive, &inner, &scheduler, ZIO_PRIORITY_INTERACTIVE) == ZIO_OK);
+	PICOTEST_ASSERT(zio_open_scheduled(&background, &inner, &scheduler, ZIO_PRIORITY_BACKGROUND) == ZIO_OK);
+
+	// Both handles keep their own position in the shared inner handle
+	write_test(&background);
+	PICOTEST_ASSERT(zio_tell(&background) == sizeof(TEST_TEXT) - 1);
+	PICOTEST_ASSERT(zio_tell(&interactive) == 0);
+	read_test(&interactive);
+	PICOTEST_ASSERT(zio_size(&interactive) == sizeof(mem));
+	PICOTEST_ASSERT(zio_seek(&background, -10, ZIO_SEEK_END) == sizeof(mem) - 10);
+	PICOTEST_ASSERT(zio_seek(&background, -200, ZIO_SEEK_CUR) == ZIO_ERROR);
+
+	ZIOSchedulerStats stats;
+	zio_scheduler_stats(&scheduler, ZIO_PRIORITY_INTERACTIVE, &stats);
+	PICOTEST_ASSERT(stats.queued == 0 && stats.completed == 2);
+	zio_scheduler_stats(&scheduler, ZIO_PRIORITY_BACKGROUND, &stats);
+	PICOTEST_ASSERT(stats.queued == 0 && stats.completed == 2);
+	zio_scheduler_stats(&scheduler, ZIO_PRIORITY_NORMAL, &stats);
+	PICOTEST_ASSERT(stats.completed == 0);
+
+	PICOTEST_ASSERT(zio_close(&interactive) == ZIO_OK);
+	PICOTEST_ASSERT(zio_close(&background) == ZIO_OK);
+	PICOTEST_ASSERT(zio_close(&inner) == ZIO_OK);
+	zio_scheduler_end(&scheduler);
+}
+
+#if defined(__linux)
+#include <pthread.h>
+
+// A memory handle that holds the worker until its gate is opened, and logs what it serves
+typedef struct Gate
+{
+	ZIOHandle memory;
+	int id;
+	volatile int open;
+	volatile int reached;
+} Gate;
+
+typedef struct GateOp
+{
+	int id;
+	char op;
+	zio_ll size;
+	int vec_count;
+} GateOp;
+
+// Only written by the one worker of the schedulers below
+static GateOp gate_ops[16];
+static int gate_op_count;
+
+static Gate *gate_of(ZIOHandle *handle)
+{
+	Gate *gate;
+	memcpy(&gate, handle->data.inline_data, sizeof(gate));
+	return gate;
+}
+
+static void gate_log(ZIOHandle *handle, char op, zio_ll size, int vec_count)
+{
+	Gate *gate = gate_of(handle);
+	__atomic_store_n(&gate->reached, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&gate->open, __ATOMIC_ACQUIRE))
+		;
+	GateOp *entry = &gate_ops[gate_op_count++];
+	entry->id = gate->id;
+	entry->op = op;
+	entry->size = size;
+	entry->vec_count = vec_count;
+}
+
+static zio_result gate_close(ZIOHandle *handle)
+{
+	return zio_close(&gate_of(handle)->memory);
+}
+static zio_ll gate_size(ZIOHandle *handle)
+{
+	return zio_size(&gate_of(handle)->memory);
+}
+static zio_ll gate_seek(ZIOHandle *handle, zio_ll offset, ZIOSeek whence)
+{
+	return zio_seek(&gate_of(handle)->memory, offset, whence);
+}
+static zio_ll gate_read(ZIOHandle *handle, void *destination, zio_ll size)
+{
+	gate_log(handle, 'r', size, 1);
+	return zio_read(&gate_of(handle)->memory, destination, size);
+}
+static zio_ll gate_write(ZIOHandle *handle, const void *source, zio_ll size)
+{
+	gate_log(handle, 'w', size, 1);
+	return zio_write(&gate_of(handle)->memory, source, size);
+}
+static zio_ll gate_writev(ZIOHandle *handle, const ZIOVec *vecs, int count)
+{
+	zio_ll size = 0;
+	for (int i = 0; i < count; ++i)
+		size += vecs[i].size;
+	gate_log(handle, 'w', size, count);
+	return zio_writev(&gate_of(handle)->memory, vecs, count);
+}
+
+static const ZIOVtable gate_vtable = { gate_close, gate_size, gate_seek, gate_read, gate_write, gate_writev };
+
+static void gate_begin(ZIOHandle *handle, Gate *gate, void *memory, zio_ll size, int id, int open)
+{
+	PICOTEST_ASSERT(zio_open_memory(&gate->memory, memory, size) == ZIO_OK);
+	gate->id = id;
+	gate->open = open;
+	gate->reached = 0;
+	memset(handle, 0, sizeof(ZIOHandle));
+	handle->vtable = &gate_vtable;
+	memcpy(handle->data.inline_data, &gate, sizeof(gate));
+}
+
+// Scheduled requests block until they are served, so each one gets its own thread
+typedef struct ScheduledRequest
+{
+	ZIOHandle handle;
+	char op;
+	char buffer[4];
+	zio_ll result;
+	pthread_t thread;
+} ScheduledRequest;
+
+static void *scheduled_request_run(void *arg)
+{
+	ScheduledRequest *request = (ScheduledRequest*)arg;
+	if (request->op == 'r')
+		request->result = zio_read(&request->handle, request->buffer, sizeof(request->buffer));
+	else
+		request->result = zio_write(&request->handle, request->buffer, sizeof(request->buffer));
+	return NULL;
+}
+
+// Starts the request and waits until 'queued' requests of its priority are queued,
+// or until the worker is held at 'gate' with it
+static void scheduled_request_start(ScheduledRequest *request, ZIOHandle *inner, ZIOScheduler *scheduler, ZIOPriority priority, char op, zio_ll offset, zio_ll queued, Gate *gate)
+{
+	PICOTEST_ASSERT(zio_open_scheduled(&request->handle, inner, scheduler, priority) == ZIO_OK);
+	PICOTEST_ASSERT(zio_seek(&request->handle, offset, ZIO_SEEK_SET) == offset);
+	request->op = op;
+	PICOTEST_ASSERT(pthread_create(&request->thread, NULL, scheduled_request_run, request) == 0);
+
+	ZIOSchedulerStats stats;
+	double start = seconds_now();
+	do
+	{
+		zio_scheduler_stats(scheduler, priority, &stats);
+	} while ((stats.queued != queued || (gate && !__atomic_load_n(&gate->reached, __ATOMIC_ACQUIRE))) && seconds_now() - start < 5.0);
+	PICOTEST_ASSERT(stats.queued == queued);
+	PICOTEST_ASSERT(!gate || gate->reached);
+}
+
+static void scheduled_request_end(ScheduledRequest *request, zio_ll result)
+{
+	PICOTEST_ASSERT(pthread_join(request->thread, NULL) == 0);
+	PICOTEST_ASSERT(request->result == result);
+	PICOTEST_ASSERT(zio_close(&request->handle) == ZIO_OK);
+}
+
+PICOTEST_CASE(scheduler_priority)
+{
+	char mem[3][16];
+	Gate gates[3];
+	ZIOHandle inner[3];
+	ScheduledRequest requests[3];
+	for (int overdue = 0; overdue < 2; ++overdue)
+	{
+		// Background requests are overdue after 1 ms in the second round
+		int deadline_ms[ZIO_PRIORITY_COUNT] = { 1000, 1000, overdue ? 1 : 1000 };
+		ZIOScheduler scheduler;
+		PICOTEST_ASSERT(zio_scheduler_begin(&scheduler, 1, deadline_ms) == ZIO_OK);
+		gate_op_count = 0;
+		for (int i = 0; i < 3; ++i)
+			gate_begin(&inner[i], &gates[i], mem[i], sizeof(mem[i]), i, i > 0);
+
+		// The worker is held at the first gate while the others queue up
+		scheduled_request_start(&requests[0], &inner[0], &scheduler, ZIO_PRIORITY_NORMAL, 'r', 0, 0, &gates[0]);
+		scheduled_request_start(&requests[1], &inner[1], &scheduler, ZIO_PRIORITY_BACKGROUND, 'r', 0, 1, NULL);
+		scheduled_request_start(&requests[2], &inner[2], &scheduler, overdue ? ZIO_PRIORITY_NORMAL : ZIO_PRIORITY_INTERACTIVE, 'r', 0, 1, NULL);
+		double start = seconds_now();
+		while (seconds_now() - start < 0.005)
+			;
+		__atomic_store_n(&gates[0].open, 1, __ATOMIC_RELEASE);
+		for (int i = 0; i < 3; ++i)
+		{
+			scheduled_request_end(&requests[i], 4);
+			PICOTEST_ASSERT(zio_close(&inner[i]) == ZIO_OK);
+		}
+
+		// An interactive request overtakes the background one, unless that is overdue
+		PICOTEST_ASSERT(gate_op_count == 3);
+		PICOTEST_ASSERT(gate_ops[0].id == 0);
+		PICOTEST_ASSERT(gate_ops[1].id == (overdue ? 1 : 2));
+		PICOTEST_ASSERT(gate_ops[2].id == (overdue ? 2 : 1));
+		zio_scheduler_end(&scheduler);
+	}
+}
+
+PICOTEST_CASE(scheduler_merge)
+{
+	char mem[3][16] = { "", "", "01234567" };
+	Gate gates[3];
+	ZIOHandle inner[3];
+	ScheduledRequest requests[5];
+	ZIOScheduler scheduler;
+	PICOTEST_ASSERT(zio_scheduler_begin(&scheduler, 1, NULL) == ZIO_OK);
+	gate_op_count = 0;
+	for (int i = 0; i < 3; ++i)
+		gate_begin(&inner[i], &gates[i], mem[i], sizeof(mem[i]), i, i > 0);
+
+	scheduled_request_start(&requests[0], &inner[0], &scheduler, ZIO_PRIORITY_NORMAL, 'r', 0, 0, &gates[0]);
+	memcpy(requests[1].buffer, "abcd", 4);
+	memcpy(requests[2].buffer, "efgh", 4);
+	scheduled_request_start(&requests[1], &inner[1], &scheduler, ZIO_PRIORITY_BACKGROUND, 'w', 0, 1, NULL);
+	scheduled_request_start(&requests[2], &inner[1], &scheduler, ZIO_PRIORITY_BACKGROUND, 'w', 4, 2, NULL);
+	scheduled_request_start(&requests[3], &inner[2], &scheduler, ZIO_PRIORITY_BACKGROUND, 'r', 0, 3, NULL);
+	scheduled_request_start(&requests[4], &inner[2], &scheduler, ZIO_PRIORITY_BACKGROUND, 'r', 4, 4, NULL);
+	__atomic_store_n(&gates[0].open, 1, __ATOMIC_RELEASE);
+	for (int i = 0; i < 5; ++i)
+		scheduled_request_end(&requests[i], 4);
+
+	// Each pair of adjacent requests is served with one call
+	PICOTEST_ASSERT(gate_op_count == 3);
+	PICOTEST_ASSERT(gate_ops[1].id == 1 && gate_ops[1].op == 'w' && gate_ops[1].size == 8 && gate_ops[1].vec_count == 2);
+	PICOTEST_ASSERT(gate_ops[2].id == 2 && gate_ops[2].op == 'r' && gate_ops[2].size == 8);
+	PICOTEST_ASSERT(memcmp(mem[1], "abcdefgh", 8) == 0);
+	PICOTEST_ASSERT(memcmp(requests[3].buffer, "0123", 4) == 0);
+	PICOTEST_ASSERT(memcmp(requests[4].buffer, "4567", 4) == 0);
+
+	ZIOSchedulerStats stats;
+	zio_scheduler_stats(&scheduler, ZIO_PRIORITY_BACKGROUND, &stats);
+	PICOTEST_ASSERT(stats.completed == 4 && stats.merged == 2);
+	for (int i = 0; i < 3; ++i)
+		PICOTEST_ASSERT(zio_close(&inner[i]) == ZIO_OK);
+	zio_scheduler_end(&scheduler);
+}
+#endif
+#endif
+
+static int check_pattern(const unsigned char *data, zio_ll offset, zio_ll size)
+{
+	zio_ll i;
+	for (i = 0; i < size; ++i)
+	{
+		if (data[i] != (unsigned char)((offset + i) * 7))
+			return 0;
+	}
+	return 1;
+}
+
+PICOTEST_CASE(adaptive_buffer)
+{
+	const zio_ll file_size = 1 << 20;
+	unsigned char *data = (unsigned char*)malloc(file_size);
+	zio_ll i;
+	for (i = 0; i < file_size; ++i)
+		data[i] = (unsigned char)(i * 7);
+
+	ZIOHandle handle;
+	ZIOFileStats stats;
+	PICOTEST_ASSERT(zio_open_file(&handle, "test.bin", ZIOM_WRITE) == ZIO_OK);
+	PICOTEST_ASSERT(zio_write(&handle, data, file_size) == file_size);
+	PICOTEST_ASSERT(zio_file_stats(&handle, &stats) == ZIO_ERROR);
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+
+	PICOTEST_ASSERT(zio_open_file(&handle, "test.bin", ZIOM_READ) == ZIO_OK);
+	PICOTEST_ASSERT(zio_size(&handle) == file_size);
+
+	// Sequential reads grow the read-ahead
+	for (i = 0; i < file_size / 2; i += 1000)
+	{
+		PICOTEST_ASSERT(zio_read(&handle, data, 1000) == 1000);
+		PICOTEST_ASSERT(check_pattern(data, i, 1000));
+	}
+	PICOTEST_ASSERT(zio_file_stats(&handle, &stats) == ZIO_OK);
+	PICOTEST_ASSERT(stats.pattern == ZIO_ACCESS_SEQUENTIAL);
+	PICOTEST_ASSERT(stats.read_ahead > ZIO_FILE_MIN_READ_AHEAD);
+	PICOTEST_ASSERT(stats.file_reads < stats.reads / 10);
+
+	// Seeking back inside the buffer does not lose it
+	PICOTEST_ASSERT(zio_seek(&handle, -500, ZIO_SEEK_CUR) == i - 500);
+	PICOTEST_ASSERT(zio_read(&handle, data, 100) == 100);
+	PICOTEST_ASSERT(check_pattern(data, i - 500, 100));
+
+	// Short strides read ahead over several strides
+	for (i = 0; i < 64; ++i)
+	{
+		PICOTEST_ASSERT(zio_seek(&handle, 4096 * i, ZIO_SEEK_SET) == 4096 * i);
+		PICOTEST_ASSERT(zio_read(&handle, data, 16) == 16);
+		PICOTEST_ASSERT(check_pattern(data, 4096 * i, 16));
+	}
+	ZIOFileStats strided;
+	PICOTEST_ASSERT(zio_file_stats(&handle, &strided) == ZIO_OK);
+	PICOTEST_ASSERT(strided.pattern == ZIO_ACCESS_STRIDED);
+	PICOTEST_ASSERT(strided.stride == 4096);
+	PICOTEST_ASSERT(strided.buffer_hits - stats.buffer_hits > 32);
+
+	// Random reads are not buffered
+	srand(1);
+	for (i = 0; i < 64; ++i)
+	{
+		zio_ll offset = ((zio_ll)rand() * 4099) % (file_size - 64);
+		PICOTEST_ASSERT(zio_seek(&handle, offset, ZIO_SEEK_SET) == offset);
+		PICOTEST_ASSERT(zio_read(&handle, data, 64) == 64);
+		PICOTEST_ASSERT(check_pattern(data, offset, 64));
+	}
+	ZIOFileStats random;
+	PICOTEST_ASSERT(zio_file_stats(&handle, &random) == ZIO_OK);
+	PICOTEST_ASSERT(random.pattern == ZIO_ACCESS_RANDOM);
+	PICOTEST_ASSERT(random.read_ahead == 0);
+	PICOTEST_ASSERT(random.bytes_read - strided.bytes_read < 64 * 64 * 2);
+
+	// Reading at the end
+	PICOTEST_ASSERT(zio_seek(&handle, -10, ZIO_SEEK_END) == file_size - 10);
+	PICOTEST_ASSERT(zio_read(&handle, data, 100) == 10);
+	PICOTEST_ASSERT(check_pattern(data, file_size - 10, 10));
+	PICOTEST_ASSERT(zio_read(&handle, data, 100) == 0);
+
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+	remove("test.bin");
+	free(data);
+}
+
+PICOTEST_CASE(memory_budget)
+{
+	ZIOMemoryStats stats;
+	zio_memory_stats(&stats);
+	PICOTEST_ASSERT(stats.used == 0);
+
+#ifndef Z_IO_NO_BITSTREAM
+	ZIOHandle handle;
+	ZIOBitReader reader;
+	ZIOBitReader small_reader;
+	PICOTEST_ASSERT(zio_open_file(&handle, "test.txt", ZIOM_WRITE | ZIOM_READ) == ZIO_OK);
+	PICOTEST_ASSERT(zio_bit_reader_begin(&reader, &handle) == ZIO_OK);
+	PICOTEST_ASSERT(reader.buffer_size == ZIO_BIT_BUFFER_SIZE);
+	zio_memory_stats(&stats);
+	PICOTEST_ASSERT(stats.used >= ZIO_BIT_BUFFER_SIZE);
+
+	// Over the soft limit readers get smaller buffers
+	zio_memory_set_limits(100, 0);
+	PICOTEST_ASSERT(zio_bit_reader_begin(&small_reader, &handle) == ZIO_OK);
+	PICOTEST_ASSERT(small_reader.buffer_size == ZIO_BIT_MIN_BUFFER_SIZE);
+	PICOTEST_ASSERT(zio_bit_reader_end(&small_reader) == ZIO_OK);
+
+	// Over the hard limit nothing can be allocated
+	zio_memory_set_limits(100, ZIO_BIT_BUFFER_SIZE + 10);
+	PICOTEST_ASSERT(zio_bit_reader_begin(&small_reader, &handle) == ZIO_ERROR);
+	zio_memory_stats(&stats);
+	PICOTEST_ASSERT(stats.failed > 0);
+
+	zio_memory_set_limits(0, 0);
+	PICOTEST_ASSERT(zio_bit_reader_end(&reader) == ZIO_OK);
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+	remove("test.txt");
+#endif
+
+	zio_memory_stats(&stats);
+	PICOTEST_ASSERT(stats.used == 0);
+}
+
+PICOTEST_CASE(handle_pool)
+{
+	// The operations live in a shared vtable, the rest fits in the inline data
+	PICOTEST_ASSERT(sizeof(ZIOHandle) == 2 * sizeof(void*) + ZIO_HANDLE_INLINE_SIZE);
+
+	static ZIOHandle *handles[2500];
+	char data[16];
+	ZIOHandlePool pool;
+	zio_handle_pool_begin(&pool, 1000);
+	int i;
+	for (i = 0; i < 2500; ++i)
+	{
+		handles[i] = zio_handle_pool_alloc(&pool);
+		PICOTEST_ASSERT(handles[i] != NULL);
+		PICOTEST_ASSERT(zio_open_const_memory(handles[i], data, sizeof(data)) == ZIO_OK);
+		PICOTEST_ASSERT(zio_size(handles[i]) == sizeof(data));
+	}
+	for (i = 0; i < 2500; i += 2)
+	{
+		PICOTEST_ASSERT(zio_close(handles[i]) == ZIO_OK);
+		zio_handle_pool_free(&pool, handles[i]);
+	}
+
+	// Freed handles are reused before a new slab is allocated
+	ZIOMemoryStats before, after;
+	zio_memory_stats(&before);
+	for (i = 0; i < 2500; i += 2)
+	{
+		handles[i] = zio_handle_pool_alloc(&pool);
+		PICOTEST_ASSERT(zio_open_memory(handles[i], data, sizeof(data)) == ZIO_OK);
+	}
+	zio_memory_stats(&after);
+	PICOTEST_ASSERT(after.used == before.used);
+
+	for (i = 0; i < 2500; ++i)
+		PICOTEST_ASSERT(zio_close(handles[i]) == ZIO_OK);
+	zio_handle_pool_end(&pool);
+	zio_memory_stats(&after);
+	PICOTEST_ASSERT(after.used == 0);
+}
+
+PICOTEST_CASE(allocator)
+{
+	long long allocations = test_allocator.allocations;
+	long long frees = test_allocator.frees;
+
+	ZIOHandle handle;
+	PICOTEST_ASSERT(zio_open_file(&handle, "test.txt", ZIOM_WRITE) == ZIO_OK);
+	write_test(&handle);
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+
+	// Read-only files allocate their read buffer state
+	PICOTEST_ASSERT(zio_open_file(&handle, "test.txt", ZIOM_READ) == ZIO_OK);
+	PICOTEST_ASSERT(test_allocator.allocations > allocations);
+	read_test(&handle);
+	PICOTEST_ASSERT(zio_close(&handle) == ZIO_OK);
+	PICOTEST_ASSERT(test_allocator.allocations - allocations == test_allocator.frees - frees);
+
+	remove("test.txt");
+}
+
 int main(void)
 {
 	int fails = 0;
 	fails += file(NULL);
+#if defined(__linux)
+	fails += file_fd(NULL);
+#endif
 	fails += memory(NULL);
 	fails += const_memory(NULL);
+	fails += adaptive_buffer(NULL);
+	fails += memory_budget(NULL);
+	fails += handle_pool(NULL);
+	fails += allocator(NULL);
+#ifndef Z_IO_NO_BITSTREAM
+	fails += bitstream(NULL);
+#endif
+#ifndef Z_IO_NO_FRAME
+	fails += frame(NULL);
+#endif
+#ifndef Z_IO_NO_LOG
+	fails += log_sink(NULL);
+	fails += log_sink_partial_block(NULL);
+#endif
+#ifndef Z_IO_NO_ROTATE
+	fails += rotate(NULL);
+#if defined(__linux)
+	fails += rotate_rename_failure(NULL);
+#endif
+#endif
+#ifndef Z_IO_NO_THROTTLE
+	fails += throttle(NULL);
+#endif
+#ifndef Z_IO_NO_SCHEDULER
+	fails += scheduler(NULL);
+#if defined(__linux)
+	fails += scheduler_priority(NULL);
+	fails += scheduler_merge(NULL);
+#endif
+#endif
 	return fails;
 }
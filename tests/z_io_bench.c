@@ -0,0 +1,129 @@
+// Compares the adaptive read buffer of read-only file handles with fixed stdio buffers
+// on a workload that mixes sequential scans with small random probes.
+
+#define Z_IO_IMPLEMENTATION
+#include "z_io.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_FILE "bench.bin"
+#define BENCH_FILE_SIZE (64 << 20)
+#define SCAN_SIZE (8 << 20)
+#define SCAN_READ 4096
+#define PROBE_COUNT 2000
+#define PROBE_READ 512
+#define ROUNDS 4
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long next_random(unsigned long long *state)
+{
+	*state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+	return *state >> 33;
+}
+
+// Scans a chunk of the file, then probes random offsets, ROUNDS times. Returns a checksum.
+static unsigned long long run_stdio(size_t buffer_size)
+{
+	static char buffer[SCAN_READ];
+	FILE *file = fopen(BENCH_FILE, "rb");
+	char *stdio_buffer = (char*)malloc(buffer_size);
+	setvbuf(file, stdio_buffer, _IOFBF, buffer_size);
+
+	unsigned long long sum = 0, state = 1;
+	int round, i;
+	for (round = 0; round < ROUNDS; ++round)
+	{
+		fseek(file, (long)round * SCAN_SIZE, SEEK_SET);
+		long scanned;
+		for (scanned = 0; scanned < SCAN_SIZE; scanned += SCAN_READ)
+			sum += fread(buffer, 1, SCAN_READ, file) + (unsigned char)buffer[0];
+		for (i = 0; i < PROBE_COUNT; ++i)
+		{
+			fseek(file, (long)(next_random(&state) % (BENCH_FILE_SIZE - PROBE_READ)), SEEK_SET);
+			sum += fread(buffer, 1, PROBE_READ, file) + (unsigned char)buffer[0];
+		}
+	}
+
+	fclose(file);
+	free(stdio_buffer);
+	return sum;
+}
+
+static unsigned long long run_zio(ZIOFileStats *stats)
+{
+	static char buffer[SCAN_READ];
+	ZIOHandle handle;
+	zio_open_file(&handle, BENCH_FILE, ZIOM_READ);
+
+	unsigned long long sum = 0, state = 1;
+	int round, i;
+	for (round = 0; round < ROUNDS; ++round)
+	{
+		zio_seek(&handle, (zio_ll)round * SCAN_SIZE, ZIO_SEEK_SET);
+		zio_ll scanned;
+		for (scanned = 0; scanned < SCAN_SIZE; scanned += SCAN_READ)
+			sum += zio_read(&handle, buffer, SCAN_READ) + (unsigned char)buffer[0];
+		for (i = 0; i < PROBE_COUNT; ++i)
+		{
+			zio_seek(&handle, (zio_ll)(next_random(&state) % (BENCH_FILE_SIZE - PROBE_READ)), ZIO_SEEK_SET);
+			sum += zio_read(&handle, buffer, PROBE_READ) + (unsigned char)buffer[0];
+		}
+	}
+
+	zio_file_stats(&handle, stats);
+	zio_close(&handle);
+	return sum;
+}
+
+int main(void)
+{
+	// Create the file, the runs below read it from the page cache
+	{
+		char *data = (char*)malloc(1 << 20);
+		int i;
+		for (i = 0; i < (1 << 20); ++i)
+			data[i] = (char)(i * 7);
+		FILE *file = fopen(BENCH_FILE, "wb");
+		if (!file)
+			return 1;
+		for (i = 0; i < BENCH_FILE_SIZE / (1 << 20); ++i)
+			fwrite(data, 1, 1 << 20, file);
+		fclose(file);
+		free(data);
+	}
+
+	const size_t buffer_sizes[] = { 4096, 65536, 1 << 20 };
+	unsigned long long expected = 0;
+	int i;
+	for (i = 0; i < (int)(sizeof(buffer_sizes) / sizeof(buffer_sizes[0])); ++i)
+	{
+		double start = now_seconds();
+		unsigned long long sum = run_stdio(buffer_sizes[i]);
+		double elapsed = now_seconds() - start;
+		if (i > 0 && sum != expected)
+			printf("checksum mismatch\n");
+		expected = sum;
+		printf("stdio %8zu byte buffer: %8.2f ms\n", buffer_sizes[i], elapsed * 1000.0);
+	}
+
+	ZIOFileStats stats;
+	double start = now_seconds();
+	unsigned long long sum = run_zio(&stats);
+	double elapsed = now_seconds() - start;
+	if (sum != expected)
+		printf("checksum mismatch\n");
+	printf("zio adaptive buffer:      %8.2f ms\n", elapsed * 1000.0);
+	printf("  reads %lld, buffer hits %lld, file reads %lld\n", stats.reads, stats.buffer_hits, stats.file_reads);
+	printf("  bytes requested %lld, bytes read %lld, pattern changes %lld\n", stats.bytes_requested, stats.bytes_read, stats.pattern_changes);
+
+	remove(BENCH_FILE);
+	return 0;
+}
@@ -11,6 +11,10 @@ before you include this file in *one* C or C++ file to create the implementation
 #define Z_FS_STATIC
 before you include this file to create a private implementation.
 
+#define ZFS_MALLOC(size, context), ZFS_REALLOC(memory, size, context) and ZFS_FREE(memory, context)
+to replace malloc, realloc and free. Define all three or none of them.
+'context' is ZFS_ALLOC_CONTEXT, which is NULL unless you define it, e.g. to a thread-local arena.
+
 #define Z_FS_NO_PATH
 to disable path functions.
 If directory traversal is enabled, path functions will be included anyway,
@@ -21,10 +25,15 @@ to disable file functions.
 
 #define Z_FS_NO_DIRECTORY
 to disable directory traversal functions.
+The parallel walker needs pthreads on POSIX, link with -pthread.
 
 #define Z_FS_ALWAYS_FORWARD_SLASH
 to always use / as the directory separator, even on Windows.
 
+On Linux the implementation defines _GNU_SOURCE, which strict modes like -std=c99 need for
+AT_FDCWD, O_CLOEXEC, posix_fallocate and others. It only takes effect when no system header
+is included before this file, otherwise define _GNU_SOURCE yourself before the first one.
+
 UNLICENSE
 This is free and unencumbered software released into the public domain.
 Anyone is free to copy, modify, publish, use, compile, sell, or
@@ -101,6 +110,13 @@ extern "C" {
 	};
 
 	// Path functions
+	// 'length' bytes of a path, which does not have to be '\0' terminated
+	typedef struct ZFSPathView
+	{
+		const char *data;
+		zfs_ll length;
+	} ZFSPathView;
+
 #ifndef Z_FS_NO_PATH
 	// Joins two paths.
 	ZFSDEF void zfs_path_join(char *result, zfs_ll result_size, const char *left, const char *right);
@@ -132,6 +148,95 @@ extern "C" {
 
 	// If 'path' is a full path, it returns 'path', otherwise it joins 'path' with the working directory.
 	ZFSDEF void zfs_path_full(char *result, zfs_ll result_size, const char *path);
+
+	// Length-aware path functions
+	// Returns a view of the '\0' terminated 'path'.
+	ZFSDEF ZFSPathView zfs_path_view(const char *path);
+
+	// As the functions above, but return the part of 'path' without copying or scanning for a '\0'.
+	ZFSDEF ZFSPathView zfs_path_view_extension(ZFSPathView path);
+	ZFSDEF ZFSPathView zfs_path_view_basename(ZFSPathView path);
+	ZFSDEF ZFSPathView zfs_path_view_basename_without_extension(ZFSPathView path);
+	ZFSDEF ZFSPathView zfs_path_view_directory(ZFSPathView path);
+
+	// The functions below write like snprintf: at most 'result_size' bytes including a '\0', and return
+	// the length of the whole result without it, so a result that did not fit is cut off and sizing a
+	// buffer takes one call with a 'result_size' of 0. 'result' can only be NULL then.
+
+	// Joins all 'parts' as zfs_path_join() joins two, in one pass. 'result' can be the first part.
+	ZFSDEF zfs_ll zfs_path_view_join(char *result, zfs_ll result_size, const ZFSPathView *parts, int part_count);
+
+	// As zfs_path_set_extension(). 'result' can be 'path'.
+	ZFSDEF zfs_ll zfs_path_view_set_extension(char *result, zfs_ll result_size, ZFSPathView path, ZFSPathView new_extension);
+
+	// Copies 'path' into 'result' with a '\0'.
+	ZFSDEF zfs_ll zfs_path_view_copy(char *result, zfs_ll result_size, ZFSPathView path);
+
+	// Path builder
+	// Holds paths up to ZFS_PATH_BUILDER_INLINE_SIZE bytes in itself, so it must not be copied, and
+	// allocates only for longer ones.
+#ifndef ZFS_PATH_BUILDER_INLINE_SIZE
+#define ZFS_PATH_BUILDER_INLINE_SIZE 256
+#endif
+
+	typedef struct ZFSPathBuilder
+	{
+		char *path; // Always '\0' terminated
+		zfs_ll length;
+		zfs_ll capacity;
+		char inline_path[ZFS_PATH_BUILDER_INLINE_SIZE];
+	} ZFSPathBuilder;
+
+	ZFSDEF void zfs_path_builder_begin(ZFSPathBuilder *builder);
+
+	ZFSDEF void zfs_path_builder_end(ZFSPathBuilder *builder);
+
+	// Joins 'part' to the end of the path, as zfs_path_join().
+	// Returns false if there was no memory, then the path is unchanged.
+	ZFSDEF zfs_bool zfs_path_builder_push(ZFSPathBuilder *builder, ZFSPathView part);
+
+	// Removes the last segment and the separator before it, given "/path/to/file" it leaves "/path/to".
+	ZFSDEF void zfs_path_builder_pop(ZFSPathBuilder *builder);
+
+	// Cuts the path back to 'length', e.g. a length from before pushing.
+	ZFSDEF void zfs_path_builder_truncate(ZFSPathBuilder *builder, zfs_ll length);
+
+	// Removes repeated separators, "." segments, ".." segments together with the segment before them, and a
+	// trailing separator, and makes the separators native, in place. A relative path keeps its leading "..",
+	// an absolute one drops ".." at the root, and an empty result becomes ".". Only the string is looked at,
+	// so "link/.." becomes "." even when "link" is a symlink to a directory elsewhere.
+	// Returns the new length.
+	ZFSDEF zfs_ll zfs_path_canonicalize(char *path);
+
+#if defined(ZFS_POSIX)
+	// Symlink resolution
+#ifndef ZFS_PATH_CACHE_SIZE
+#define ZFS_PATH_CACHE_SIZE 1024
+#endif
+
+	// Resolved directories, each kept in the slot its path hashes to until another one replaces it
+	typedef struct ZFSPathCache
+	{
+		void *slots;
+		zfs_ll slot_count;
+	} ZFSPathCache;
+
+	// Rounds 'slot_count' up to a power of two, 0 for ZFS_PATH_CACHE_SIZE.
+	// Returns false if there was no memory.
+	ZFSDEF zfs_bool zfs_path_cache_begin(ZFSPathCache *cache, zfs_ll slot_count);
+
+	// Forgets all resolved directories, e.g. after symlinks to directories were changed.
+	ZFSDEF void zfs_path_cache_clear(ZFSPathCache *cache);
+
+	ZFSDEF void zfs_path_cache_end(ZFSPathCache *cache);
+
+	// As realpath(), writes the absolute path of 'path' without symlinks, "." or ".." segments, relative paths
+	// starting from the working directory. Each directory on the way is looked up in 'cache' first and added
+	// to it after, so paths under directories resolved before only stat what comes after them. Cached
+	// directories are not checked again. 'cache' can be NULL, and must not be used by several threads at once.
+	// Returns the length like zfs_path_view_join(), or -1 with errno set, e.g. if a segment does not exist.
+	ZFSDEF zfs_ll zfs_path_resolve(ZFSPathCache *cache, char *result, zfs_ll result_size, const char *path);
+#endif
 #endif // Z_FS_NO_PATH
 
 	// File functions
@@ -147,14 +252,70 @@ extern "C" {
 	// Returns false if it failed.
 	ZFSDEF zfs_bool zfs_file_rename(const char *old_filename, const char *new_filename);
 
-	// Copies 'source_filename' to 'destination_filename'.
-	// Copies in 32k byte chunks to conserve memory.
+	// Copies 'source_filename' to 'destination_filename', see zfs_file_copy_ex().
 	// Returns false if it failed.
 	ZFSDEF zfs_bool zfs_file_copy(const char *source_filename, const char *destination_filename);
 
+#ifndef ZFS_COPY_BUFFER_SIZE
+#define ZFS_COPY_BUFFER_SIZE (1 << 20)
+#endif
+
+	typedef enum
+	{
+		ZFS_COPY_METHOD_NONE,     // There was no data to copy, the source is empty or only holes
+		ZFS_COPY_METHOD_REFLINK,  // The destination shares the source's blocks until either is written
+		ZFS_COPY_METHOD_RANGE,    // copy_file_range, which filesystems can do without reading the data
+		ZFS_COPY_METHOD_SENDFILE,
+		ZFS_COPY_METHOD_BUFFER,   // Read and written through a ZFS_COPY_BUFFER_SIZE buffer
+	} ZFSCopyMethod;
+
+	enum
+	{
+		ZFS_COPY_PREALLOCATE = 1<<0, // Allocate the whole destination up front, which also fills the holes
+		ZFS_COPY_NO_REFLINK = 1<<1,  // Always copy the data
+	};
+
+	// Copies 'source_filename' to 'destination_filename' with the fastest method the filesystems allow.
+	// A reflink is tried first, then the data is copied with copy_file_range, sendfile or a buffer,
+	// falling back to the next one when a method is not supported. Only the data regions of a sparse
+	// source are copied, so holes stay holes.
+	// 'method', which can be NULL, is set to the method the data was copied with, the slowest one
+	// if it had to fall back part way. Other platforms always use the buffer.
+	// Returns false if it failed.
+	ZFSDEF zfs_bool zfs_file_copy_ex(const char *source_filename, const char *destination_filename, int flags, ZFSCopyMethod *method);
+
 	// Deletes 'filename'.
 	// Returns false if it failed.
 	ZFSDEF zfs_bool zfs_file_delete(const char *filename);
+
+	// Directory-relative file functions
+#if defined(ZFS_POSIX)
+	// An open directory that names are looked up in, so the path to it is only resolved once, and
+	// names keep referring to the same directory if it is moved or renamed.
+	typedef struct ZFSRoot
+	{
+		int fd;
+	} ZFSRoot;
+
+	// Opens 'path', which is relative to 'parent' or the working directory if 'parent' is NULL.
+	// Only search permission is needed on the directory.
+	// Returns false if it failed.
+	ZFSDEF zfs_bool zfs_root_begin(ZFSRoot *root, const ZFSRoot *parent, const char *path);
+
+	ZFSDEF void zfs_root_end(ZFSRoot *root);
+
+	// As the functions above, with names relative to 'root', or the working directory if 'root' is NULL
+	ZFSDEF zfs_bool zfs_file_touch_at(const ZFSRoot *root, const char *filename);
+	ZFSDEF zfs_bool zfs_file_exists_at(const ZFSRoot *root, const char *filename);
+	ZFSDEF zfs_bool zfs_file_rename_at(const ZFSRoot *old_root, const char *old_filename, const ZFSRoot *new_root, const char *new_filename);
+	ZFSDEF zfs_bool zfs_file_copy_at(const ZFSRoot *source_root, const char *source_filename, const ZFSRoot *destination_root, const char *destination_filename, int flags, ZFSCopyMethod *method);
+	ZFSDEF zfs_bool zfs_file_delete_at(const ZFSRoot *root, const char *filename);
+
+	// Opens 'filename' with open() 'flags', e.g. O_WRONLY | O_CREAT | O_TRUNC, creating files with
+	// permissions 0666 less the umask. The fd can be handed to zio_open_fd() from z_io.h.
+	// Returns the fd, or -1 if it failed.
+	ZFSDEF int zfs_file_open_at(const ZFSRoot *root, const char *filename, int flags);
+#endif
 #endif // Z_FS_NO_FILE
 
 	// Directory traversal
@@ -191,6 +352,386 @@ extern "C" {
 
 	// Returns whether the context currently points at a directory.
 	ZFSDEF zfs_bool zfs_directory_is_directory(ZFSDir *context);
+
+	typedef enum
+	{
+		ZFS_TYPE_UNKNOWN,
+		ZFS_TYPE_FILE,
+		ZFS_TYPE_DIRECTORY,
+		ZFS_TYPE_SYMLINK,
+		ZFS_TYPE_OTHER, // Devices, pipes, sockets
+	} ZFSType;
+
+	// Entry metadata
+	enum
+	{
+		ZFS_INFO_TYPE = 1<<0,
+		ZFS_INFO_SIZE = 1<<1,
+		ZFS_INFO_MTIME = 1<<2,
+		ZFS_INFO_INODE = 1<<3,
+		ZFS_INFO_MODE = 1<<4,
+		ZFS_INFO_ALL = ZFS_INFO_TYPE | ZFS_INFO_SIZE | ZFS_INFO_MTIME | ZFS_INFO_INODE | ZFS_INFO_MODE,
+	};
+
+	typedef struct ZFSEntryInfo
+	{
+		int fields; // ZFS_INFO_* flags of the fields below that are set
+		ZFSType type; // Of the entry itself, symlinks are not followed
+		zfs_ll size;
+		zfs_ll mtime_seconds; // Since the Unix epoch
+		int mtime_nanoseconds;
+		zfs_ll inode; // Not on Windows
+		unsigned int mode; // Permission bits, not on Windows
+	} ZFSEntryInfo;
+
+	// Fills 'info' with the ZFS_INFO_* 'fields' of the entry the context currently points at.
+	// Type and inode come from the directory itself when possible. Anything else is fetched with a single
+	// stat of only the requested fields, which is kept until zfs_directory_next().
+	// Returns false if a requested field could not be read.
+	ZFSDEF zfs_bool zfs_directory_current_info(ZFSDir *context, int fields, ZFSEntryInfo *info);
+
+	// Arena that directory listings are allocated from
+#ifndef ZFS_ARENA_BLOCK_SIZE
+#define ZFS_ARENA_BLOCK_SIZE 65536
+#endif
+
+	typedef struct ZFSArena
+	{
+		char *memory; // The block allocations are made from
+		zfs_ll size;
+		zfs_ll used;
+		void *blocks; // Blocks allocated when 'memory' ran out
+	} ZFSArena;
+
+	// 'memory' is used first and can be NULL. Blocks of at least ZFS_ARENA_BLOCK_SIZE bytes are
+	// allocated when it runs out, each twice the size of the last.
+	ZFSDEF void zfs_arena_begin(ZFSArena *arena, void *memory, zfs_ll size);
+
+	// Returns 16 byte aligned memory that stays valid until zfs_arena_end(), or NULL if there was no memory.
+	ZFSDEF void *zfs_arena_alloc(ZFSArena *arena, zfs_ll size);
+
+	// Frees the blocks the arena allocated. The memory given to zfs_arena_begin() is not touched.
+	ZFSDEF void zfs_arena_end(ZFSArena *arena);
+
+	// Directory listing
+	enum
+	{
+		ZFS_LIST_SORT = 1<<0,  // Sort by name, in byte order
+		ZFS_LIST_SIZES = 1<<1, // Fill 'sizes', which stats every file
+	};
+
+	typedef struct ZFSDirList
+	{
+		zfs_ll count;
+		const char *names;          // All names one after another, each terminated by '\0'
+		const zfs_ll *name_offsets; // Where each name starts in 'names'
+		const unsigned char *types; // ZFSType of each entry
+		const zfs_ll *sizes;        // Size of each entry, NULL without ZFS_LIST_SIZES
+	} ZFSDirList;
+
+	// Lists the entries of 'path', without "." and "..", into columns allocated from 'arena'.
+	// The directory is read once into temporary columns, which are then copied into the arena,
+	// so each column is a single allocation.
+	// Returns false if it failed, then 'list' is empty.
+	ZFSDEF zfs_bool zfs_directory_list(ZFSArena *arena, const char *path, int flags, ZFSDirList *list);
+
+	// Batched directory reading
+#if defined(ZFS_POSIX)
+	// Reads entries straight from the kernel into a caller-provided buffer, many per system call.
+	// zfs_directory_begin() and the walkers are built on this.
+#ifndef ZFS_DIRECTORY_BUFFER_SIZE
+#define ZFS_DIRECTORY_BUFFER_SIZE 32768
+#endif
+#define ZFS_DIRECTORY_MIN_BUFFER_SIZE 1024 // Must fit the longest entry
+
+	typedef struct ZFSDirEntry
+	{
+		const char *name;
+		zfs_ll inode;
+		ZFSType type; // ZFS_TYPE_UNKNOWN if the filesystem does not tell
+	} ZFSDirEntry;
+
+	typedef struct ZFSDirBatch
+	{
+		int fd;
+		char *buffer;
+		zfs_ll buffer_size;
+		zfs_ll pos;
+		zfs_ll end;
+	} ZFSDirBatch;
+
+	// 'buffer' must stay valid until zfs_directory_batch_end(), at least ZFS_DIRECTORY_MIN_BUFFER_SIZE bytes.
+	// Returns false if it failed.
+	ZFSDEF zfs_bool zfs_directory_batch_begin(ZFSDirBatch *batch, const char *path, void *buffer, zfs_ll buffer_size);
+
+	// As zfs_directory_batch_begin(), but takes over an open directory fd.
+	ZFSDEF zfs_bool zfs_directory_batch_begin_fd(ZFSDirBatch *batch, int fd, void *buffer, zfs_ll buffer_size);
+
+	// Fills 'entries' with up to 'max_entries' entries, without "." and "..". Names point into the buffer
+	// and are valid until the next call.
+	// Returns the number of entries, 0 at the end, or -1 if reading failed.
+	ZFSDEF int zfs_directory_batch_next(ZFSDirBatch *batch, ZFSDirEntry *entries, int max_entries);
+
+	// Closes the directory.
+	ZFSDEF void zfs_directory_batch_end(ZFSDirBatch *batch);
+
+	// As zfs_directory_current_info(), for an entry from zfs_directory_batch_next().
+	ZFSDEF zfs_bool zfs_directory_batch_info(ZFSDirBatch *batch, const ZFSDirEntry *entry, int fields, ZFSEntryInfo *info);
+
+	// As zfs_directory_current_info(), for 'name' in the directory 'dir_fd', e.g. a ZFSWalkEntry.
+	// Always stats, with statx where the kernel has it.
+	ZFSDEF zfs_bool zfs_entry_info_at(int dir_fd, const char *name, int fields, ZFSEntryInfo *info);
+#endif
+
+	// Glob patterns
+	typedef struct ZFSGlob
+	{
+		void *handle;
+	} ZFSGlob;
+
+	enum
+	{
+		ZFS_GLOB_MATCH = 1<<0,   // The entry matches a pattern
+		ZFS_GLOB_DESCEND = 1<<1, // Entries under it can match a pattern
+	};
+
+	// Compiles patterns of '/' separated segments into an automaton over path segments. Segments can
+	// use *, ? and [a-z] (negated with [!a-z]) and match names in byte order, including names that start
+	// with a dot. A "**" segment matches any number of segments, {a,b} expands to each alternative and
+	// \ escapes the next character.
+	// Returns false if there was no memory.
+	ZFSDEF zfs_bool zfs_glob_compile(ZFSGlob *glob, const char *const *patterns, int pattern_count);
+
+	ZFSDEF void zfs_glob_free(ZFSGlob *glob);
+
+	// States stand for where the patterns are after a number of segments, so a walker can keep one
+	// per directory. This is the state of the directory the patterns are relative to.
+#define ZFS_GLOB_START 1
+
+	// Moves from 'state', the state of a directory, to 'next_state', the state of its entry 'name'.
+	// Returns ZFS_GLOB_* flags of the entry, or -1 if there was no memory. States are added as they are
+	// reached, so a ZFSGlob must not be stepped on several threads at the same time.
+	ZFSDEF int zfs_glob_step(ZFSGlob *glob, int state, const char *name, int *next_state);
+
+	// Returns true if the relative path 'path' matches a pattern.
+	ZFSDEF zfs_bool zfs_glob_match(ZFSGlob *glob, const char *path);
+
+	// Recursive directory walk
+#if defined(ZFS_POSIX)
+	typedef enum
+	{
+		ZFS_WALK_CONTINUE,
+		ZFS_WALK_SKIP, // Do not descend into this directory
+		ZFS_WALK_STOP, // End the walk
+	} ZFSWalkAction;
+
+	enum
+	{
+		ZFS_WALK_FOLLOW_SYMLINKS = 1<<0, // Descend into symlinked directories, each directory is visited once
+	};
+
+	typedef struct ZFSWalkEntry
+	{
+		const char *path; // Relative to the walked directory, e.g. "dir/file.txt"
+		const char *name; // The last part of 'path'
+		zfs_ll path_length;
+		int depth;        // 1 for entries directly in the walked directory
+		ZFSType type;     // Symlinks to directories are ZFS_TYPE_DIRECTORY when following symlinks
+		int dir_fd;       // The directory that contains the entry, for *at() functions
+		int error;        // Post-order only, the errno if the directory could not be read
+	} ZFSWalkEntry;
+
+	typedef ZFSWalkAction (*ZFSWalkCallback)(const ZFSWalkEntry *entry, void *user_data);
+
+	typedef struct ZFSWalkOptions
+	{
+		ZFSWalkCallback pre;  // Called for every entry, before the contents of a directory. Can be NULL.
+		ZFSWalkCallback post; // Called for directories after their contents. Can be NULL.
+		void *user_data;
+		int max_depth;        // Directories at this depth are not entered, 0 for no limit
+		int flags;
+		ZFSGlob *glob;        // Only entries it matches are passed to the callbacks, and directories nothing
+		                      // under can match are not entered. Can be NULL.
+		const char *ignore_file; // Ignore files to load from each directory, e.g. ".gitignore". Can be NULL.
+	} ZFSWalkOptions;
+
+	// Walks the tree under 'path' without building or resolving full paths: directories are opened
+	// relative to their parent and entry types come from the directory itself when possible.
+	// 'post' is called for every directory 'pre' returned ZFS_WALK_CONTINUE for.
+	// One directory is kept open per level.
+	// Ignore files hold gitignore rules: one pattern per line, "#" comments, "!" to include again,
+	// a trailing "/" for directories only, and a "/" anywhere else to match relative to the ignore file
+	// instead of any name below it. Ignored entries are not passed to the callbacks and ignored directories
+	// are not read. Rules of deeper ignore files win, and within a file later rules win.
+	// Returns false if 'path' could not be opened or there was no memory. Without memory to enter a directory,
+	// it gets ENOMEM as its post-order error and the walk goes on, for anything else the walk is cut short.
+	ZFSDEF zfs_bool zfs_walk(const char *path, const ZFSWalkOptions *options);
+
+	// Parallel directory walk
+#ifndef ZFS_WALK_BATCH_SIZE
+#define ZFS_WALK_BATCH_SIZE 256
+#endif
+
+	// Called on the worker threads, from several at the same time. The entries are only valid during
+	// the call, and their 'dir_fd' is -1. Return ZFS_WALK_STOP to end the walk.
+	typedef ZFSWalkAction (*ZFSWalkBatchCallback)(const ZFSWalkEntry *entries, int count, void *user_data);
+
+	typedef struct ZFSParallelWalkOptions
+	{
+		ZFSWalkBatchCallback batch;
+		ZFSWalkCallback filter; // Called on the worker threads for directories before they are entered. Can be NULL.
+		void *user_data;
+		int max_depth;          // Directories at this depth are not entered, 0 for no limit
+		int flags;
+		int thread_count;       // 0 for one per CPU
+		int batch_size;         // Entries per batch, 0 for ZFS_WALK_BATCH_SIZE
+	} ZFSParallelWalkOptions;
+
+	// Walks the tree under 'path' on several threads. Directories are tasks in per-thread deques that
+	// idle threads steal from, and each thread collects the entries it finds into its own batches.
+	// Entries come in no particular order.
+	// Returns false if 'path' could not be opened, or part of the tree was not walked for lack of memory.
+	ZFSDEF zfs_bool zfs_walk_parallel(const char *path, const ZFSParallelWalkOptions *options);
+
+	// Tree copy
+#ifndef Z_FS_NO_FILE
+#ifndef ZFS_TREE_COPY_BATCH_SIZE
+#define ZFS_TREE_COPY_BATCH_SIZE 16
+#endif
+
+	typedef struct ZFSTreeCopyOptions
+	{
+		int flags;        // ZFS_COPY_* for every file
+		int thread_count; // 0 for one per CPU
+	} ZFSTreeCopyOptions;
+
+	// Copies the tree under 'source' to 'destination', which is created if it does not exist, on the
+	// parallel walker's thread pool. Each directory is created as soon as it is found and its files are
+	// copied ZFS_TREE_COPY_BATCH_SIZE at a time by whichever thread is free, as zfs_file_copy_ex() does.
+	// Files, directories and symlinks keep their permissions and times, directories once all their
+	// entries are copied. Existing files are overwritten, read-only ones too. Other types of entries
+	// are skipped. 'options' can be NULL.
+	// Returns false if 'source' could not be opened or anything under it could not be copied, which does
+	// not stop the rest from being copied.
+	ZFSDEF zfs_bool zfs_tree_copy(const char *source, const char *destination, const ZFSTreeCopyOptions *options);
+#endif
+
+	// Tree delete
+	// 'path' starts with the path given to zfs_tree_delete(), 'error' is the errno
+	typedef void (*ZFSDeleteErrorCallback)(const char *path, int error, void *user_data);
+
+	typedef struct ZFSTreeDeleteOptions
+	{
+		ZFSDeleteErrorCallback error; // Called for every entry that could not be deleted, from several threads at the same time. Can be NULL.
+		void *user_data;
+		int thread_count;            // 0 for one per CPU
+		const char *trash_directory; // Move the tree into this directory and delete it on a background thread. Can be NULL.
+	} ZFSTreeDeleteOptions;
+
+	// Deletes 'path' and everything under it on the parallel walker's thread pool, one task per directory.
+	// Entries are unlinked relative to their directory and only stat'ed when the filesystem does not
+	// give their type and unlinking them fails. Entries that can not be deleted are reported to 'error'
+	// and the rest are still deleted. A symlink is deleted, never what it points to.
+	// With a trash directory, which must be on the same filesystem, the tree is renamed into a new
+	// directory in it and the call returns right away. The background thread calls 'error' with the
+	// trash path, so 'user_data' must outlive it. If the process exits first, what is left stays in the
+	// trash directory. If the tree can not be renamed or the thread can not be started, it is deleted
+	// before returning.
+	// 'options' can be NULL.
+	// Returns false if anything could not be deleted.
+	ZFSDEF zfs_bool zfs_tree_delete(const char *path, const ZFSTreeDeleteOptions *options);
+
+	typedef struct ZFSGlobResult
+	{
+		zfs_ll count;
+		const char *const *paths; // Relative to the walked directory, sorted in byte order
+	} ZFSGlobResult;
+
+	// Finds the entries under 'path' that match any of 'patterns', allocating the result from 'arena'.
+	// Returns false if 'path' could not be opened or there was no memory.
+	ZFSDEF zfs_bool zfs_glob(ZFSArena *arena, const char *path, const char *const *patterns, int pattern_count, ZFSGlobResult *result);
+
+	// Directory watching
+#ifndef ZFS_WATCH_COALESCE_MS
+#define ZFS_WATCH_COALESCE_MS 100
+#endif
+
+	enum
+	{
+		ZFS_WATCH_CREATED = 1<<0,    // Created or moved in
+		ZFS_WATCH_DELETED = 1<<1,    // Deleted or moved out
+		ZFS_WATCH_MODIFIED = 1<<2,
+		ZFS_WATCH_ATTRIBUTES = 1<<3, // Permissions, timestamps, owner
+		ZFS_WATCH_RESCAN = 1<<4,     // Changes under the directory may have been missed, walk it again
+	};
+
+	typedef struct ZFSWatchEvent
+	{
+		const char *path; // Relative to the watched directory, "" for the directory itself
+		int flags;        // ZFS_WATCH_* of every change to the path during the window
+		zfs_bool is_directory;
+	} ZFSWatchEvent;
+
+	typedef struct ZFSWatch
+	{
+		int fd; // Readable when zfs_watch_read() may have events, e.g. for poll or epoll
+		void *handle;
+	} ZFSWatch;
+
+	// Watches the tree under 'path' with inotify. Changes to a path are held for 'coalesce_ms'
+	// milliseconds from the first one, 0 for ZFS_WATCH_COALESCE_MS, and then delivered as one event.
+	// New directories are watched as they appear, and what they already hold is reported as created.
+	// A directory that can not be watched because the inotify watch limit is reached gets a
+	// ZFS_WATCH_RESCAN event every window until watching it succeeds, so only that subtree has to be
+	// walked again. An overflowing event queue gets a ZFS_WATCH_RESCAN of the whole tree.
+	// Returns false if 'path' could not be watched.
+	ZFSDEF zfs_bool zfs_watch_begin(ZFSWatch *watch, const char *path, int coalesce_ms);
+
+	// Returns up to 'max_events' events whose window has passed, oldest first, without blocking. They are
+	// valid until the next call. Returns 0 when nothing is due yet, even if 'fd' was readable.
+	ZFSDEF int zfs_watch_read(ZFSWatch *watch, ZFSWatchEvent *events, int max_events);
+
+	ZFSDEF void zfs_watch_end(ZFSWatch *watch);
+
+	// Tree snapshots
+	typedef struct ZFSSnapshot
+	{
+		const void *data; // The mapped snapshot file, NULL for an empty snapshot
+		zfs_ll size;
+		zfs_ll directory_count;
+		zfs_ll entry_count;
+	} ZFSSnapshot;
+
+	typedef enum
+	{
+		ZFS_SNAPSHOT_ADDED,
+		ZFS_SNAPSHOT_REMOVED,
+		ZFS_SNAPSHOT_MODIFIED, // Size, mtime or inode changed
+	} ZFSSnapshotChange;
+
+	enum
+	{
+		ZFS_SNAPSHOT_STAT_FILES = 1<<0, // Also stat the files of directories that did not change, see below
+	};
+
+	// 'path' is relative to the snapshotted directory
+	typedef void (*ZFSSnapshotCallback)(const char *path, ZFSSnapshotChange change, ZFSType type, void *user_data);
+
+	// Maps a snapshot file written by zfs_snapshot_update(). Nothing is read until it is used.
+	// Returns false if the file could not be mapped or is not a snapshot.
+	ZFSDEF zfs_bool zfs_snapshot_open(ZFSSnapshot *snapshot, const char *filename);
+
+	ZFSDEF void zfs_snapshot_close(ZFSSnapshot *snapshot);
+
+	// Scans the tree under 'path' against 'snapshot', which can be zeroed for an empty one, calls 'callback'
+	// for every difference and writes the new snapshot to 'filename'. The file is replaced atomically, so it
+	// can be the file 'snapshot' was opened from.
+	// Directories whose mtime did not change since the snapshot are not listed again, only their
+	// subdirectories are opened. A file modified in place does not change the mtime of its directory,
+	// so those are only found in such directories with ZFS_SNAPSHOT_STAT_FILES.
+	// Returns false if 'path' could not be opened or the snapshot could not be written.
+	ZFSDEF zfs_bool zfs_snapshot_update(const ZFSSnapshot *snapshot, const char *path, const char *filename, int flags, ZFSSnapshotCallback callback, void *user_data);
+#endif
 #endif // Z_FS_NO_DIRECTORY
 
 #ifdef __cplusplus
@@ -201,13 +742,46 @@ extern "C" {
 
 #ifdef Z_FS_IMPLEMENTATION
 
+#if defined(__linux) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h> // For FILE API
+#include <stdlib.h> // For malloc, realloc, free
+#include <stddef.h> // For offsetof
 #include <string.h> // For memcpy, strlen, strcmp
 
+#if defined(ZFS_MALLOC) && defined(ZFS_REALLOC) && defined(ZFS_FREE)
+// User-provided allocator
+#elif !defined(ZFS_MALLOC) && !defined(ZFS_REALLOC) && !defined(ZFS_FREE)
+#define ZFS_MALLOC(size, context) ((void)(context), malloc(size))
+#define ZFS_REALLOC(memory, size, context) ((void)(context), realloc(memory, size))
+#define ZFS_FREE(memory, context) ((void)(context), free(memory))
+#else
+#error "Define all or none of ZFS_MALLOC, ZFS_REALLOC and ZFS_FREE"
+#endif
+
+#ifndef ZFS_ALLOC_CONTEXT
+#define ZFS_ALLOC_CONTEXT NULL
+#endif
+
 #if defined(ZFS_POSIX)
 #include <dirent.h> // For directory walking API
+#include <errno.h> // For errno
+#include <fcntl.h> // For openat
+#include <linux/stat.h> // For statx
+#include <pthread.h> // For the parallel walker
+#include <linux/fs.h> // For FICLONE
+#include <sys/epoll.h> // For the watcher's pollable fd
+#include <sys/ioctl.h> // For ioctl
+#include <sys/inotify.h> // For inotify
+#include <sys/mman.h> // For mmap
+#include <sys/sendfile.h> // For sendfile
+#include <sys/syscall.h> // For getdents64
+#include <sys/timerfd.h> // For the watcher's coalescing window
 #include <sys/time.h> // For utimes
 #include <sys/stat.h> // For stat
+#include <time.h> // For clock_gettime
 #include <unistd.h> // For access, getcwd
 #elif defined(ZFS_WINDOWS)
 #if defined(_MSC_VER) && !defined(_CRT_SECURE_NO_WARNINGS)
@@ -255,145 +829,559 @@ static inline zfs_ll zfs__find_last_char(const char *path, zfs_ll len, char c)
 	return index;
 }
 
-ZFSPATHDEF void zfs_path_join(char *result, zfs_ll result_size, const char *left, const char *right)
+ZFSPATHDEF ZFSPathView zfs_path_view(const char *path)
 {
-	zfs_ll left_len = strlen(left);
-	zfs_ll right_len = strlen(right);
+	ZFSPathView view;
+	view.data = path;
+	view.length = strlen(path);
+	return view;
+}
 
-	if (result != left)
-	{
-		if (left_len >= result_size)
-			left_len = result_size - 1;
-		memcpy(result, left, left_len);
-	}
+static inline ZFSPathView zfs__path_view_part(ZFSPathView path, zfs_ll begin, zfs_ll end)
+{
+	ZFSPathView view;
+	view.data = path.data + begin;
+	view.length = end - begin;
+	return view;
+}
 
-	if (left_len + 1 < result_size && left_len > 0 && !zfs__is_dir_sep(result[left_len - 1]))
-		result[left_len++] = ZFS__DIR_SEP;
+// Where the extension starts, or the length if there is none
+static inline zfs_ll zfs__extension_index(ZFSPathView path)
+{
+	zfs_ll dir_sep_index = zfs__find_last_dir_sep(path.data, path.length) + 1;
+	zfs_ll ext_index = zfs__find_last_char(path.data, path.length, '.');
+	return (ext_index < dir_sep_index ? path.length : ext_index);
+}
 
-	if (left_len > 0 && right_len > 0 && zfs__is_dir_sep(right[0]))
-	{
-		++right;
-		--right_len;
-	}
+ZFSPATHDEF ZFSPathView zfs_path_view_extension(ZFSPathView path)
+{
+	return zfs__path_view_part(path, zfs__extension_index(path), path.length);
+}
 
-	if (left_len + right_len >= result_size)
-		right_len = result_size - left_len - 1;
-	memcpy(result + left_len, right, right_len);
+ZFSPATHDEF ZFSPathView zfs_path_view_basename(ZFSPathView path)
+{
+	return zfs__path_view_part(path, zfs__find_last_dir_sep(path.data, path.length) + 1, path.length);
+}
 
-	result[left_len + right_len] = '\0';
+ZFSPATHDEF ZFSPathView zfs_path_view_basename_without_extension(ZFSPathView path)
+{
+	return zfs__path_view_part(path, zfs__find_last_dir_sep(path.data, path.length) + 1, zfs__extension_index(path));
 }
 
-ZFSPATHDEF void zfs_path_extension(char *result, zfs_ll result_size, const char *path)
+ZFSPATHDEF ZFSPathView zfs_path_view_directory(ZFSPathView path)
 {
-	zfs_ll len = strlen(path);
-	zfs_ll dir_sep_index = zfs__find_last_dir_sep(path, len) + 1;
-	zfs_ll ext_index = zfs__find_last_char(path, len, '.');
-	if (ext_index < dir_sep_index)
-		ext_index = len;
+	return zfs__path_view_part(path, 0, zfs__find_last_dir_sep(path.data, path.length) + 1);
+}
 
-	len -= ext_index;
-	if (len >= result_size)
-		len = result_size - 1;
-	memcpy(result, path + ext_index, len);
-	result[len] = '\0';
+// Writes what fits of 'length' bytes at 'offset' of the result, leaving room for the '\0'
+static inline void zfs__path_put(char *result, zfs_ll result_size, zfs_ll offset, const char *data, zfs_ll length)
+{
+	if (offset + length >= result_size)
+		length = result_size - offset - 1;
+	if (length > 0 && result + offset != data)
+		memmove(result + offset, data, length);
 }
 
-ZFSPATHDEF void zfs_path_set_extension(char *result, zfs_ll result_size, const char *path, const char *new_extension)
+static inline zfs_ll zfs__path_terminate(char *result, zfs_ll result_size, zfs_ll length)
 {
-	zfs_ll len = strlen(path);
-	zfs_ll dir_sep_index = zfs__find_last_dir_sep(path, len) + 1;
-	zfs_ll ext_index = zfs__find_last_char(path, len, '.');
-	if (ext_index < dir_sep_index)
-		ext_index = len;
+	if (result_size > 0)
+		result[length < result_size ? length : result_size - 1] = '\0';
+	return length;
+}
 
-	if (result != path)
+ZFSPATHDEF zfs_ll zfs_path_view_join(char *result, zfs_ll result_size, const ZFSPathView *parts, int part_count)
+{
+	zfs_ll length = 0;
+	char last = '\0';
+	int i;
+	for (i = 0; i < part_count; ++i)
 	{
-		if (ext_index >= result_size)
-			ext_index = result_size - 1;
-		memcpy(result, path, ext_index);
+		ZFSPathView part = parts[i];
+		if (i > 0 && length > 0)
+		{
+			if (!zfs__is_dir_sep(last))
+			{
+				last = ZFS__DIR_SEP;
+				zfs__path_put(result, result_size, length++, &last, 1);
+			}
+			if (part.length > 0 && zfs__is_dir_sep(part.data[0]))
+			{
+				++part.data;
+				--part.length;
+			}
+		}
+		zfs__path_put(result, result_size, length, part.data, part.length);
+		length += part.length;
+		if (part.length > 0)
+			last = part.data[part.length - 1];
 	}
-
-	zfs_ll ext_len = strlen(new_extension);
-	if (ext_index + ext_len >= result_size)
-		ext_len = result_size - ext_index - 1;
-	memcpy(result + ext_index, new_extension, ext_len);
-
-	result[ext_index + ext_len] = '\0';
+	return zfs__path_terminate(result, result_size, length);
 }
 
-ZFSPATHDEF void zfs_path_basename(char *result, zfs_ll result_size, const char *path)
+ZFSPATHDEF zfs_ll zfs_path_view_set_extension(char *result, zfs_ll result_size, ZFSPathView path, ZFSPathView new_extension)
 {
-	zfs_ll len = strlen(path);
-	zfs_ll offset = zfs__find_last_dir_sep(path, len) + 1;
-	len -= offset;
-	if (len >= result_size)
-		len = result_size - 1;
-	memcpy(result, path + offset, len);
-	result[len] = '\0';
+	zfs_ll ext_index = zfs__extension_index(path);
+	zfs__path_put(result, result_size, 0, path.data, ext_index);
+	zfs__path_put(result, result_size, ext_index, new_extension.data, new_extension.length);
+	return zfs__path_terminate(result, result_size, ext_index + new_extension.length);
 }
 
-ZFSPATHDEF void zfs_path_basename_without_extension(char *result, zfs_ll result_size, const char *path)
+ZFSPATHDEF zfs_ll zfs_path_view_copy(char *result, zfs_ll result_size, ZFSPathView path)
 {
-	zfs_ll len = strlen(path);
-	zfs_ll dir_sep_index = zfs__find_last_dir_sep(path, len) + 1;
-	zfs_ll ext_index = zfs__find_last_char(path, len, '.');
-	if (ext_index < dir_sep_index)
-		ext_index = len;
+	zfs__path_put(result, result_size, 0, path.data, path.length);
+	return zfs__path_terminate(result, result_size, path.length);
+}
 
-	len = ext_index - dir_sep_index;
-	if (len >= result_size)
-		len = result_size - 1;
-	memcpy(result, path + dir_sep_index, len);
-	result[len] = '\0';
+#ifndef Z_FS_NO_PATH
+ZFSPATHDEF void zfs_path_builder_begin(ZFSPathBuilder *builder)
+{
+	builder->path = builder->inline_path;
+	builder->path[0] = '\0';
+	builder->length = 0;
+	builder->capacity = ZFS_PATH_BUILDER_INLINE_SIZE;
 }
 
-ZFSPATHDEF void zfs_path_directory(char *result, zfs_ll result_size, const char *path)
+ZFSPATHDEF void zfs_path_builder_end(ZFSPathBuilder *builder)
 {
-	zfs_ll len = strlen(path);
-	zfs_ll dir_sep_index = zfs__find_last_dir_sep(path, len);
-	len = dir_sep_index + 1;
-	if (len >= result_size)
-		len = result_size - 1;
-	memcpy(result, path, len);
-	result[len] = '\0';
+	if (builder->path != builder->inline_path)
+		ZFS_FREE(builder->path, ZFS_ALLOC_CONTEXT);
+	zfs_path_builder_begin(builder);
 }
 
-ZFSPATHDEF void zfs_path_normalize_inplace(char *path)
+ZFSPATHDEF zfs_bool zfs_path_builder_push(ZFSPathBuilder *builder, ZFSPathView part)
 {
-	while (*path)
+	ZFSPathView parts[2];
+	parts[0].data = builder->path;
+	parts[0].length = builder->length;
+	parts[1] = part;
+	zfs_ll length = zfs_path_view_join(NULL, 0, parts, 2);
+	if (length >= builder->capacity)
 	{
-		if (zfs__is_dir_sep(*path))
-			(*path) = ZFS__DIR_SEP;
-		++path;
+		zfs_ll capacity = builder->capacity * 2;
+		while (capacity <= length)
+			capacity *= 2;
+		char *path;
+		if (builder->path == builder->inline_path)
+		{
+			path = (char*)ZFS_MALLOC(capacity, ZFS_ALLOC_CONTEXT);
+			if (path)
+				memcpy(path, builder->path, builder->length + 1);
+		}
+		else
+		{
+			path = (char*)ZFS_REALLOC(builder->path, capacity, ZFS_ALLOC_CONTEXT);
+		}
+		if (!path)
+			return ZFS_FALSE;
+		builder->path = path;
+		builder->capacity = capacity;
+		parts[0].data = path;
 	}
+	builder->length = zfs_path_view_join(builder->path, builder->capacity, parts, 2);
+	return ZFS_TRUE;
 }
 
-ZFSPATHDEF void zfs_path_normalize(char *result, zfs_ll result_size, const char *path)
+ZFSPATHDEF void zfs_path_builder_pop(ZFSPathBuilder *builder)
 {
-	zfs_ll len = strlen(path);
-	if (len >= result_size)
-		len = result_size - 1;
-	memcpy(result, path, len);
-	result[len] = '\0';
-
-	zfs_path_normalize_inplace(result);
+	ZFSPathView path;
+	path.data = builder->path;
+	path.length = builder->length;
+	zfs_ll length = zfs_path_view_directory(path).length;
+	// Keeps the separator of a root, "/file" leaves "/"
+	if (length > 1)
+		--length;
+	zfs_path_builder_truncate(builder, length);
 }
 
-ZFSPATHDEF zfs_bool zfs_path_working_directory(char *result, zfs_ll result_size)
+ZFSPATHDEF void zfs_path_builder_truncate(ZFSPathBuilder *builder, zfs_ll length)
 {
-#if defined(ZFS_POSIX)
-	return (getcwd(result, result_size) != NULL);
-#elif defined(ZFS_WINDOWS)
-	return (GetCurrentDirectoryA((DWORD)result_size, result) != 0);
-#endif
+	if (length < builder->length)
+	{
+		builder->length = length;
+		builder->path[length] = '\0';
+	}
 }
 
-ZFSPATHDEF void zfs_path_full(char *result, zfs_ll result_size, const char *path)
+ZFSPATHDEF zfs_ll zfs_path_canonicalize(char *path)
 {
-	if (zfs__is_dir_sep(path[0]))
+	// Nothing before 'root' is removed by ".."
+	zfs_ll root = (zfs__is_dir_sep(path[0]) ? 1 : 0);
+#if defined(ZFS_WINDOWS)
+	if (path[0] && path[1] == ':')
+		root = (zfs__is_dir_sep(path[2]) ? 3 : 2);
+	if (root == 3)
+		path[2] = ZFS__DIR_SEP;
+#endif
+	if (root == 1)
+		path[0] = ZFS__DIR_SEP;
+	zfs_bool absolute = (root > 0 && zfs__is_dir_sep(path[root - 1]));
+
+	zfs_ll read = root, write = root;
+	while (path[read])
 	{
-		zfs_path_join(result, result_size, "", path);
-		return;
+		if (zfs__is_dir_sep(path[read]))
+		{
+			++read;
+			continue;
+		}
+		zfs_ll end = read;
+		while (path[end] && !zfs__is_dir_sep(path[end]))
+			++end;
+		zfs_ll length = end - read;
+
+		if (length == 1 && path[read] == '.')
+		{
+			read = end;
+			continue;
+		}
+		if (length == 2 && path[read] == '.' && path[read + 1] == '.')
+		{
+			zfs_ll last = write;
+			while (last > root && !zfs__is_dir_sep(path[last - 1]))
+				--last;
+			zfs_bool last_is_parent = (write - last == 2 && path[last] == '.' && path[last + 1] == '.');
+			if (write > root && !last_is_parent)
+			{
+				write = (last > root ? last - 1 : root);
+				read = end;
+				continue;
+			}
+			if (absolute)
+			{
+				read = end;
+				continue;
+			}
+		}
+
+		if (write > root)
+			path[write++] = ZFS__DIR_SEP;
+		memmove(path + write, path + read, length);
+		write += length;
+		read = end;
+	}
+
+	if (write == 0)
+		path[write++] = '.';
+	path[write] = '\0';
+	return write;
+}
+
+#if defined(ZFS_POSIX)
+typedef struct zfs__path_cache_slot
+{
+	unsigned long long hash;
+	char *key; // The path as it was found, followed by the resolved one unless they are the same
+	zfs_ll key_length;
+	const char *value;
+	zfs_ll value_length;
+} zfs__path_cache_slot;
+
+#define ZFS__MAX_SYMLINKS 40 // As Linux
+
+// FNV-1a
+static unsigned long long zfs__path_hash(ZFSPathView path)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	zfs_ll i;
+	for (i = 0; i < path.length; ++i)
+		hash = (hash ^ (unsigned char)path.data[i]) * 1099511628211ULL;
+	return hash;
+}
+
+ZFSPATHDEF zfs_bool zfs_path_cache_begin(ZFSPathCache *cache, zfs_ll slot_count)
+{
+	if (slot_count <= 0)
+		slot_count = ZFS_PATH_CACHE_SIZE;
+	zfs_ll count = 1;
+	while (count < slot_count)
+		count *= 2;
+	cache->slots = ZFS_MALLOC(count * sizeof(zfs__path_cache_slot), ZFS_ALLOC_CONTEXT);
+	cache->slot_count = (cache->slots ? count : 0);
+	if (cache->slots)
+		memset(cache->slots, 0, count * sizeof(zfs__path_cache_slot));
+	return (cache->slots != NULL);
+}
+
+ZFSPATHDEF void zfs_path_cache_clear(ZFSPathCache *cache)
+{
+	zfs__path_cache_slot *slots = (zfs__path_cache_slot*)cache->slots;
+	zfs_ll i;
+	for (i = 0; i < cache->slot_count; ++i)
+	{
+		if (slots[i].key)
+			ZFS_FREE(slots[i].key, ZFS_ALLOC_CONTEXT);
+		memset(&slots[i], 0, sizeof(zfs__path_cache_slot));
+	}
+}
+
+ZFSPATHDEF void zfs_path_cache_end(ZFSPathCache *cache)
+{
+	zfs_path_cache_clear(cache);
+	if (cache->slots)
+		ZFS_FREE(cache->slots, ZFS_ALLOC_CONTEXT);
+	cache->slots = NULL;
+	cache->slot_count = 0;
+}
+
+static zfs__path_cache_slot *zfs__path_cache_slot_for(ZFSPathCache *cache, ZFSPathView key, unsigned long long *hash)
+{
+	if (!cache || cache->slot_count == 0)
+		return NULL;
+	*hash = zfs__path_hash(key);
+	return (zfs__path_cache_slot*)cache->slots + (*hash & (cache->slot_count - 1));
+}
+
+static const zfs__path_cache_slot *zfs__path_cache_find(ZFSPathCache *cache, ZFSPathView key)
+{
+	unsigned long long hash;
+	const zfs__path_cache_slot *slot = zfs__path_cache_slot_for(cache, key, &hash);
+	if (slot && slot->key && slot->hash == hash && slot->key_length == key.length && memcmp(slot->key, key.data, key.length) == 0)
+		return slot;
+	return NULL;
+}
+
+static void zfs__path_cache_insert(ZFSPathCache *cache, ZFSPathView key, ZFSPathView value)
+{
+	unsigned long long hash;
+	zfs__path_cache_slot *slot = zfs__path_cache_slot_for(cache, key, &hash);
+	if (!slot)
+		return;
+	zfs_bool same = (key.length == value.length && memcmp(key.data, value.data, key.length) == 0);
+	char *memory = (char*)ZFS_MALLOC(key.length + 1 + (same ? 0 : value.length + 1), ZFS_ALLOC_CONTEXT);
+	if (!memory)
+		return; // Only slower next time
+	if (slot->key)
+		ZFS_FREE(slot->key, ZFS_ALLOC_CONTEXT);
+	slot->hash = hash;
+	slot->key = memory;
+	slot->key_length = key.length;
+	memcpy(memory, key.data, key.length);
+	memory[key.length] = '\0';
+	slot->value = memory;
+	slot->value_length = value.length;
+	if (!same)
+	{
+		memcpy(memory + key.length + 1, value.data, value.length);
+		memory[key.length + 1 + value.length] = '\0';
+		slot->value = memory + key.length + 1;
+	}
+}
+
+static zfs_bool zfs__path_builder_set(ZFSPathBuilder *builder, const char *path, zfs_ll length)
+{
+	ZFSPathView view;
+	view.data = path;
+	view.length = length;
+	zfs_path_builder_truncate(builder, 0);
+	return zfs_path_builder_push(builder, view);
+}
+
+// Resolves 'path' from the symlink free directory in 'resolved', or from the root if 'path' is absolute.
+// 'directory' is set if the result must be a directory, 'links_left' counts the symlinks that can still be followed.
+static zfs_bool zfs__path_resolve(ZFSPathCache *cache, ZFSPathBuilder *resolved, ZFSPathView path, zfs_bool directory, int *links_left)
+{
+	if (path.length > 0 && path.data[0] == '/')
+		zfs_path_builder_truncate(resolved, 1);
+
+	zfs_ll read = 0;
+	while (read < path.length)
+	{
+		while (read < path.length && path.data[read] == '/')
+			++read;
+		zfs_ll end = read;
+		while (end < path.length && path.data[end] != '/')
+			++end;
+		ZFSPathView segment = zfs__path_view_part(path, read, end);
+		read = end;
+		while (read < path.length && path.data[read] == '/')
+			++read;
+		// Anything but the last segment has to be a directory, as does the last one with a separator after it
+		zfs_bool need_directory = (read < path.length || end < path.length || directory);
+
+		if (segment.length == 0 || (segment.length == 1 && segment.data[0] == '.'))
+			continue;
+		if (segment.length == 2 && segment.data[0] == '.' && segment.data[1] == '.')
+		{
+			// The directory is symlink free already, so its parent is the lexical one
+			zfs_path_builder_pop(resolved);
+			continue;
+		}
+
+		zfs_ll parent_length = resolved->length;
+		if (!zfs_path_builder_push(resolved, segment))
+			return ZFS_FALSE;
+		ZFSPathView found;
+		found.data = resolved->path;
+		found.length = resolved->length;
+		const zfs__path_cache_slot *slot = zfs__path_cache_find(cache, found);
+		if (slot)
+		{
+			if (!zfs__path_builder_set(resolved, slot->value, slot->value_length))
+				return ZFS_FALSE;
+			continue;
+		}
+
+		struct stat st;
+		if (lstat(resolved->path, &st) != 0)
+			return ZFS_FALSE;
+		if (S_ISLNK(st.st_mode))
+		{
+			if (--*links_left < 0)
+			{
+				errno = ELOOP;
+				return ZFS_FALSE;
+			}
+
+			// Keeps the path the link was found at as the key, followed by what it points to
+			zfs_ll target_size = (st.st_size > 0 ? st.st_size : 4095) + 1; // Some links in /proc have no size
+			char *memory = (char*)ZFS_MALLOC(found.length + 1 + target_size, ZFS_ALLOC_CONTEXT);
+			if (!memory)
+			{
+				errno = ENOMEM;
+				return ZFS_FALSE;
+			}
+			memcpy(memory, found.data, found.length + 1);
+			found.data = memory;
+			ZFSPathView target;
+			target.data = memory + found.length + 1;
+			target.length = readlink(found.data, memory + found.length + 1, target_size);
+			zfs_bool ok = (target.length >= 0 && target.length < target_size);
+			if (target.length >= target_size)
+				errno = ENAMETOOLONG; // Changed while reading it
+			zfs_path_builder_truncate(resolved, parent_length);
+			ok = (ok && zfs__path_resolve(cache, resolved, target, need_directory, links_left));
+			if (ok && need_directory)
+			{
+				ZFSPathView value;
+				value.data = resolved->path;
+				value.length = resolved->length;
+				zfs__path_cache_insert(cache, found, value);
+			}
+			ZFS_FREE(memory, ZFS_ALLOC_CONTEXT);
+			if (!ok)
+				return ZFS_FALSE;
+		}
+		else if (need_directory)
+		{
+			if (!S_ISDIR(st.st_mode))
+			{
+				errno = ENOTDIR;
+				return ZFS_FALSE;
+			}
+			zfs__path_cache_insert(cache, found, found);
+		}
+	}
+	return ZFS_TRUE;
+}
+
+ZFSPATHDEF zfs_ll zfs_path_resolve(ZFSPathCache *cache, char *result, zfs_ll result_size, const char *path)
+{
+	if (!path[0])
+	{
+		errno = ENOENT;
+		return -1;
+	}
+
+	ZFSPathBuilder resolved;
+	zfs_path_builder_begin(&resolved);
+	zfs_bool ok;
+	if (path[0] == '/')
+	{
+		ok = zfs_path_builder_push(&resolved, zfs_path_view("/"));
+	}
+	else
+	{
+		// The kernel gives the working directory without symlinks
+		char *working_directory = getcwd(NULL, 0);
+		ok = (working_directory && zfs_path_builder_push(&resolved, zfs_path_view(working_directory)));
+		free(working_directory);
+	}
+
+	int links_left = ZFS__MAX_SYMLINKS;
+	ok = (ok && zfs__path_resolve(cache, &resolved, zfs_path_view(path), ZFS_FALSE, &links_left));
+	zfs_ll length = -1;
+	if (ok)
+	{
+		ZFSPathView view;
+		view.data = resolved.path;
+		view.length = resolved.length;
+		length = zfs_path_view_copy(result, result_size, view);
+	}
+	zfs_path_builder_end(&resolved);
+	return length;
+}
+#endif
+#endif
+
+ZFSPATHDEF void zfs_path_join(char *result, zfs_ll result_size, const char *left, const char *right)
+{
+	ZFSPathView parts[2];
+	parts[0] = zfs_path_view(left);
+	parts[1] = zfs_path_view(right);
+	zfs_path_view_join(result, result_size, parts, 2);
+}
+
+ZFSPATHDEF void zfs_path_extension(char *result, zfs_ll result_size, const char *path)
+{
+	zfs_path_view_copy(result, result_size, zfs_path_view_extension(zfs_path_view(path)));
+}
+
+ZFSPATHDEF void zfs_path_set_extension(char *result, zfs_ll result_size, const char *path, const char *new_extension)
+{
+	zfs_path_view_set_extension(result, result_size, zfs_path_view(path), zfs_path_view(new_extension));
+}
+
+ZFSPATHDEF void zfs_path_basename(char *result, zfs_ll result_size, const char *path)
+{
+	zfs_path_view_copy(result, result_size, zfs_path_view_basename(zfs_path_view(path)));
+}
+
+ZFSPATHDEF void zfs_path_basename_without_extension(char *result, zfs_ll result_size, const char *path)
+{
+	zfs_path_view_copy(result, result_size, zfs_path_view_basename_without_extension(zfs_path_view(path)));
+}
+
+ZFSPATHDEF void zfs_path_directory(char *result, zfs_ll result_size, const char *path)
+{
+	zfs_path_view_copy(result, result_size, zfs_path_view_directory(zfs_path_view(path)));
+}
+
+ZFSPATHDEF void zfs_path_normalize_inplace(char *path)
+{
+	while (*path)
+	{
+		if (zfs__is_dir_sep(*path))
+			(*path) = ZFS__DIR_SEP;
+		++path;
+	}
+}
+
+ZFSPATHDEF void zfs_path_normalize(char *result, zfs_ll result_size, const char *path)
+{
+	zfs_ll len = strlen(path);
+	if (len >= result_size)
+		len = result_size - 1;
+	memcpy(result, path, len);
+	result[len] = '\0';
+
+	zfs_path_normalize_inplace(result);
+}
+
+ZFSPATHDEF zfs_bool zfs_path_working_directory(char *result, zfs_ll result_size)
+{
+#if defined(ZFS_POSIX)
+	return (getcwd(result, result_size) != NULL);
+#elif defined(ZFS_WINDOWS)
+	return (GetCurrentDirectoryA((DWORD)result_size, result) != 0);
+#endif
+}
+
+ZFSPATHDEF void zfs_path_full(char *result, zfs_ll result_size, const char *path)
+{
+	if (zfs__is_dir_sep(path[0]))
+	{
+		zfs_path_join(result, result_size, "", path);
+		return;
 	}
 
 	if (!zfs_path_working_directory(result, result_size))
@@ -405,6 +1393,24 @@ ZFSPATHDEF void zfs_path_full(char *result, zfs_ll result_size, const char *path
 }
 #endif // Z_FS_NO_PATH
 
+#if defined(ZFS_POSIX) && (!defined(Z_FS_NO_FILE) || !defined(Z_FS_NO_DIRECTORY))
+static zfs_bool zfs__write_all(int fd, const void *data, zfs_ll size)
+{
+	const char *bytes = (const char*)data;
+	while (size > 0)
+	{
+		ssize_t written = write(fd, bytes, size);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return ZFS_FALSE;
+		bytes += written;
+		size -= written;
+	}
+	return ZFS_TRUE;
+}
+#endif
+
 #ifndef Z_FS_NO_FILE
 ZFSDEF zfs_bool zfs_file_touch(const char *filename)
 {
@@ -457,149 +1463,4134 @@ ZFSDEF zfs_bool zfs_file_rename(const char *old_filename, const char *new_filena
 
 ZFSDEF zfs_bool zfs_file_copy(const char *source_filename, const char *destination_filename)
 {
-	FILE *source_file = fopen(source_filename, "rb");
-	if (!source_file)
-		return ZFS_FALSE;
-
-	FILE *destination_file = fopen(destination_filename, "wb");
-	if (!destination_file)
-	{
-		fclose(source_file);
-		return ZFS_FALSE;
-	}
+	return zfs_file_copy_ex(source_filename, destination_filename, 0, NULL);
+}
 
-	char buffer[32768]; // 32k
+#if defined(ZFS_POSIX)
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
 
-	size_t n;
-	while ((n = fread(buffer, 1, sizeof(buffer), source_file)) > 0)
+// Copies 'length' bytes at 'offset' of 'in' to the same offset of 'out'. Moves '*method' on to the
+// next method when the current one does not work for these files. Returns the offset it got to,
+// which is short of the end when the source ends first, or -1 if it failed.
+static zfs_ll zfs__file_copy_range(int in, int out, zfs_ll offset, zfs_ll length, ZFSCopyMethod *method, char **buffer)
+{
+	zfs_ll end = offset + length;
+	while (offset < end)
 	{
-		if (fwrite(buffer, 1, n, destination_file) != n)
+		zfs_ll chunk = (end - offset < 0x40000000 ? end - offset : 0x40000000);
+		zfs_ll copied;
+		if (*method == ZFS_COPY_METHOD_RANGE)
 		{
-			fclose(source_file);
-			fclose(destination_file);
-			return ZFS_FALSE;
+#if defined(SYS_copy_file_range)
+			zfs_ll in_offset = offset, out_offset = offset;
+			copied = syscall(SYS_copy_file_range, in, &in_offset, out, &out_offset, (size_t)chunk, 0);
+#else
+			copied = -1;
+			errno = ENOSYS;
+#endif
+			// Kernels before 5.3 do not copy across filesystems, before 4.5 not at all
+			if (copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+			{
+				*method = ZFS_COPY_METHOD_SENDFILE;
+				continue;
+			}
+		}
+		else if (*method == ZFS_COPY_METHOD_SENDFILE)
+		{
+			off_t in_offset = offset;
+			if (lseek(out, offset, SEEK_SET) < 0)
+				return -1;
+			copied = sendfile(out, in, &in_offset, (size_t)chunk);
+			if (copied < 0 && (errno == ENOSYS || errno == EINVAL))
+			{
+				*method = ZFS_COPY_METHOD_BUFFER;
+				continue;
+			}
+		}
+		else
+		{
+			if (!*buffer && !(*buffer = (char*)ZFS_MALLOC(ZFS_COPY_BUFFER_SIZE, ZFS_ALLOC_CONTEXT)))
+				return -1;
+			copied = pread(in, *buffer, (size_t)(chunk < ZFS_COPY_BUFFER_SIZE ? chunk : ZFS_COPY_BUFFER_SIZE), offset);
+			if (copied > 0 && (lseek(out, offset, SEEK_SET) < 0 || !zfs__write_all(out, *buffer, copied)))
+				return -1;
 		}
-	}
-
-	fclose(source_file);
-	fclose(destination_file);
-	return ZFS_TRUE;
-}
 
-ZFSDEF zfs_bool zfs_file_delete(const char *filename)
-{
-	return (remove(filename) == 0);
+		if (copied < 0 && errno == EINTR)
+			continue;
+		if (copied < 0)
+			return -1;
+		if (copied == 0)
+			break; // The source ended first
+		offset += copied;
+	}
+	return offset;
 }
-#endif // Z_FS_NO_FILE
 
-#ifndef Z_FS_NO_DIRECTORY
-static inline zfs_bool zfs__skip_directory(ZFSDir *context)
+// Copies the data regions of a regular file and sets the size, which leaves the holes in between.
+// 'size' is only where the copy stops, the file can have shrunk since or hold less than it says.
+static zfs_bool zfs__file_copy_regular(int in, int out, zfs_ll size, int flags, ZFSCopyMethod *method)
 {
-	const char *name =
-#if defined(ZFS_POSIX)
-		((struct dirent*)context->data)->d_name;
-#elif defined(ZFS_WINDOWS)
-		((LPWIN32_FIND_DATAA)context->data)->cFileName;
+#if defined(FICLONE)
+	if (!(flags & ZFS_COPY_NO_REFLINK) && ioctl(out, FICLONE, in) == 0)
+	{
+		*method = ZFS_COPY_METHOD_REFLINK;
+		return ZFS_TRUE;
+	}
 #endif
-	return (strcmp(name, ".") == 0 || strcmp(name, "..") == 0);
-}
-
-ZFSDEF zfs_bool zfs_directory_begin(ZFSDir *context, const char *path)
-{
-#if defined(ZFS_POSIX)
-	context->handle = opendir(path);
-	context->data = NULL;
-	if (!context->handle)
-		return ZFS_FALSE;
+	if ((flags & ZFS_COPY_PREALLOCATE) && size > 0)
+		posix_fallocate(out, 0, size); // Only an optimization, so errors are ignored
 
-	if (!zfs_directory_next(context))
+	ZFSCopyMethod next = ZFS_COPY_METHOD_RANGE;
+	char *buffer = NULL;
+	zfs_bool ok = ZFS_TRUE;
+	zfs_ll offset = 0, end = size;
+	while (ok && offset < size)
 	{
-		zfs_directory_end(context);
-		return ZFS_FALSE;
+		zfs_ll data = lseek(in, offset, SEEK_DATA);
+		zfs_ll hole = size;
+		if (data < 0 && errno == ENXIO)
+			break; // Only a hole is left
+		if (data < 0)
+			data = offset; // The filesystem can not tell, copy the rest
+		else if ((hole = lseek(in, data, SEEK_HOLE)) < 0 || hole > size)
+			hole = size;
+		if (data >= size)
+			break;
+		zfs_ll reached = zfs__file_copy_range(in, out, data, hole - data, &next, &buffer);
+		*method = next;
+		ok = (reached >= 0);
+		if (ok && reached < hole)
+		{
+			// Setting the size would pad the copy with zeros past the data, as files in /sys claim a page
+			end = reached;
+			break;
+		}
+		offset = hole;
 	}
 
-	return ZFS_TRUE;
-#elif defined(ZFS_WINDOWS)
-	char new_path[MAX_PATH];
-	zfs_path_join(new_path, sizeof(new_path), path, "\\*");
+	// Or the source shrank into a hole
+	struct stat st;
+	if (ok && fstat(in, &st) == 0 && st.st_size < end)
+		end = st.st_size;
+	ZFS_FREE(buffer, ZFS_ALLOC_CONTEXT);
+	return (ok && ftruncate(out, end) == 0);
+}
 
-	context->handle = FindFirstFileA(new_path, (LPWIN32_FIND_DATAA)&context->data);
-	if (context->handle == INVALID_HANDLE_VALUE)
-		return ZFS_FALSE;
+// Copies the contents of 'in', which 'st' is the stat of, to the empty file 'out'
+static zfs_bool zfs__file_copy_fd(int in, int out, const struct stat *st, int flags, ZFSCopyMethod *method)
+{
+	*method = ZFS_COPY_METHOD_NONE;
+	if (S_ISREG(st->st_mode) && st->st_size > 0)
+		return zfs__file_copy_regular(in, out, st->st_size, flags, method);
 
-	while (zfs__skip_directory(context))
+	// Pipes, devices and files like those in /proc have no size or holes, read them to the end
+	char *buffer = (char*)ZFS_MALLOC(ZFS_COPY_BUFFER_SIZE, ZFS_ALLOC_CONTEXT);
+	zfs_bool ok = (buffer != NULL);
+	ssize_t n;
+	while (ok && ((n = read(in, buffer, ZFS_COPY_BUFFER_SIZE)) != 0))
 	{
-		if (!FindNextFileA(context->handle, (LPWIN32_FIND_DATAA)&context->data))
+		if (n < 0)
+			ok = (errno == EINTR);
+		else
 		{
-			zfs_directory_end(context);
-			return ZFS_FALSE;
+			ok = zfs__write_all(out, buffer, n);
+			*method = ZFS_COPY_METHOD_BUFFER;
 		}
 	}
-
-	return ZFS_TRUE;
-#endif
+	ZFS_FREE(buffer, ZFS_ALLOC_CONTEXT);
+	return ok;
 }
+#endif
 
-ZFSDEF zfs_bool zfs_directory_next(ZFSDir *context)
+ZFSDEF zfs_bool zfs_file_copy_ex(const char *source_filename, const char *destination_filename, int flags, ZFSCopyMethod *method)
 {
+	ZFSCopyMethod used = ZFS_COPY_METHOD_NONE;
+	zfs_bool ok = ZFS_FALSE;
 #if defined(ZFS_POSIX)
-	do
-	{
-		context->data = readdir((DIR*)context->handle);
-		if (!context->data)
-			return ZFS_FALSE;
-	} while (zfs__skip_directory(context));
-	return ZFS_TRUE;
-#elif defined(ZFS_WINDOWS)
-	do
+	ok = zfs_file_copy_at(NULL, source_filename, NULL, destination_filename, flags, &used);
+#else
+	(void)flags;
+	FILE *source_file = fopen(source_filename, "rb");
+	if (!source_file)
+		return ZFS_FALSE;
+	FILE *destination_file = fopen(destination_filename, "wb");
+	char *buffer = (destination_file ? (char*)ZFS_MALLOC(ZFS_COPY_BUFFER_SIZE, ZFS_ALLOC_CONTEXT) : NULL);
+	ok = (buffer != NULL);
+	size_t n;
+	while (ok && (n = fread(buffer, 1, ZFS_COPY_BUFFER_SIZE, source_file)) > 0)
 	{
-		if (!FindNextFileA(context->handle, (LPWIN32_FIND_DATAA)&context->data))
-			return ZFS_FALSE;
-	} while (zfs__skip_directory(context));
-	return ZFS_TRUE;
+		ok = (fwrite(buffer, 1, n, destination_file) == n);
+		used = ZFS_COPY_METHOD_BUFFER;
+	}
+	ok = (ok && !ferror(source_file));
+	ZFS_FREE(buffer, ZFS_ALLOC_CONTEXT);
+	if (destination_file && fclose(destination_file) != 0)
+		ok = ZFS_FALSE;
+	fclose(source_file);
 #endif
+	if (method)
+		*method = used;
+	return ok;
 }
 
-ZFSDEF void zfs_directory_end(ZFSDir *context)
+ZFSDEF zfs_bool zfs_file_delete(const char *filename)
 {
+	return (remove(filename) == 0);
+}
+
 #if defined(ZFS_POSIX)
-	closedir((DIR*)context->handle);
-	context->handle = NULL;
-	context->data = NULL;
-#elif defined(ZFS_WINDOWS)
-	FindClose(context->handle);
-	context->handle = NULL;
-	memset(&context->data, 0, sizeof(context->data));
-#endif
+static inline int zfs__root_fd(const ZFSRoot *root)
+{
+	return (root ? root->fd : AT_FDCWD);
 }
 
-ZFSDEF const char *zfs_directory_current_filename(ZFSDir *context)
+ZFSDEF zfs_bool zfs_root_begin(ZFSRoot *root, const ZFSRoot *parent, const char *path)
 {
-#if defined(ZFS_POSIX)
-	const char *name = ((struct dirent*)context->data)->d_name;
-	return name;
-#elif defined(ZFS_WINDOWS)
-	const char *name = ((LPWIN32_FIND_DATAA)context->data)->cFileName;
-	return name;
+#if defined(O_PATH)
+	root->fd = openat(zfs__root_fd(parent), path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+#else
+	root->fd = openat(zfs__root_fd(parent), path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 #endif
+	return (root->fd >= 0);
 }
 
-ZFSDEF zfs_bool zfs_directory_is_directory(ZFSDir *context)
+ZFSDEF void zfs_root_end(ZFSRoot *root)
 {
-#if defined(ZFS_POSIX)
-	#ifdef _DIRENT_HAVE_D_TYPE
-	return (S_ISDIR(DTTOIF(((struct dirent*)context->data)->d_type)) != 0);
-	#else
-	//TODO(johannes): Does not work yet, we need to convert d_name to full path first
-	struct stat buf;
-	if (stat(((struct dirent*)context->data)->d_name, &buf) != 0)
+	if (root->fd >= 0)
+		close(root->fd);
+	root->fd = -1;
+}
+
+ZFSDEF zfs_bool zfs_file_touch_at(const ZFSRoot *root, const char *filename)
+{
+	if (utimensat(zfs__root_fd(root), filename, NULL, 0) == 0)
+		return ZFS_TRUE;
+	if (errno != ENOENT)
 		return ZFS_FALSE;
-	return (S_ISDIR(buf.st_mode) != 0);
-	#endif
+	int fd = openat(zfs__root_fd(root), filename, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return ZFS_FALSE;
+	close(fd);
+	return ZFS_TRUE;
+}
+
+ZFSDEF zfs_bool zfs_file_exists_at(const ZFSRoot *root, const char *filename)
+{
+	return (faccessat(zfs__root_fd(root), filename, F_OK, 0) == 0);
+}
+
+ZFSDEF zfs_bool zfs_file_rename_at(const ZFSRoot *old_root, const char *old_filename, const ZFSRoot *new_root, const char *new_filename)
+{
+	return (renameat(zfs__root_fd(old_root), old_filename, zfs__root_fd(new_root), new_filename) == 0);
+}
+
+ZFSDEF zfs_bool zfs_file_copy_at(const ZFSRoot *source_root, const char *source_filename, const ZFSRoot *destination_root, const char *destination_filename, int flags, ZFSCopyMethod *method)
+{
+	ZFSCopyMethod used = ZFS_COPY_METHOD_NONE;
+	int in = openat(zfs__root_fd(source_root), source_filename, O_RDONLY | O_CLOEXEC);
+	if (in < 0)
+		return ZFS_FALSE;
+	struct stat st;
+	zfs_bool ok = ZFS_FALSE;
+	int out = (fstat(in, &st) == 0 ? openat(zfs__root_fd(destination_root), destination_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666) : -1);
+	if (out >= 0)
+	{
+		ok = zfs__file_copy_fd(in, out, &st, flags, &used);
+		if (close(out) != 0)
+			ok = ZFS_FALSE;
+	}
+	close(in);
+	if (method)
+		*method = used;
+	return ok;
+}
+
+ZFSDEF zfs_bool zfs_file_delete_at(const ZFSRoot *root, const char *filename)
+{
+	// As remove(), which also deletes empty directories
+	if (unlinkat(zfs__root_fd(root), filename, 0) == 0)
+		return ZFS_TRUE;
+	return ((errno == EISDIR || errno == EPERM) && unlinkat(zfs__root_fd(root), filename, AT_REMOVEDIR) == 0);
+}
+
+ZFSDEF int zfs_file_open_at(const ZFSRoot *root, const char *filename, int flags)
+{
+	return openat(zfs__root_fd(root), filename, flags | O_CLOEXEC, 0666);
+}
+#endif
+#endif // Z_FS_NO_FILE
+
+#ifndef Z_FS_NO_DIRECTORY
+#if defined(ZFS_POSIX)
+static inline ZFSType zfs__type_from_mode(mode_t mode)
+{
+	if (S_ISREG(mode))
+		return ZFS_TYPE_FILE;
+	if (S_ISDIR(mode))
+		return ZFS_TYPE_DIRECTORY;
+	if (S_ISLNK(mode))
+		return ZFS_TYPE_SYMLINK;
+	return ZFS_TYPE_OTHER;
+}
+
+static inline ZFSType zfs__type_from_d_type(unsigned char d_type)
+{
+	switch (d_type)
+	{
+	case DT_REG: return ZFS_TYPE_FILE;
+	case DT_DIR: return ZFS_TYPE_DIRECTORY;
+	case DT_LNK: return ZFS_TYPE_SYMLINK;
+	case DT_UNKNOWN: return ZFS_TYPE_UNKNOWN;
+	default: return ZFS_TYPE_OTHER;
+	}
+}
+
+static inline zfs_bool zfs__is_dot_or_dot_dot(const char *name)
+{
+	return (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')));
+}
+
+// The records getdents64 fills the buffer with
+typedef struct zfs__dirent64
+{
+	unsigned long long d_ino;
+	long long d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[1];
+} zfs__dirent64;
+
+ZFSDEF zfs_bool zfs_directory_batch_begin(ZFSDirBatch *batch, const char *path, void *buffer, zfs_ll buffer_size)
+{
+	return zfs_directory_batch_begin_fd(batch, open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC), buffer, buffer_size);
+}
+
+ZFSDEF zfs_bool zfs_directory_batch_begin_fd(ZFSDirBatch *batch, int fd, void *buffer, zfs_ll buffer_size)
+{
+	batch->fd = fd;
+	batch->buffer = (char*)buffer;
+	batch->buffer_size = buffer_size;
+	batch->pos = 0;
+	batch->end = 0;
+	if (fd < 0 || !buffer || buffer_size < ZFS_DIRECTORY_MIN_BUFFER_SIZE)
+	{
+		zfs_directory_batch_end(batch);
+		return ZFS_FALSE;
+	}
+	return ZFS_TRUE;
+}
+
+ZFSDEF int zfs_directory_batch_next(ZFSDirBatch *batch, ZFSDirEntry *entries, int max_entries)
+{
+	int count = 0;
+	while (count < max_entries)
+	{
+		if (batch->pos == batch->end)
+		{
+			// Refilling overwrites the names in the entries so far
+			if (count > 0)
+				break;
+			unsigned int size = (unsigned int)(batch->buffer_size < (1 << 30) ? batch->buffer_size : (1 << 30));
+			long read_size = syscall(SYS_getdents64, batch->fd, batch->buffer, size);
+			if (read_size < 0)
+				return -1;
+			if (read_size == 0)
+				break;
+			batch->pos = 0;
+			batch->end = read_size;
+		}
+
+		// The buffer does not have to be aligned
+		zfs__dirent64 record;
+		char *name = batch->buffer + batch->pos + offsetof(zfs__dirent64, d_name);
+		memcpy(&record, batch->buffer + batch->pos, offsetof(zfs__dirent64, d_name));
+		batch->pos += record.d_reclen;
+		if (zfs__is_dot_or_dot_dot(name))
+			continue;
+
+		entries[count].name = name;
+		entries[count].inode = (zfs_ll)record.d_ino;
+		entries[count].type = zfs__type_from_d_type(record.d_type);
+		++count;
+	}
+	return count;
+}
+
+ZFSDEF void zfs_directory_batch_end(ZFSDirBatch *batch)
+{
+	if (batch->fd >= 0)
+		close(batch->fd);
+	batch->fd = -1;
+	batch->pos = 0;
+	batch->end = 0;
+}
+
+// Fills the 'fields' of 'info' that need a stat, and whatever else the same call returns
+static zfs_bool zfs__stat_info(int dir_fd, const char *name, int fields, ZFSEntryInfo *info)
+{
+#if defined(SYS_statx) && defined(STATX_TYPE)
+	// Kernels before 4.11 do not have statx
+	static int statx_missing = 0;
+	if (!__atomic_load_n(&statx_missing, __ATOMIC_RELAXED))
+	{
+		unsigned int mask = 0;
+		if (fields & ZFS_INFO_TYPE)
+			mask |= STATX_TYPE;
+		if (fields & ZFS_INFO_SIZE)
+			mask |= STATX_SIZE;
+		if (fields & ZFS_INFO_MTIME)
+			mask |= STATX_MTIME;
+		if (fields & ZFS_INFO_INODE)
+			mask |= STATX_INO;
+		if (fields & ZFS_INFO_MODE)
+			mask |= STATX_MODE;
+
+		struct statx buf;
+		if (syscall(SYS_statx, dir_fd, name, AT_SYMLINK_NOFOLLOW, mask, &buf) == 0)
+		{
+			if (buf.stx_mask & STATX_TYPE)
+			{
+				info->type = zfs__type_from_mode(buf.stx_mode);
+				info->fields |= ZFS_INFO_TYPE;
+			}
+			if (buf.stx_mask & STATX_SIZE)
+			{
+				info->size = (zfs_ll)buf.stx_size;
+				info->fields |= ZFS_INFO_SIZE;
+			}
+			if (buf.stx_mask & STATX_MTIME)
+			{
+				info->mtime_seconds = (zfs_ll)buf.stx_mtime.tv_sec;
+				info->mtime_nanoseconds = (int)buf.stx_mtime.tv_nsec;
+				info->fields |= ZFS_INFO_MTIME;
+			}
+			if (buf.stx_mask & STATX_INO)
+			{
+				info->inode = (zfs_ll)buf.stx_ino;
+				info->fields |= ZFS_INFO_INODE;
+			}
+			if (buf.stx_mask & STATX_MODE)
+			{
+				info->mode = (unsigned int)(buf.stx_mode & 07777);
+				info->fields |= ZFS_INFO_MODE;
+			}
+			return ((info->fields & fields) == fields);
+		}
+		if (errno != ENOSYS)
+			return ZFS_FALSE;
+		__atomic_store_n(&statx_missing, 1, __ATOMIC_RELAXED);
+	}
+#endif
+
+	struct stat buf;
+	if (fstatat(dir_fd, name, &buf, AT_SYMLINK_NOFOLLOW) != 0)
+		return ZFS_FALSE;
+	info->type = zfs__type_from_mode(buf.st_mode);
+	info->size = (zfs_ll)buf.st_size;
+	info->mtime_seconds = (zfs_ll)buf.st_mtim.tv_sec;
+	info->mtime_nanoseconds = (int)buf.st_mtim.tv_nsec;
+	info->inode = (zfs_ll)buf.st_ino;
+	info->mode = (unsigned int)(buf.st_mode & 07777);
+	info->fields = ZFS_INFO_ALL;
+	return ZFS_TRUE;
+}
+
+// Adds the 'fields' that 'info' does not have yet, starting with what the directory entry tells
+static zfs_bool zfs__dir_entry_info(int dir_fd, const ZFSDirEntry *entry, int fields, ZFSEntryInfo *info)
+{
+	if (info->fields == 0)
+	{
+		if (entry->type != ZFS_TYPE_UNKNOWN)
+		{
+			info->type = entry->type;
+			info->fields |= ZFS_INFO_TYPE;
+		}
+		info->inode = entry->inode;
+		info->fields |= ZFS_INFO_INODE;
+	}
+	int missing = fields & ~info->fields;
+	return (missing == 0 || zfs__stat_info(dir_fd, entry->name, missing, info));
+}
+
+ZFSDEF zfs_bool zfs_directory_batch_info(ZFSDirBatch *batch, const ZFSDirEntry *entry, int fields, ZFSEntryInfo *info)
+{
+	memset(info, 0, sizeof(*info));
+	return zfs__dir_entry_info(batch->fd, entry, fields, info);
+}
+
+ZFSDEF zfs_bool zfs_entry_info_at(int dir_fd, const char *name, int fields, ZFSEntryInfo *info)
+{
+	memset(info, 0, sizeof(*info));
+	return zfs__stat_info(dir_fd, name, fields, info);
+}
+
+// ZFSDir reads through a batch of one entry at a time
+typedef struct zfs__dir_state
+{
+	ZFSDirBatch batch;
+	ZFSDirEntry entry;
+	ZFSEntryInfo info; // What is known about 'entry' so far
+} zfs__dir_state;
+#elif defined(ZFS_WINDOWS)
+static inline zfs_bool zfs__skip_directory(ZFSDir *context)
+{
+	const char *name = ((LPWIN32_FIND_DATAA)context->data)->cFileName;
+	return (strcmp(name, ".") == 0 || strcmp(name, "..") == 0);
+}
+#endif
+
+ZFSDEF zfs_bool zfs_directory_begin(ZFSDir *context, const char *path)
+{
+#if defined(ZFS_POSIX)
+	zfs__dir_state *state = (zfs__dir_state*)ZFS_MALLOC(sizeof(zfs__dir_state) + ZFS_DIRECTORY_BUFFER_SIZE, ZFS_ALLOC_CONTEXT);
+	context->handle = state;
+	context->data = NULL;
+	if (!state)
+		return ZFS_FALSE;
+	if (!zfs_directory_batch_begin(&state->batch, path, state + 1, ZFS_DIRECTORY_BUFFER_SIZE))
+	{
+		ZFS_FREE(state, ZFS_ALLOC_CONTEXT);
+		context->handle = NULL;
+		return ZFS_FALSE;
+	}
+	context->data = &state->entry;
+
+	if (!zfs_directory_next(context))
+	{
+		zfs_directory_end(context);
+		return ZFS_FALSE;
+	}
+
+	return ZFS_TRUE;
+#elif defined(ZFS_WINDOWS)
+	char new_path[MAX_PATH];
+	zfs_path_join(new_path, sizeof(new_path), path, "\\*");
+
+	context->handle = FindFirstFileA(new_path, (LPWIN32_FIND_DATAA)&context->data);
+	if (context->handle == INVALID_HANDLE_VALUE)
+		return ZFS_FALSE;
+
+	while (zfs__skip_directory(context))
+	{
+		if (!FindNextFileA(context->handle, (LPWIN32_FIND_DATAA)&context->data))
+		{
+			zfs_directory_end(context);
+			return ZFS_FALSE;
+		}
+	}
+
+	return ZFS_TRUE;
+#endif
+}
+
+ZFSDEF zfs_bool zfs_directory_next(ZFSDir *context)
+{
+#if defined(ZFS_POSIX)
+	zfs__dir_state *state = (zfs__dir_state*)context->handle;
+	memset(&state->info, 0, sizeof(state->info));
+	return (zfs_directory_batch_next(&state->batch, &state->entry, 1) == 1);
+#elif defined(ZFS_WINDOWS)
+	do
+	{
+		if (!FindNextFileA(context->handle, (LPWIN32_FIND_DATAA)&context->data))
+			return ZFS_FALSE;
+	} while (zfs__skip_directory(context));
+	return ZFS_TRUE;
+#endif
+}
+
+ZFSDEF void zfs_directory_end(ZFSDir *context)
+{
+#if defined(ZFS_POSIX)
+	zfs__dir_state *state = (zfs__dir_state*)context->handle;
+	zfs_directory_batch_end(&state->batch);
+	ZFS_FREE(state, ZFS_ALLOC_CONTEXT);
+	context->handle = NULL;
+	context->data = NULL;
+#elif defined(ZFS_WINDOWS)
+	FindClose(context->handle);
+	context->handle = NULL;
+	memset(&context->data, 0, sizeof(context->data));
+#endif
+}
+
+ZFSDEF const char *zfs_directory_current_filename(ZFSDir *context)
+{
+#if defined(ZFS_POSIX)
+	const char *name = ((ZFSDirEntry*)context->data)->name;
+	return name;
+#elif defined(ZFS_WINDOWS)
+	const char *name = ((LPWIN32_FIND_DATAA)context->data)->cFileName;
+	return name;
+#endif
+}
+
+ZFSDEF zfs_bool zfs_directory_is_directory(ZFSDir *context)
+{
+#if defined(ZFS_POSIX)
+	ZFSEntryInfo info;
+	return (zfs_directory_current_info(context, ZFS_INFO_TYPE, &info) && info.type == ZFS_TYPE_DIRECTORY);
 #elif defined(ZFS_WINDOWS)
 	return (((LPWIN32_FIND_DATAA)context->data)->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
 #endif
 }
+
+ZFSDEF zfs_bool zfs_directory_current_info(ZFSDir *context, int fields, ZFSEntryInfo *info)
+{
+#if defined(ZFS_POSIX)
+	zfs__dir_state *state = (zfs__dir_state*)context->handle;
+	zfs_bool result = zfs__dir_entry_info(state->batch.fd, &state->entry, fields, &state->info);
+	*info = state->info;
+	return result;
+#elif defined(ZFS_WINDOWS)
+	const WIN32_FIND_DATAA *data = (const WIN32_FIND_DATAA*)context->data;
+	memset(info, 0, sizeof(*info));
+	if ((data->dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) && data->dwReserved0 == IO_REPARSE_TAG_SYMLINK)
+		info->type = ZFS_TYPE_SYMLINK;
+	else if (data->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		info->type = ZFS_TYPE_DIRECTORY;
+	else
+		info->type = ZFS_TYPE_FILE;
+	info->size = ((zfs_ll)data->nFileSizeHigh << 32) | data->nFileSizeLow;
+	// FILETIME counts 100 nanoseconds since 1601
+	zfs_ll ticks = (((zfs_ll)data->ftLastWriteTime.dwHighDateTime << 32) | data->ftLastWriteTime.dwLowDateTime) - 116444736000000000LL;
+	info->mtime_seconds = ticks / 10000000;
+	info->mtime_nanoseconds = (int)(ticks % 10000000) * 100;
+	info->fields = ZFS_INFO_TYPE | ZFS_INFO_SIZE | ZFS_INFO_MTIME;
+	return ((info->fields & fields) == fields);
+#endif
+}
+
+// Makes room for 'size' bytes in a growing buffer
+static zfs_bool zfs__reserve(char **buffer, zfs_ll *capacity, zfs_ll size)
+{
+	if (size <= *capacity)
+		return ZFS_TRUE;
+	zfs_ll new_capacity = (*capacity ? *capacity : 256);
+	while (new_capacity < size)
+		new_capacity *= 2;
+	char *new_buffer = (char*)ZFS_REALLOC(*buffer, new_capacity, ZFS_ALLOC_CONTEXT);
+	if (!new_buffer)
+		return ZFS_FALSE;
+	*buffer = new_buffer;
+	*capacity = new_capacity;
+	return ZFS_TRUE;
+}
+
+// Arena blocks start with a header that links them, padded to keep allocations aligned
+#define ZFS__ARENA_HEADER_SIZE 16
+
+ZFSDEF void zfs_arena_begin(ZFSArena *arena, void *memory, zfs_ll size)
+{
+	arena->memory = (char*)memory;
+	arena->size = (memory ? size : 0);
+	arena->used = 0;
+	arena->blocks = NULL;
+}
+
+ZFSDEF void *zfs_arena_alloc(ZFSArena *arena, zfs_ll size)
+{
+	zfs_ll padding = (zfs_ll)((16 - ((size_t)(arena->memory + arena->used) & 15)) & 15);
+	if (!arena->memory || arena->used + padding + size > arena->size)
+	{
+		zfs_ll block_size = (arena->blocks ? arena->size * 2 : ZFS_ARENA_BLOCK_SIZE);
+		if (block_size < size)
+			block_size = size;
+		char *block = (char*)ZFS_MALLOC(ZFS__ARENA_HEADER_SIZE + block_size, ZFS_ALLOC_CONTEXT);
+		if (!block)
+			return NULL;
+		*(void**)block = arena->blocks;
+		arena->blocks = block;
+		arena->memory = block + ZFS__ARENA_HEADER_SIZE;
+		arena->size = block_size;
+		arena->used = 0;
+		padding = 0;
+	}
+	void *memory = arena->memory + arena->used + padding;
+	arena->used += padding + size;
+	return memory;
+}
+
+ZFSDEF void zfs_arena_end(ZFSArena *arena)
+{
+	while (arena->blocks)
+	{
+		void *next = *(void**)arena->blocks;
+		ZFS_FREE(arena->blocks, ZFS_ALLOC_CONTEXT);
+		arena->blocks = next;
+	}
+	arena->memory = NULL;
+	arena->size = 0;
+	arena->used = 0;
+}
+
+// Below this many entries a bucket is insertion sorted
+#define ZFS__RADIX_SORT_CUTOFF 32
+
+// MSD radix sort of 'order' by name, where all names in it share their first 'depth' bytes
+static void zfs__radix_sort(zfs_ll *order, zfs_ll *scratch, zfs_ll count, const char *names, const zfs_ll *offsets, zfs_ll depth)
+{
+	while (count > 1)
+	{
+		if (count < ZFS__RADIX_SORT_CUTOFF)
+		{
+			zfs_ll i, j;
+			for (i = 1; i < count; ++i)
+			{
+				zfs_ll index = order[i];
+				const char *name = names + offsets[index] + depth;
+				for (j = i; j > 0 && strcmp(names + offsets[order[j - 1]] + depth, name) > 0; --j)
+					order[j] = order[j - 1];
+				order[j] = index;
+			}
+			return;
+		}
+
+		zfs_ll bucket_starts[257];
+		memset(bucket_starts, 0, sizeof(bucket_starts));
+		zfs_ll i;
+		for (i = 0; i < count; ++i)
+			++bucket_starts[(unsigned char)names[offsets[order[i]] + depth] + 1];
+		for (i = 1; i < 257; ++i)
+			bucket_starts[i] += bucket_starts[i - 1];
+		zfs_ll bucket_ends[256];
+		memcpy(bucket_ends, bucket_starts, sizeof(bucket_ends));
+		for (i = 0; i < count; ++i)
+			scratch[bucket_ends[(unsigned char)names[offsets[order[i]] + depth]]++] = order[i];
+		memcpy(order, scratch, count * sizeof(zfs_ll));
+
+		// Names that end here are already in place, recurse into the other buckets but the largest,
+		// which the loop continues with
+		int largest = 1, bucket;
+		for (bucket = 2; bucket < 256; ++bucket)
+		{
+			if (bucket_starts[bucket + 1] - bucket_starts[bucket] > bucket_starts[largest + 1] - bucket_starts[largest])
+				largest = bucket;
+		}
+		for (bucket = 1; bucket < 256; ++bucket)
+		{
+			if (bucket != largest)
+				zfs__radix_sort(order + bucket_starts[bucket], scratch, bucket_starts[bucket + 1] - bucket_starts[bucket], names, offsets, depth + 1);
+		}
+		order += bucket_starts[largest];
+		count = bucket_starts[largest + 1] - bucket_starts[largest];
+		++depth;
+	}
+}
+
+static zfs_bool zfs__is_directory(const char *path)
+{
+#if defined(ZFS_POSIX)
+	struct stat buf;
+	return (stat(path, &buf) == 0 && S_ISDIR(buf.st_mode));
+#elif defined(ZFS_WINDOWS)
+	DWORD attributes = GetFileAttributesA(path);
+	return (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0);
+#endif
+}
+
+ZFSDEF zfs_bool zfs_directory_list(ZFSArena *arena, const char *path, int flags, ZFSDirList *list)
+{
+	memset(list, 0, sizeof(*list));
+
+	// Read the directory once into growing scratch columns
+	char *names = NULL, *offsets = NULL, *types = NULL, *sizes = NULL;
+	zfs_ll names_capacity = 0, offsets_capacity = 0, types_capacity = 0, sizes_capacity = 0;
+	zfs_ll count = 0, names_size = 0;
+	zfs_bool ok = ZFS_TRUE;
+	ZFSDir dir;
+	if (zfs_directory_begin(&dir, path))
+	{
+		do
+		{
+			ZFSEntryInfo info;
+			if (!zfs_directory_current_info(&dir, ZFS_INFO_TYPE | ((flags & ZFS_LIST_SIZES) ? ZFS_INFO_SIZE : 0), &info))
+				continue; // Removed since it was read
+			const char *name = zfs_directory_current_filename(&dir);
+			zfs_ll name_size = strlen(name) + 1;
+			ok = (zfs__reserve(&names, &names_capacity, names_size + name_size) &&
+			      zfs__reserve(&offsets, &offsets_capacity, (count + 1) * sizeof(zfs_ll)) &&
+			      zfs__reserve(&types, &types_capacity, count + 1) &&
+			      (!(flags & ZFS_LIST_SIZES) || zfs__reserve(&sizes, &sizes_capacity, (count + 1) * sizeof(zfs_ll))));
+			if (!ok)
+				break;
+			memcpy(names + names_size, name, name_size);
+			((zfs_ll*)offsets)[count] = names_size;
+			types[count] = (unsigned char)info.type;
+			if (flags & ZFS_LIST_SIZES)
+				((zfs_ll*)sizes)[count] = info.size;
+			names_size += name_size;
+			++count;
+		} while (zfs_directory_next(&dir));
+		zfs_directory_end(&dir);
+	}
+	else
+	{
+		ok = zfs__is_directory(path); // Empty, or failed
+	}
+
+	// Sort an order of the entries, then copy each column into the arena in that order
+	zfs_ll *order = NULL;
+	if (ok && (flags & ZFS_LIST_SORT) && count > 1)
+	{
+		order = (zfs_ll*)ZFS_MALLOC(count * 2 * sizeof(zfs_ll), ZFS_ALLOC_CONTEXT);
+		ok = (order != NULL);
+		if (ok)
+		{
+			zfs_ll i;
+			for (i = 0; i < count; ++i)
+				order[i] = i;
+			zfs__radix_sort(order, order + count, count, names, (const zfs_ll*)offsets, 0);
+		}
+	}
+	if (ok && count > 0)
+	{
+		char *list_names = (char*)zfs_arena_alloc(arena, names_size);
+		zfs_ll *list_offsets = (zfs_ll*)zfs_arena_alloc(arena, count * sizeof(zfs_ll));
+		unsigned char *list_types = (unsigned char*)zfs_arena_alloc(arena, count);
+		zfs_ll *list_sizes = ((flags & ZFS_LIST_SIZES) ? (zfs_ll*)zfs_arena_alloc(arena, count * sizeof(zfs_ll)) : NULL);
+		ok = (list_names && list_offsets && list_types && (!(flags & ZFS_LIST_SIZES) || list_sizes));
+		if (ok)
+		{
+			zfs_ll used = 0;
+			zfs_ll i;
+			for (i = 0; i < count; ++i)
+			{
+				zfs_ll index = (order ? order[i] : i);
+				const char *name = names + ((zfs_ll*)offsets)[index];
+				zfs_ll name_size = strlen(name) + 1;
+				memcpy(list_names + used, name, name_size);
+				list_offsets[i] = used;
+				list_types[i] = (unsigned char)types[index];
+				if (list_sizes)
+					list_sizes[i] = ((zfs_ll*)sizes)[index];
+				used += name_size;
+			}
+			list->count = count;
+			list->names = list_names;
+			list->name_offsets = list_offsets;
+			list->types = list_types;
+			list->sizes = list_sizes;
+		}
+	}
+
+	ZFS_FREE(order, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(names, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(offsets, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(types, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(sizes, ZFS_ALLOC_CONTEXT);
+	return ok;
+}
+
+// Glob segments are matched one path segment at a time. Each pattern is a run of segments followed by
+// an end marker, and a state is the set of segment positions the patterns can be at, kept as a bitset.
+// States are interned in a hash table as they are reached, which builds the deterministic automaton lazily.
+// Literal and suffix segments only depend on which of their texts a name equals or ends with, called
+// its class, so steps from states without generic segments are cached by state and class.
+enum
+{
+	ZFS__GLOB_END,      // The pattern has matched
+	ZFS__GLOB_GLOBSTAR, // "**"
+	ZFS__GLOB_ANY,      // "*"
+	ZFS__GLOB_LITERAL,  // No wildcards
+	ZFS__GLOB_SUFFIX,   // "*" followed by no wildcards, e.g. "*.c"
+	ZFS__GLOB_GENERIC,
+};
+
+typedef struct zfs__glob_segment
+{
+	int kind;
+	zfs_ll text;       // Offset in 'text', unescaped unless the kind is ZFS__GLOB_GENERIC
+	zfs_ll length;
+	int pattern_flags; // End markers only, what the pattern was added with
+} zfs__glob_segment;
+
+// Open addressed set of entries, which are indexes into arrays of the user
+typedef struct zfs__glob_table
+{
+	int *entries;               // Entry + 1, 0 marks free slots
+	unsigned long long *hashes;
+	zfs_ll count;
+	zfs_ll capacity;            // Power of two, 0 when empty
+} zfs__glob_table;
+
+typedef struct zfs__glob
+{
+	zfs__glob_segment *segments;
+	zfs_ll segment_count;
+	zfs_ll segment_capacity;
+	char *text;
+	zfs_ll text_size;
+	zfs_ll text_capacity;
+
+	zfs_ll words;                   // 64 bit words per state
+	unsigned long long *end_mask;   // Positions of the end markers
+	unsigned long long *sets;       // 'words' per state
+	unsigned long long *hashes;
+	unsigned char *flags;           // ZFS_GLOB_* and ZFS__GLOB_GENERIC_STATE of each state
+	int state_count;
+	zfs_ll state_capacity;
+	unsigned long long *scratch;
+	zfs__glob_table state_table;    // States by their set
+
+	zfs__glob_table text_table;     // First literal and suffix segment of each kind and text
+	zfs_ll *suffix_lengths;         // Distinct lengths of the suffix segments
+	int suffix_length_count;
+	int *classes;                   // Literal matched, then suffix matched for each length, -1 for none
+	int *class_key;                 // Class of the name being stepped with
+	int class_count;
+	zfs_ll class_capacity;
+	zfs__glob_table class_table;
+	int *transitions;               // State, class and next state
+	int transition_count;
+	zfs_ll transition_capacity;
+	zfs__glob_table transition_table;
+} zfs__glob;
+
+// Flag of states with generic segments, whose steps are not cached
+#define ZFS__GLOB_GENERIC_STATE (1<<7)
+
+static inline zfs_bool zfs__glob_is_special(char c)
+{
+	return (c == '*' || c == '?' || c == '[' || c == '\\');
+}
+
+static zfs_bool zfs__glob_add_segment(zfs__glob *glob, int kind, const char *text, zfs_ll length)
+{
+	if (!zfs__reserve((char**)&glob->segments, &glob->segment_capacity, (glob->segment_count + 1) * sizeof(zfs__glob_segment)) ||
+	    !zfs__reserve(&glob->text, &glob->text_capacity, glob->text_size + length + 1))
+		return ZFS_FALSE;
+	zfs__glob_segment *segment = &glob->segments[glob->segment_count++];
+	segment->kind = kind;
+	segment->text = glob->text_size;
+	segment->length = 0;
+	segment->pattern_flags = 0;
+	zfs_ll i;
+	for (i = 0; i < length; ++i)
+	{
+		if (kind != ZFS__GLOB_GENERIC && text[i] == '\\' && i + 1 < length)
+			++i;
+		glob->text[glob->text_size + segment->length++] = text[i];
+	}
+	glob->text[glob->text_size + segment->length] = '\0';
+	glob->text_size += segment->length + 1;
+	return ZFS_TRUE;
+}
+
+// Adds the segments of a pattern without braces, then its end marker
+static zfs_bool zfs__glob_add_segments(zfs__glob *glob, const char *pattern, zfs_ll length)
+{
+	zfs_ll start = 0, end;
+	for (; start < length; start = end + 1)
+	{
+		end = start;
+		while (end < length && pattern[end] != '/')
+			++end;
+		const char *text = pattern + start;
+		zfs_ll text_length = end - start;
+		if (text_length == 0 || (text_length == 1 && text[0] == '.'))
+			continue;
+
+		int kind = ZFS__GLOB_LITERAL;
+		if (text_length == 2 && text[0] == '*' && text[1] == '*')
+		{
+			// Consecutive "**" match the same as one
+			if (glob->segment_count > 0 && glob->segments[glob->segment_count - 1].kind == ZFS__GLOB_GLOBSTAR)
+				continue;
+			kind = ZFS__GLOB_GLOBSTAR;
+		}
+		else
+		{
+			zfs_ll i;
+			for (i = (text[0] == '*' ? 1 : 0); i < text_length; ++i)
+			{
+				if (text[i] == '\\' && i + 1 < text_length)
+					++i;
+				else if (zfs__glob_is_special(text[i]))
+					kind = ZFS__GLOB_GENERIC;
+			}
+			if (kind == ZFS__GLOB_LITERAL && text[0] == '*')
+			{
+				kind = (text_length == 1 ? ZFS__GLOB_ANY : ZFS__GLOB_SUFFIX);
+				++text;
+				--text_length;
+			}
+		}
+		if (!zfs__glob_add_segment(glob, kind, text, text_length))
+			return ZFS_FALSE;
+	}
+	return zfs__glob_add_segment(glob, ZFS__GLOB_END, "", 0);
+}
+
+// Adds a pattern once for each alternative of its first brace group, which expands the rest in turn
+static zfs_bool zfs__glob_add(zfs__glob *glob, const char *pattern, zfs_ll length)
+{
+	zfs_ll open = -1, close = -1, i;
+	int nesting = 0;
+	for (i = 0; i < length && close < 0; ++i)
+	{
+		if (pattern[i] == '\\')
+			++i;
+		else if (pattern[i] == '{' && nesting++ == 0)
+			open = i;
+		else if (pattern[i] == '}' && nesting > 0 && --nesting == 0)
+			close = i;
+	}
+	if (close < 0)
+		return zfs__glob_add_segments(glob, pattern, length);
+
+	// Alternatives are never longer than the group
+	char *expanded = (char*)ZFS_MALLOC(length, ZFS_ALLOC_CONTEXT);
+	if (!expanded)
+		return ZFS_FALSE;
+	memcpy(expanded, pattern, open);
+	zfs_bool result = ZFS_TRUE;
+	zfs_ll start = open + 1;
+	nesting = 0;
+	for (i = open + 1; i <= close && result; ++i)
+	{
+		if (i == close || (pattern[i] == ',' && nesting == 0))
+		{
+			zfs_ll alternative = i - start;
+			memcpy(expanded + open, pattern + start, alternative);
+			memcpy(expanded + open + alternative, pattern + close + 1, length - close - 1);
+			result = zfs__glob_add(glob, expanded, open + alternative + length - close - 1);
+			start = i + 1;
+		}
+		else if (pattern[i] == '\\')
+			++i;
+		else if (pattern[i] == '{')
+			++nesting;
+		else if (pattern[i] == '}')
+			--nesting;
+	}
+	ZFS_FREE(expanded, ZFS_ALLOC_CONTEXT);
+	return result;
+}
+
+// Matches [...] at 'pattern' against 'c', and moves 'pattern' past it.
+// Returns -1 if the class is not closed, in which case '[' is a literal.
+static int zfs__glob_match_class(const char **pattern, const char *pattern_end, unsigned char c)
+{
+	const char *p = *pattern + 1;
+	zfs_bool negated = (p < pattern_end && (*p == '!' || *p == '^'));
+	if (negated)
+		++p;
+	zfs_bool matched = ZFS_FALSE;
+	const char *first = p;
+	while (p < pattern_end && (*p != ']' || p == first))
+	{
+		if (*p == '\\' && p + 1 < pattern_end)
+			++p;
+		unsigned char low = (unsigned char)*p++;
+		unsigned char high = low;
+		if (p + 1 < pattern_end && *p == '-' && p[1] != ']')
+		{
+			++p;
+			if (*p == '\\' && p + 1 < pattern_end)
+				++p;
+			high = (unsigned char)*p++;
+		}
+		if (c >= low && c <= high)
+			matched = ZFS_TRUE;
+	}
+	if (p >= pattern_end)
+		return -1;
+	*pattern = p + 1;
+	return (matched != negated);
+}
+
+// Matches a whole name against a segment with wildcards, backtracking to the last * on a mismatch
+static zfs_bool zfs__glob_match_generic(const char *pattern, const char *pattern_end, const char *name)
+{
+	const char *star = NULL, *star_name = NULL;
+	while (*name)
+	{
+		if (pattern < pattern_end)
+		{
+			if (*pattern == '*')
+			{
+				star = ++pattern;
+				star_name = name;
+				continue;
+			}
+			const char *next = pattern;
+			int matched = -1;
+			if (*pattern == '?')
+			{
+				matched = 1;
+				++next;
+			}
+			else if (*pattern == '[')
+				matched = zfs__glob_match_class(&next, pattern_end, (unsigned char)*name);
+			if (matched < 0)
+			{
+				if (*next == '\\' && next + 1 < pattern_end)
+					++next;
+				matched = (*next++ == *name);
+			}
+			if (matched)
+			{
+				pattern = next;
+				++name;
+				continue;
+			}
+		}
+		if (!star)
+			return ZFS_FALSE;
+		pattern = star;
+		name = ++star_name;
+	}
+	while (pattern < pattern_end && *pattern == '*')
+		++pattern;
+	return (pattern == pattern_end);
+}
+
+static zfs_bool zfs__glob_match_segment(const zfs__glob *glob, const zfs__glob_segment *segment, const char *name, zfs_ll name_length)
+{
+	const char *text = glob->text + segment->text;
+	switch (segment->kind)
+	{
+	case ZFS__GLOB_GLOBSTAR:
+	case ZFS__GLOB_ANY:
+		return ZFS_TRUE;
+	case ZFS__GLOB_LITERAL:
+		return (name_length == segment->length && memcmp(name, text, name_length) == 0);
+	case ZFS__GLOB_SUFFIX:
+		return (name_length >= segment->length && memcmp(name + name_length - segment->length, text, segment->length) == 0);
+	case ZFS__GLOB_GENERIC:
+		return zfs__glob_match_generic(text, text + segment->length, name);
+	default:
+		return ZFS_FALSE;
+	}
+}
+
+// Adds 'position' to 'set', and what follows it while it is a "**" that can match nothing
+static void zfs__glob_close(const zfs__glob *glob, unsigned long long *set, zfs_ll position)
+{
+	for (;;)
+	{
+		set[position >> 6] |= 1ULL << (position & 63);
+		if (glob->segments[position].kind != ZFS__GLOB_GLOBSTAR)
+			break;
+		++position;
+	}
+}
+
+static zfs_ll zfs__glob_table_slot(const zfs__glob_table *table, unsigned long long hash)
+{
+	// Spreads the high bits of the hashes into the low ones
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+	return (zfs_ll)(hash & (table->capacity - 1));
+}
+
+// Returns the entries with 'hash' one at a time, starting from 'slot' set to -1, then -1 when there are no more
+static int zfs__glob_table_next(const zfs__glob_table *table, unsigned long long hash, zfs_ll *slot)
+{
+	if (table->capacity == 0)
+		return -1;
+	zfs_ll mask = table->capacity - 1;
+	*slot = (*slot < 0 ? zfs__glob_table_slot(table, hash) : (*slot + 1) & mask);
+	for (; table->entries[*slot] != 0; *slot = (*slot + 1) & mask)
+	{
+		if (table->hashes[*slot] == hash)
+			return table->entries[*slot] - 1;
+	}
+	return -1;
+}
+
+// Adds an entry that is not in the table yet. Returns false if there was no memory.
+static zfs_bool zfs__glob_table_insert(zfs__glob_table *table, unsigned long long hash, int entry)
+{
+	if ((table->count + 1) * 2 > table->capacity)
+	{
+		zfs__glob_table grown;
+		grown.count = 0;
+		grown.capacity = (table->capacity ? table->capacity * 2 : 64);
+		grown.entries = (int*)ZFS_MALLOC(grown.capacity * sizeof(int), ZFS_ALLOC_CONTEXT);
+		grown.hashes = (unsigned long long*)ZFS_MALLOC(grown.capacity * sizeof(unsigned long long), ZFS_ALLOC_CONTEXT);
+		if (!grown.entries || !grown.hashes)
+		{
+			ZFS_FREE(grown.entries, ZFS_ALLOC_CONTEXT);
+			ZFS_FREE(grown.hashes, ZFS_ALLOC_CONTEXT);
+			return ZFS_FALSE;
+		}
+		memset(grown.entries, 0, grown.capacity * sizeof(int));
+		zfs_ll i;
+		for (i = 0; i < table->capacity; ++i)
+		{
+			if (table->entries[i] != 0)
+				zfs__glob_table_insert(&grown, table->hashes[i], table->entries[i] - 1);
+		}
+		ZFS_FREE(table->entries, ZFS_ALLOC_CONTEXT);
+		ZFS_FREE(table->hashes, ZFS_ALLOC_CONTEXT);
+		*table = grown;
+	}
+
+	zfs_ll mask = table->capacity - 1;
+	zfs_ll slot = zfs__glob_table_slot(table, hash);
+	while (table->entries[slot] != 0)
+		slot = (slot + 1) & mask;
+	table->entries[slot] = entry + 1;
+	table->hashes[slot] = hash;
+	++table->count;
+	return ZFS_TRUE;
+}
+
+static void zfs__glob_table_free(zfs__glob_table *table)
+{
+	ZFS_FREE(table->entries, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(table->hashes, ZFS_ALLOC_CONTEXT);
+}
+
+// FNV-1a
+static unsigned long long zfs__glob_hash_bytes(unsigned long long hash, const void *data, zfs_ll size)
+{
+	const unsigned char *bytes = (const unsigned char*)data;
+	zfs_ll i;
+	for (i = 0; i < size; ++i)
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	return hash;
+}
+
+static unsigned long long zfs__glob_hash(const zfs__glob *glob, const unsigned long long *set)
+{
+	unsigned long long hash = 0;
+	zfs_ll i;
+	for (i = 0; i < glob->words; ++i)
+		hash = (hash ^ set[i]) * 0x9E3779B97F4A7C15ULL;
+	return hash;
+}
+
+// Adds 'set' as a new state and returns it, or -1 if there was no memory
+static int zfs__glob_add_state(zfs__glob *glob, const unsigned long long *set, unsigned long long hash)
+{
+	int state = glob->state_count;
+	zfs_ll capacity = glob->state_capacity;
+	if (!zfs__reserve((char**)&glob->sets, &glob->state_capacity, (state + 1) * glob->words * sizeof(unsigned long long)))
+		return -1;
+	if (glob->state_capacity != capacity)
+	{
+		zfs_ll states = glob->state_capacity / (glob->words * sizeof(unsigned long long));
+		unsigned long long *hashes = (unsigned long long*)ZFS_REALLOC(glob->hashes, states * sizeof(unsigned long long), ZFS_ALLOC_CONTEXT);
+		if (hashes)
+			glob->hashes = hashes;
+		unsigned char *flags = (unsigned char*)ZFS_REALLOC(glob->flags, states, ZFS_ALLOC_CONTEXT);
+		if (flags)
+			glob->flags = flags;
+		if (!hashes || !flags)
+		{
+			glob->state_capacity = capacity;
+			return -1;
+		}
+	}
+	if (!zfs__glob_table_insert(&glob->state_table, hash, state))
+		return -1;
+
+	memcpy(glob->sets + state * glob->words, set, glob->words * sizeof(unsigned long long));
+	glob->hashes[state] = hash;
+	glob->flags[state] = 0;
+	zfs_ll word;
+	for (word = 0; word < glob->words; ++word)
+	{
+		if (set[word] & glob->end_mask[word])
+			glob->flags[state] |= ZFS_GLOB_MATCH;
+		if (set[word] & ~glob->end_mask[word])
+			glob->flags[state] |= ZFS_GLOB_DESCEND;
+		unsigned long long bits = set[word];
+		zfs_ll position;
+		for (position = word * 64; bits; bits >>= 1, ++position)
+		{
+			if ((bits & 1) && glob->segments[position].kind == ZFS__GLOB_GENERIC)
+				glob->flags[state] |= ZFS__GLOB_GENERIC_STATE;
+		}
+	}
+	++glob->state_count;
+	return state;
+}
+
+// Returns the state of 'set', adding it if it is new, or -1 if there was no memory
+static int zfs__glob_intern(zfs__glob *glob, const unsigned long long *set)
+{
+	unsigned long long hash = zfs__glob_hash(glob, set);
+	zfs_ll slot = -1;
+	int state;
+	while ((state = zfs__glob_table_next(&glob->state_table, hash, &slot)) >= 0)
+	{
+		if (memcmp(glob->sets + state * glob->words, set, glob->words * sizeof(unsigned long long)) == 0)
+			return state;
+	}
+	return zfs__glob_add_state(glob, set, hash);
+}
+
+// Returns the first segment of 'kind' with 'text', or -1 if there is none
+static int zfs__glob_find_text(const zfs__glob *glob, int kind, const char *text, zfs_ll length, unsigned long long hash)
+{
+	zfs_ll slot = -1;
+	int position;
+	while ((position = zfs__glob_table_next(&glob->text_table, hash, &slot)) >= 0)
+	{
+		const zfs__glob_segment *segment = &glob->segments[position];
+		if (segment->kind == kind && segment->length == length && memcmp(glob->text + segment->text, text, length) == 0)
+			return position;
+	}
+	return -1;
+}
+
+static inline unsigned long long zfs__glob_hash_text(int kind, const char *text, zfs_ll length)
+{
+	return zfs__glob_hash_bytes(14695981039346656037ULL ^ (unsigned long long)kind, text, length);
+}
+
+// Returns the class of a name, adding it if it is new, or -1 if there was no memory
+static int zfs__glob_classify(zfs__glob *glob, const char *name, zfs_ll name_length)
+{
+	int *class_key = glob->class_key;
+	zfs_ll key_size = (glob->suffix_length_count + 1) * sizeof(int);
+	class_key[0] = zfs__glob_find_text(glob, ZFS__GLOB_LITERAL, name, name_length, zfs__glob_hash_text(ZFS__GLOB_LITERAL, name, name_length));
+	int i;
+	for (i = 0; i < glob->suffix_length_count; ++i)
+	{
+		zfs_ll length = glob->suffix_lengths[i];
+		const char *suffix = name + name_length - length;
+		class_key[i + 1] = (length <= name_length ? zfs__glob_find_text(glob, ZFS__GLOB_SUFFIX, suffix, length, zfs__glob_hash_text(ZFS__GLOB_SUFFIX, suffix, length)) : -1);
+	}
+
+	unsigned long long hash = zfs__glob_hash_bytes(14695981039346656037ULL, class_key, key_size);
+	zfs_ll slot = -1;
+	int result;
+	while ((result = zfs__glob_table_next(&glob->class_table, hash, &slot)) >= 0)
+	{
+		if (memcmp((char*)glob->classes + result * key_size, class_key, key_size) == 0)
+			break;
+	}
+	if (result < 0 && zfs__reserve((char**)&glob->classes, &glob->class_capacity, (glob->class_count + 1) * key_size) &&
+	    zfs__glob_table_insert(&glob->class_table, hash, glob->class_count))
+	{
+		memcpy((char*)glob->classes + glob->class_count * key_size, class_key, key_size);
+		result = glob->class_count++;
+	}
+	return result;
+}
+
+static inline unsigned long long zfs__glob_hash_transition(int state, int class_id)
+{
+	return (((unsigned long long)state << 32) | (unsigned)class_id) * 0x9E3779B97F4A7C15ULL;
+}
+
+// Sets up the states once all patterns are added. Returns false if there was no memory.
+static zfs_bool zfs__glob_finish(zfs__glob *g)
+{
+	// One set for the end markers and one to step into
+	g->words = g->segment_count / 64 + 1;
+	g->end_mask = (unsigned long long*)ZFS_MALLOC(g->words * 2 * sizeof(unsigned long long), ZFS_ALLOC_CONTEXT);
+	if (!g->end_mask)
+		return ZFS_FALSE;
+	g->scratch = g->end_mask + g->words;
+	memset(g->end_mask, 0, g->words * 2 * sizeof(unsigned long long));
+
+	// State 0 matches nothing. ZFS_GLOB_START is added even when it is the same set, so it is always 1.
+	if (zfs__glob_add_state(g, g->scratch, zfs__glob_hash(g, g->scratch)) != 0)
+		return ZFS_FALSE;
+
+	// Each pattern starts after the end of the previous one
+	zfs_ll position;
+	for (position = 0; position < g->segment_count; ++position)
+	{
+		if (g->segments[position].kind == ZFS__GLOB_END)
+			g->end_mask[position >> 6] |= 1ULL << (position & 63);
+		else if (position == 0 || g->segments[position - 1].kind == ZFS__GLOB_END)
+			zfs__glob_close(g, g->scratch, position);
+
+		// Segments with the same text match the same names, so the first one stands for them
+		const zfs__glob_segment *segment = &g->segments[position];
+		if (segment->kind != ZFS__GLOB_LITERAL && segment->kind != ZFS__GLOB_SUFFIX)
+			continue;
+		const char *text = g->text + segment->text;
+		unsigned long long hash = zfs__glob_hash_text(segment->kind, text, segment->length);
+		if (zfs__glob_find_text(g, segment->kind, text, segment->length, hash) >= 0)
+			continue;
+		if (!zfs__glob_table_insert(&g->text_table, hash, (int)position))
+			return ZFS_FALSE;
+		if (segment->kind != ZFS__GLOB_SUFFIX)
+			continue;
+		int i;
+		for (i = 0; i < g->suffix_length_count && g->suffix_lengths[i] != segment->length; ++i)
+			;
+		if (i == g->suffix_length_count)
+		{
+			zfs_ll *lengths = (zfs_ll*)ZFS_REALLOC(g->suffix_lengths, (i + 1) * sizeof(zfs_ll), ZFS_ALLOC_CONTEXT);
+			if (!lengths)
+				return ZFS_FALSE;
+			g->suffix_lengths = lengths;
+			g->suffix_lengths[g->suffix_length_count++] = segment->length;
+		}
+	}
+	g->class_key = (int*)ZFS_MALLOC((g->suffix_length_count + 1) * sizeof(int), ZFS_ALLOC_CONTEXT);
+	if (!g->class_key)
+		return ZFS_FALSE;
+	return (zfs__glob_add_state(g, g->scratch, zfs__glob_hash(g, g->scratch)) == ZFS_GLOB_START);
+}
+
+// Returns the flags of the last pattern that matched on the way to 'state', ignoring patterns with
+// any of 'skip_flags', or -1 if none did
+static int zfs__glob_last_match(const zfs__glob *glob, int state, int skip_flags)
+{
+	const unsigned long long *set = glob->sets + state * glob->words;
+	zfs_ll word;
+	for (word = glob->words - 1; word >= 0; --word)
+	{
+		unsigned long long bits = set[word] & glob->end_mask[word];
+		int bit;
+		for (bit = 63; bit >= 0 && bits; --bit)
+		{
+			if (!((bits >> bit) & 1))
+				continue;
+			int flags = glob->segments[word * 64 + bit].pattern_flags;
+			if (!(flags & skip_flags))
+				return flags;
+		}
+	}
+	return -1;
+}
+
+ZFSDEF zfs_bool zfs_glob_compile(ZFSGlob *glob, const char *const *patterns, int pattern_count)
+{
+	zfs__glob *g = (zfs__glob*)ZFS_MALLOC(sizeof(zfs__glob), ZFS_ALLOC_CONTEXT);
+	glob->handle = g;
+	if (!g)
+		return ZFS_FALSE;
+	memset(g, 0, sizeof(zfs__glob));
+
+	int i;
+	for (i = 0; i < pattern_count; ++i)
+	{
+		if (!zfs__glob_add(g, patterns[i], strlen(patterns[i])))
+			break;
+	}
+	if (i < pattern_count || !zfs__glob_finish(g))
+	{
+		zfs_glob_free(glob);
+		return ZFS_FALSE;
+	}
+	return ZFS_TRUE;
+}
+
+ZFSDEF void zfs_glob_free(ZFSGlob *glob)
+{
+	zfs__glob *g = (zfs__glob*)glob->handle;
+	if (!g)
+		return;
+	ZFS_FREE(g->segments, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(g->text, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(g->end_mask, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(g->sets, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(g->hashes, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(g->flags, ZFS_ALLOC_CONTEXT);
+	zfs__glob_table_free(&g->state_table);
+	zfs__glob_table_free(&g->text_table);
+	ZFS_FREE(g->suffix_lengths, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(g->classes, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(g->class_key, ZFS_ALLOC_CONTEXT);
+	zfs__glob_table_free(&g->class_table);
+	ZFS_FREE(g->transitions, ZFS_ALLOC_CONTEXT);
+	zfs__glob_table_free(&g->transition_table);
+	ZFS_FREE(g, ZFS_ALLOC_CONTEXT);
+	glob->handle = NULL;
+}
+
+ZFSDEF int zfs_glob_step(ZFSGlob *glob, int state, const char *name, int *next_state)
+{
+	zfs__glob *g = (zfs__glob*)glob->handle;
+	*next_state = 0;
+	if (state == 0)
+		return 0;
+
+	zfs_ll name_length = strlen(name);
+	int class_id = -1, next = -1;
+	unsigned long long hash = 0;
+	if (!(g->flags[state] & ZFS__GLOB_GENERIC_STATE))
+	{
+		// Without a class the step is only not cached
+		class_id = zfs__glob_classify(g, name, name_length);
+		hash = zfs__glob_hash_transition(state, class_id);
+		zfs_ll slot = -1;
+		int transition;
+		while (class_id >= 0 && (transition = zfs__glob_table_next(&g->transition_table, hash, &slot)) >= 0)
+		{
+			const int *t = g->transitions + transition * 3;
+			if (t[0] == state && t[1] == class_id)
+			{
+				next = t[2];
+				break;
+			}
+		}
+	}
+
+	if (next < 0)
+	{
+		memset(g->scratch, 0, g->words * sizeof(unsigned long long));
+		const unsigned long long *set = g->sets + state * g->words;
+		zfs_ll word;
+		for (word = 0; word < g->words; ++word)
+		{
+			unsigned long long bits = set[word];
+			zfs_ll position;
+			for (position = word * 64; bits; bits >>= 1, ++position)
+			{
+				if (!(bits & 1))
+					continue;
+				// "**" stays where it is, other segments move on when they match
+				const zfs__glob_segment *segment = &g->segments[position];
+				if (segment->kind == ZFS__GLOB_GLOBSTAR)
+					zfs__glob_close(g, g->scratch, position);
+				else if (segment->kind != ZFS__GLOB_END && zfs__glob_match_segment(g, segment, name, name_length))
+					zfs__glob_close(g, g->scratch, position + 1);
+			}
+		}
+		next = zfs__glob_intern(g, g->scratch);
+		if (next < 0)
+			return -1;
+
+		if (class_id >= 0 &&
+		    zfs__reserve((char**)&g->transitions, &g->transition_capacity, (g->transition_count + 1) * 3 * sizeof(int)) &&
+		    zfs__glob_table_insert(&g->transition_table, hash, g->transition_count))
+		{
+			int *t = g->transitions + g->transition_count++ * 3;
+			t[0] = state;
+			t[1] = class_id;
+			t[2] = next;
+		}
+	}
+	*next_state = next;
+	return (g->flags[next] & (ZFS_GLOB_MATCH | ZFS_GLOB_DESCEND));
+}
+
+ZFSDEF zfs_bool zfs_glob_match(ZFSGlob *glob, const char *path)
+{
+	char name[256];
+	int state = ZFS_GLOB_START, flags = 0;
+	while (*path)
+	{
+		zfs_ll length = 0;
+		while (path[length] && !zfs__is_dir_sep(path[length]))
+			++length;
+		if (length > 0 && !(length == 1 && path[0] == '.'))
+		{
+			// Longer than any name can be
+			if (length >= (zfs_ll)sizeof(name))
+				return ZFS_FALSE;
+			memcpy(name, path, length);
+			name[length] = '\0';
+			flags = zfs_glob_step(glob, state, name, &state);
+			if (flags <= 0)
+				return ZFS_FALSE;
+		}
+		path += length + (path[length] ? 1 : 0);
+	}
+	return ((flags & ZFS_GLOB_MATCH) != 0);
+}
+
+#if defined(ZFS_POSIX)
+// Set of directories by device and inode, to visit each directory once when following symlinks
+typedef struct zfs__inode_set
+{
+	dev_t *devices;
+	ino_t *inodes;
+	zfs_ll count;
+	zfs_ll capacity; // Power of two, 0 when empty
+} zfs__inode_set;
+
+static inline zfs_ll zfs__inode_hash(dev_t device, ino_t inode)
+{
+	unsigned long long hash = ((unsigned long long)inode ^ ((unsigned long long)device << 32)) * 0x9E3779B97F4A7C15ULL;
+	return (zfs_ll)(hash >> 16);
+}
+
+// Returns false if it was already in the set, or there was no memory for it
+static zfs_bool zfs__inode_set_insert(zfs__inode_set *set, dev_t device, ino_t inode)
+{
+	if ((set->count + 1) * 2 > set->capacity)
+	{
+		zfs__inode_set grown;
+		grown.count = 0;
+		grown.capacity = (set->capacity ? set->capacity * 2 : 64);
+		grown.devices = (dev_t*)ZFS_MALLOC(grown.capacity * sizeof(dev_t), ZFS_ALLOC_CONTEXT);
+		grown.inodes = (ino_t*)ZFS_MALLOC(grown.capacity * sizeof(ino_t), ZFS_ALLOC_CONTEXT);
+		if (!grown.devices || !grown.inodes)
+		{
+			ZFS_FREE(grown.devices, ZFS_ALLOC_CONTEXT);
+			ZFS_FREE(grown.inodes, ZFS_ALLOC_CONTEXT);
+			return ZFS_FALSE;
+		}
+		// Inode 0 marks free slots
+		memset(grown.inodes, 0, grown.capacity * sizeof(ino_t));
+		zfs_ll i;
+		for (i = 0; i < set->capacity; ++i)
+		{
+			if (set->inodes[i] != 0)
+				zfs__inode_set_insert(&grown, set->devices[i], set->inodes[i]);
+		}
+		ZFS_FREE(set->devices, ZFS_ALLOC_CONTEXT);
+		ZFS_FREE(set->inodes, ZFS_ALLOC_CONTEXT);
+		*set = grown;
+	}
+
+	zfs_ll mask = set->capacity - 1;
+	zfs_ll index = zfs__inode_hash(device, inode) & mask;
+	while (set->inodes[index] != 0)
+	{
+		if (set->inodes[index] == inode && set->devices[index] == device)
+			return ZFS_FALSE;
+		index = (index + 1) & mask;
+	}
+	set->devices[index] = device;
+	set->inodes[index] = inode;
+	++set->count;
+	return ZFS_TRUE;
+}
+
+static void zfs__inode_set_free(zfs__inode_set *set)
+{
+	ZFS_FREE(set->devices, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(set->inodes, ZFS_ALLOC_CONTEXT);
+	memset(set, 0, sizeof(zfs__inode_set));
+}
+
+// Buffer per level of the serial walk, smaller than ZFS_DIRECTORY_BUFFER_SIZE as deep trees have many levels
+#define ZFS__WALK_LEVEL_BUFFER_SIZE 8192
+#define ZFS__WALK_LEVEL_ENTRIES 64
+
+typedef struct zfs__walk_level
+{
+	ZFSDirBatch batch;
+	ZFSDirEntry entries[ZFS__WALK_LEVEL_ENTRIES];
+	int count;
+	int index;
+	char *buffer;       // Kept for the next directory at this level
+	zfs_ll base;        // Length of the path of this directory including the trailing /
+	zfs_ll name_offset; // Where the name of this directory starts in the path
+	int glob_state;     // Where options->glob is for the entries of this directory
+	zfs_bool matched;   // Whether the callbacks see this directory
+	ZFSGlob ignore;     // Rules of the ignore file in this directory, the handle is NULL without one
+	zfs_ll ignore_base; // Where the states of the ignore files that apply here start in the walk's stack
+	int ignore_count;   // Ignore files that apply to the entries of this directory
+} zfs__walk_level;
+
+// Opens a directory relative to 'dir_fd', and checks that it is not in 'visited' yet if it is not NULL.
+// Returns -1 with 'error' set if it failed.
+static int zfs__walk_open(int dir_fd, const char *name, zfs_bool follow, zfs__inode_set *visited, int *error)
+{
+	int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (follow ? 0 : O_NOFOLLOW));
+	if (fd < 0)
+	{
+		*error = errno;
+		return -1;
+	}
+	if (visited)
+	{
+		struct stat buf;
+		if (fstat(fd, &buf) != 0)
+			*error = errno;
+		else if (!zfs__inode_set_insert(visited, buf.st_dev, buf.st_ino))
+			*error = ELOOP;
+		else
+			return fd;
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Starts reading 'fd' at 'depth', allocating the level if it is new
+static zfs_bool zfs__walk_push(zfs__walk_level **levels, zfs_ll *level_capacity, int *level_count, int depth, int fd)
+{
+	if (depth >= *level_count)
+	{
+		if (!zfs__reserve((char**)levels, level_capacity, (depth + 1) * sizeof(zfs__walk_level)))
+		{
+			close(fd);
+			return ZFS_FALSE;
+		}
+		(*levels)[depth].buffer = (char*)ZFS_MALLOC(ZFS__WALK_LEVEL_BUFFER_SIZE, ZFS_ALLOC_CONTEXT);
+		if (!(*levels)[depth].buffer)
+		{
+			close(fd);
+			return ZFS_FALSE;
+		}
+		*level_count = depth + 1;
+	}
+	zfs__walk_level *level = &(*levels)[depth];
+	level->count = 0;
+	level->index = 0;
+	level->ignore.handle = NULL;
+	return zfs_directory_batch_begin_fd(&level->batch, fd, level->buffer, ZFS__WALK_LEVEL_BUFFER_SIZE);
+}
+
+// Ignore rules are glob patterns, with these flags on their end markers
+enum
+{
+	ZFS__IGNORE_NEGATED = 1<<0,   // "!pattern"
+	ZFS__IGNORE_DIRECTORY = 1<<1, // "pattern/"
+};
+
+// Adds the rules of an ignore file to 'glob'
+static zfs_bool zfs__ignore_parse(zfs__glob *glob, const char *text, zfs_ll size, char *pattern)
+{
+	const char *line = text, *text_end = text + size;
+	for (; line < text_end; ++line)
+	{
+		const char *line_end = line;
+		while (line_end < text_end && *line_end != '\n')
+			++line_end;
+		zfs_ll length = line_end - line;
+		const char *rule = line;
+		line = line_end;
+
+		// Trailing spaces are trimmed unless escaped
+		if (length > 0 && rule[length - 1] == '\r')
+			--length;
+		while (length > 0 && rule[length - 1] == ' ' && !(length > 1 && rule[length - 2] == '\\'))
+			--length;
+		if (length == 0 || rule[0] == '#')
+			continue;
+
+		int flags = 0;
+		if (rule[0] == '!')
+		{
+			flags |= ZFS__IGNORE_NEGATED;
+			++rule;
+			--length;
+		}
+		if (length > 0 && rule[length - 1] == '/')
+		{
+			flags |= ZFS__IGNORE_DIRECTORY;
+			--length;
+		}
+		if (length == 0)
+			continue;
+
+		// Rules without a "/" match names at any depth, "dir/**" matches what is in 'dir' but not 'dir'
+		zfs_ll pattern_length = 0;
+		if (!memchr(rule, '/', length))
+		{
+			memcpy(pattern, "**/", 3);
+			pattern_length = 3;
+		}
+		else if (rule[0] == '/')
+		{
+			++rule;
+			--length;
+		}
+		memcpy(pattern + pattern_length, rule, length);
+		pattern_length += length;
+		if (length >= 3 && memcmp(rule + length - 3, "/**", 3) == 0)
+		{
+			memcpy(pattern + pattern_length - 2, "*/**", 4);
+			pattern_length += 2;
+		}
+
+		zfs_ll first = glob->segment_count, i;
+		if (!zfs__glob_add(glob, pattern, pattern_length))
+			return ZFS_FALSE;
+		for (i = first; i < glob->segment_count; ++i)
+		{
+			if (glob->segments[i].kind == ZFS__GLOB_END)
+				glob->segments[i].pattern_flags = flags;
+		}
+	}
+	return ZFS_TRUE;
+}
+
+// Loads the ignore file 'name' in 'dir_fd', one pattern per rule.
+// Leaves the handle NULL if there is no such file, it has no rules or there was no memory.
+static void zfs__ignore_load(ZFSGlob *ignore, int dir_fd, const char *name)
+{
+	ignore->handle = NULL;
+	int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	struct stat buf;
+	char *text = NULL;
+	zfs_ll size = 0;
+	if (fstat(fd, &buf) == 0 && buf.st_size > 0)
+	{
+		// The text, then room for the longest pattern a line can turn into
+		text = (char*)ZFS_MALLOC(buf.st_size * 2 + 8, ZFS_ALLOC_CONTEXT);
+		ssize_t result = 1;
+		while (text && size < buf.st_size && (result = read(fd, text + size, buf.st_size - size)) > 0)
+			size += result;
+	}
+	close(fd);
+
+	zfs__glob *g = (size > 0 ? (zfs__glob*)ZFS_MALLOC(sizeof(zfs__glob), ZFS_ALLOC_CONTEXT) : NULL);
+	if (g)
+	{
+		memset(g, 0, sizeof(zfs__glob));
+		ignore->handle = g;
+		if (!zfs__ignore_parse(g, text, size, text + size) || g->segment_count == 0 || !zfs__glob_finish(g))
+			zfs_glob_free(ignore);
+	}
+	ZFS_FREE(text, ZFS_ALLOC_CONTEXT);
+}
+
+// Loads the ignore file of the directory at 'depth'. Its parent left the states of its own ignore files
+// for this directory right after them, where the states of this level start.
+static zfs_bool zfs__walk_load_ignore(zfs__walk_level *levels, int depth, const char *ignore_file, int **states, zfs_ll *states_capacity)
+{
+	zfs__walk_level *level = &levels[depth];
+	level->ignore_base = (depth > 0 ? levels[depth - 1].ignore_base + levels[depth - 1].ignore_count : 0);
+	level->ignore_count = (depth > 0 ? levels[depth - 1].ignore_count : 0);
+	if (!ignore_file)
+		return ZFS_TRUE;
+	zfs__ignore_load(&level->ignore, level->batch.fd, ignore_file);
+	if (!level->ignore.handle)
+		return ZFS_TRUE;
+	if (!zfs__reserve((char**)states, states_capacity, (level->ignore_base + level->ignore_count + 1) * sizeof(int)))
+		return ZFS_FALSE;
+	(*states)[level->ignore_base + level->ignore_count++] = ZFS_GLOB_START;
+	return ZFS_TRUE;
+}
+
+ZFSDEF zfs_bool zfs_walk(const char *path, const ZFSWalkOptions *options)
+{
+	zfs__inode_set visited;
+	memset(&visited, 0, sizeof(visited));
+
+	zfs_bool follow = ((options->flags & ZFS_WALK_FOLLOW_SYMLINKS) != 0);
+	int error = 0;
+	int root = zfs__walk_open(AT_FDCWD, path, ZFS_TRUE, follow ? &visited : NULL, &error);
+
+	zfs__walk_level *levels = NULL;
+	zfs_ll level_capacity = 0;
+	int level_count = 0;
+	char *entry_path = NULL;
+	zfs_ll path_capacity = 0;
+	int *ignore_states = NULL;
+	zfs_ll ignore_capacity = 0;
+	int depth = 0;
+	zfs_bool out_of_memory = ZFS_FALSE;
+	if (root < 0 || !zfs__walk_push(&levels, &level_capacity, &level_count, 0, root))
+	{
+		ZFS_FREE(levels, ZFS_ALLOC_CONTEXT);
+		zfs__inode_set_free(&visited);
+		return ZFS_FALSE;
+	}
+	levels[0].base = 0;
+	levels[0].name_offset = 0;
+	levels[0].glob_state = ZFS_GLOB_START;
+	zfs_bool ok = zfs__walk_load_ignore(levels, 0, options->ignore_file, &ignore_states, &ignore_capacity);
+
+	ZFSWalkEntry entry;
+	while (ok && depth >= 0)
+	{
+		zfs__walk_level *level = &levels[depth];
+		if (level->index == level->count)
+		{
+			level->count = zfs_directory_batch_next(&level->batch, level->entries, ZFS__WALK_LEVEL_ENTRIES);
+			level->index = 0;
+		}
+		if (level->count <= 0)
+		{
+			// Ending the batch closes the directory, which can change errno
+			int read_error = (level->count < 0 ? errno : 0);
+			zfs_directory_batch_end(&level->batch);
+			zfs_glob_free(&level->ignore);
+			--depth;
+			if (depth >= 0 && options->post && level->matched)
+			{
+				// The entry for this directory, in its parent
+				entry.path_length = level->base - 1;
+				entry_path[entry.path_length] = '\0';
+				entry.path = entry_path;
+				entry.name = entry_path + level->name_offset;
+				entry.depth = depth + 1;
+				entry.type = ZFS_TYPE_DIRECTORY;
+				entry.dir_fd = levels[depth].batch.fd;
+				entry.error = read_error;
+				if (options->post(&entry, options->user_data) == ZFS_WALK_STOP)
+					break;
+			}
+			continue;
+		}
+		const ZFSDirEntry *dir_entry = &level->entries[level->index++];
+
+		zfs_ll name_length = strlen(dir_entry->name);
+		if (!zfs__reserve(&entry_path, &path_capacity, level->base + name_length + 2))
+		{
+			ok = ZFS_FALSE;
+			break;
+		}
+		memcpy(entry_path + level->base, dir_entry->name, name_length + 1);
+
+		entry.path = entry_path;
+		entry.name = entry_path + level->base;
+		entry.path_length = level->base + name_length;
+		entry.depth = depth + 1;
+		entry.type = dir_entry->type;
+		entry.dir_fd = level->batch.fd;
+		entry.error = 0;
+
+		// Only stat when the directory did not tell, or when a symlink should be followed
+		if (entry.type == ZFS_TYPE_UNKNOWN || (entry.type == ZFS_TYPE_SYMLINK && follow))
+		{
+			struct stat buf;
+			if (fstatat(entry.dir_fd, entry.name, &buf, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0)
+				entry.type = zfs__type_from_mode(buf.st_mode);
+		}
+
+		// The deepest ignore file with a matching rule decides. Every file is stepped either way, which leaves
+		// their states for the entries of this one after the current states.
+		if (level->ignore_count > 0)
+		{
+			if (!zfs__reserve((char**)&ignore_states, &ignore_capacity, (level->ignore_base + level->ignore_count * 2) * sizeof(int)))
+			{
+				ok = ZFS_FALSE;
+				break;
+			}
+			int *states = ignore_states + level->ignore_base;
+			int i, j = level->ignore_count, rule = -1;
+			for (i = depth; i >= 0; --i)
+			{
+				if (!levels[i].ignore.handle)
+					continue;
+				--j;
+				if (zfs_glob_step(&levels[i].ignore, states[j], entry.name, &states[level->ignore_count + j]) < 0)
+					break;
+				if (rule < 0)
+					rule = zfs__glob_last_match((zfs__glob*)levels[i].ignore.handle, states[level->ignore_count + j], (entry.type == ZFS_TYPE_DIRECTORY ? 0 : ZFS__IGNORE_DIRECTORY));
+			}
+			if (i >= 0)
+			{
+				ok = ZFS_FALSE;
+				break;
+			}
+			if (rule >= 0 && !(rule & ZFS__IGNORE_NEGATED))
+				continue;
+		}
+
+		// Entries the glob does not match are not seen, and directories it can not match under are not entered
+		int glob_flags = ZFS_GLOB_MATCH | ZFS_GLOB_DESCEND, glob_state = 0;
+		if (options->glob && (glob_flags = zfs_glob_step(options->glob, level->glob_state, entry.name, &glob_state)) < 0)
+		{
+			ok = ZFS_FALSE;
+			break;
+		}
+		zfs_bool matched = ((glob_flags & ZFS_GLOB_MATCH) != 0);
+
+		ZFSWalkAction action = ((options->pre && matched) ? options->pre(&entry, options->user_data) : ZFS_WALK_CONTINUE);
+		if (action == ZFS_WALK_STOP)
+			break;
+		if (entry.type != ZFS_TYPE_DIRECTORY || action == ZFS_WALK_SKIP || !(glob_flags & ZFS_GLOB_DESCEND))
+			continue;
+
+		int fd = -1;
+		if (options->max_depth <= 0 || entry.depth < options->max_depth)
+			fd = zfs__walk_open(entry.dir_fd, entry.name, follow, follow ? &visited : NULL, &entry.error);
+		zfs_ll name_offset = level->base;
+		if (fd >= 0)
+		{
+			if (zfs__walk_push(&levels, &level_capacity, &level_count, depth + 1, fd))
+			{
+				++depth;
+				levels[depth].base = entry.path_length + 1;
+				levels[depth].name_offset = name_offset;
+				levels[depth].glob_state = glob_state;
+				levels[depth].matched = matched;
+				entry_path[entry.path_length] = '/';
+				ok = zfs__walk_load_ignore(levels, depth, options->ignore_file, &ignore_states, &ignore_capacity);
+				continue;
+			}
+			entry.error = ENOMEM;
+			out_of_memory = ZFS_TRUE;
+		}
+		if (options->post && matched && options->post(&entry, options->user_data) == ZFS_WALK_STOP)
+			break;
+	}
+
+	// Stopped early
+	for (; depth >= 0; --depth)
+	{
+		zfs_directory_batch_end(&levels[depth].batch);
+		zfs_glob_free(&levels[depth].ignore);
+	}
+
+	int i;
+	for (i = 0; i < level_count; ++i)
+		ZFS_FREE(levels[i].buffer, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(levels, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(entry_path, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(ignore_states, ZFS_ALLOC_CONTEXT);
+	zfs__inode_set_free(&visited);
+	return (ok && !out_of_memory);
+}
+
+// Thread pool with one work-stealing deque per worker. Workers push and pop their own tasks
+// last in first out, which keeps the working set small, and steal the oldest task of another
+// worker when they run out, which is usually the largest amount of work.
+typedef struct zfs__task zfs__task;
+typedef struct zfs__pool zfs__pool;
+
+struct zfs__task
+{
+	void (*run)(zfs__pool *pool, zfs__task *task, int worker);
+	void (*discard)(zfs__pool *pool, zfs__task *task); // Called instead of run for tasks left after a stop
+};
+
+typedef struct zfs__deque
+{
+	pthread_mutex_t lock;
+	zfs__task **tasks;
+	zfs_ll capacity; // Power of two
+	zfs_ll top;      // Stolen from here
+	zfs_ll bottom;   // Pushed and popped here by the owner
+	char padding[64]; // Keep workers' deques out of each other's cache lines
+} zfs__deque;
+
+struct zfs__pool
+{
+	zfs__deque *deques;
+	int worker_count;
+	void (*idle)(zfs__pool *pool, int worker); // Called before a worker waits for work and before it exits
+	void *user_data;
+
+	zfs_ll pending; // Queued and running tasks
+	zfs_ll queued;
+	int idle_count;
+	int stop;
+
+	pthread_mutex_t idle_lock;
+	pthread_cond_t work;
+};
+
+typedef struct zfs__pool_thread
+{
+	zfs__pool *pool;
+	int worker;
+	pthread_t thread;
+} zfs__pool_thread;
+
+static zfs_bool zfs__pool_begin(zfs__pool *pool, int worker_count, void *user_data)
+{
+	memset(pool, 0, sizeof(zfs__pool));
+	pool->deques = (zfs__deque*)ZFS_MALLOC(worker_count * sizeof(zfs__deque), ZFS_ALLOC_CONTEXT);
+	if (!pool->deques)
+		return ZFS_FALSE;
+	memset(pool->deques, 0, worker_count * sizeof(zfs__deque));
+	int i;
+	for (i = 0; i < worker_count; ++i)
+		pthread_mutex_init(&pool->deques[i].lock, NULL);
+	pool->worker_count = worker_count;
+	pool->user_data = user_data;
+	pthread_mutex_init(&pool->idle_lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	return ZFS_TRUE;
+}
+
+// Discards tasks left after a stop
+static void zfs__pool_end(zfs__pool *pool)
+{
+	int i;
+	for (i = 0; i < pool->worker_count; ++i)
+	{
+		zfs__deque *deque = &pool->deques[i];
+		while (deque->top < deque->bottom)
+		{
+			zfs__task *task = deque->tasks[deque->top++ & (deque->capacity - 1)];
+			task->discard(pool, task);
+		}
+		ZFS_FREE(deque->tasks, ZFS_ALLOC_CONTEXT);
+		pthread_mutex_destroy(&deque->lock);
+	}
+	ZFS_FREE(pool->deques, ZFS_ALLOC_CONTEXT);
+	pthread_mutex_destroy(&pool->idle_lock);
+	pthread_cond_destroy(&pool->work);
+}
+
+static void zfs__pool_stop(zfs__pool *pool)
+{
+	pthread_mutex_lock(&pool->idle_lock);
+	__atomic_store_n(&pool->stop, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->idle_lock);
+}
+
+// Returns false if there was no memory for the task, then it has not been queued
+static zfs_bool zfs__pool_push(zfs__pool *pool, int worker, zfs__task *task)
+{
+	zfs__deque *deque = &pool->deques[worker];
+	pthread_mutex_lock(&deque->lock);
+	if (deque->bottom - deque->top == deque->capacity)
+	{
+		zfs_ll capacity = (deque->capacity ? deque->capacity * 2 : 64);
+		zfs__task **tasks = (zfs__task**)ZFS_MALLOC(capacity * sizeof(zfs__task*), ZFS_ALLOC_CONTEXT);
+		if (!tasks)
+		{
+			pthread_mutex_unlock(&deque->lock);
+			return ZFS_FALSE;
+		}
+		zfs_ll i;
+		for (i = deque->top; i < deque->bottom; ++i)
+			tasks[i & (capacity - 1)] = deque->tasks[i & (deque->capacity - 1)];
+		ZFS_FREE(deque->tasks, ZFS_ALLOC_CONTEXT);
+		deque->tasks = tasks;
+		deque->capacity = capacity;
+	}
+	// Counted before it can be taken, so 'pending' cannot reach 0 while the pusher's task runs
+	__atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+	deque->tasks[deque->bottom & (deque->capacity - 1)] = task;
+	__atomic_store_n(&deque->bottom, deque->bottom + 1, __ATOMIC_RELAXED); // Thieves peek at it without the lock
+	pthread_mutex_unlock(&deque->lock);
+
+	if (__atomic_load_n(&pool->idle_count, __ATOMIC_SEQ_CST) > 0)
+	{
+		pthread_mutex_lock(&pool->idle_lock);
+		pthread_cond_signal(&pool->work);
+		pthread_mutex_unlock(&pool->idle_lock);
+	}
+	return ZFS_TRUE;
+}
+
+static zfs__task *zfs__pool_take(zfs__pool *pool, int worker)
+{
+	zfs__task *task = NULL;
+	zfs__deque *deque = &pool->deques[worker];
+	pthread_mutex_lock(&deque->lock);
+	if (deque->top < deque->bottom)
+	{
+		__atomic_store_n(&deque->bottom, deque->bottom - 1, __ATOMIC_RELAXED);
+		task = deque->tasks[deque->bottom & (deque->capacity - 1)];
+	}
+	pthread_mutex_unlock(&deque->lock);
+
+	int i;
+	for (i = 1; !task && i < pool->worker_count; ++i)
+	{
+		deque = &pool->deques[(worker + i) % pool->worker_count];
+		if (__atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) == __atomic_load_n(&deque->top, __ATOMIC_RELAXED))
+			continue;
+		pthread_mutex_lock(&deque->lock);
+		if (deque->top < deque->bottom)
+		{
+			task = deque->tasks[deque->top & (deque->capacity - 1)];
+			__atomic_store_n(&deque->top, deque->top + 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&deque->lock);
+	}
+
+	if (task)
+		__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+	return task;
+}
+
+static void zfs__pool_work(zfs__pool *pool, int worker)
+{
+	for (;;)
+	{
+		zfs__task *task = NULL;
+		if (!__atomic_load_n(&pool->stop, __ATOMIC_SEQ_CST))
+			task = zfs__pool_take(pool, worker);
+		if (task)
+		{
+			task->run(pool, task, worker);
+			if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0)
+			{
+				pthread_mutex_lock(&pool->idle_lock);
+				pthread_cond_broadcast(&pool->work);
+				pthread_mutex_unlock(&pool->idle_lock);
+			}
+			continue;
+		}
+
+		if (pool->idle)
+			pool->idle(pool, worker);
+
+		// Pushers only wake workers they see as idle, so become idle before checking for work
+		pthread_mutex_lock(&pool->idle_lock);
+		__atomic_add_fetch(&pool->idle_count, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) > 0 && !__atomic_load_n(&pool->stop, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&pool->work, &pool->idle_lock);
+		__atomic_sub_fetch(&pool->idle_count, 1, __ATOMIC_SEQ_CST);
+		zfs_bool done = (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0 || __atomic_load_n(&pool->stop, __ATOMIC_SEQ_CST));
+		pthread_mutex_unlock(&pool->idle_lock);
+		if (done)
+			break;
+	}
+}
+
+static void *zfs__pool_thread_proc(void *arg)
+{
+	zfs__pool_thread *thread = (zfs__pool_thread*)arg;
+	zfs__pool_work(thread->pool, thread->worker);
+	return NULL;
+}
+
+// Runs until all tasks are done or the pool is stopped. The calling thread is worker 0.
+static void zfs__pool_run(zfs__pool *pool)
+{
+	zfs__pool_thread *threads = NULL;
+	if (pool->worker_count > 1)
+		threads = (zfs__pool_thread*)ZFS_MALLOC(pool->worker_count * sizeof(zfs__pool_thread), ZFS_ALLOC_CONTEXT);
+
+	int started = 1;
+	if (threads)
+	{
+		// With fewer threads than deques, the other workers steal what is left in the empty ones
+		for (; started < pool->worker_count; ++started)
+		{
+			threads[started].pool = pool;
+			threads[started].worker = started;
+			if (pthread_create(&threads[started].thread, NULL, zfs__pool_thread_proc, &threads[started]) != 0)
+				break;
+		}
+	}
+
+	zfs__pool_work(pool, 0);
+
+	int i;
+	for (i = 1; i < started; ++i)
+		pthread_join(threads[i].thread, NULL);
+	ZFS_FREE(threads, ZFS_ALLOC_CONTEXT);
+}
+
+static int zfs__cpu_count(void)
+{
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return (count > 0 ? (int)count : 1);
+}
+
+// Parallel walk
+// Directories are queued with their fd open, so they are opened relative to their parent.
+// Past this many, directories are queued by path and opened relative to the root instead.
+#define ZFS__WALK_MAX_QUEUED_FDS 256
+
+typedef struct zfs__walk_task
+{
+	zfs__task task;
+	int fd;    // -1 to open 'path' relative to the root
+	int depth; // Depth of the directory itself, 0 for the root
+	zfs_ll path_length;
+	char path[1];
+} zfs__walk_task;
+
+typedef struct zfs__walk_worker
+{
+	ZFSWalkEntry *entries;
+	zfs_ll *path_offsets;
+	int count;
+	char *paths; // The paths of the batch, 'entries' point into it once the batch is full
+	zfs_ll paths_size;
+	zfs_ll paths_capacity;
+	char *scratch; // Path of the current entry
+	zfs_ll scratch_capacity;
+	char *buffer;  // For reading directories, ZFS_DIRECTORY_BUFFER_SIZE bytes
+	ZFSDirEntry dir_entries[ZFS__WALK_LEVEL_ENTRIES];
+	char padding[64];
+} zfs__walk_worker;
+
+typedef struct zfs__parallel_walk
+{
+	const ZFSParallelWalkOptions *options;
+	int root_fd;
+	int batch_size;
+	zfs__walk_worker *workers;
+	int queued_fds;
+	int failed;
+
+	pthread_mutex_t visited_lock;
+	zfs__inode_set visited;
+} zfs__parallel_walk;
+
+// Returns an fd, or -1 if it could not be opened or was visited already
+static int zfs__parallel_walk_open(zfs__parallel_walk *walk, int dir_fd, const char *name)
+{
+	zfs_bool follow = ((walk->options->flags & ZFS_WALK_FOLLOW_SYMLINKS) != 0);
+	int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | (follow ? 0 : O_NOFOLLOW));
+	if (fd >= 0 && follow)
+	{
+		struct stat buf;
+		zfs_bool first = ZFS_FALSE;
+		if (fstat(fd, &buf) == 0)
+		{
+			pthread_mutex_lock(&walk->visited_lock);
+			first = zfs__inode_set_insert(&walk->visited, buf.st_dev, buf.st_ino);
+			pthread_mutex_unlock(&walk->visited_lock);
+		}
+		if (!first)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+	return fd;
+}
+
+static void zfs__parallel_walk_flush(zfs__pool *pool, int worker)
+{
+	zfs__parallel_walk *walk = (zfs__parallel_walk*)pool->user_data;
+	zfs__walk_worker *w = &walk->workers[worker];
+	if (w->count == 0)
+		return;
+
+	int i;
+	for (i = 0; i < w->count; ++i)
+	{
+		ZFSWalkEntry *entry = &w->entries[i];
+		entry->path = w->paths + w->path_offsets[i];
+		entry->name = strrchr(entry->path, '/');
+		entry->name = (entry->name ? entry->name + 1 : entry->path);
+	}
+	if (!__atomic_load_n(&pool->stop, __ATOMIC_SEQ_CST) && walk->options->batch(w->entries, w->count, walk->options->user_data) == ZFS_WALK_STOP)
+		zfs__pool_stop(pool);
+	w->count = 0;
+	w->paths_size = 0;
+}
+
+static void zfs__parallel_walk_discard(zfs__pool *pool, zfs__task *task)
+{
+	zfs__parallel_walk *walk = (zfs__parallel_walk*)pool->user_data;
+	zfs__walk_task *walk_task = (zfs__walk_task*)task;
+	if (walk_task->fd >= 0)
+	{
+		close(walk_task->fd);
+		__atomic_sub_fetch(&walk->queued_fds, 1, __ATOMIC_RELAXED);
+	}
+	ZFS_FREE(walk_task, ZFS_ALLOC_CONTEXT);
+}
+
+static void zfs__parallel_walk_run(zfs__pool *pool, zfs__task *task, int worker)
+{
+	zfs__parallel_walk *walk = (zfs__parallel_walk*)pool->user_data;
+	const ZFSParallelWalkOptions *options = walk->options;
+	zfs__walk_worker *w = &walk->workers[worker];
+	zfs__walk_task *walk_task = (zfs__walk_task*)task;
+	zfs_bool follow = ((options->flags & ZFS_WALK_FOLLOW_SYMLINKS) != 0);
+
+	int fd = walk_task->fd;
+	if (fd >= 0)
+		__atomic_sub_fetch(&walk->queued_fds, 1, __ATOMIC_RELAXED);
+	else
+		fd = zfs__parallel_walk_open(walk, walk->root_fd, walk_task->path);
+	ZFSDirBatch batch;
+	if (!zfs_directory_batch_begin_fd(&batch, fd, w->buffer, ZFS_DIRECTORY_BUFFER_SIZE))
+	{
+		ZFS_FREE(walk_task, ZFS_ALLOC_CONTEXT);
+		return;
+	}
+
+	// Entries in the root have no leading /
+	zfs_ll base = walk_task->path_length + (walk_task->path_length > 0 ? 1 : 0);
+	zfs_bool ok = zfs__reserve(&w->scratch, &w->scratch_capacity, base + 1);
+	if (ok)
+	{
+		memcpy(w->scratch, walk_task->path, walk_task->path_length);
+		if (base > 0)
+			w->scratch[base - 1] = '/';
+	}
+
+	int count = 0, index = 0;
+	while (ok && !__atomic_load_n(&pool->stop, __ATOMIC_RELAXED))
+	{
+		if (index == count)
+		{
+			count = zfs_directory_batch_next(&batch, w->dir_entries, ZFS__WALK_LEVEL_ENTRIES);
+			index = 0;
+			if (count <= 0)
+				break;
+		}
+		const ZFSDirEntry *dir_entry = &w->dir_entries[index++];
+
+		zfs_ll name_length = strlen(dir_entry->name);
+		zfs_ll path_length = base + name_length;
+		ok = (zfs__reserve(&w->scratch, &w->scratch_capacity, path_length + 1) && zfs__reserve(&w->paths, &w->paths_capacity, w->paths_size + path_length + 1));
+		if (!ok)
+			break;
+		memcpy(w->scratch + base, dir_entry->name, name_length + 1);
+
+		ZFSWalkEntry entry;
+		entry.path = w->scratch;
+		entry.name = w->scratch + base;
+		entry.path_length = path_length;
+		entry.depth = walk_task->depth + 1;
+		entry.type = dir_entry->type;
+		entry.dir_fd = batch.fd;
+		entry.error = 0;
+		if (entry.type == ZFS_TYPE_UNKNOWN || (entry.type == ZFS_TYPE_SYMLINK && follow))
+		{
+			struct stat buf;
+			if (fstatat(entry.dir_fd, entry.name, &buf, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0)
+				entry.type = zfs__type_from_mode(buf.st_mode);
+		}
+
+		if (entry.type == ZFS_TYPE_DIRECTORY && (options->max_depth <= 0 || entry.depth < options->max_depth))
+		{
+			ZFSWalkAction action = (options->filter ? options->filter(&entry, options->user_data) : ZFS_WALK_CONTINUE);
+			if (action == ZFS_WALK_STOP)
+			{
+				zfs__pool_stop(pool);
+				break;
+			}
+			zfs__walk_task *child = NULL;
+			if (action == ZFS_WALK_CONTINUE)
+				child = (zfs__walk_task*)ZFS_MALLOC(sizeof(zfs__walk_task) + path_length, ZFS_ALLOC_CONTEXT);
+			if (child)
+			{
+				child->task.run = zfs__parallel_walk_run;
+				child->task.discard = zfs__parallel_walk_discard;
+				child->fd = -1;
+				child->depth = entry.depth;
+				child->path_length = path_length;
+				memcpy(child->path, entry.path, path_length + 1);
+				if (__atomic_add_fetch(&walk->queued_fds, 1, __ATOMIC_RELAXED) <= ZFS__WALK_MAX_QUEUED_FDS)
+				{
+					child->fd = zfs__parallel_walk_open(walk, entry.dir_fd, entry.name);
+					if (child->fd < 0)
+					{
+						// Unreadable, or a loop
+						__atomic_sub_fetch(&walk->queued_fds, 1, __ATOMIC_RELAXED);
+						ZFS_FREE(child, ZFS_ALLOC_CONTEXT);
+						child = NULL;
+						action = ZFS_WALK_SKIP;
+					}
+				}
+				else
+				{
+					__atomic_sub_fetch(&walk->queued_fds, 1, __ATOMIC_RELAXED);
+				}
+			}
+			if (child && !zfs__pool_push(pool, worker, &child->task))
+			{
+				zfs__parallel_walk_discard(pool, &child->task);
+				child = NULL;
+			}
+			if (!child && action == ZFS_WALK_CONTINUE)
+				__atomic_store_n(&walk->failed, 1, __ATOMIC_RELAXED);
+		}
+
+		// Add to the batch, 'path' and 'name' are set when it is flushed, as 'paths' can move until then
+		memcpy(w->paths + w->paths_size, entry.path, path_length + 1);
+		w->path_offsets[w->count] = w->paths_size;
+		entry.path = NULL;
+		entry.name = NULL;
+		entry.dir_fd = -1;
+		w->entries[w->count++] = entry;
+		w->paths_size += path_length + 1;
+		if (w->count == walk->batch_size)
+			zfs__parallel_walk_flush(pool, worker);
+	}
+
+	if (!ok)
+		__atomic_store_n(&walk->failed, 1, __ATOMIC_RELAXED);
+	zfs_directory_batch_end(&batch);
+	ZFS_FREE(walk_task, ZFS_ALLOC_CONTEXT);
+}
+
+ZFSDEF zfs_bool zfs_walk_parallel(const char *path, const ZFSParallelWalkOptions *options)
+{
+	zfs__parallel_walk walk;
+	memset(&walk, 0, sizeof(walk));
+	walk.options = options;
+	walk.batch_size = (options->batch_size > 0 ? options->batch_size : ZFS_WALK_BATCH_SIZE);
+	pthread_mutex_init(&walk.visited_lock, NULL);
+
+	int thread_count = (options->thread_count > 0 ? options->thread_count : zfs__cpu_count());
+	zfs__walk_task *root = (zfs__walk_task*)ZFS_MALLOC(sizeof(zfs__walk_task), ZFS_ALLOC_CONTEXT);
+	walk.workers = (zfs__walk_worker*)ZFS_MALLOC(thread_count * sizeof(zfs__walk_worker), ZFS_ALLOC_CONTEXT);
+	walk.root_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	zfs__pool pool;
+	zfs_bool ok = (root && walk.workers && walk.root_fd >= 0 && zfs__pool_begin(&pool, thread_count, &walk));
+	if (ok)
+	{
+		memset(walk.workers, 0, thread_count * sizeof(zfs__walk_worker));
+		int i;
+		for (i = 0; i < thread_count; ++i)
+		{
+			walk.workers[i].entries = (ZFSWalkEntry*)ZFS_MALLOC(walk.batch_size * sizeof(ZFSWalkEntry), ZFS_ALLOC_CONTEXT);
+			walk.workers[i].path_offsets = (zfs_ll*)ZFS_MALLOC(walk.batch_size * sizeof(zfs_ll), ZFS_ALLOC_CONTEXT);
+			walk.workers[i].buffer = (char*)ZFS_MALLOC(ZFS_DIRECTORY_BUFFER_SIZE, ZFS_ALLOC_CONTEXT);
+			if (!walk.workers[i].entries || !walk.workers[i].path_offsets || !walk.workers[i].buffer)
+				ok = ZFS_FALSE;
+		}
+
+		root->task.run = zfs__parallel_walk_run;
+		root->task.discard = zfs__parallel_walk_discard;
+		root->fd = zfs__parallel_walk_open(&walk, walk.root_fd, ".");
+		root->depth = 0;
+		root->path_length = 0;
+		root->path[0] = '\0';
+		walk.queued_fds = 1;
+		if (ok && root->fd >= 0 && zfs__pool_push(&pool, 0, &root->task))
+		{
+			root = NULL;
+			pool.idle = zfs__parallel_walk_flush;
+			zfs__pool_run(&pool);
+		}
+		else
+		{
+			ok = ZFS_FALSE;
+			if (root->fd >= 0)
+				close(root->fd);
+		}
+		zfs__pool_end(&pool);
+
+		for (i = 0; i < thread_count; ++i)
+		{
+			ZFS_FREE(walk.workers[i].entries, ZFS_ALLOC_CONTEXT);
+			ZFS_FREE(walk.workers[i].path_offsets, ZFS_ALLOC_CONTEXT);
+			ZFS_FREE(walk.workers[i].paths, ZFS_ALLOC_CONTEXT);
+			ZFS_FREE(walk.workers[i].scratch, ZFS_ALLOC_CONTEXT);
+			ZFS_FREE(walk.workers[i].buffer, ZFS_ALLOC_CONTEXT);
+		}
+	}
+
+	if (walk.root_fd >= 0)
+		close(walk.root_fd);
+	ZFS_FREE(root, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(walk.workers, ZFS_ALLOC_CONTEXT);
+	zfs__inode_set_free(&walk.visited);
+	pthread_mutex_destroy(&walk.visited_lock);
+	return (ok && !walk.failed);
+}
+
+#ifndef Z_FS_NO_FILE
+// Tree copy
+// Directories are tasks that create their subdirectories and queue them, and queue their files in
+// batches. A directory keeps its fds open until every task under it is done, then gets its permissions
+// and times, which writing its entries would have changed.
+typedef struct zfs__copy_directory zfs__copy_directory;
+
+struct zfs__copy_directory
+{
+	zfs__task task;
+	zfs__copy_directory *parent;
+	int source_fd;      // -1 until the task runs, except for the root
+	int destination_fd;
+	int pending;        // This directory's own task and the unfinished tasks under it
+	zfs_bool listed;    // 'st' is set and the permissions and times are copied when it is done
+	struct stat st;
+	char name[1];
+};
+
+typedef struct zfs__copy_files
+{
+	zfs__task task;
+	zfs__copy_directory *directory;
+	int count;
+	char names[1]; // 'count' ZFSType bytes each followed by a '\0' terminated name
+} zfs__copy_files;
+
+typedef struct zfs__copy_worker
+{
+	char *names; // The batch being collected
+	zfs_ll names_size;
+	zfs_ll names_capacity;
+	int count;
+	char *buffer; // For reading directories, ZFS_DIRECTORY_BUFFER_SIZE bytes
+	ZFSDirEntry dir_entries[ZFS__WALK_LEVEL_ENTRIES];
+	char padding[64];
+} zfs__copy_worker;
+
+typedef struct zfs__tree_copy
+{
+	int flags;
+	zfs__copy_worker *workers;
+	dev_t destination_device; // Of the destination root, so copying a tree into itself ends
+	ino_t destination_inode;
+	int failed;
+} zfs__tree_copy;
+
+static void zfs__tree_copy_release(zfs__tree_copy *copy, zfs__copy_directory *directory)
+{
+	while (directory && __atomic_sub_fetch(&directory->pending, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		if (directory->destination_fd >= 0)
+		{
+			struct timespec times[2] = { directory->st.st_atim, directory->st.st_mtim };
+			if (directory->listed && (fchmod(directory->destination_fd, directory->st.st_mode & 07777) != 0 || futimens(directory->destination_fd, times) != 0))
+				__atomic_store_n(&copy->failed, 1, __ATOMIC_RELAXED);
+			close(directory->destination_fd);
+		}
+		if (directory->source_fd >= 0)
+			close(directory->source_fd);
+		zfs__copy_directory *parent = directory->parent;
+		ZFS_FREE(directory, ZFS_ALLOC_CONTEXT);
+		directory = parent;
+	}
+}
+
+static zfs_bool zfs__tree_copy_symlink(zfs__copy_directory *directory, const char *name)
+{
+	char target[4096];
+	struct stat st;
+	ssize_t length = readlinkat(directory->source_fd, name, target, sizeof(target));
+	if (length < 0 || length == (ssize_t)sizeof(target) || fstatat(directory->source_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+		return ZFS_FALSE;
+	target[length] = '\0';
+	int result = symlinkat(target, directory->destination_fd, name);
+	if (result != 0 && errno == EEXIST && unlinkat(directory->destination_fd, name, 0) == 0)
+		result = symlinkat(target, directory->destination_fd, name);
+	struct timespec times[2] = { st.st_atim, st.st_mtim };
+	return (result == 0 && utimensat(directory->destination_fd, name, times, AT_SYMLINK_NOFOLLOW) == 0);
+}
+
+static zfs_bool zfs__tree_copy_file(zfs__tree_copy *copy, zfs__copy_directory *directory, const char *name)
+{
+	// O_NONBLOCK in case it was replaced by a FIFO after it was listed
+	int in = openat(directory->source_fd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+	if (in < 0)
+		return ZFS_FALSE;
+	struct stat st;
+	zfs_bool ok = (fstat(in, &st) == 0 && S_ISREG(st.st_mode));
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC;
+	int out = (ok ? openat(directory->destination_fd, name, flags, 0600) : -1);
+	// A read-only file from an earlier copy is replaced
+	if (out < 0 && ok && errno == EACCES && unlinkat(directory->destination_fd, name, 0) == 0)
+		out = openat(directory->destination_fd, name, flags, 0600);
+	if (out >= 0)
+	{
+		ZFSCopyMethod method;
+		struct timespec times[2] = { st.st_atim, st.st_mtim };
+		ok = (zfs__file_copy_fd(in, out, &st, copy->flags, &method) &&
+		      fchmod(out, st.st_mode & 07777) == 0 &&
+		      futimens(out, times) == 0);
+		if (close(out) != 0)
+			ok = ZFS_FALSE;
+	}
+	close(in);
+	return (ok && out >= 0);
+}
+
+static void zfs__tree_copy_files_run(zfs__pool *pool, zfs__task *task, int worker)
+{
+	(void)worker;
+	zfs__tree_copy *copy = (zfs__tree_copy*)pool->user_data;
+	zfs__copy_files *files = (zfs__copy_files*)task;
+	const char *name = files->names;
+	int i;
+	for (i = 0; i < files->count; ++i)
+	{
+		ZFSType type = (ZFSType)*name++;
+		zfs_bool ok = (type == ZFS_TYPE_SYMLINK ? zfs__tree_copy_symlink(files->directory, name) : zfs__tree_copy_file(copy, files->directory, name));
+		if (!ok)
+			__atomic_store_n(&copy->failed, 1, __ATOMIC_RELAXED);
+		name += strlen(name) + 1;
+	}
+	zfs__tree_copy_release(copy, files->directory);
+	ZFS_FREE(files, ZFS_ALLOC_CONTEXT);
+}
+
+static void zfs__tree_copy_files_discard(zfs__pool *pool, zfs__task *task)
+{
+	zfs__copy_files *files = (zfs__copy_files*)task;
+	zfs__tree_copy_release((zfs__tree_copy*)pool->user_data, files->directory);
+	ZFS_FREE(files, ZFS_ALLOC_CONTEXT);
+}
+
+// Queues a task that holds a reference to 'directory', discarding it if there was no memory
+static void zfs__tree_copy_push(zfs__pool *pool, int worker, zfs__copy_directory *directory, zfs__task *task)
+{
+	__atomic_add_fetch(&directory->pending, 1, __ATOMIC_RELAXED);
+	if (!zfs__pool_push(pool, worker, task))
+	{
+		__atomic_store_n(&((zfs__tree_copy*)pool->user_data)->failed, 1, __ATOMIC_RELAXED);
+		task->discard(pool, task);
+	}
+}
+
+// Queues the files the worker collected from 'directory'
+static void zfs__tree_copy_flush(zfs__pool *pool, int worker, zfs__copy_directory *directory)
+{
+	zfs__tree_copy *copy = (zfs__tree_copy*)pool->user_data;
+	zfs__copy_worker *w = &copy->workers[worker];
+	if (w->count == 0)
+		return;
+	zfs__copy_files *files = (zfs__copy_files*)ZFS_MALLOC(sizeof(zfs__copy_files) + w->names_size, ZFS_ALLOC_CONTEXT);
+	if (files)
+	{
+		files->task.run = zfs__tree_copy_files_run;
+		files->task.discard = zfs__tree_copy_files_discard;
+		files->directory = directory;
+		files->count = w->count;
+		memcpy(files->names, w->names, w->names_size);
+		zfs__tree_copy_push(pool, worker, directory, &files->task);
+	}
+	else
+	{
+		__atomic_store_n(&copy->failed, 1, __ATOMIC_RELAXED);
+	}
+	w->count = 0;
+	w->names_size = 0;
+}
+
+static void zfs__tree_copy_directory_discard(zfs__pool *pool, zfs__task *task)
+{
+	zfs__tree_copy_release((zfs__tree_copy*)pool->user_data, (zfs__copy_directory*)task);
+}
+
+static void zfs__tree_copy_directory_run(zfs__pool *pool, zfs__task *task, int worker)
+{
+	zfs__tree_copy *copy = (zfs__tree_copy*)pool->user_data;
+	zfs__copy_worker *w = &copy->workers[worker];
+	zfs__copy_directory *directory = (zfs__copy_directory*)task;
+
+	if (directory->parent)
+	{
+		directory->source_fd = openat(directory->parent->source_fd, directory->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (directory->source_fd >= 0)
+			directory->destination_fd = openat(directory->parent->destination_fd, directory->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	}
+	ZFSDirBatch batch;
+	directory->listed = (directory->destination_fd >= 0 && fstat(directory->source_fd, &directory->st) == 0 &&
+	                     (directory->st.st_dev != copy->destination_device || directory->st.st_ino != copy->destination_inode));
+	// An earlier copy may have left it read-only, its mode is set again once it is done
+	if (directory->listed)
+		fchmod(directory->destination_fd, 0700);
+	if (!directory->listed || !zfs_directory_batch_begin_fd(&batch, directory->source_fd, w->buffer, ZFS_DIRECTORY_BUFFER_SIZE))
+	{
+		__atomic_store_n(&copy->failed, 1, __ATOMIC_RELAXED);
+		zfs__tree_copy_release(copy, directory);
+		return;
+	}
+
+	int count;
+	while ((count = zfs_directory_batch_next(&batch, w->dir_entries, ZFS__WALK_LEVEL_ENTRIES)) > 0)
+	{
+		int i;
+		for (i = 0; i < count; ++i)
+		{
+			const char *name = w->dir_entries[i].name;
+			ZFSType type = w->dir_entries[i].type;
+			if (type == ZFS_TYPE_UNKNOWN)
+			{
+				struct stat st;
+				if (fstatat(directory->source_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+					type = zfs__type_from_mode(st.st_mode);
+			}
+
+			zfs_ll name_length = strlen(name);
+			if (type == ZFS_TYPE_DIRECTORY)
+			{
+				// Created here, before it is queued, and made accessible to the owner until it is done
+				zfs__copy_directory *child = NULL;
+				if (mkdirat(directory->destination_fd, name, 0700) == 0 || errno == EEXIST)
+					child = (zfs__copy_directory*)ZFS_MALLOC(sizeof(zfs__copy_directory) + name_length, ZFS_ALLOC_CONTEXT);
+				if (!child)
+				{
+					__atomic_store_n(&copy->failed, 1, __ATOMIC_RELAXED);
+					continue;
+				}
+				child->task.run = zfs__tree_copy_directory_run;
+				child->task.discard = zfs__tree_copy_directory_discard;
+				child->parent = directory;
+				child->source_fd = -1;
+				child->destination_fd = -1;
+				child->pending = 1;
+				memcpy(child->name, name, name_length + 1);
+				zfs__tree_copy_push(pool, worker, directory, &child->task);
+			}
+			else if (type == ZFS_TYPE_FILE || type == ZFS_TYPE_SYMLINK)
+			{
+				if (!zfs__reserve(&w->names, &w->names_capacity, w->names_size + name_length + 2))
+				{
+					__atomic_store_n(&copy->failed, 1, __ATOMIC_RELAXED);
+					continue;
+				}
+				w->names[w->names_size] = (char)type;
+				memcpy(w->names + w->names_size + 1, name, name_length + 1);
+				w->names_size += name_length + 2;
+				if (++w->count == ZFS_TREE_COPY_BATCH_SIZE)
+					zfs__tree_copy_flush(pool, worker, directory);
+			}
+		}
+	}
+	if (count < 0)
+		__atomic_store_n(&copy->failed, 1, __ATOMIC_RELAXED);
+	// 'source_fd' is still needed for the files, so the batch is not ended
+	zfs__tree_copy_flush(pool, worker, directory);
+	zfs__tree_copy_release(copy, directory);
+}
+
+ZFSDEF zfs_bool zfs_tree_copy(const char *source, const char *destination, const ZFSTreeCopyOptions *options)
+{
+	zfs__tree_copy copy;
+	memset(&copy, 0, sizeof(copy));
+	copy.flags = (options ? options->flags : 0);
+	int thread_count = (options && options->thread_count > 0 ? options->thread_count : zfs__cpu_count());
+
+	zfs__copy_directory *root = (zfs__copy_directory*)ZFS_MALLOC(sizeof(zfs__copy_directory), ZFS_ALLOC_CONTEXT);
+	if (!root)
+		return ZFS_FALSE;
+	memset(root, 0, sizeof(zfs__copy_directory));
+	root->task.run = zfs__tree_copy_directory_run;
+	root->task.discard = zfs__tree_copy_directory_discard;
+	root->pending = 1;
+	root->source_fd = open(source, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	root->destination_fd = -1;
+	if (root->source_fd >= 0 && (mkdir(destination, 0700) == 0 || errno == EEXIST))
+		root->destination_fd = open(destination, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	struct stat st;
+	zfs_bool ok = (root->destination_fd >= 0 && fstat(root->destination_fd, &st) == 0);
+	copy.destination_device = (ok ? st.st_dev : 0);
+	copy.destination_inode = (ok ? st.st_ino : 0);
+
+	zfs__pool pool;
+	copy.workers = (zfs__copy_worker*)ZFS_MALLOC(thread_count * sizeof(zfs__copy_worker), ZFS_ALLOC_CONTEXT);
+	ok = (ok && copy.workers && zfs__pool_begin(&pool, thread_count, &copy));
+	if (ok)
+	{
+		memset(copy.workers, 0, thread_count * sizeof(zfs__copy_worker));
+		int i;
+		for (i = 0; i < thread_count; ++i)
+		{
+			copy.workers[i].buffer = (char*)ZFS_MALLOC(ZFS_DIRECTORY_BUFFER_SIZE, ZFS_ALLOC_CONTEXT);
+			if (!copy.workers[i].buffer)
+				ok = ZFS_FALSE;
+		}
+
+		if (ok && zfs__pool_push(&pool, 0, &root->task))
+		{
+			root = NULL;
+			zfs__pool_run(&pool);
+		}
+		else
+		{
+			ok = ZFS_FALSE;
+		}
+		zfs__pool_end(&pool);
+
+		for (i = 0; i < thread_count; ++i)
+		{
+			ZFS_FREE(copy.workers[i].names, ZFS_ALLOC_CONTEXT);
+			ZFS_FREE(copy.workers[i].buffer, ZFS_ALLOC_CONTEXT);
+		}
+	}
+
+	if (root)
+		zfs__tree_copy_release(&copy, root);
+	ZFS_FREE(copy.workers, ZFS_ALLOC_CONTEXT);
+	return (ok && !copy.failed);
+}
+#endif // Z_FS_NO_FILE
+
+// Tree delete
+// Directories are tasks that unlink their entries and queue their subdirectories. A directory is
+// removed by the last task under it to finish. Entries within one directory are unlinked by one
+// thread, as the kernel serializes changes to a directory anyway.
+typedef struct zfs__delete_directory zfs__delete_directory;
+
+struct zfs__delete_directory
+{
+	zfs__task task;
+	zfs__delete_directory *parent; // NULL for the root, whose 'name' is the whole path
+	int fd;                        // -1 until the task runs, except for the root
+	int pending;                   // This directory's own task and the unfinished tasks under it
+	char name[1];
+};
+
+typedef struct zfs__delete_worker
+{
+	char *buffer; // For reading directories, ZFS_DIRECTORY_BUFFER_SIZE bytes
+	ZFSDirEntry dir_entries[ZFS__WALK_LEVEL_ENTRIES];
+	char padding[64];
+} zfs__delete_worker;
+
+typedef struct zfs__tree_delete
+{
+	ZFSDeleteErrorCallback error;
+	void *user_data;
+	zfs__delete_worker *workers;
+	int failed;
+} zfs__tree_delete;
+
+// Reports 'name' in 'directory', or the directory itself if 'name' is NULL
+static void zfs__tree_delete_error(zfs__tree_delete *d, zfs__delete_directory *directory, const char *name, int error)
+{
+	__atomic_store_n(&d->failed, 1, __ATOMIC_RELAXED);
+	if (!d->error)
+		return;
+	if (!name)
+	{
+		name = directory->name;
+		directory = directory->parent;
+	}
+
+	// The path is only built for errors, from the names of the directories above
+	zfs_ll length = strlen(name);
+	zfs__delete_directory *parent;
+	for (parent = directory; parent; parent = parent->parent)
+		length += strlen(parent->name) + 1;
+	char *path = (char*)ZFS_MALLOC(length + 1, ZFS_ALLOC_CONTEXT);
+	if (!path)
+	{
+		d->error(name, error, d->user_data);
+		return;
+	}
+	zfs_ll name_length = strlen(name);
+	memcpy(path + length - name_length, name, name_length + 1);
+	length -= name_length;
+	for (parent = directory; parent; parent = parent->parent)
+	{
+		path[--length] = '/';
+		name_length = strlen(parent->name);
+		length -= name_length;
+		memcpy(path + length, parent->name, name_length);
+	}
+	d->error(path, error, d->user_data);
+	ZFS_FREE(path, ZFS_ALLOC_CONTEXT);
+}
+
+static void zfs__tree_delete_release(zfs__tree_delete *d, zfs__delete_directory *directory)
+{
+	while (directory && __atomic_sub_fetch(&directory->pending, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		zfs__delete_directory *parent = directory->parent;
+		// One that could not be opened was reported already
+		if (directory->fd >= 0)
+		{
+			close(directory->fd);
+			if (unlinkat(parent ? parent->fd : AT_FDCWD, directory->name, AT_REMOVEDIR) != 0)
+				zfs__tree_delete_error(d, directory, NULL, errno);
+		}
+		ZFS_FREE(directory, ZFS_ALLOC_CONTEXT);
+		directory = parent;
+	}
+}
+
+static void zfs__tree_delete_discard(zfs__pool *pool, zfs__task *task)
+{
+	zfs__tree_delete_release((zfs__tree_delete*)pool->user_data, (zfs__delete_directory*)task);
+}
+
+static void zfs__tree_delete_run(zfs__pool *pool, zfs__task *task, int worker)
+{
+	zfs__tree_delete *d = (zfs__tree_delete*)pool->user_data;
+	zfs__delete_worker *w = &d->workers[worker];
+	zfs__delete_directory *directory = (zfs__delete_directory*)task;
+
+	if (directory->parent)
+		directory->fd = openat(directory->parent->fd, directory->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	ZFSDirBatch batch;
+	if (directory->fd < 0 || !zfs_directory_batch_begin_fd(&batch, directory->fd, w->buffer, ZFS_DIRECTORY_BUFFER_SIZE))
+	{
+		// begin_fd closed the fd if it failed
+		zfs__tree_delete_error(d, directory, NULL, (directory->fd < 0 ? errno : ENOMEM));
+		directory->fd = -1;
+		zfs__tree_delete_release(d, directory);
+		return;
+	}
+
+	int count;
+	while ((count = zfs_directory_batch_next(&batch, w->dir_entries, ZFS__WALK_LEVEL_ENTRIES)) > 0)
+	{
+		int i;
+		for (i = 0; i < count; ++i)
+		{
+			const char *name = w->dir_entries[i].name;
+			ZFSType type = w->dir_entries[i].type;
+			if (type != ZFS_TYPE_DIRECTORY)
+			{
+				if (unlinkat(directory->fd, name, 0) == 0)
+					continue;
+				// Without a type from the filesystem, failing with EISDIR is how directories are found
+				int error = errno;
+				struct stat st;
+				if (type != ZFS_TYPE_UNKNOWN || (error != EISDIR && error != EPERM) ||
+				    fstatat(directory->fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(st.st_mode))
+				{
+					zfs__tree_delete_error(d, directory, name, error);
+					continue;
+				}
+			}
+
+			zfs_ll name_length = strlen(name);
+			zfs__delete_directory *child = (zfs__delete_directory*)ZFS_MALLOC(sizeof(zfs__delete_directory) + name_length, ZFS_ALLOC_CONTEXT);
+			if (!child)
+			{
+				zfs__tree_delete_error(d, directory, name, ENOMEM);
+				continue;
+			}
+			child->task.run = zfs__tree_delete_run;
+			child->task.discard = zfs__tree_delete_discard;
+			child->parent = directory;
+			child->fd = -1;
+			child->pending = 1;
+			memcpy(child->name, name, name_length + 1);
+			__atomic_add_fetch(&directory->pending, 1, __ATOMIC_RELAXED);
+			if (!zfs__pool_push(pool, worker, &child->task))
+			{
+				zfs__tree_delete_error(d, directory, name, ENOMEM);
+				zfs__tree_delete_release(d, child);
+			}
+		}
+	}
+	if (count < 0)
+		zfs__tree_delete_error(d, directory, NULL, errno);
+	// 'fd' is still needed for the subdirectories, so the batch is not ended
+	zfs__tree_delete_release(d, directory);
+}
+
+typedef struct zfs__tree_delete_background
+{
+	ZFSTreeDeleteOptions options;
+	char path[1];
+} zfs__tree_delete_background;
+
+static void *zfs__tree_delete_thread(void *arg)
+{
+	zfs__tree_delete_background *background = (zfs__tree_delete_background*)arg;
+	zfs_tree_delete(background->path, &background->options);
+	ZFS_FREE(background, ZFS_ALLOC_CONTEXT);
+	return NULL;
+}
+
+// Renames 'path' into a new directory in the trash and deletes that on a detached thread.
+// Returns false if 'path' was not moved, otherwise 'deleted' is false if it was deleted here and that failed.
+static zfs_bool zfs__tree_delete_in_background(const char *path, const ZFSTreeDeleteOptions *options, zfs_bool *deleted)
+{
+	zfs_ll length = strlen(options->trash_directory);
+	zfs__tree_delete_background *background = (zfs__tree_delete_background*)ZFS_MALLOC(sizeof(zfs__tree_delete_background) + length + 32, ZFS_ALLOC_CONTEXT);
+	if (!background)
+		return ZFS_FALSE;
+	background->options = *options;
+	background->options.trash_directory = NULL;
+	memcpy(background->path, options->trash_directory, length);
+	strcpy(background->path + length, "/zfs-trash-XXXXXX");
+	if (!mkdtemp(background->path))
+	{
+		ZFS_FREE(background, ZFS_ALLOC_CONTEXT);
+		return ZFS_FALSE;
+	}
+	length = strlen(background->path);
+	strcpy(background->path + length, "/tree");
+	zfs_bool moved = (rename(path, background->path) == 0);
+	background->path[length] = '\0';
+	if (!moved)
+	{
+		rmdir(background->path);
+		ZFS_FREE(background, ZFS_ALLOC_CONTEXT);
+		return ZFS_FALSE;
+	}
+
+	pthread_attr_t attributes;
+	pthread_t thread;
+	zfs_bool started = ZFS_FALSE;
+	if (pthread_attr_init(&attributes) == 0)
+	{
+		started = (pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED) == 0 &&
+		           pthread_create(&thread, &attributes, zfs__tree_delete_thread, background) == 0);
+		pthread_attr_destroy(&attributes);
+	}
+	*deleted = ZFS_TRUE;
+	if (!started)
+	{
+		// Without a thread it is deleted now, like a tree that could not be moved
+		*deleted = zfs_tree_delete(background->path, &background->options);
+		ZFS_FREE(background, ZFS_ALLOC_CONTEXT);
+	}
+	return ZFS_TRUE;
+}
+
+ZFSDEF zfs_bool zfs_tree_delete(const char *path, const ZFSTreeDeleteOptions *options)
+{
+	zfs_bool deleted;
+	if (options && options->trash_directory && zfs__tree_delete_in_background(path, options, &deleted))
+		return deleted;
+
+	zfs__tree_delete d;
+	memset(&d, 0, sizeof(d));
+	d.error = (options ? options->error : NULL);
+	d.user_data = (options ? options->user_data : NULL);
+	int thread_count = (options && options->thread_count > 0 ? options->thread_count : zfs__cpu_count());
+
+	int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0 && (errno == ENOTDIR || errno == ELOOP))
+	{
+		// Not a directory
+		if (unlink(path) == 0)
+			return ZFS_TRUE;
+		fd = -1;
+	}
+	zfs__delete_directory *root = NULL;
+	if (fd >= 0)
+		root = (zfs__delete_directory*)ZFS_MALLOC(sizeof(zfs__delete_directory) + strlen(path), ZFS_ALLOC_CONTEXT);
+	if (!root)
+	{
+		if (d.error)
+			d.error(path, (fd < 0 ? errno : ENOMEM), d.user_data);
+		if (fd >= 0)
+			close(fd);
+		return ZFS_FALSE;
+	}
+	root->task.run = zfs__tree_delete_run;
+	root->task.discard = zfs__tree_delete_discard;
+	root->parent = NULL;
+	root->fd = fd;
+	root->pending = 1;
+	strcpy(root->name, path);
+
+	zfs__pool pool;
+	d.workers = (zfs__delete_worker*)ZFS_MALLOC(thread_count * sizeof(zfs__delete_worker), ZFS_ALLOC_CONTEXT);
+	zfs_bool ok = (d.workers && zfs__pool_begin(&pool, thread_count, &d));
+	if (ok)
+	{
+		memset(d.workers, 0, thread_count * sizeof(zfs__delete_worker));
+		int i;
+		for (i = 0; i < thread_count; ++i)
+		{
+			d.workers[i].buffer = (char*)ZFS_MALLOC(ZFS_DIRECTORY_BUFFER_SIZE, ZFS_ALLOC_CONTEXT);
+			if (!d.workers[i].buffer)
+				ok = ZFS_FALSE;
+		}
+
+		if (ok && zfs__pool_push(&pool, 0, &root->task))
+		{
+			root = NULL;
+			zfs__pool_run(&pool);
+		}
+		else
+		{
+			ok = ZFS_FALSE;
+		}
+		zfs__pool_end(&pool);
+
+		for (i = 0; i < thread_count; ++i)
+			ZFS_FREE(d.workers[i].buffer, ZFS_ALLOC_CONTEXT);
+	}
+
+	if (root)
+	{
+		// Never ran, so nothing was deleted
+		if (d.error)
+			d.error(path, ENOMEM, d.user_data);
+		close(root->fd);
+		ZFS_FREE(root, ZFS_ALLOC_CONTEXT);
+	}
+	ZFS_FREE(d.workers, ZFS_ALLOC_CONTEXT);
+	return (ok && !d.failed);
+}
+
+// Paths collected by zfs_glob(), one after another
+typedef struct zfs__glob_paths
+{
+	char *names;
+	zfs_ll names_size;
+	zfs_ll names_capacity;
+	zfs_ll *offsets;
+	zfs_ll offsets_capacity;
+	zfs_ll count;
+	zfs_bool failed;
+} zfs__glob_paths;
+
+static ZFSWalkAction zfs__glob_collect(const ZFSWalkEntry *entry, void *user_data)
+{
+	zfs__glob_paths *paths = (zfs__glob_paths*)user_data;
+	if (!zfs__reserve(&paths->names, &paths->names_capacity, paths->names_size + entry->path_length + 1) ||
+	    !zfs__reserve((char**)&paths->offsets, &paths->offsets_capacity, (paths->count + 1) * sizeof(zfs_ll)))
+	{
+		paths->failed = ZFS_TRUE;
+		return ZFS_WALK_STOP;
+	}
+	paths->offsets[paths->count++] = paths->names_size;
+	memcpy(paths->names + paths->names_size, entry->path, entry->path_length + 1);
+	paths->names_size += entry->path_length + 1;
+	return ZFS_WALK_CONTINUE;
+}
+
+ZFSDEF zfs_bool zfs_glob(ZFSArena *arena, const char *path, const char *const *patterns, int pattern_count, ZFSGlobResult *result)
+{
+	memset(result, 0, sizeof(*result));
+	ZFSGlob glob;
+	if (!zfs_glob_compile(&glob, patterns, pattern_count))
+		return ZFS_FALSE;
+
+	zfs__glob_paths paths;
+	memset(&paths, 0, sizeof(paths));
+	ZFSWalkOptions options;
+	memset(&options, 0, sizeof(options));
+	options.pre = zfs__glob_collect;
+	options.user_data = &paths;
+	options.glob = &glob;
+	zfs_bool ok = (zfs_walk(path, &options) && !paths.failed);
+
+	if (ok && paths.count > 0)
+	{
+		// Copy the names into the arena once, and sort pointers to them
+		char *names = (char*)zfs_arena_alloc(arena, paths.names_size);
+		const char **sorted = (const char**)zfs_arena_alloc(arena, paths.count * sizeof(const char*));
+		zfs_ll *order = (zfs_ll*)ZFS_MALLOC(paths.count * 2 * sizeof(zfs_ll), ZFS_ALLOC_CONTEXT);
+		if (names && sorted && order)
+		{
+			memcpy(names, paths.names, paths.names_size);
+			zfs_ll i;
+			for (i = 0; i < paths.count; ++i)
+				order[i] = i;
+			zfs__radix_sort(order, order + paths.count, paths.count, names, paths.offsets, 0);
+			for (i = 0; i < paths.count; ++i)
+				sorted[i] = names + paths.offsets[order[i]];
+			result->count = paths.count;
+			result->paths = sorted;
+		}
+		else
+			ok = ZFS_FALSE;
+		ZFS_FREE(order, ZFS_ALLOC_CONTEXT);
+	}
+
+	ZFS_FREE(paths.names, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(paths.offsets, ZFS_ALLOC_CONTEXT);
+	zfs_glob_free(&glob);
+	return ok;
+}
+
+// Watched directories are kept by watch descriptor, and events wait in 'pending' in the order they
+// were first seen, which is also the order they are due in, with a hash index by path
+#define ZFS__WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+typedef struct zfs__watch_pending
+{
+	char *path;
+	int flags;
+	zfs_bool is_directory;
+	zfs_ll due; // When the window of the first event ends, in milliseconds
+} zfs__watch_pending;
+
+typedef struct zfs__watch
+{
+	int inotify_fd;
+	int timer_fd;
+	zfs_ll window;
+	zfs_ll now;             // Milliseconds, updated by zfs_watch_read()
+	char *root;
+
+	char **directories;     // Path of each watched directory by watch descriptor, NULL for free ones
+	zfs_ll directory_count;
+	zfs_ll directories_capacity;
+
+	zfs__watch_pending *pending;
+	zfs_ll pending_count;
+	zfs_ll pending_capacity;
+	int *index;             // Indices into 'pending', -1 for free slots
+	zfs_ll index_size;      // Power of two
+
+	char **unwatched;       // Directories that hit the watch limit, retried every window
+	zfs_ll unwatched_count;
+	zfs_ll unwatched_capacity;
+	zfs_ll retry_time;
+
+	char **delivered;       // Paths of the events returned last
+	zfs_ll delivered_count;
+	zfs_ll delivered_capacity;
+} zfs__watch;
+
+static zfs_ll zfs__watch_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (zfs_ll)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned long long zfs__string_hash(const char *string)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	for (; *string; ++string)
+		hash = (hash ^ (unsigned char)*string) * 1099511628211ULL;
+	return hash;
+}
+
+// Returns a new string of 'directory' and 'name' joined like walk entry paths, or NULL if there was no memory
+static char *zfs__join_new(const char *directory, const char *name)
+{
+	zfs_ll directory_length = strlen(directory), name_length = strlen(name);
+	char *path = (char*)ZFS_MALLOC(directory_length + name_length + 2, ZFS_ALLOC_CONTEXT);
+	if (!path)
+		return NULL;
+	memcpy(path, directory, directory_length);
+	if (directory_length > 0 && name_length > 0)
+		path[directory_length++] = '/';
+	memcpy(path + directory_length, name, name_length + 1);
+	return path;
+}
+
+// Rebuilds the index of 'pending' with 'size' slots
+static zfs_bool zfs__watch_index(zfs__watch *w, zfs_ll size)
+{
+	int *index = w->index;
+	if (size != w->index_size)
+	{
+		index = (int*)ZFS_MALLOC(size * sizeof(int), ZFS_ALLOC_CONTEXT);
+		if (!index)
+			return ZFS_FALSE;
+		ZFS_FREE(w->index, ZFS_ALLOC_CONTEXT);
+		w->index = index;
+		w->index_size = size;
+	}
+	memset(index, 0xFF, size * sizeof(int));
+	zfs_ll i;
+	for (i = 0; i < w->pending_count; ++i)
+	{
+		zfs_ll slot = (zfs_ll)(zfs__string_hash(w->pending[i].path) & (size - 1));
+		while (index[slot] >= 0)
+			slot = (slot + 1) & (size - 1);
+		index[slot] = (int)i;
+	}
+	return ZFS_TRUE;
+}
+
+// Adds 'flags' to the pending event of 'path', which starts a window if there is none
+static void zfs__watch_event(zfs__watch *w, const char *path, int flags, zfs_bool is_directory)
+{
+	unsigned long long hash = zfs__string_hash(path);
+	if (w->index_size > 0)
+	{
+		zfs_ll slot = (zfs_ll)(hash & (w->index_size - 1));
+		for (; w->index[slot] >= 0; slot = (slot + 1) & (w->index_size - 1))
+		{
+			zfs__watch_pending *pending = &w->pending[w->index[slot]];
+			if (strcmp(pending->path, path) == 0)
+			{
+				pending->flags |= flags;
+				pending->is_directory = is_directory;
+				return;
+			}
+		}
+	}
+
+	char *copy = zfs__join_new(path, "");
+	if (!copy || !zfs__reserve((char**)&w->pending, &w->pending_capacity, (w->pending_count + 1) * sizeof(zfs__watch_pending)) ||
+	    ((w->pending_count + 1) * 2 > w->index_size && !zfs__watch_index(w, w->index_size ? w->index_size * 2 : 64)))
+	{
+		ZFS_FREE(copy, ZFS_ALLOC_CONTEXT);
+		return;
+	}
+	zfs__watch_pending *pending = &w->pending[w->pending_count];
+	pending->path = copy;
+	pending->flags = flags;
+	pending->is_directory = is_directory;
+	pending->due = w->now + w->window;
+	zfs_ll slot = (zfs_ll)(hash & (w->index_size - 1));
+	while (w->index[slot] >= 0)
+		slot = (slot + 1) & (w->index_size - 1);
+	w->index[slot] = (int)w->pending_count++;
+}
+
+// Watches the directory 'path', which is 'relative' in the tree.
+// Returns 1 if it is watched, 0 if it hit the watch limit and will be rescanned, or -1 if it failed.
+static int zfs__watch_add(zfs__watch *w, const char *path, const char *relative)
+{
+	int wd = inotify_add_watch(w->inotify_fd, path, ZFS__WATCH_MASK);
+	if (wd < 0)
+	{
+		if (errno != ENOSPC)
+			return -1;
+		char *copy = zfs__join_new(relative, "");
+		if (copy && zfs__reserve((char**)&w->unwatched, &w->unwatched_capacity, (w->unwatched_count + 1) * sizeof(char*)))
+			w->unwatched[w->unwatched_count++] = copy;
+		else
+			ZFS_FREE(copy, ZFS_ALLOC_CONTEXT);
+		zfs__watch_event(w, relative, ZFS_WATCH_RESCAN, ZFS_TRUE);
+		return 0;
+	}
+
+	if (wd >= w->directory_count)
+	{
+		if (!zfs__reserve((char**)&w->directories, &w->directories_capacity, (wd + 1) * sizeof(char*)))
+		{
+			inotify_rm_watch(w->inotify_fd, wd);
+			return -1;
+		}
+		memset(w->directories + w->directory_count, 0, (wd + 1 - w->directory_count) * sizeof(char*));
+		w->directory_count = wd + 1;
+	}
+	// Watching a directory again returns its descriptor, under its new path if it moved
+	char *copy = zfs__join_new(relative, "");
+	if (!copy)
+	{
+		inotify_rm_watch(w->inotify_fd, wd);
+		return -1;
+	}
+	ZFS_FREE(w->directories[wd], ZFS_ALLOC_CONTEXT);
+	w->directories[wd] = copy;
+	return 1;
+}
+
+typedef struct zfs__watch_tree
+{
+	zfs__watch *watch;
+	const char *path;
+	const char *relative;
+	zfs_bool report; // Report entries as created
+} zfs__watch_tree;
+
+static ZFSWalkAction zfs__watch_tree_entry(const ZFSWalkEntry *entry, void *user_data)
+{
+	zfs__watch_tree *tree = (zfs__watch_tree*)user_data;
+	char *relative = zfs__join_new(tree->relative, entry->path);
+	if (!relative)
+		return ZFS_WALK_STOP;
+	zfs_bool is_directory = (entry->type == ZFS_TYPE_DIRECTORY);
+	if (tree->report)
+		zfs__watch_event(tree->watch, relative, ZFS_WATCH_CREATED, is_directory);
+
+	// Only watched directories are entered, the rest are rescanned instead
+	ZFSWalkAction action = ZFS_WALK_CONTINUE;
+	if (is_directory)
+	{
+		char *path = zfs__join_new(tree->path, entry->path);
+		if (!path || zfs__watch_add(tree->watch, path, relative) <= 0)
+			action = ZFS_WALK_SKIP;
+		ZFS_FREE(path, ZFS_ALLOC_CONTEXT);
+	}
+	ZFS_FREE(relative, ZFS_ALLOC_CONTEXT);
+	return action;
+}
+
+// Watches the directory 'relative' and everything under it.
+// Returns false if the directory itself could not be watched.
+static zfs_bool zfs__watch_add_tree(zfs__watch *w, const char *relative, zfs_bool report)
+{
+	char *path = zfs__join_new(w->root, relative);
+	int added = (path ? zfs__watch_add(w, path, relative) : -1);
+	if (added > 0)
+	{
+		zfs__watch_tree tree;
+		tree.watch = w;
+		tree.path = path;
+		tree.relative = relative;
+		tree.report = report;
+		ZFSWalkOptions options;
+		memset(&options, 0, sizeof(options));
+		options.pre = zfs__watch_tree_entry;
+		options.user_data = &tree;
+		zfs_walk(path, &options);
+	}
+	ZFS_FREE(path, ZFS_ALLOC_CONTEXT);
+	return (added >= 0);
+}
+
+// Stops watching the directory 'relative' and everything under it, after it moved away
+static void zfs__watch_remove_tree(zfs__watch *w, const char *relative)
+{
+	zfs_ll length = strlen(relative), i;
+	for (i = 0; i < w->directory_count; ++i)
+	{
+		const char *path = w->directories[i];
+		if (path && strncmp(path, relative, length) == 0 && (path[length] == '\0' || path[length] == '/'))
+		{
+			inotify_rm_watch(w->inotify_fd, (int)i);
+			ZFS_FREE(w->directories[i], ZFS_ALLOC_CONTEXT);
+			w->directories[i] = NULL;
+		}
+	}
+	for (i = 0; i < w->unwatched_count; ++i)
+	{
+		const char *path = w->unwatched[i];
+		if (strncmp(path, relative, length) == 0 && (path[length] == '\0' || path[length] == '/'))
+		{
+			ZFS_FREE(w->unwatched[i], ZFS_ALLOC_CONTEXT);
+			w->unwatched[i--] = w->unwatched[--w->unwatched_count];
+		}
+	}
+}
+
+static void zfs__watch_handle(zfs__watch *w, const struct inotify_event *event)
+{
+	if (event->mask & IN_Q_OVERFLOW)
+	{
+		zfs__watch_event(w, "", ZFS_WATCH_RESCAN, ZFS_TRUE);
+		return;
+	}
+	if (event->wd < 0 || event->wd >= w->directory_count || !w->directories[event->wd])
+		return;
+	const char *directory = w->directories[event->wd];
+	if (event->mask & IN_IGNORED)
+	{
+		ZFS_FREE(w->directories[event->wd], ZFS_ALLOC_CONTEXT);
+		w->directories[event->wd] = NULL;
+		return;
+	}
+	// Entries are reported by their parent, except for the watched directory itself
+	if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+	{
+		if (directory[0] == '\0')
+			zfs__watch_event(w, "", ZFS_WATCH_DELETED, ZFS_TRUE);
+		return;
+	}
+	if (event->len == 0)
+		return;
+
+	char *path = zfs__join_new(directory, event->name);
+	if (!path)
+		return;
+	zfs_bool is_directory = ((event->mask & IN_ISDIR) != 0);
+	int flags = 0;
+	if (event->mask & (IN_CREATE | IN_MOVED_TO))
+		flags |= ZFS_WATCH_CREATED;
+	if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+		flags |= ZFS_WATCH_DELETED;
+	if (event->mask & IN_MODIFY)
+		flags |= ZFS_WATCH_MODIFIED;
+	if (event->mask & IN_ATTRIB)
+		flags |= ZFS_WATCH_ATTRIBUTES;
+
+	if (is_directory && (event->mask & IN_MOVED_FROM))
+		zfs__watch_remove_tree(w, path);
+	zfs__watch_event(w, path, flags, is_directory);
+	if (is_directory && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+		zfs__watch_add_tree(w, path, ZFS_TRUE);
+	ZFS_FREE(path, ZFS_ALLOC_CONTEXT);
+}
+
+// Arms the timer for the next event that is due, or the next retry of unwatched directories
+static void zfs__watch_arm(zfs__watch *w)
+{
+	zfs_ll next = -1;
+	if (w->pending_count > 0)
+		next = w->pending[0].due;
+	if (w->unwatched_count > 0 && (next < 0 || w->retry_time < next))
+		next = w->retry_time;
+
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(spec));
+	if (next >= 0)
+	{
+		// A zero time disarms the timer, so what is already due fires after a nanosecond
+		zfs_ll delay = next - w->now;
+		if (delay > 0)
+		{
+			spec.it_value.tv_sec = delay / 1000;
+			spec.it_value.tv_nsec = (delay % 1000) * 1000000;
+		}
+		else
+			spec.it_value.tv_nsec = 1;
+	}
+	timerfd_settime(w->timer_fd, 0, &spec, NULL);
+}
+
+static void zfs__watch_free(zfs__watch *w)
+{
+	zfs_ll i;
+	for (i = 0; i < w->directory_count; ++i)
+		ZFS_FREE(w->directories[i], ZFS_ALLOC_CONTEXT);
+	for (i = 0; i < w->pending_count; ++i)
+		ZFS_FREE(w->pending[i].path, ZFS_ALLOC_CONTEXT);
+	for (i = 0; i < w->unwatched_count; ++i)
+		ZFS_FREE(w->unwatched[i], ZFS_ALLOC_CONTEXT);
+	for (i = 0; i < w->delivered_count; ++i)
+		ZFS_FREE(w->delivered[i], ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(w->directories, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(w->pending, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(w->index, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(w->unwatched, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(w->delivered, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(w->root, ZFS_ALLOC_CONTEXT);
+	if (w->inotify_fd >= 0)
+		close(w->inotify_fd);
+	if (w->timer_fd >= 0)
+		close(w->timer_fd);
+	ZFS_FREE(w, ZFS_ALLOC_CONTEXT);
+}
+
+ZFSDEF zfs_bool zfs_watch_begin(ZFSWatch *watch, const char *path, int coalesce_ms)
+{
+	watch->fd = -1;
+	zfs__watch *w = (zfs__watch*)ZFS_MALLOC(sizeof(zfs__watch), ZFS_ALLOC_CONTEXT);
+	watch->handle = w;
+	if (!w)
+		return ZFS_FALSE;
+	memset(w, 0, sizeof(zfs__watch));
+	w->window = (coalesce_ms > 0 ? coalesce_ms : ZFS_WATCH_COALESCE_MS);
+	w->now = zfs__watch_time();
+	w->retry_time = w->now + w->window;
+	w->root = zfs__join_new(path, "");
+	w->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	w->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	watch->fd = epoll_create1(EPOLL_CLOEXEC);
+
+	// Both fds make the epoll fd readable
+	zfs_bool ok = (w->root && w->inotify_fd >= 0 && w->timer_fd >= 0 && watch->fd >= 0);
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	ok = ok && epoll_ctl(watch->fd, EPOLL_CTL_ADD, w->inotify_fd, &event) == 0;
+	ok = ok && epoll_ctl(watch->fd, EPOLL_CTL_ADD, w->timer_fd, &event) == 0;
+	ok = ok && zfs__watch_add_tree(w, "", ZFS_FALSE);
+	if (!ok)
+	{
+		zfs_watch_end(watch);
+		return ZFS_FALSE;
+	}
+	zfs__watch_arm(w);
+	return ZFS_TRUE;
+}
+
+ZFSDEF int zfs_watch_read(ZFSWatch *watch, ZFSWatchEvent *events, int max_events)
+{
+	zfs__watch *w = (zfs__watch*)watch->handle;
+	w->now = zfs__watch_time();
+	zfs_ll i;
+	for (i = 0; i < w->delivered_count; ++i)
+		ZFS_FREE(w->delivered[i], ZFS_ALLOC_CONTEXT);
+	w->delivered_count = 0;
+
+	union
+	{
+		struct inotify_event event;
+		char bytes[16384];
+	} buffer;
+	ssize_t size;
+	while ((size = read(w->inotify_fd, &buffer, sizeof(buffer))) > 0)
+	{
+		ssize_t offset = 0;
+		while (offset < size)
+		{
+			const struct inotify_event *event = (const struct inotify_event*)(buffer.bytes + offset);
+			zfs__watch_handle(w, event);
+			offset += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	// Clears the timer, it is armed again below
+	unsigned long long expirations;
+	ssize_t cleared = read(w->timer_fd, &expirations, sizeof(expirations));
+	(void)cleared;
+
+	// Each unwatched directory is rescanned every window, and watched as soon as there is room
+	if (w->unwatched_count > 0 && w->now >= w->retry_time)
+	{
+		zfs_ll count = w->unwatched_count;
+		char **unwatched = w->unwatched;
+		w->unwatched = NULL;
+		w->unwatched_count = 0;
+		w->unwatched_capacity = 0;
+		for (i = 0; i < count; ++i)
+		{
+			zfs__watch_event(w, unwatched[i], ZFS_WATCH_RESCAN, ZFS_TRUE);
+			zfs__watch_add_tree(w, unwatched[i], ZFS_FALSE);
+			ZFS_FREE(unwatched[i], ZFS_ALLOC_CONTEXT);
+		}
+		ZFS_FREE(unwatched, ZFS_ALLOC_CONTEXT);
+		w->retry_time = w->now + w->window;
+	}
+
+	int count = 0;
+	if (zfs__reserve((char**)&w->delivered, &w->delivered_capacity, max_events * sizeof(char*)))
+	{
+		while (count < max_events && count < w->pending_count && w->pending[count].due <= w->now)
+		{
+			const zfs__watch_pending *pending = &w->pending[count];
+			events[count].path = pending->path;
+			events[count].flags = pending->flags;
+			events[count].is_directory = pending->is_directory;
+			w->delivered[count++] = pending->path;
+		}
+		w->delivered_count = count;
+	}
+	if (count > 0)
+	{
+		w->pending_count -= count;
+		memmove(w->pending, w->pending + count, w->pending_count * sizeof(zfs__watch_pending));
+		zfs__watch_index(w, w->index_size);
+	}
+
+	zfs__watch_arm(w);
+	return count;
+}
+
+ZFSDEF void zfs_watch_end(ZFSWatch *watch)
+{
+	if (watch->handle)
+		zfs__watch_free((zfs__watch*)watch->handle);
+	if (watch->fd >= 0)
+		close(watch->fd);
+	watch->handle = NULL;
+	watch->fd = -1;
+}
+
+// Snapshot files are a header, the directories sorted by path, the entries of each directory sorted by
+// name, then the names. Records have fixed sizes and refer to strings by their offset in the names,
+// so a mapped file is used as it is.
+#define ZFS__SNAPSHOT_MAGIC "ZFSSNP01"
+
+typedef struct zfs__snapshot_header
+{
+	char magic[8];
+	unsigned long long directory_count;
+	unsigned long long entry_count;
+	unsigned long long names_size;
+} zfs__snapshot_header;
+
+typedef struct zfs__snapshot_directory
+{
+	unsigned long long path; // "" for the snapshotted directory
+	unsigned long long first_entry;
+	unsigned long long entry_count;
+	long long mtime_seconds; // -1 if it could not be read, so it is always listed again
+	long long mtime_nanoseconds;
+} zfs__snapshot_directory;
+
+typedef struct zfs__snapshot_entry
+{
+	unsigned long long name;
+	unsigned long long size;
+	unsigned long long inode;
+	long long mtime_seconds;
+	int mtime_nanoseconds;
+	int type;
+} zfs__snapshot_entry;
+
+static inline const zfs__snapshot_directory *zfs__snapshot_directories(const ZFSSnapshot *snapshot)
+{
+	return (const zfs__snapshot_directory*)((const char*)snapshot->data + sizeof(zfs__snapshot_header));
+}
+
+static inline const zfs__snapshot_entry *zfs__snapshot_entries(const ZFSSnapshot *snapshot)
+{
+	return (const zfs__snapshot_entry*)(zfs__snapshot_directories(snapshot) + snapshot->directory_count);
+}
+
+// Offsets are checked as they are used, so a damaged file can not be read past its end
+static inline const char *zfs__snapshot_name(const ZFSSnapshot *snapshot, unsigned long long offset)
+{
+	const char *names = (const char*)(zfs__snapshot_entries(snapshot) + snapshot->entry_count);
+	zfs_ll names_size = snapshot->size - (names - (const char*)snapshot->data);
+	return (offset < (unsigned long long)names_size ? names + offset : "");
+}
+
+static inline zfs_ll zfs__snapshot_entry_count(const ZFSSnapshot *snapshot, const zfs__snapshot_directory *directory)
+{
+	if (directory->first_entry > (unsigned long long)snapshot->entry_count || directory->entry_count > snapshot->entry_count - directory->first_entry)
+		return 0;
+	return (zfs_ll)directory->entry_count;
+}
+
+// Returns the directory 'path' in 'snapshot', or NULL
+static const zfs__snapshot_directory *zfs__snapshot_find(const ZFSSnapshot *snapshot, const char *path)
+{
+	if (!snapshot || !snapshot->data)
+		return NULL;
+	const zfs__snapshot_directory *directories = zfs__snapshot_directories(snapshot);
+	zfs_ll low = 0, high = snapshot->directory_count;
+	while (low < high)
+	{
+		zfs_ll middle = low + (high - low) / 2;
+		int order = strcmp(zfs__snapshot_name(snapshot, directories[middle].path), path);
+		if (order == 0)
+			return &directories[middle];
+		if (order < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return NULL;
+}
+
+ZFSDEF zfs_bool zfs_snapshot_open(ZFSSnapshot *snapshot, const char *filename)
+{
+	memset(snapshot, 0, sizeof(*snapshot));
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return ZFS_FALSE;
+	struct stat buf;
+	void *data = MAP_FAILED;
+	if (fstat(fd, &buf) == 0 && buf.st_size > (off_t)sizeof(zfs__snapshot_header))
+		data = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return ZFS_FALSE;
+
+	// The names end the file, and the last one ends it with a '\0'
+	const zfs__snapshot_header *header = (const zfs__snapshot_header*)data;
+	unsigned long long size = buf.st_size - sizeof(zfs__snapshot_header);
+	if (memcmp(header->magic, ZFS__SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->directory_count > size / sizeof(zfs__snapshot_directory) ||
+	    header->entry_count > size / sizeof(zfs__snapshot_entry) ||
+	    header->names_size > size ||
+	    header->directory_count * sizeof(zfs__snapshot_directory) + header->entry_count * sizeof(zfs__snapshot_entry) + header->names_size != size ||
+	    ((const char*)data)[buf.st_size - 1] != '\0')
+	{
+		munmap(data, buf.st_size);
+		return ZFS_FALSE;
+	}
+	snapshot->data = data;
+	snapshot->size = buf.st_size;
+	snapshot->directory_count = header->directory_count;
+	snapshot->entry_count = header->entry_count;
+	return ZFS_TRUE;
+}
+
+ZFSDEF void zfs_snapshot_close(ZFSSnapshot *snapshot)
+{
+	if (snapshot->data)
+		munmap((void*)snapshot->data, snapshot->size);
+	memset(snapshot, 0, sizeof(*snapshot));
+}
+
+// The new snapshot as it is built. Directories are added as they are found and scanned in that order.
+typedef struct zfs__snapshot_builder
+{
+	const ZFSSnapshot *old;
+	ZFSSnapshotCallback callback;
+	void *user_data;
+	zfs_bool failed;
+
+	zfs__snapshot_directory *directories;
+	zfs_ll directory_count;
+	zfs_ll directories_capacity;
+	zfs__snapshot_entry *entries;
+	zfs_ll entry_count;
+	zfs_ll entries_capacity;
+	char *names;
+	zfs_ll names_size;
+	zfs_ll names_capacity;
+
+	char *path; // Of the change being reported
+	zfs_ll path_capacity;
+} zfs__snapshot_builder;
+
+// Entries of the directory being listed, before they are sorted
+typedef struct zfs__snapshot_listing
+{
+	char *buffer;
+	char *names;
+	zfs_ll names_size;
+	zfs_ll names_capacity;
+	zfs_ll *offsets;
+	zfs_ll offsets_capacity;
+	zfs__snapshot_entry *entries;
+	zfs_ll entries_capacity;
+	zfs_ll *order; // Then scratch for the sort
+	zfs_ll order_capacity;
+	zfs_ll count;
+} zfs__snapshot_listing;
+
+// Adds 'directory' and 'name' joined like walk entry paths to the names, and returns its offset
+static zfs_ll zfs__snapshot_add_name(zfs__snapshot_builder *b, const char *directory, const char *name)
+{
+	zfs_ll directory_length = strlen(directory), name_length = strlen(name);
+	if (!zfs__reserve(&b->names, &b->names_capacity, b->names_size + directory_length + name_length + 2))
+	{
+		b->failed = ZFS_TRUE;
+		return -1;
+	}
+	zfs_ll offset = b->names_size;
+	memcpy(b->names + b->names_size, directory, directory_length);
+	b->names_size += directory_length;
+	if (directory_length > 0 && name_length > 0)
+		b->names[b->names_size++] = '/';
+	memcpy(b->names + b->names_size, name, name_length + 1);
+	b->names_size += name_length + 1;
+	return offset;
+}
+
+static void zfs__snapshot_add_directory(zfs__snapshot_builder *b, const char *directory, const char *name)
+{
+	zfs_ll path = zfs__snapshot_add_name(b, directory, name);
+	if (path < 0 || !zfs__reserve((char**)&b->directories, &b->directories_capacity, (b->directory_count + 1) * sizeof(zfs__snapshot_directory)))
+	{
+		b->failed = ZFS_TRUE;
+		return;
+	}
+	zfs__snapshot_directory *record = &b->directories[b->directory_count++];
+	memset(record, 0, sizeof(*record));
+	record->path = path;
+	record->mtime_seconds = -1;
+}
+
+// Adds 'entry' to the directory at 'index', which is the one being scanned
+static void zfs__snapshot_add_entry(zfs__snapshot_builder *b, zfs_ll index, const char *directory, const char *name, const zfs__snapshot_entry *entry)
+{
+	zfs_ll offset = zfs__snapshot_add_name(b, "", name);
+	if (offset < 0 || !zfs__reserve((char**)&b->entries, &b->entries_capacity, (b->entry_count + 1) * sizeof(zfs__snapshot_entry)))
+	{
+		b->failed = ZFS_TRUE;
+		return;
+	}
+	b->entries[b->entry_count] = *entry;
+	b->entries[b->entry_count++].name = offset;
+	++b->directories[index].entry_count;
+	if (entry->type == ZFS_TYPE_DIRECTORY)
+		zfs__snapshot_add_directory(b, directory, name);
+}
+
+static void zfs__snapshot_report(zfs__snapshot_builder *b, const char *directory, const char *name, ZFSSnapshotChange change, int type)
+{
+	zfs_ll directory_length = strlen(directory), name_length = strlen(name);
+	if (!zfs__reserve(&b->path, &b->path_capacity, directory_length + name_length + 2))
+	{
+		b->failed = ZFS_TRUE;
+		return;
+	}
+	memcpy(b->path, directory, directory_length);
+	if (directory_length > 0)
+		b->path[directory_length++] = '/';
+	memcpy(b->path + directory_length, name, name_length + 1);
+	b->callback(b->path, change, (ZFSType)type, b->user_data);
+}
+
+// Reports an entry of the old snapshot as removed, and everything under it
+static void zfs__snapshot_report_removed(zfs__snapshot_builder *b, const char *directory, const zfs__snapshot_entry *entry)
+{
+	const char *name = zfs__snapshot_name(b->old, entry->name);
+	zfs__snapshot_report(b, directory, name, ZFS_SNAPSHOT_REMOVED, entry->type);
+	if (entry->type != ZFS_TYPE_DIRECTORY)
+		return;
+	char *path = zfs__join_new(directory, name);
+	const zfs__snapshot_directory *removed = (path ? zfs__snapshot_find(b->old, path) : NULL);
+	if (removed)
+	{
+		const zfs__snapshot_entry *entries = zfs__snapshot_entries(b->old) + removed->first_entry;
+		zfs_ll i, count = zfs__snapshot_entry_count(b->old, removed);
+		for (i = 0; i < count; ++i)
+			zfs__snapshot_report_removed(b, path, &entries[i]);
+	}
+	ZFS_FREE(path, ZFS_ALLOC_CONTEXT);
+}
+
+static inline zfs_bool zfs__snapshot_modified(const zfs__snapshot_entry *old, const zfs__snapshot_entry *entry)
+{
+	return (old->size != entry->size || old->inode != entry->inode || old->mtime_seconds != entry->mtime_seconds || old->mtime_nanoseconds != entry->mtime_nanoseconds);
+}
+
+// Takes the entries of an unchanged directory from the old snapshot
+static void zfs__snapshot_reuse(zfs__snapshot_builder *b, zfs_ll index, const zfs__snapshot_directory *old, int fd, int flags, const char *directory)
+{
+	const zfs__snapshot_entry *entries = zfs__snapshot_entries(b->old) + old->first_entry;
+	zfs_ll i, count = zfs__snapshot_entry_count(b->old, old);
+	for (i = 0; i < count && !b->failed; ++i)
+	{
+		const char *name = zfs__snapshot_name(b->old, entries[i].name);
+		zfs__snapshot_entry entry = entries[i];
+		if ((flags & ZFS_SNAPSHOT_STAT_FILES) && entry.type != ZFS_TYPE_DIRECTORY)
+		{
+			struct stat buf;
+			if (fstatat(fd, name, &buf, AT_SYMLINK_NOFOLLOW) != 0)
+			{
+				zfs__snapshot_report_removed(b, directory, &entries[i]);
+				continue;
+			}
+			entry.size = buf.st_size;
+			entry.inode = buf.st_ino;
+			entry.mtime_seconds = buf.st_mtim.tv_sec;
+			entry.mtime_nanoseconds = (int)buf.st_mtim.tv_nsec;
+			if (zfs__snapshot_modified(&entries[i], &entry))
+				zfs__snapshot_report(b, directory, name, ZFS_SNAPSHOT_MODIFIED, entry.type);
+		}
+		zfs__snapshot_add_entry(b, index, directory, name, &entry);
+	}
+}
+
+// Lists a directory that changed, and compares it with the old snapshot by merging both sorted by name
+static void zfs__snapshot_list(zfs__snapshot_builder *b, zfs_ll index, const zfs__snapshot_directory *old, int fd, const char *directory, zfs__snapshot_listing *listing)
+{
+	listing->count = 0;
+	listing->names_size = 0;
+	ZFSDirBatch batch;
+	if (zfs_directory_batch_begin_fd(&batch, fd, listing->buffer, ZFS_DIRECTORY_BUFFER_SIZE))
+	{
+		ZFSDirEntry entries[64];
+		int count, i;
+		while ((count = zfs_directory_batch_next(&batch, entries, 64)) > 0)
+		{
+			for (i = 0; i < count; ++i)
+			{
+				// Entries removed since they were read are left out
+				ZFSEntryInfo info;
+				if (!zfs_directory_batch_info(&batch, &entries[i], ZFS_INFO_TYPE | ZFS_INFO_SIZE | ZFS_INFO_MTIME | ZFS_INFO_INODE, &info))
+					continue;
+				zfs_ll name_size = strlen(entries[i].name) + 1;
+				if (!zfs__reserve(&listing->names, &listing->names_capacity, listing->names_size + name_size) ||
+				    !zfs__reserve((char**)&listing->offsets, &listing->offsets_capacity, (listing->count + 1) * sizeof(zfs_ll)) ||
+				    !zfs__reserve((char**)&listing->entries, &listing->entries_capacity, (listing->count + 1) * sizeof(zfs__snapshot_entry)))
+				{
+					b->failed = ZFS_TRUE;
+					break;
+				}
+				memcpy(listing->names + listing->names_size, entries[i].name, name_size);
+				listing->offsets[listing->count] = listing->names_size;
+				listing->names_size += name_size;
+				zfs__snapshot_entry *entry = &listing->entries[listing->count++];
+				entry->name = 0;
+				entry->size = info.size;
+				entry->inode = info.inode;
+				entry->mtime_seconds = info.mtime_seconds;
+				entry->mtime_nanoseconds = info.mtime_nanoseconds;
+				entry->type = info.type;
+			}
+		}
+		zfs_directory_batch_end(&batch);
+	}
+	if (!zfs__reserve((char**)&listing->order, &listing->order_capacity, listing->count * 2 * sizeof(zfs_ll)))
+		b->failed = ZFS_TRUE;
+	if (b->failed)
+		return;
+	zfs_ll i;
+	for (i = 0; i < listing->count; ++i)
+		listing->order[i] = i;
+	zfs__radix_sort(listing->order, listing->order + listing->count, listing->count, listing->names, listing->offsets, 0);
+
+	const zfs__snapshot_entry *old_entries = (old ? zfs__snapshot_entries(b->old) + old->first_entry : NULL);
+	zfs_ll old_index = 0, old_count = (old ? zfs__snapshot_entry_count(b->old, old) : 0);
+	for (i = 0; i < listing->count && !b->failed; ++i)
+	{
+		const char *name = listing->names + listing->offsets[listing->order[i]];
+		const zfs__snapshot_entry *entry = &listing->entries[listing->order[i]];
+		int order = 1;
+		while (old_index < old_count && (order = strcmp(zfs__snapshot_name(b->old, old_entries[old_index].name), name)) < 0)
+			zfs__snapshot_report_removed(b, directory, &old_entries[old_index++]);
+		if (old_index < old_count && order == 0)
+		{
+			const zfs__snapshot_entry *old_entry = &old_entries[old_index++];
+			if (old_entry->type != entry->type)
+			{
+				zfs__snapshot_report_removed(b, directory, old_entry);
+				zfs__snapshot_report(b, directory, name, ZFS_SNAPSHOT_ADDED, entry->type);
+			}
+			else if (entry->type != ZFS_TYPE_DIRECTORY && zfs__snapshot_modified(old_entry, entry))
+				zfs__snapshot_report(b, directory, name, ZFS_SNAPSHOT_MODIFIED, entry->type);
+		}
+		else
+			zfs__snapshot_report(b, directory, name, ZFS_SNAPSHOT_ADDED, entry->type);
+		zfs__snapshot_add_entry(b, index, directory, name, entry);
+	}
+	while (old_index < old_count && !b->failed)
+		zfs__snapshot_report_removed(b, directory, &old_entries[old_index++]);
+}
+
+// Writes the snapshot next to 'filename' and renames it over it, with the directories sorted by path
+static zfs_bool zfs__snapshot_write(zfs__snapshot_builder *b, const char *filename)
+{
+	zfs_ll count = b->directory_count, i;
+	zfs_ll filename_length = strlen(filename);
+	zfs_ll *order = (zfs_ll*)ZFS_MALLOC(count * 3 * sizeof(zfs_ll), ZFS_ALLOC_CONTEXT);
+	zfs__snapshot_directory *sorted = (zfs__snapshot_directory*)ZFS_MALLOC(count * sizeof(zfs__snapshot_directory), ZFS_ALLOC_CONTEXT);
+	char *temporary = (char*)ZFS_MALLOC(filename_length + 5, ZFS_ALLOC_CONTEXT);
+	zfs_bool ok = (order && sorted && temporary);
+	if (ok)
+	{
+		zfs_ll *offsets = order + count * 2;
+		for (i = 0; i < count; ++i)
+		{
+			order[i] = i;
+			offsets[i] = (zfs_ll)b->directories[i].path;
+		}
+		zfs__radix_sort(order, order + count, count, b->names, offsets, 0);
+		for (i = 0; i < count; ++i)
+			sorted[i] = b->directories[order[i]];
+
+		zfs__snapshot_header header;
+		memcpy(header.magic, ZFS__SNAPSHOT_MAGIC, sizeof(header.magic));
+		header.directory_count = count;
+		header.entry_count = b->entry_count;
+		header.names_size = b->names_size;
+		memcpy(temporary, filename, filename_length);
+		memcpy(temporary + filename_length, ".tmp", 5);
+		int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		ok = (fd >= 0 &&
+		      zfs__write_all(fd, &header, sizeof(header)) &&
+		      zfs__write_all(fd, sorted, count * sizeof(zfs__snapshot_directory)) &&
+		      zfs__write_all(fd, b->entries, b->entry_count * sizeof(zfs__snapshot_entry)) &&
+		      zfs__write_all(fd, b->names, b->names_size));
+		if (fd >= 0 && close(fd) != 0)
+			ok = ZFS_FALSE;
+		ok = (ok && rename(temporary, filename) == 0);
+		if (!ok && fd >= 0)
+			unlink(temporary);
+	}
+	ZFS_FREE(order, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(sorted, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(temporary, ZFS_ALLOC_CONTEXT);
+	return ok;
+}
+
+ZFSDEF zfs_bool zfs_snapshot_update(const ZFSSnapshot *snapshot, const char *path, const char *filename, int flags, ZFSSnapshotCallback callback, void *user_data)
+{
+	int root = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (root < 0)
+		return ZFS_FALSE;
+
+	zfs__snapshot_builder b;
+	memset(&b, 0, sizeof(b));
+	b.old = snapshot;
+	b.callback = callback;
+	b.user_data = user_data;
+	zfs__snapshot_listing listing;
+	memset(&listing, 0, sizeof(listing));
+	listing.buffer = (char*)ZFS_MALLOC(ZFS_DIRECTORY_BUFFER_SIZE, ZFS_ALLOC_CONTEXT);
+	b.failed = !listing.buffer;
+	char *directory = NULL;
+	zfs_ll directory_capacity = 0;
+
+	// Timestamps are coarse, so a directory changed within a second of the scan could change again
+	// without its mtime changing. Those keep an mtime of -1 and are listed again next time.
+	struct timespec start;
+	clock_gettime(CLOCK_REALTIME, &start);
+
+	// The list of directories grows as they are found, which makes it the queue to scan
+	zfs__snapshot_add_directory(&b, "", "");
+	zfs_ll index;
+	for (index = 0; index < b.directory_count && !b.failed; ++index)
+	{
+		// Names move as they grow
+		const char *name = b.names + b.directories[index].path;
+		zfs_ll name_size = strlen(name) + 1;
+		if (!zfs__reserve(&directory, &directory_capacity, name_size))
+		{
+			b.failed = ZFS_TRUE;
+			break;
+		}
+		memcpy(directory, name, name_size);
+		b.directories[index].first_entry = b.entry_count;
+
+		// The mtime is read before listing, so changes made while listing are found next time
+		int fd = (directory[0] ? openat(root, directory, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : dup(root));
+		struct stat buf;
+		const zfs__snapshot_directory *old = zfs__snapshot_find(snapshot, directory);
+		if (fd < 0 || fstat(fd, &buf) != 0)
+		{
+			if (fd >= 0)
+				close(fd);
+			const zfs__snapshot_entry *old_entries = (old ? zfs__snapshot_entries(snapshot) + old->first_entry : NULL);
+			zfs_ll i, old_count = (old ? zfs__snapshot_entry_count(snapshot, old) : 0);
+			for (i = 0; i < old_count; ++i)
+				zfs__snapshot_report_removed(&b, directory, &old_entries[i]);
+			continue;
+		}
+		if (buf.st_mtim.tv_sec < start.tv_sec - 1)
+		{
+			b.directories[index].mtime_seconds = buf.st_mtim.tv_sec;
+			b.directories[index].mtime_nanoseconds = buf.st_mtim.tv_nsec;
+		}
+
+		if (old && old->mtime_seconds == buf.st_mtim.tv_sec && old->mtime_nanoseconds == buf.st_mtim.tv_nsec)
+		{
+			zfs__snapshot_reuse(&b, index, old, fd, flags, directory);
+			close(fd);
+		}
+		else
+			zfs__snapshot_list(&b, index, old, fd, directory, &listing);
+	}
+	close(root);
+
+	zfs_bool ok = (!b.failed && zfs__snapshot_write(&b, filename));
+	ZFS_FREE(directory, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(listing.buffer, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(listing.names, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(listing.offsets, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(listing.entries, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(listing.order, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(b.directories, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(b.entries, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(b.names, ZFS_ALLOC_CONTEXT);
+	ZFS_FREE(b.path, ZFS_ALLOC_CONTEXT);
+	return ok;
+}
+#endif // ZFS_POSIX
 #endif // Z_FS_NO_DIRECTORY
 
 #endif // Z_FS_IMPLEMENTATION
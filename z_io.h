@@ -8,6 +8,33 @@ USAGE
 	#define Z_IO_STATIC
 	before you include this file to create a private implementation.
 
+	On Linux the implementation defines _GNU_SOURCE, which strict modes like -std=c99 need for
+	clock_gettime, pwritev and others. It only takes effect when no system header is included
+	before this file, otherwise define _GNU_SOURCE yourself before the first one.
+
+	#define ZIO_MALLOC(size, context), ZIO_REALLOC(memory, size, context) and ZIO_FREE(memory, context)
+	to replace malloc, realloc and free. Define all three or none of them. 'context' is
+	ZIO_ALLOC_CONTEXT, which is NULL unless you define it, e.g. to a thread-local arena.
+	Background threads may free memory that was allocated on another thread.
+
+	#define Z_IO_NO_BITSTREAM
+	to disable the bit reader/writer.
+
+	#define Z_IO_NO_FRAME
+	to disable the length-prefixed frame reader/writer.
+
+	#define Z_IO_NO_LOG
+	to disable the multi-threaded log sink.
+
+	#define Z_IO_NO_ROTATE
+	to disable rotating file handles.
+
+	#define Z_IO_NO_THROTTLE
+	to disable rate-limited handles.
+
+	#define Z_IO_NO_SCHEDULER
+	to disable the priority I/O scheduler.
+
 EXAMPLE
 	// Allocated on stack
 	ZIOHandle handle;
@@ -20,6 +47,15 @@ EXAMPLE
 	zio_close(handle);
 	free(handle);
 
+	// Allocated from a pool
+	ZIOHandlePool pool;
+	zio_handle_pool_begin(&pool, 0);
+	ZIOHandle *handle = zio_handle_pool_alloc(&pool);
+	zio_open_const_memory(handle, data, size);
+	zio_close(handle);
+	zio_handle_pool_free(&pool, handle);
+	zio_handle_pool_end(&pool);
+
 UNLICENSE
 	This is free and unencumbered software released into the public domain.
 
@@ -60,6 +96,8 @@ extern "C" {
 #endif
 
 typedef long long zio_ll;
+typedef unsigned long long zio_u64;
+typedef unsigned int zio_u32;
 typedef int zio_result;
 
 typedef enum
@@ -79,25 +117,48 @@ enum
 {
 	ZIO_ERROR = -1,
 	ZIO_OK    = 0,
+	ZIO_EOF   = 1, // Returned by functions that can run out of data without it being an error
 };
 
+typedef struct ZIOVec
+{
+	const void *data;
+	zio_ll size;
+} ZIOVec;
+
 typedef struct ZIOHandle ZIOHandle;
 
-struct ZIOHandle
+// The operations of a backend, shared by all of its handles
+typedef struct ZIOVtable
 {
 	zio_result (*close)(ZIOHandle *handle);
 	zio_ll (*size)(ZIOHandle *handle);
 	zio_ll (*seek)(ZIOHandle *handle, zio_ll offset, ZIOSeek whence);
 	zio_ll (*read)(ZIOHandle *handle, void *destination, zio_ll size);
 	zio_ll (*write)(ZIOHandle *handle, const void *source, zio_ll size);
+	zio_ll (*writev)(ZIOHandle *handle, const ZIOVec *vecs, int count);
+} ZIOVtable;
+
+// Custom backends can point 'vtable' at their own operations and keep their state in 'data.inline_data'
+#define ZIO_HANDLE_INLINE_SIZE 24
 
+struct ZIOHandle
+{
+	const ZIOVtable *vtable;
 	const char *last_error;
 
 	union
 	{
+		unsigned char inline_data[ZIO_HANDLE_INLINE_SIZE];
+		void *align; // Keeps the pointers below aligned
+		struct
+		{
+			ZIOHandle *next;
+		} pool; // Free handles in a ZIOHandlePool
 		struct
 		{
 			void *handle;
+			void *reader; // Adaptive read buffer, only for read-only files
 		} file;
 		struct
 		{
@@ -105,33 +166,483 @@ struct ZIOHandle
 			char *pos;
 			char *end;
 		} mem;
+		struct
+		{
+			void *state;
+		} rotate;
+		struct
+		{
+			ZIOHandle *inner;
+			struct ZIOThrottleGroup *group;
+		} throttle;
+		struct
+		{
+			ZIOHandle *inner;
+			void *state;
+			zio_ll pos; // The priority is in which vtable the handle uses
+		} sched;
 	} data;
 };
 
 // 'handle' can be either malloc'ed or simply created on the stack
 ZIODEF zio_result zio_open_file(ZIOHandle *handle, const char *filename, ZIOMode mode);
+
+// Opens a file from an fd, e.g. one from zfs_file_open_at(). Whether the file is created or truncated is
+// up to how 'fd' was opened. The fd is owned by the handle, and closed if opening fails, so a failed open
+// can be passed straight in.
+ZIODEF zio_result zio_open_fd(ZIOHandle *handle, int fd, ZIOMode mode);
 ZIODEF zio_result zio_open_memory(ZIOHandle *handle, void *memory, zio_ll size);
 ZIODEF zio_result zio_open_const_memory(ZIOHandle *handle, const void *memory, zio_ll size);
 
-static inline zio_result zio_close(ZIOHandle *handle) { return handle->close(handle); }
+// Handle pool
+// Hands out handles from slabs of 'handles_per_slab', for programs that keep many handles alive.
+// Slabs are kept until zio_handle_pool_end(). Not thread-safe.
+#define ZIO_HANDLE_POOL_SLAB_SIZE 1024
+
+typedef struct ZIOHandlePool
+{
+	void *slabs;
+	ZIOHandle *free_list;
+	ZIOHandle *next;     // Next never used handle in the newest slab
+	ZIOHandle *slab_end;
+	zio_ll handles_per_slab;
+} ZIOHandlePool;
+
+// 'handles_per_slab' of 0 means ZIO_HANDLE_POOL_SLAB_SIZE
+ZIODEF void zio_handle_pool_begin(ZIOHandlePool *pool, zio_ll handles_per_slab);
+
+// Frees all slabs, handles from the pool should be closed first
+ZIODEF void zio_handle_pool_end(ZIOHandlePool *pool);
+
+// Returns an unopened handle, or NULL if out of memory
+ZIODEF ZIOHandle *zio_handle_pool_alloc(ZIOHandlePool *pool);
+
+ZIODEF void zio_handle_pool_free(ZIOHandlePool *pool, ZIOHandle *handle);
+
+static inline zio_result zio_close(ZIOHandle *handle) { return handle->vtable->close(handle); }
 
 // Returns size of data, or ZIO_ERROR
-static inline zio_ll zio_size(ZIOHandle *handle) { return handle->size(handle); }
+static inline zio_ll zio_size(ZIOHandle *handle) { return handle->vtable->size(handle); }
 
 // Returns position in data after seek, or ZIO_ERROR
-static inline zio_ll zio_seek(ZIOHandle *handle, zio_ll offset, ZIOSeek whence) { return handle->seek(handle, offset, whence); }
+static inline zio_ll zio_seek(ZIOHandle *handle, zio_ll offset, ZIOSeek whence) { return handle->vtable->seek(handle, offset, whence); }
 
 // Returns position in data, or ZIO_ERROR
-static inline zio_ll zio_tell(ZIOHandle *handle) { return handle->seek(handle, 0, ZIO_SEEK_CUR); }
+static inline zio_ll zio_tell(ZIOHandle *handle) { return handle->vtable->seek(handle, 0, ZIO_SEEK_CUR); }
 
 // Returns bytes read, or ZIO_ERROR
-static inline zio_ll zio_read(ZIOHandle *handle, void *destination, zio_ll size) { return handle->read(handle, destination, size); }
+static inline zio_ll zio_read(ZIOHandle *handle, void *destination, zio_ll size) { return handle->vtable->read(handle, destination, size); }
 
 // Return bytes written, or ZIO_ERROR
-static inline zio_ll zio_write(ZIOHandle *handle, const void *source, zio_ll size) { return handle->write(handle, source, size); }
+static inline zio_ll zio_write(ZIOHandle *handle, const void *source, zio_ll size) { return handle->vtable->write(handle, source, size); }
+
+// Writes 'count' buffers in one operation. Return bytes written, or ZIO_ERROR
+static inline zio_ll zio_writev(ZIOHandle *handle, const ZIOVec *vecs, int count) { return handle->vtable->writev(handle, vecs, count); }
 
 static inline const char *zio_last_error(ZIOHandle *handle) { return handle->last_error; }
 
+// Rotating file handles
+#ifndef Z_IO_NO_ROTATE
+typedef struct ZIORotateConfig
+{
+	const char *filename;  // The file that is written to, rotated files get ".1", ".2" and so on appended
+	zio_ll max_size;       // Rotate when the file has grown to this many bytes, 0 to disable
+	int max_seconds;       // Rotate when the file has been written to for this long, 0 to disable
+
+	// Called on the background thread after a file has been rotated, e.g. to compress it.
+	// The file for the next rotation is already open by then.
+	void (*rotated)(const char *rotated_filename, void *user_data);
+	void *user_data;
+} ZIORotateConfig;
+
+// Opens 'config->filename' for appending. A background thread opens the next file ahead of time,
+// so rotating only swaps files and never blocks the writer. Closing and renaming the old file
+// happens on the background thread. If the next file is not ready yet, writing continues in
+// the current file until it is.
+// Only zio_write(), zio_writev(), zio_size() and zio_tell() are supported.
+ZIODEF zio_result zio_open_rotating(ZIOHandle *handle, const ZIORotateConfig *config);
+#endif // Z_IO_NO_ROTATE
+
+// Rate-limited handles
+#ifndef Z_IO_NO_THROTTLE
+// A token bucket shared by every handle opened with it. Handles in the group can use up to
+// 'bytes_per_second' and 'ops_per_second' together (0 is unlimited), and up to 'burst_ms'
+// worth of both can be used at once after being idle.
+typedef struct ZIOThrottleGroup
+{
+	zio_u64 byte_cost_num; // Nanoseconds per byte is byte_cost_num / byte_cost_den
+	zio_u64 byte_cost_den;
+	zio_u64 op_cost;       // Nanoseconds per operation
+	zio_u64 burst;         // Nanoseconds
+	volatile zio_u64 byte_time; // When the byte budget is used up
+	volatile zio_u64 op_time;   // When the operation budget is used up
+} ZIOThrottleGroup;
+
+ZIODEF void zio_throttle_group_init(ZIOThrottleGroup *group, zio_ll bytes_per_second, zio_ll ops_per_second, int burst_ms);
+
+// Wraps 'inner', sleeping in reads and writes while the group is over budget.
+// Closing the handle does not close 'inner'.
+ZIODEF zio_result zio_open_throttled(ZIOHandle *handle, ZIOHandle *inner, ZIOThrottleGroup *group);
+#endif // Z_IO_NO_THROTTLE
+
+// Priority I/O scheduler
+#ifndef Z_IO_NO_SCHEDULER
+#ifndef ZIO_SCHEDULER_MAX_MERGE_READ
+#define ZIO_SCHEDULER_MAX_MERGE_READ 262144
+#endif
+
+typedef enum
+{
+	ZIO_PRIORITY_INTERACTIVE,
+	ZIO_PRIORITY_NORMAL,
+	ZIO_PRIORITY_BACKGROUND,
+	ZIO_PRIORITY_COUNT,
+} ZIOPriority;
+
+typedef struct ZIOSchedulerStats
+{
+	zio_ll queued;     // Requests waiting right now
+	zio_ll completed;
+	zio_ll merged;     // Requests that were coalesced into the read or write of the request before them
+	zio_u64 total_wait_ns;
+	zio_u64 max_wait_ns;
+	zio_u64 total_service_ns;
+} ZIOSchedulerStats;
+
+typedef struct ZIOScheduler
+{
+	void *state;
+} ZIOScheduler;
+
+// Starts 'worker_count' worker threads. Requests are served highest priority first, unless a
+// request has waited longer than the deadline of its priority, then it is served first.
+// 'deadline_ms' has ZIO_PRIORITY_COUNT entries, or is NULL for 5, 50 and 500 ms.
+ZIODEF zio_result zio_scheduler_begin(ZIOScheduler *scheduler, int worker_count, const int *deadline_ms);
+
+// Stops the worker threads. All scheduled handles must have been closed.
+ZIODEF void zio_scheduler_end(ZIOScheduler *scheduler);
+
+ZIODEF void zio_scheduler_stats(ZIOScheduler *scheduler, ZIOPriority priority, ZIOSchedulerStats *stats);
+
+// Wraps 'inner' so that its reads, writes and size queries are queued with 'priority' and
+// served by the scheduler's workers. Queued requests for adjacent ranges of the same handle are
+// coalesced: writes into one zio_writev(), reads into one zio_read() through a temporary buffer of
+// up to ZIO_SCHEDULER_MAX_MERGE_READ bytes. The handle starts at the current position of 'inner', which must only be
+// used through scheduled handles until they are closed. Closing the handle does not close 'inner'.
+ZIODEF zio_result zio_open_scheduled(ZIOHandle *handle, ZIOHandle *inner, ZIOScheduler *scheduler, ZIOPriority priority);
+#endif // Z_IO_NO_SCHEDULER
+
+// Adaptive file buffering
+// Files opened with only ZIOM_READ are read through an internal buffer that follows the access
+// pattern. Recent read offsets classify the stream as sequential, strided or random: sequential
+// streams read ahead up to ZIO_FILE_MAX_READ_AHEAD bytes, short strides read ahead over the next
+// few strides, and random reads go straight to the destination without buffering.
+// Seeks inside the buffer do not touch the file.
+#ifndef ZIO_FILE_MIN_READ_AHEAD
+#define ZIO_FILE_MIN_READ_AHEAD 16384
+#endif
+#ifndef ZIO_FILE_MAX_READ_AHEAD
+#define ZIO_FILE_MAX_READ_AHEAD 1048576
+#endif
+
+typedef enum
+{
+	ZIO_ACCESS_UNKNOWN,
+	ZIO_ACCESS_SEQUENTIAL,
+	ZIO_ACCESS_STRIDED,
+	ZIO_ACCESS_RANDOM,
+} ZIOAccessPattern;
+
+typedef struct ZIOFileStats
+{
+	ZIOAccessPattern pattern;
+	zio_ll read_ahead;      // Bytes the next buffer fill will read
+	zio_ll stride;          // Distance between the last two reads
+	zio_ll reads;           // zio_read() calls
+	zio_ll buffer_hits;     // zio_read() calls served entirely from the buffer
+	zio_ll file_reads;      // Reads from the file
+	zio_ll bytes_requested; // Bytes asked for by zio_read()
+	zio_ll bytes_read;      // Bytes read from the file
+	zio_ll pattern_changes;
+} ZIOFileStats;
+
+// Only for handles from zio_open_file() with ZIOM_READ alone, returns ZIO_ERROR for others
+ZIODEF zio_result zio_file_stats(ZIOHandle *handle, ZIOFileStats *stats);
+
+// Memory budget
+// Every buffer the library allocates is accounted for here. Over the soft limit, caches are
+// released instead of kept and buffers fall back to smaller sizes. Allocations that would go
+// over the hard limit fail.
+typedef struct ZIOMemoryStats
+{
+	zio_ll used;
+	zio_ll peak;
+	zio_ll failed; // Allocations that failed
+	zio_ll soft_limit;
+	zio_ll hard_limit;
+} ZIOMemoryStats;
+
+// Sets the limits in bytes, 0 means no limit. Meant to be called at startup.
+ZIODEF void zio_memory_set_limits(zio_ll soft_limit, zio_ll hard_limit);
+
+ZIODEF void zio_memory_stats(ZIOMemoryStats *stats);
+
+// Bitstreams
+#ifndef Z_IO_NO_BITSTREAM
+// Bits are kept in a 64-bit buffer that is refilled/flushed a whole word at a time.
+// Memory handles are read and written in place, other handles go through an internal
+// buffer of ZIO_BIT_BUFFER_SIZE bytes (ZIO_BIT_MIN_BUFFER_SIZE over the memory soft limit).
+// Use either the _lsb or the _msb functions on a reader or writer, never both.
+#ifndef ZIO_BIT_BUFFER_SIZE
+#define ZIO_BIT_BUFFER_SIZE 4096
+#endif
+#define ZIO_BIT_MIN_BUFFER_SIZE 64
+
+// Maximum number of bits that can be peeked/consumed after a refill
+#define ZIO_BIT_MAX_READ 56
+// Maximum number of bits that can be put in one call
+#define ZIO_BIT_MAX_WRITE 56
+
+typedef struct ZIOBitReader
+{
+	ZIOHandle *handle;
+	const unsigned char *pos;
+	const unsigned char *end;
+	unsigned char *buffer; // NULL when reading a memory handle in place
+	zio_ll buffer_size;
+	zio_u64 bits;
+	int count;   // Number of bits in 'bits'
+	int padding; // Number of zero bits added past the end of the data
+	int at_end;
+} ZIOBitReader;
+
+typedef struct ZIOBitWriter
+{
+	ZIOHandle *handle;
+	unsigned char *pos;
+	unsigned char *end;
+	unsigned char *buffer; // NULL when writing a memory handle in place
+	zio_ll buffer_size;
+	zio_u64 bits;
+	int count;
+	int failed;
+	unsigned char tail[16]; // Used instead of 'buffer' near the end of a memory handle
+} ZIOBitWriter;
+
+// Starts reading bits at the current position of 'handle'.
+ZIODEF zio_result zio_bit_reader_begin(ZIOBitReader *reader, ZIOHandle *handle);
+
+// Moves 'handle' back to the first byte that has not been (fully) consumed and releases the reader.
+ZIODEF zio_result zio_bit_reader_end(ZIOBitReader *reader);
+
+// Starts writing bits at the current position of 'handle'.
+// When writing to memory, up to 7 bytes past the final position may be overwritten.
+ZIODEF zio_result zio_bit_writer_begin(ZIOBitWriter *writer, ZIOHandle *handle);
+
+// Writes out the remaining bits, padding the last byte with zeros, and releases the writer.
+// Returns ZIO_ERROR if any write failed.
+ZIODEF zio_result zio_bit_writer_end(ZIOBitWriter *writer);
+
+ZIODEF void zio__bit_reader_refill_slow(ZIOBitReader *reader, int msb_first);
+ZIODEF void zio__bit_writer_flush_slow(ZIOBitWriter *writer);
+
+static inline zio_u64 zio__load_le64(const unsigned char *p)
+{
+	return ((zio_u64)p[0]) | ((zio_u64)p[1] << 8) | ((zio_u64)p[2] << 16) | ((zio_u64)p[3] << 24) |
+		((zio_u64)p[4] << 32) | ((zio_u64)p[5] << 40) | ((zio_u64)p[6] << 48) | ((zio_u64)p[7] << 56);
+}
+static inline zio_u64 zio__load_be64(const unsigned char *p)
+{
+	return ((zio_u64)p[7]) | ((zio_u64)p[6] << 8) | ((zio_u64)p[5] << 16) | ((zio_u64)p[4] << 24) |
+		((zio_u64)p[3] << 32) | ((zio_u64)p[2] << 40) | ((zio_u64)p[1] << 48) | ((zio_u64)p[0] << 56);
+}
+static inline void zio__store_le64(unsigned char *p, zio_u64 v)
+{
+	int i;
+	for (i = 0; i < 8; ++i)
+		p[i] = (unsigned char)(v >> (i * 8));
+}
+static inline void zio__store_be64(unsigned char *p, zio_u64 v)
+{
+	int i;
+	for (i = 0; i < 8; ++i)
+		p[i] = (unsigned char)(v >> (56 - i * 8));
+}
+
+// Makes sure at least ZIO_BIT_MAX_READ bits are buffered. Past the end of the data, zeros are read.
+static inline void zio_bit_refill_lsb(ZIOBitReader *reader)
+{
+	if (reader->end - reader->pos >= 8)
+	{
+		reader->bits |= zio__load_le64(reader->pos) << reader->count;
+		reader->pos += (63 - reader->count) >> 3;
+		reader->count |= 56;
+	}
+	else
+	{
+		zio__bit_reader_refill_slow(reader, 0);
+	}
+}
+static inline void zio_bit_refill_msb(ZIOBitReader *reader)
+{
+	if (reader->end - reader->pos >= 8)
+	{
+		reader->bits |= zio__load_be64(reader->pos) >> reader->count;
+		reader->pos += (63 - reader->count) >> 3;
+		reader->count |= 56;
+	}
+	else
+	{
+		zio__bit_reader_refill_slow(reader, 1);
+	}
+}
+
+// Returns the next 'count' bits (0 to ZIO_BIT_MAX_READ) without consuming them.
+static inline zio_u64 zio_bit_peek_lsb(ZIOBitReader *reader, int count) { return reader->bits & ((1ULL << count) - 1); }
+static inline zio_u64 zio_bit_peek_msb(ZIOBitReader *reader, int count) { return (reader->bits >> 1) >> (63 - count); }
+
+// Consumes 'count' bits, which must not be more than are buffered.
+static inline void zio_bit_consume_lsb(ZIOBitReader *reader, int count) { reader->bits >>= count; reader->count -= count; }
+static inline void zio_bit_consume_msb(ZIOBitReader *reader, int count) { reader->bits <<= count; reader->count -= count; }
+
+// Refills, peeks and consumes 'count' bits.
+static inline zio_u64 zio_bit_read_lsb(ZIOBitReader *reader, int count)
+{
+	zio_bit_refill_lsb(reader);
+	zio_u64 value = zio_bit_peek_lsb(reader, count);
+	zio_bit_consume_lsb(reader, count);
+	return value;
+}
+static inline zio_u64 zio_bit_read_msb(ZIOBitReader *reader, int count)
+{
+	zio_bit_refill_msb(reader);
+	zio_u64 value = zio_bit_peek_msb(reader, count);
+	zio_bit_consume_msb(reader, count);
+	return value;
+}
+
+// Returns whether more bits have been consumed than there was data.
+static inline int zio_bit_reader_overrun(ZIOBitReader *reader) { return reader->count < reader->padding; }
+
+// Writes the low 'count' bits (0 to ZIO_BIT_MAX_WRITE) of 'value'.
+static inline void zio_bit_put_lsb(ZIOBitWriter *writer, zio_u64 value, int count)
+{
+	writer->bits |= (value & ((1ULL << count) - 1)) << writer->count;
+	writer->count += count;
+	if (writer->end - writer->pos < 8)
+		zio__bit_writer_flush_slow(writer);
+	zio__store_le64(writer->pos, writer->bits);
+	writer->pos += writer->count >> 3;
+	writer->bits >>= writer->count & ~7;
+	writer->count &= 7;
+}
+static inline void zio_bit_put_msb(ZIOBitWriter *writer, zio_u64 value, int count)
+{
+	writer->bits |= ((value & ((1ULL << count) - 1)) << (63 - writer->count - count)) << 1;
+	writer->count += count;
+	if (writer->end - writer->pos < 8)
+		zio__bit_writer_flush_slow(writer);
+	zio__store_be64(writer->pos, writer->bits);
+	writer->pos += writer->count >> 3;
+	writer->bits <<= writer->count & ~7;
+	writer->count &= 7;
+}
+#endif // Z_IO_NO_BITSTREAM
+
+// Frames
+#ifndef Z_IO_NO_FRAME
+// A frame is a 4 byte little endian payload size, optionally followed by a 4 byte little
+// endian CRC32C of the payload, followed by the payload.
+typedef enum
+{
+	ZIOF_CRC32C = 1<<0,
+} ZIOFrameFlags;
+
+typedef struct ZIOFrame
+{
+	const void *data;
+	zio_ll size;
+} ZIOFrame;
+
+typedef struct ZIOFramer
+{
+	ZIOHandle *handle;
+	zio_ll max_frame_size;
+	int flags;
+	char *buffer; // Reused for every frame read from a non-memory handle
+	zio_ll buffer_capacity;
+} ZIOFramer;
+
+// Both sides need to agree on 'flags'. Frames larger than 'max_frame_size' are rejected.
+ZIODEF zio_result zio_framer_begin(ZIOFramer *framer, ZIOHandle *handle, zio_ll max_frame_size, int flags);
+
+// Releases the frame buffer. Does not close the handle.
+ZIODEF void zio_framer_end(ZIOFramer *framer);
+
+// Writes header and payload with a single zio_writev().
+ZIODEF zio_result zio_frame_write(ZIOFramer *framer, const void *data, zio_ll size);
+
+// Returns ZIO_OK, ZIO_EOF if there are no more frames, or ZIO_ERROR.
+// For memory handles 'frame->data' points into the memory itself, otherwise it points into the
+// framer's buffer and is only valid until the next call to zio_frame_read() or zio_framer_end().
+ZIODEF zio_result zio_frame_read(ZIOFramer *framer, ZIOFrame *frame);
+
+// Updates 'crc' (start with 0) with 'size' bytes of 'data'.
+ZIODEF zio_u32 zio_crc32c(zio_u32 crc, const void *data, zio_ll size);
+#endif // Z_IO_NO_FRAME
+
+// Log sink
+#ifndef Z_IO_NO_LOG
+// Many threads append records to one handle. Each thread appends to its own block without
+// locking, and a flusher thread writes full blocks with zio_writev(). Every flush interval it also
+// takes the partially filled blocks of all writers, so records do not wait for a block to fill.
+// Every record is an 8 byte little endian sequence number, a 4 byte little endian payload size,
+// and the payload. Records from different threads can be written out of order, sort by the
+// sequence number to restore the order they were appended in.
+#ifndef ZIO_LOG_BLOCK_SIZE
+#define ZIO_LOG_BLOCK_SIZE 65536
+#endif
+
+#define ZIO_LOG_RECORD_HEADER_SIZE 12
+
+typedef struct ZIOLogSink
+{
+	void *state;
+} ZIOLogSink;
+
+// One per thread, can be either malloc'ed or simply created on the stack
+typedef struct ZIOLogWriter
+{
+	ZIOLogSink *sink;
+	void *volatile block; // Empty while a record is appended, so the flusher leaves it alone
+	struct ZIOLogWriter *prev;
+	struct ZIOLogWriter *next;
+} ZIOLogWriter;
+
+// Starts the flusher thread. A record is written within about 'flush_interval_ms' after it was appended,
+// or one interval later if the flusher found its writer in the middle of appending another record.
+// 'block_size' is the size of each thread's blocks, 0 means ZIO_LOG_BLOCK_SIZE.
+// 'handle' must not be used by anything else until zio_log_sink_end().
+ZIODEF zio_result zio_log_sink_begin(ZIOLogSink *sink, ZIOHandle *handle, zio_ll block_size, int flush_interval_ms);
+
+// Writes everything left and stops the flusher thread. All writers must have ended.
+// Returns ZIO_ERROR if any write failed.
+ZIODEF zio_result zio_log_sink_end(ZIOLogSink *sink);
+
+// Registers the writer with the flusher.
+ZIODEF void zio_log_writer_begin(ZIOLogWriter *writer, ZIOLogSink *sink);
+
+// Hands over the partially filled block, then detaches from the sink.
+ZIODEF void zio_log_writer_end(ZIOLogWriter *writer);
+
+// Appends a record. Only one thread may use a writer at a time.
+// Returns ZIO_ERROR if the record does not fit in a block, or memory ran out.
+ZIODEF zio_result zio_log_write(ZIOLogWriter *writer, const void *data, zio_ll size);
+
+// Hands over the partially filled block so it is written with the next flush.
+ZIODEF void zio_log_writer_flush(ZIOLogWriter *writer);
+#endif // Z_IO_NO_LOG
+
 #ifdef __cplusplus
 }
 #endif
@@ -140,10 +651,59 @@ static inline const char *zio_last_error(ZIOHandle *handle) { return handle->las
 
 #ifdef Z_IO_IMPLEMENTATION
 
+#if defined(__linux) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if defined(__linux) || defined(__APPLE__) || defined(__unix__)
+#define ZIO_POSIX
+#include <fcntl.h> // For posix_fadvise
+#include <sys/uio.h> // For pwritev
+#include <unistd.h> // For fileno, close
+#elif defined(_WIN32)
+#define ZIO_WINDOWS
+#include <io.h> // For _fdopen, _close
+#endif
+
+#if !defined(Z_IO_NO_LOG) || !defined(Z_IO_NO_ROTATE) || !defined(Z_IO_NO_THROTTLE) || !defined(Z_IO_NO_SCHEDULER)
+#define ZIO__THREADS
+#endif
+
+#include <time.h> // For time, clock_gettime
+
+#if defined(ZIO__THREADS) && defined(ZIO_POSIX)
+#include <pthread.h>
+#elif defined(ZIO_WINDOWS)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#undef WIN32_LEAN_AND_MEAN
+#undef NOMINMAX
+#endif
+
+#if defined(ZIO_MALLOC) && defined(ZIO_REALLOC) && defined(ZIO_FREE)
+// User-provided allocator
+#elif !defined(ZIO_MALLOC) && !defined(ZIO_REALLOC) && !defined(ZIO_FREE)
+#define ZIO_MALLOC(size, context) ((void)(context), malloc(size))
+#define ZIO_REALLOC(memory, size, context) ((void)(context), realloc(memory, size))
+#define ZIO_FREE(memory, context) ((void)(context), free(memory))
+#else
+#error "Define all or none of ZIO_MALLOC, ZIO_REALLOC and ZIO_FREE"
+#endif
+
+#ifndef ZIO_ALLOC_CONTEXT
+#define ZIO_ALLOC_CONTEXT NULL
+#endif
+
+#if !defined(Z_IO_NO_FRAME) && defined(__SSE4_2__)
+#include <nmmintrin.h> // For _mm_crc32_*
+#endif
+
 static inline void zio__zero_handle(ZIOHandle *handle)
 {
 	memset(handle, 0, sizeof(ZIOHandle));
@@ -160,6 +720,261 @@ static inline zio_result zio__set_error(ZIOHandle *handle, const char *error_str
 	return ZIO_ERROR;
 }
 
+// Atomics
+#if defined(_MSC_VER)
+static inline void *zio__atomic_load_ptr(void *volatile *p) { return InterlockedCompareExchangePointer(p, NULL, NULL); }
+static inline void *zio__atomic_exchange_ptr(void *volatile *p, void *value) { return InterlockedExchangePointer(p, value); }
+static inline void zio__atomic_store_ptr(void *volatile *p, void *value) { InterlockedExchangePointer(p, value); }
+static inline int zio__atomic_cas_ptr(void *volatile *p, void *expected, void *desired) { return InterlockedCompareExchangePointer(p, desired, expected) == expected; }
+static inline zio_u64 zio__atomic_fetch_add(volatile zio_u64 *p, zio_u64 value) { return (zio_u64)InterlockedExchangeAdd64((volatile LONG64*)p, (LONG64)value); }
+static inline zio_u64 zio__atomic_load_u64(volatile zio_u64 *p) { return (zio_u64)InterlockedCompareExchange64((volatile LONG64*)p, 0, 0); }
+static inline int zio__atomic_cas_u64(volatile zio_u64 *p, zio_u64 expected, zio_u64 desired) { return (zio_u64)InterlockedCompareExchange64((volatile LONG64*)p, (LONG64)desired, (LONG64)expected) == expected; }
+#else
+static inline void *zio__atomic_load_ptr(void *volatile *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void *zio__atomic_exchange_ptr(void *volatile *p, void *value) { return __atomic_exchange_n(p, value, __ATOMIC_ACQ_REL); }
+static inline void zio__atomic_store_ptr(void *volatile *p, void *value) { __atomic_store_n(p, value, __ATOMIC_RELEASE); }
+static inline int zio__atomic_cas_ptr(void *volatile *p, void *expected, void *desired) { return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); }
+static inline zio_u64 zio__atomic_fetch_add(volatile zio_u64 *p, zio_u64 value) { return __atomic_fetch_add(p, value, __ATOMIC_RELAXED); }
+static inline zio_u64 zio__atomic_load_u64(volatile zio_u64 *p) { return __atomic_load_n(p, __ATOMIC_RELAXED); }
+static inline int zio__atomic_cas_u64(volatile zio_u64 *p, zio_u64 expected, zio_u64 desired) { return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED); }
+#endif
+
+// Memory budget
+static volatile zio_u64 zio__memory_used;
+static volatile zio_u64 zio__memory_peak;
+static volatile zio_u64 zio__memory_failed;
+static zio_ll zio__memory_soft_limit;
+static zio_ll zio__memory_hard_limit;
+
+// Every allocation starts with its size, so it can be accounted for when freed
+#define ZIO__ALLOC_HEADER 16
+
+static inline int zio__memory_over_soft_limit(void)
+{
+	return (zio__memory_soft_limit > 0 && (zio_ll)zio__atomic_load_u64(&zio__memory_used) > zio__memory_soft_limit);
+}
+
+// Adds 'size' to the used memory, returns false if that goes over the hard limit
+static int zio__memory_reserve(zio_ll size)
+{
+	zio_u64 used = zio__atomic_fetch_add(&zio__memory_used, (zio_u64)size) + (zio_u64)size;
+	if (zio__memory_hard_limit > 0 && size > 0 && (zio_ll)used > zio__memory_hard_limit)
+	{
+		zio__atomic_fetch_add(&zio__memory_used, (zio_u64)-size);
+		zio__atomic_fetch_add(&zio__memory_failed, 1);
+		return 0;
+	}
+
+	zio_u64 peak;
+	while ((peak = zio__atomic_load_u64(&zio__memory_peak)) < used && !zio__atomic_cas_u64(&zio__memory_peak, peak, used));
+	return 1;
+}
+
+static void zio__memory_release(zio_ll size)
+{
+	zio__atomic_fetch_add(&zio__memory_used, (zio_u64)-size);
+}
+
+// Returns NULL if the allocation would go over the hard limit, or ZIO_MALLOC fails
+static void *zio__alloc(zio_ll size)
+{
+	if (!zio__memory_reserve(size))
+		return NULL;
+
+	char *memory = (char*)ZIO_MALLOC((size_t)(size + ZIO__ALLOC_HEADER), ZIO_ALLOC_CONTEXT);
+	if (!memory)
+	{
+		zio__memory_release(size);
+		zio__atomic_fetch_add(&zio__memory_failed, 1);
+		return NULL;
+	}
+	memcpy(memory, &size, sizeof(size));
+	return memory + ZIO__ALLOC_HEADER;
+}
+
+// Keeps the contents up to the smaller size. Returns NULL and leaves 'memory' as it was if it fails.
+static void *zio__realloc(void *memory, zio_ll size)
+{
+	if (!memory)
+		return zio__alloc(size);
+
+	char *base = (char*)memory - ZIO__ALLOC_HEADER;
+	zio_ll old_size;
+	memcpy(&old_size, base, sizeof(old_size));
+	if (!zio__memory_reserve(size - old_size))
+		return NULL;
+
+	char *new_base = (char*)ZIO_REALLOC(base, (size_t)(size + ZIO__ALLOC_HEADER), ZIO_ALLOC_CONTEXT);
+	if (!new_base)
+	{
+		zio__memory_release(size - old_size);
+		zio__atomic_fetch_add(&zio__memory_failed, 1);
+		return NULL;
+	}
+	memcpy(new_base, &size, sizeof(size));
+	return new_base + ZIO__ALLOC_HEADER;
+}
+
+static void *zio__alloc_zero(zio_ll size)
+{
+	void *memory = zio__alloc(size);
+	if (memory)
+		memset(memory, 0, (size_t)size);
+	return memory;
+}
+
+// For buffers that work with less. Allocates 'min_size' instead of 'size' when over the soft limit,
+// or when 'size' does not fit. Sets 'actual_size' to what was allocated.
+static void *zio__alloc_flexible(zio_ll size, zio_ll min_size, zio_ll *actual_size)
+{
+	void *memory = NULL;
+	if (!zio__memory_over_soft_limit())
+		memory = zio__alloc(size);
+	if (!memory)
+	{
+		size = min_size;
+		memory = zio__alloc(size);
+	}
+	*actual_size = (memory ? size : 0);
+	return memory;
+}
+
+static void zio__free(void *memory)
+{
+	if (!memory)
+		return;
+	char *base = (char*)memory - ZIO__ALLOC_HEADER;
+	zio_ll size;
+	memcpy(&size, base, sizeof(size));
+	zio__memory_release(size);
+	ZIO_FREE(base, ZIO_ALLOC_CONTEXT);
+}
+
+ZIODEF void zio_memory_set_limits(zio_ll soft_limit, zio_ll hard_limit)
+{
+	zio__memory_soft_limit = soft_limit;
+	zio__memory_hard_limit = hard_limit;
+}
+
+ZIODEF void zio_memory_stats(ZIOMemoryStats *stats)
+{
+	stats->used = (zio_ll)zio__atomic_load_u64(&zio__memory_used);
+	stats->peak = (zio_ll)zio__atomic_load_u64(&zio__memory_peak);
+	stats->failed = (zio_ll)zio__atomic_load_u64(&zio__memory_failed);
+	stats->soft_limit = zio__memory_soft_limit;
+	stats->hard_limit = zio__memory_hard_limit;
+}
+
+// Threads
+#ifdef ZIO__THREADS
+#if defined(ZIO_POSIX)
+typedef pthread_t zio__thread;
+typedef pthread_mutex_t zio__mutex;
+typedef pthread_cond_t zio__cond;
+#define ZIO__THREAD_PROC(name) static void *name(void *arg)
+#define ZIO__THREAD_RETURN return NULL
+
+static inline int zio__thread_start(zio__thread *thread, void *(*proc)(void*), void *arg) { return pthread_create(thread, NULL, proc, arg) == 0; }
+static inline void zio__thread_join(zio__thread thread) { pthread_join(thread, NULL); }
+static inline void zio__mutex_init(zio__mutex *mutex) { pthread_mutex_init(mutex, NULL); }
+static inline void zio__mutex_destroy(zio__mutex *mutex) { pthread_mutex_destroy(mutex); }
+static inline void zio__mutex_lock(zio__mutex *mutex) { pthread_mutex_lock(mutex); }
+static inline void zio__mutex_unlock(zio__mutex *mutex) { pthread_mutex_unlock(mutex); }
+static inline void zio__cond_init(zio__cond *cond) { pthread_cond_init(cond, NULL); }
+static inline void zio__cond_destroy(zio__cond *cond) { pthread_cond_destroy(cond); }
+static inline void zio__cond_signal(zio__cond *cond) { pthread_cond_signal(cond); }
+static inline void zio__cond_broadcast(zio__cond *cond) { pthread_cond_broadcast(cond); }
+static inline void zio__cond_wait(zio__cond *cond, zio__mutex *mutex) { pthread_cond_wait(cond, mutex); }
+static inline void zio__cond_timed_wait(zio__cond *cond, zio__mutex *mutex, int milliseconds)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += milliseconds / 1000;
+	ts.tv_nsec += (long)(milliseconds % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L)
+	{
+		ts.tv_nsec -= 1000000000L;
+		++ts.tv_sec;
+	}
+	pthread_cond_timedwait(cond, mutex, &ts);
+}
+#elif defined(ZIO_WINDOWS)
+typedef HANDLE zio__thread;
+typedef SRWLOCK zio__mutex;
+typedef CONDITION_VARIABLE zio__cond;
+#define ZIO__THREAD_PROC(name) static DWORD WINAPI name(LPVOID arg)
+#define ZIO__THREAD_RETURN return 0
+
+static inline int zio__thread_start(zio__thread *thread, LPTHREAD_START_ROUTINE proc, void *arg) { *thread = CreateThread(NULL, 0, proc, arg, 0, NULL); return *thread != NULL; }
+static inline void zio__thread_join(zio__thread thread) { WaitForSingleObject(thread, INFINITE); CloseHandle(thread); }
+static inline void zio__mutex_init(zio__mutex *mutex) { InitializeSRWLock(mutex); }
+static inline void zio__mutex_destroy(zio__mutex *mutex) { (void)mutex; }
+static inline void zio__mutex_lock(zio__mutex *mutex) { AcquireSRWLockExclusive(mutex); }
+static inline void zio__mutex_unlock(zio__mutex *mutex) { ReleaseSRWLockExclusive(mutex); }
+static inline void zio__cond_init(zio__cond *cond) { InitializeConditionVariable(cond); }
+static inline void zio__cond_destroy(zio__cond *cond) { (void)cond; }
+static inline void zio__cond_signal(zio__cond *cond) { WakeConditionVariable(cond); }
+static inline void zio__cond_broadcast(zio__cond *cond) { WakeAllConditionVariable(cond); }
+static inline void zio__cond_wait(zio__cond *cond, zio__mutex *mutex) { SleepConditionVariableSRW(cond, mutex, INFINITE, 0); }
+static inline void zio__cond_timed_wait(zio__cond *cond, zio__mutex *mutex, int milliseconds) { SleepConditionVariableSRW(cond, mutex, (DWORD)milliseconds, 0); }
+#endif
+
+
+// Monotonic time in nanoseconds
+#if defined(ZIO_POSIX)
+static inline zio_u64 zio__time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (zio_u64)ts.tv_sec * 1000000000ULL + (zio_u64)ts.tv_nsec;
+}
+static inline void zio__sleep_until_ns(zio_u64 deadline)
+{
+	struct timespec ts;
+	ts.tv_sec = (time_t)(deadline / 1000000000ULL);
+	ts.tv_nsec = (long)(deadline % 1000000000ULL);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+#elif defined(ZIO_WINDOWS)
+static inline zio_u64 zio__time_ns(void)
+{
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (zio_u64)(counter.QuadPart / frequency.QuadPart) * 1000000000ULL + (zio_u64)(counter.QuadPart % frequency.QuadPart) * 1000000000ULL / (zio_u64)frequency.QuadPart;
+}
+static inline void zio__sleep_until_ns(zio_u64 deadline)
+{
+	// Sleep() is only precise to the scheduler tick, sleep most of the way and yield for the rest
+	zio_u64 now;
+	while ((now = zio__time_ns()) < deadline)
+	{
+		zio_u64 remaining_ms = (deadline - now) / 1000000ULL;
+		Sleep(remaining_ms > 2 ? (DWORD)(remaining_ms - 2) : 0);
+	}
+}
+#endif
+#endif // ZIO__THREADS
+
+// Used by backends that have no better way of writing several buffers
+static zio_ll zio__generic_writev(ZIOHandle *handle, const ZIOVec *vecs, int count)
+{
+	zio_ll total = 0;
+	int i;
+	for (i = 0; i < count; ++i)
+	{
+		if (vecs[i].size <= 0)
+			continue;
+		zio_ll written = zio_write(handle, vecs[i].data, vecs[i].size);
+		if (written == ZIO_ERROR)
+			return ZIO_ERROR;
+		total += written;
+		if (written < vecs[i].size)
+			break;
+	}
+	return total;
+}
+
 // File I/O
 static zio_result zio__file_close(ZIOHandle *handle)
 {
@@ -185,31 +1000,341 @@ static zio_ll zio__file_seek(ZIOHandle *handle, zio_ll offset, ZIOSeek whence)
 }
 static zio_ll zio__file_read(ZIOHandle *handle, void *destination, zio_ll size)
 {
-	zio_ll read_count = fread(destination, size, 1, (FILE*)handle->data.file.handle);
+	zio_ll read_count = fread(destination, 1, size, (FILE*)handle->data.file.handle);
 	if (read_count == 0 && ferror((FILE*)handle->data.file.handle))
 		return zio__set_error(handle, strerror(errno));
-	return read_count * size;
+	return read_count;
 }
 static zio_ll zio__file_write(ZIOHandle *handle, const void *source, zio_ll size)
 {
-	zio_ll write_count = fwrite(source, size, 1, (FILE*)handle->data.file.handle);
+	zio_ll write_count = fwrite(source, 1, size, (FILE*)handle->data.file.handle);
 	if (write_count == 0 && ferror((FILE*)handle->data.file.handle))
-		return zio__set_error(handle, strerror(errno));;
-	return write_count * size;
-}
-
-// Memory I/O
-static zio_result zio__memory_close(ZIOHandle *handle)
-{
-	zio__zero_handle(handle);
-	return ZIO_OK;
+		return zio__set_error(handle, strerror(errno));
+	return write_count;
 }
-static zio_ll zio__memory_size(ZIOHandle *handle)
+#if defined(ZIO_POSIX)
+static zio_ll zio__file_writev(ZIOHandle *handle, const ZIOVec *vecs, int count)
 {
-	zio_ll size = (handle->data.mem.end - handle->data.mem.begin);
-	return size;
+	FILE *file = (FILE*)handle->data.file.handle;
+
+	// Write whatever stdio has buffered first, then write directly to the file and move the stream past it
+	if (fflush(file) != 0)
+		return zio__set_error(handle, strerror(errno));
+	off_t offset = ftello(file);
+	if (offset < 0)
+		return zio__set_error(handle, strerror(errno));
+
+	zio_ll total = 0;
+	int i = 0;
+	zio_ll vec_offset = 0;
+	while (i < count)
+	{
+		struct iovec iov[16];
+		int iov_count = 0;
+		int j;
+		for (j = i; j < count && iov_count < 16; ++j)
+		{
+			zio_ll skip = (j == i ? vec_offset : 0);
+			if (vecs[j].size - skip <= 0)
+				continue;
+			iov[iov_count].iov_base = (char*)vecs[j].data + skip;
+			iov[iov_count].iov_len = (size_t)(vecs[j].size - skip);
+			++iov_count;
+		}
+		if (iov_count == 0)
+			break;
+
+		ssize_t written = pwritev(fileno(file), iov, iov_count, offset + total);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			fseeko(file, offset + total, SEEK_SET);
+			return zio__set_error(handle, strerror(errno));
+		}
+		if (written == 0)
+			break;
+		total += written;
+
+		// Advance past what was written, which might end in the middle of a buffer
+		vec_offset += written;
+		while (i < count && vec_offset >= vecs[i].size)
+		{
+			vec_offset -= (vecs[i].size > 0 ? vecs[i].size : 0);
+			++i;
+		}
+	}
+
+	if (fseeko(file, offset + total, SEEK_SET) != 0)
+		return zio__set_error(handle, strerror(errno));
+	return total;
 }
-static zio_ll zio__memory_seek(ZIOHandle *handle, zio_ll offset, ZIOSeek whence)
+#else
+#define zio__file_writev zio__generic_writev
+#endif
+
+static const ZIOVtable zio__file_vtable =
+{
+	zio__file_close,
+	zio__file_size,
+	zio__file_seek,
+	zio__file_read,
+	zio__file_write,
+	zio__file_writev,
+};
+
+// Adaptive file buffering
+#define ZIO__ACCESS_HISTORY 8
+// Reading ahead over strides longer than this reads more that is skipped than is used
+#define ZIO__MAX_BUFFERED_STRIDE (ZIO_FILE_MAX_READ_AHEAD / 4)
+
+typedef struct zio__file_reader
+{
+	char *buffer;
+	zio_ll capacity;
+	zio_ll start;  // File offset of buffer[0], the file itself is at start + length
+	zio_ll length; // Valid bytes in the buffer
+	zio_ll pos;    // Read position in the buffer
+
+	zio_ll last_offset;
+	zio_ll last_end;
+	unsigned history; // The last ZIO__ACCESS_HISTORY classifications, 2 bits each
+
+	ZIOFileStats stats;
+} zio__file_reader;
+
+static void zio__file_advise(zio__file_reader *reader, FILE *file, zio_ll offset, zio_ll size)
+{
+#if defined(ZIO_POSIX) && defined(POSIX_FADV_SEQUENTIAL)
+	int advice;
+	if (size > 0)
+		advice = POSIX_FADV_WILLNEED;
+	else if (reader->stats.pattern == ZIO_ACCESS_SEQUENTIAL)
+		advice = POSIX_FADV_SEQUENTIAL;
+	else if (reader->stats.pattern == ZIO_ACCESS_RANDOM)
+		advice = POSIX_FADV_RANDOM;
+	else
+		advice = POSIX_FADV_NORMAL;
+	posix_fadvise(fileno(file), (off_t)offset, (off_t)size, advice);
+#endif
+}
+
+// Classifies a read and picks the read-ahead for the pattern the recent reads agree on
+static void zio__file_classify(zio__file_reader *reader, FILE *file, zio_ll offset, zio_ll size)
+{
+	ZIOAccessPattern access;
+	zio_ll stride = offset - reader->last_offset;
+	if (offset == reader->last_end)
+		access = ZIO_ACCESS_SEQUENTIAL;
+	else if (stride != 0 && stride == reader->stats.stride)
+		access = ZIO_ACCESS_STRIDED;
+	else
+		access = ZIO_ACCESS_RANDOM;
+	reader->stats.stride = stride;
+	reader->last_offset = offset;
+	reader->last_end = offset + size;
+	reader->history = ((reader->history << 2) | (unsigned)access) & ((1u << (2 * ZIO__ACCESS_HISTORY)) - 1);
+
+	// Majority of the history, ties go to the latest read
+	int counts[4] = {0, 0, 0, 0};
+	int i;
+	for (i = 0; i < ZIO__ACCESS_HISTORY; ++i)
+		counts[(reader->history >> (2 * i)) & 3]++;
+	ZIOAccessPattern pattern = access;
+	for (i = ZIO_ACCESS_SEQUENTIAL; i <= ZIO_ACCESS_RANDOM; ++i)
+	{
+		if (counts[i] > counts[pattern])
+			pattern = (ZIOAccessPattern)i;
+	}
+
+	if (pattern != reader->stats.pattern)
+	{
+		reader->stats.pattern = pattern;
+		reader->stats.pattern_changes++;
+		if (pattern == ZIO_ACCESS_SEQUENTIAL)
+			reader->stats.read_ahead = ZIO_FILE_MIN_READ_AHEAD; // Grows with every buffer fill
+		else if (pattern == ZIO_ACCESS_RANDOM)
+			reader->stats.read_ahead = 0;
+		zio__file_advise(reader, file, 0, 0);
+	}
+
+	if (pattern == ZIO_ACCESS_STRIDED)
+	{
+		zio_ll distance = (stride < 0 ? -stride : stride);
+		if (stride > 0 && distance <= ZIO__MAX_BUFFERED_STRIDE)
+		{
+			// Cover the next few strides with one fill
+			reader->stats.read_ahead = distance * 4;
+			if (reader->stats.read_ahead > ZIO_FILE_MAX_READ_AHEAD)
+				reader->stats.read_ahead = ZIO_FILE_MAX_READ_AHEAD;
+		}
+		else
+		{
+			// Read directly, but let the OS fetch the next one in the background
+			reader->stats.read_ahead = 0;
+			if (offset + stride >= 0)
+				zio__file_advise(reader, file, offset + stride, size);
+		}
+	}
+}
+
+static zio_result zio__file_buffered_close(ZIOHandle *handle)
+{
+	zio__file_reader *reader = (zio__file_reader*)handle->data.file.reader;
+	zio__free(reader->buffer);
+	zio__free(reader);
+	handle->data.file.reader = NULL;
+	return zio__file_close(handle);
+}
+static zio_ll zio__file_buffered_size(ZIOHandle *handle)
+{
+	zio__file_reader *reader = (zio__file_reader*)handle->data.file.reader;
+	FILE *file = (FILE*)handle->data.file.handle;
+
+	// Put the file back where the buffer ends, so the buffer stays valid
+	if (fseek(file, 0, SEEK_END) != 0)
+		return zio__set_error(handle, strerror(errno));
+	zio_ll size = ftell(file);
+	if (fseek(file, (long)(reader->start + reader->length), SEEK_SET) != 0)
+		return zio__set_error(handle, strerror(errno));
+	return size;
+}
+static zio_ll zio__file_buffered_seek(ZIOHandle *handle, zio_ll offset, ZIOSeek whence)
+{
+	zio__file_reader *reader = (zio__file_reader*)handle->data.file.reader;
+	zio_ll target;
+	switch (whence)
+	{
+	case ZIO_SEEK_SET:
+		target = offset;
+		break;
+	case ZIO_SEEK_CUR:
+		target = reader->start + reader->pos + offset;
+		break;
+	case ZIO_SEEK_END:
+	{
+		zio_ll size = zio__file_buffered_size(handle);
+		if (size == ZIO_ERROR)
+			return ZIO_ERROR;
+		target = size + offset;
+		break;
+	}
+	default:
+		return zio__set_error(handle, "Invalid whence value");
+	}
+	if (target < 0)
+		return zio__set_error(handle, "Invalid offset");
+
+	if (target >= reader->start && target <= reader->start + reader->length)
+	{
+		reader->pos = target - reader->start;
+		return target;
+	}
+
+	if (fseek((FILE*)handle->data.file.handle, (long)target, SEEK_SET) != 0)
+		return zio__set_error(handle, strerror(errno));
+	reader->start = target;
+	reader->length = 0;
+	reader->pos = 0;
+	return target;
+}
+static zio_ll zio__file_buffered_read(ZIOHandle *handle, void *destination, zio_ll size)
+{
+	zio__file_reader *reader = (zio__file_reader*)handle->data.file.reader;
+	FILE *file = (FILE*)handle->data.file.handle;
+	char *dest = (char*)destination;
+	if (size <= 0)
+		return 0;
+
+	zio__file_classify(reader, file, reader->start + reader->pos, size);
+	reader->stats.reads++;
+	reader->stats.bytes_requested += size;
+
+	zio_ll total = reader->length - reader->pos;
+	if (total > size)
+		total = size;
+	if (total > 0)
+	{
+		memcpy(dest, reader->buffer + reader->pos, (size_t)total);
+		reader->pos += total;
+		if (total == size)
+		{
+			reader->stats.buffer_hits++;
+			return total;
+		}
+	}
+
+	// The buffer is used up, continue from where the file is
+	zio_ll remaining = size - total;
+	reader->start += reader->length;
+	reader->length = 0;
+	reader->pos = 0;
+
+	zio_ll read_ahead = reader->stats.read_ahead;
+	if (read_ahead > remaining && (reader->capacity < read_ahead || (zio__memory_over_soft_limit() && reader->capacity > ZIO_FILE_MIN_READ_AHEAD)))
+	{
+		zio__free(reader->buffer);
+		reader->buffer = (char*)zio__alloc_flexible(read_ahead, ZIO_FILE_MIN_READ_AHEAD, &reader->capacity);
+	}
+	if (read_ahead > reader->capacity)
+		read_ahead = reader->capacity;
+
+	zio_ll read_count;
+	if (read_ahead <= remaining)
+	{
+		read_count = fread(dest + total, 1, (size_t)remaining, file);
+		reader->start += read_count;
+		total += read_count;
+	}
+	else
+	{
+		read_count = fread(reader->buffer, 1, (size_t)read_ahead, file);
+		reader->length = read_count;
+		reader->pos = (read_count < remaining ? read_count : remaining);
+		memcpy(dest + total, reader->buffer, (size_t)reader->pos);
+		total += reader->pos;
+
+		if (reader->stats.pattern == ZIO_ACCESS_SEQUENTIAL && reader->stats.read_ahead < ZIO_FILE_MAX_READ_AHEAD)
+			reader->stats.read_ahead *= 2;
+	}
+	reader->stats.file_reads++;
+	reader->stats.bytes_read += read_count;
+
+	if (total == 0 && ferror(file))
+		return zio__set_error(handle, strerror(errno));
+	return total;
+}
+
+static const ZIOVtable zio__file_buffered_vtable =
+{
+	zio__file_buffered_close,
+	zio__file_buffered_size,
+	zio__file_buffered_seek,
+	zio__file_buffered_read,
+	zio__file_write,
+	zio__file_writev,
+};
+
+ZIODEF zio_result zio_file_stats(ZIOHandle *handle, ZIOFileStats *stats)
+{
+	if (handle->vtable != &zio__file_buffered_vtable)
+		return zio__set_error(handle, "Not a read-only file handle");
+	*stats = ((zio__file_reader*)handle->data.file.reader)->stats;
+	return ZIO_OK;
+}
+
+// Memory I/O
+static zio_result zio__memory_close(ZIOHandle *handle)
+{
+	zio__zero_handle(handle);
+	return ZIO_OK;
+}
+static zio_ll zio__memory_size(ZIOHandle *handle)
+{
+	zio_ll size = (handle->data.mem.end - handle->data.mem.begin);
+	return size;
+}
+static zio_ll zio__memory_seek(ZIOHandle *handle, zio_ll offset, ZIOSeek whence)
 {
 	char *new_pos;
 	switch (whence)
@@ -264,42 +1389,137 @@ static zio_ll zio__memory_write(ZIOHandle *handle, const void *source, zio_ll si
 	handle->data.mem.pos += total_bytes;
 	return total_bytes;
 }
+static zio_ll zio__memory_writev(ZIOHandle *handle, const ZIOVec *vecs, int count)
+{
+	zio_ll total = 0;
+	int i;
+	for (i = 0; i < count; ++i)
+	{
+		zio_ll mem_available = (handle->data.mem.end - handle->data.mem.pos);
+		zio_ll size = vecs[i].size;
+		if (size > mem_available)
+			size = mem_available;
+		if (size <= 0)
+			continue;
+		memcpy(handle->data.mem.pos, vecs[i].data, size);
+		handle->data.mem.pos += size;
+		total += size;
+	}
+	return total;
+}
 static zio_ll zio__const_memory_write(ZIOHandle *handle, const void *source, zio_ll size)
 {
 	return zio__set_error(handle, "Cannot write to const memory");
 }
+static zio_ll zio__const_memory_writev(ZIOHandle *handle, const ZIOVec *vecs, int count)
+{
+	(void)vecs;
+	(void)count;
+	return zio__set_error(handle, "Cannot write to const memory");
+}
 
-ZIODEF zio_result zio_open_file(ZIOHandle *handle, const char *filename, ZIOMode mode)
+static const ZIOVtable zio__memory_vtable =
 {
-	char mode_flags[7];
+	zio__memory_close,
+	zio__memory_size,
+	zio__memory_seek,
+	zio__memory_read,
+	zio__memory_write,
+	zio__memory_writev,
+};
+
+static const ZIOVtable zio__const_memory_vtable =
+{
+	zio__memory_close,
+	zio__memory_size,
+	zio__memory_seek,
+	zio__memory_read,
+	zio__const_memory_write,
+	zio__const_memory_writev,
+};
+
+// Memory handles are read and written in place by the bitstreams and framers
+static inline int zio__is_memory(ZIOHandle *handle)
+{
+	return (handle->vtable == &zio__memory_vtable || handle->vtable == &zio__const_memory_vtable);
+}
+
+// Builds the stdio mode string for 'mode'
+static void zio__file_mode(ZIOMode mode, char mode_flags[7])
+{
+	int i = 0;
+	if (zio__test_flag(mode, ZIOM_WRITE))
+		mode_flags[i++] = 'w';
+	else if (zio__test_flag(mode, ZIOM_READ))
+		mode_flags[i++] = 'r';
+	if (zio__test_flag(mode, ZIOM_WRITE | ZIOM_READ))
+		mode_flags[i++] = '+';
+	mode_flags[i++] = 'b'; // Always open in binary mode
+	mode_flags[i] = '\0';
+}
+
+static zio_result zio__open_stdio(ZIOHandle *handle, FILE *file, ZIOMode mode)
+{
+	handle->data.file.handle = file;
 
-	// Build mode string
+	handle->vtable = &zio__file_vtable;
+
+	// Read-only files bypass the stdio buffer for the adaptive one, or keep it if there is no memory
+	if (!zio__test_flag(mode, ZIOM_WRITE))
 	{
-		int i = 0;
-		if (zio__test_flag(mode, ZIOM_WRITE))
-			mode_flags[i++] = 'w';
-		else if (zio__test_flag(mode, ZIOM_READ))
-			mode_flags[i++] = 'r';
-		if (zio__test_flag(mode, ZIOM_WRITE | ZIOM_READ))
-			mode_flags[i++] = '+';
-		mode_flags[i++] = 'b'; // Always open in binary mode
-		mode_flags[i] = '\0';
+		zio__file_reader *reader = (zio__file_reader*)zio__alloc_zero(sizeof(zio__file_reader));
+		if (reader && setvbuf(file, NULL, _IONBF, 0) == 0)
+		{
+			reader->stats.read_ahead = ZIO_FILE_MIN_READ_AHEAD;
+			handle->data.file.reader = reader;
+			handle->vtable = &zio__file_buffered_vtable;
+		}
+		else
+		{
+			zio__free(reader);
+		}
 	}
+	return ZIO_OK;
+}
+
+ZIODEF zio_result zio_open_file(ZIOHandle *handle, const char *filename, ZIOMode mode)
+{
+	char mode_flags[7];
+	zio__file_mode(mode, mode_flags);
 
 	zio__zero_handle(handle);
 
 	FILE *file = fopen(filename, mode_flags);
 	if (!file)
 		return zio__set_error(handle, strerror(errno));
+	return zio__open_stdio(handle, file, mode);
+}
 
-	handle->data.file.handle = file;
+ZIODEF zio_result zio_open_fd(ZIOHandle *handle, int fd, ZIOMode mode)
+{
+	char mode_flags[7];
+	zio__file_mode(mode, mode_flags);
 
-	handle->close = zio__file_close;
-	handle->size  = zio__file_size;
-	handle->seek  = zio__file_seek;
-	handle->read  = zio__file_read;
-	handle->write = zio__file_write;
-	return ZIO_OK;
+	zio__zero_handle(handle);
+
+	if (fd < 0)
+		return zio__set_error(handle, strerror(EBADF));
+#if defined(ZIO_WINDOWS)
+	FILE *file = _fdopen(fd, mode_flags);
+#else
+	FILE *file = fdopen(fd, mode_flags);
+#endif
+	if (!file)
+	{
+		zio_result result = zio__set_error(handle, strerror(errno));
+#if defined(ZIO_WINDOWS)
+		_close(fd);
+#else
+		close(fd);
+#endif
+		return result;
+	}
+	return zio__open_stdio(handle, file, mode);
 }
 
 ZIODEF zio_result zio_open_memory(ZIOHandle *handle, void *memory, zio_ll size)
@@ -313,11 +1533,7 @@ ZIODEF zio_result zio_open_memory(ZIOHandle *handle, void *memory, zio_ll size)
 	handle->data.mem.pos = handle->data.mem.begin;
 	handle->data.mem.end = handle->data.mem.begin + size;
 
-	handle->close = zio__memory_close;
-	handle->size  = zio__memory_size;
-	handle->seek  = zio__memory_seek;
-	handle->read  = zio__memory_read;
-	handle->write = zio__memory_write;
+	handle->vtable = &zio__memory_vtable;
 	return ZIO_OK;
 }
 
@@ -332,12 +1548,1594 @@ ZIODEF zio_result zio_open_const_memory(ZIOHandle *handle, const void *memory, z
 	handle->data.mem.pos = handle->data.mem.begin;
 	handle->data.mem.end = handle->data.mem.begin + size;
 
-	handle->close = zio__memory_close;
-	handle->size  = zio__memory_size;
-	handle->seek  = zio__memory_seek;
-	handle->read  = zio__memory_read;
-	handle->write = zio__const_memory_write;
+	handle->vtable = &zio__const_memory_vtable;
+	return ZIO_OK;
+}
+
+// Handle pool
+typedef struct zio__handle_slab
+{
+	struct zio__handle_slab *next;
+	ZIOHandle handles[1];
+} zio__handle_slab;
+
+ZIODEF void zio_handle_pool_begin(ZIOHandlePool *pool, zio_ll handles_per_slab)
+{
+	memset(pool, 0, sizeof(ZIOHandlePool));
+	pool->handles_per_slab = (handles_per_slab > 0 ? handles_per_slab : ZIO_HANDLE_POOL_SLAB_SIZE);
+}
+
+ZIODEF void zio_handle_pool_end(ZIOHandlePool *pool)
+{
+	zio__handle_slab *slab = (zio__handle_slab*)pool->slabs;
+	while (slab)
+	{
+		zio__handle_slab *next = slab->next;
+		zio__free(slab);
+		slab = next;
+	}
+	memset(pool, 0, sizeof(ZIOHandlePool));
+}
+
+ZIODEF ZIOHandle *zio_handle_pool_alloc(ZIOHandlePool *pool)
+{
+	ZIOHandle *handle = pool->free_list;
+	if (handle)
+	{
+		pool->free_list = handle->data.pool.next;
+	}
+	else
+	{
+		// Handles are carved out of the newest slab as needed, so a new slab is not touched all at once
+		if (pool->next == pool->slab_end)
+		{
+			zio__handle_slab *slab = (zio__handle_slab*)zio__alloc(sizeof(zio__handle_slab) + (pool->handles_per_slab - 1) * sizeof(ZIOHandle));
+			if (!slab)
+				return NULL;
+			slab->next = (zio__handle_slab*)pool->slabs;
+			pool->slabs = slab;
+			pool->next = slab->handles;
+			pool->slab_end = slab->handles + pool->handles_per_slab;
+		}
+		handle = pool->next++;
+	}
+	zio__zero_handle(handle);
+	return handle;
+}
+
+ZIODEF void zio_handle_pool_free(ZIOHandlePool *pool, ZIOHandle *handle)
+{
+	if (!handle)
+		return;
+	handle->vtable = NULL;
+	handle->data.pool.next = pool->free_list;
+	pool->free_list = handle;
+}
+
+// Bitstreams
+#ifndef Z_IO_NO_BITSTREAM
+ZIODEF zio_result zio_bit_reader_begin(ZIOBitReader *reader, ZIOHandle *handle)
+{
+	memset(reader, 0, sizeof(ZIOBitReader));
+	reader->handle = handle;
+
+	if (zio__is_memory(handle))
+	{
+		reader->pos = (const unsigned char*)handle->data.mem.pos;
+		reader->end = (const unsigned char*)handle->data.mem.end;
+		return ZIO_OK;
+	}
+
+	reader->buffer = (unsigned char*)zio__alloc_flexible(ZIO_BIT_BUFFER_SIZE, ZIO_BIT_MIN_BUFFER_SIZE, &reader->buffer_size);
+	if (!reader->buffer)
+		return zio__set_error(handle, "Out of memory");
+	reader->pos = reader->buffer;
+	reader->end = reader->buffer;
+	return ZIO_OK;
+}
+
+ZIODEF zio_result zio_bit_reader_end(ZIOBitReader *reader)
+{
+	zio_ll unread = reader->end - reader->pos;
+	if (reader->count > reader->padding)
+		unread += (reader->count - reader->padding) >> 3;
+
+	zio_result result = ZIO_OK;
+	if (!reader->buffer)
+	{
+		reader->handle->data.mem.pos = (char*)reader->pos - ((reader->count > reader->padding) ? ((reader->count - reader->padding) >> 3) : 0);
+	}
+	else
+	{
+		if (unread > 0 && zio_seek(reader->handle, -unread, ZIO_SEEK_CUR) == ZIO_ERROR)
+			result = ZIO_ERROR;
+		zio__free(reader->buffer);
+	}
+
+	memset(reader, 0, sizeof(ZIOBitReader));
+	return result;
+}
+
+static void zio__bit_reader_fill(ZIOBitReader *reader)
+{
+	// Memory handles are read in place, so there is nothing more to fill
+	if (!reader->buffer || reader->at_end)
+		return;
+
+	zio_ll left = reader->end - reader->pos;
+	memmove(reader->buffer, reader->pos, left);
+
+	zio_ll read_count = zio_read(reader->handle, reader->buffer + left, reader->buffer_size - left);
+	if (read_count <= 0)
+	{
+		// Errors are treated as end of data, the error string is kept in the handle
+		read_count = 0;
+		reader->at_end = 1;
+	}
+
+	reader->pos = reader->buffer;
+	reader->end = reader->buffer + left + read_count;
+}
+
+ZIODEF void zio__bit_reader_refill_slow(ZIOBitReader *reader, int msb_first)
+{
+	zio__bit_reader_fill(reader);
+
+	// Stops below 64 bits like the fast path, which shifts by the count
+	while (reader->count < ZIO_BIT_MAX_READ)
+	{
+		zio_u64 byte = 0;
+		if (reader->pos < reader->end)
+			byte = *reader->pos++;
+		else
+			reader->padding += 8;
+
+		if (msb_first)
+			reader->bits |= byte << (56 - reader->count);
+		else
+			reader->bits |= byte << reader->count;
+		reader->count += 8;
+	}
+}
+
+static void zio__bit_writer_commit(ZIOBitWriter *writer)
+{
+	if (!writer->buffer)
+	{
+		writer->handle->data.mem.pos = (char*)writer->pos;
+		return;
+	}
+
+	zio_ll size = writer->pos - writer->buffer;
+	if (size > 0 && zio_write(writer->handle, writer->buffer, size) != size)
+		writer->failed = 1;
+	writer->pos = writer->buffer;
+}
+
+ZIODEF zio_result zio_bit_writer_begin(ZIOBitWriter *writer, ZIOHandle *handle)
+{
+	memset(writer, 0, sizeof(ZIOBitWriter));
+	writer->handle = handle;
+
+	if (handle->vtable == &zio__memory_vtable)
+	{
+		writer->pos = (unsigned char*)handle->data.mem.pos;
+		writer->end = (unsigned char*)handle->data.mem.end;
+		return ZIO_OK;
+	}
+
+	writer->buffer = (unsigned char*)zio__alloc_flexible(ZIO_BIT_BUFFER_SIZE, ZIO_BIT_MIN_BUFFER_SIZE, &writer->buffer_size);
+	if (!writer->buffer)
+		return zio__set_error(handle, "Out of memory");
+	writer->pos = writer->buffer;
+	writer->end = writer->buffer + writer->buffer_size;
+	return ZIO_OK;
+}
+
+ZIODEF zio_result zio_bit_writer_end(ZIOBitWriter *writer)
+{
+	// Every put stores the partial byte at 'pos', so it only has to be included
+	if (writer->count > 0)
+		++writer->pos;
+	zio__bit_writer_commit(writer);
+
+	zio_result result = (writer->failed ? ZIO_ERROR : ZIO_OK);
+	if (writer->buffer != writer->tail)
+		zio__free(writer->buffer);
+	memset(writer, 0, sizeof(ZIOBitWriter));
+	return result;
+}
+
+ZIODEF void zio__bit_writer_flush_slow(ZIOBitWriter *writer)
+{
+	zio__bit_writer_commit(writer);
+
+	if (!writer->buffer)
+	{
+		// The end of the memory is near, continue through a small buffer so words can still be
+		// stored whole. The memory handle truncates what does not fit.
+		writer->buffer = writer->tail;
+		writer->pos = writer->tail;
+		writer->end = writer->tail + sizeof(writer->tail);
+	}
+}
+#endif // Z_IO_NO_BITSTREAM
+
+// Frames
+#ifndef Z_IO_NO_FRAME
+static const zio_u32 zio__crc32c_table[256] =
+{
+	0x00000000, 0xF26B8303, 0xE13B70F7, 0x1350F3F4, 0xC79A971F, 0x35F1141C, 0x26A1E7E8, 0xD4CA64EB,
+	0x8AD958CF, 0x78B2DBCC, 0x6BE22838, 0x9989AB3B, 0x4D43CFD0, 0xBF284CD3, 0xAC78BF27, 0x5E133C24,
+	0x105EC76F, 0xE235446C, 0xF165B798, 0x030E349B, 0xD7C45070, 0x25AFD373, 0x36FF2087, 0xC494A384,
+	0x9A879FA0, 0x68EC1CA3, 0x7BBCEF57, 0x89D76C54, 0x5D1D08BF, 0xAF768BBC, 0xBC267848, 0x4E4DFB4B,
+	0x20BD8EDE, 0xD2D60DDD, 0xC186FE29, 0x33ED7D2A, 0xE72719C1, 0x154C9AC2, 0x061C6936, 0xF477EA35,
+	0xAA64D611, 0x580F5512, 0x4B5FA6E6, 0xB93425E5, 0x6DFE410E, 0x9F95C20D, 0x8CC531F9, 0x7EAEB2FA,
+	0x30E349B1, 0xC288CAB2, 0xD1D83946, 0x23B3BA45, 0xF779DEAE, 0x05125DAD, 0x1642AE59, 0xE4292D5A,
+	0xBA3A117E, 0x4851927D, 0x5B016189, 0xA96AE28A, 0x7DA08661, 0x8FCB0562, 0x9C9BF696, 0x6EF07595,
+	0x417B1DBC, 0xB3109EBF, 0xA0406D4B, 0x522BEE48, 0x86E18AA3, 0x748A09A0, 0x67DAFA54, 0x95B17957,
+	0xCBA24573, 0x39C9C670, 0x2A993584, 0xD8F2B687, 0x0C38D26C, 0xFE53516F, 0xED03A29B, 0x1F682198,
+	0x5125DAD3, 0xA34E59D0, 0xB01EAA24, 0x42752927, 0x96BF4DCC, 0x64D4CECF, 0x77843D3B, 0x85EFBE38,
+	0xDBFC821C, 0x2997011F, 0x3AC7F2EB, 0xC8AC71E8, 0x1C661503, 0xEE0D9600, 0xFD5D65F4, 0x0F36E6F7,
+	0x61C69362, 0x93AD1061, 0x80FDE395, 0x72966096, 0xA65C047D, 0x5437877E, 0x4767748A, 0xB50CF789,
+	0xEB1FCBAD, 0x197448AE, 0x0A24BB5A, 0xF84F3859, 0x2C855CB2, 0xDEEEDFB1, 0xCDBE2C45, 0x3FD5AF46,
+	0x7198540D, 0x83F3D70E, 0x90A324FA, 0x62C8A7F9, 0xB602C312, 0x44694011, 0x5739B3E5, 0xA55230E6,
+	0xFB410CC2, 0x092A8FC1, 0x1A7A7C35, 0xE811FF36, 0x3CDB9BDD, 0xCEB018DE, 0xDDE0EB2A, 0x2F8B6829,
+	0x82F63B78, 0x709DB87B, 0x63CD4B8F, 0x91A6C88C, 0x456CAC67, 0xB7072F64, 0xA457DC90, 0x563C5F93,
+	0x082F63B7, 0xFA44E0B4, 0xE9141340, 0x1B7F9043, 0xCFB5F4A8, 0x3DDE77AB, 0x2E8E845F, 0xDCE5075C,
+	0x92A8FC17, 0x60C37F14, 0x73938CE0, 0x81F80FE3, 0x55326B08, 0xA759E80B, 0xB4091BFF, 0x466298FC,
+	0x1871A4D8, 0xEA1A27DB, 0xF94AD42F, 0x0B21572C, 0xDFEB33C7, 0x2D80B0C4, 0x3ED04330, 0xCCBBC033,
+	0xA24BB5A6, 0x502036A5, 0x4370C551, 0xB11B4652, 0x65D122B9, 0x97BAA1BA, 0x84EA524E, 0x7681D14D,
+	0x2892ED69, 0xDAF96E6A, 0xC9A99D9E, 0x3BC21E9D, 0xEF087A76, 0x1D63F975, 0x0E330A81, 0xFC588982,
+	0xB21572C9, 0x407EF1CA, 0x532E023E, 0xA145813D, 0x758FE5D6, 0x87E466D5, 0x94B49521, 0x66DF1622,
+	0x38CC2A06, 0xCAA7A905, 0xD9F75AF1, 0x2B9CD9F2, 0xFF56BD19, 0x0D3D3E1A, 0x1E6DCDEE, 0xEC064EED,
+	0xC38D26C4, 0x31E6A5C7, 0x22B65633, 0xD0DDD530, 0x0417B1DB, 0xF67C32D8, 0xE52CC12C, 0x1747422F,
+	0x49547E0B, 0xBB3FFD08, 0xA86F0EFC, 0x5A048DFF, 0x8ECEE914, 0x7CA56A17, 0x6FF599E3, 0x9D9E1AE0,
+	0xD3D3E1AB, 0x21B862A8, 0x32E8915C, 0xC083125F, 0x144976B4, 0xE622F5B7, 0xF5720643, 0x07198540,
+	0x590AB964, 0xAB613A67, 0xB831C993, 0x4A5A4A90, 0x9E902E7B, 0x6CFBAD78, 0x7FAB5E8C, 0x8DC0DD8F,
+	0xE330A81A, 0x115B2B19, 0x020BD8ED, 0xF0605BEE, 0x24AA3F05, 0xD6C1BC06, 0xC5914FF2, 0x37FACCF1,
+	0x69E9F0D5, 0x9B8273D6, 0x88D28022, 0x7AB90321, 0xAE7367CA, 0x5C18E4C9, 0x4F48173D, 0xBD23943E,
+	0xF36E6F75, 0x0105EC76, 0x12551F82, 0xE03E9C81, 0x34F4F86A, 0xC69F7B69, 0xD5CF889D, 0x27A40B9E,
+	0x79B737BA, 0x8BDCB4B9, 0x988C474D, 0x6AE7C44E, 0xBE2DA0A5, 0x4C4623A6, 0x5F16D052, 0xAD7D5351,
+};
+
+ZIODEF zio_u32 zio_crc32c(zio_u32 crc, const void *data, zio_ll size)
+{
+	const unsigned char *p = (const unsigned char*)data;
+	crc = ~crc;
+#if defined(__SSE4_2__) && (defined(__x86_64__) || defined(_M_X64))
+	for (; size >= 8; size -= 8, p += 8)
+	{
+		unsigned long long word;
+		memcpy(&word, p, 8);
+		crc = (zio_u32)_mm_crc32_u64(crc, word);
+	}
+	for (; size > 0; --size, ++p)
+		crc = _mm_crc32_u8(crc, *p);
+#elif defined(__SSE4_2__)
+	// _mm_crc32_u64 only exists on x86-64
+	for (; size >= 4; size -= 4, p += 4)
+	{
+		unsigned int word;
+		memcpy(&word, p, 4);
+		crc = _mm_crc32_u32(crc, word);
+	}
+	for (; size > 0; --size, ++p)
+		crc = _mm_crc32_u8(crc, *p);
+#else
+	for (; size > 0; --size, ++p)
+		crc = zio__crc32c_table[(crc ^ *p) & 0xFF] ^ (crc >> 8);
+#endif
+	return ~crc;
+}
+
+static inline void zio__store_le32(unsigned char *p, zio_u32 v)
+{
+	p[0] = (unsigned char)v;
+	p[1] = (unsigned char)(v >> 8);
+	p[2] = (unsigned char)(v >> 16);
+	p[3] = (unsigned char)(v >> 24);
+}
+static inline zio_u32 zio__load_le32(const unsigned char *p)
+{
+	return ((zio_u32)p[0]) | ((zio_u32)p[1] << 8) | ((zio_u32)p[2] << 16) | ((zio_u32)p[3] << 24);
+}
+
+// Reads until 'size' bytes have been read or there is no more data
+static zio_ll zio__read_full(ZIOHandle *handle, void *destination, zio_ll size)
+{
+	zio_ll total = 0;
+	while (total < size)
+	{
+		zio_ll read_count = zio_read(handle, (char*)destination + total, size - total);
+		if (read_count == ZIO_ERROR)
+			return ZIO_ERROR;
+		if (read_count == 0)
+			break;
+		total += read_count;
+	}
+	return total;
+}
+
+ZIODEF zio_result zio_framer_begin(ZIOFramer *framer, ZIOHandle *handle, zio_ll max_frame_size, int flags)
+{
+	memset(framer, 0, sizeof(ZIOFramer));
+	if (max_frame_size <= 0 || max_frame_size > 0xFFFFFFFFLL)
+		return zio__set_error(handle, "Invalid max frame size");
+	framer->handle = handle;
+	framer->max_frame_size = max_frame_size;
+	framer->flags = flags;
+	return ZIO_OK;
+}
+
+ZIODEF void zio_framer_end(ZIOFramer *framer)
+{
+	zio__free(framer->buffer);
+	memset(framer, 0, sizeof(ZIOFramer));
+}
+
+ZIODEF zio_result zio_frame_write(ZIOFramer *framer, const void *data, zio_ll size)
+{
+	if (size < 0 || size > framer->max_frame_size)
+		return zio__set_error(framer->handle, "Frame too large");
+
+	unsigned char header[8];
+	zio_ll header_size = 4;
+	zio__store_le32(header, (zio_u32)size);
+	if (framer->flags & ZIOF_CRC32C)
+	{
+		zio__store_le32(header + 4, zio_crc32c(0, data, size));
+		header_size = 8;
+	}
+
+	ZIOVec vecs[2] = { { header, header_size }, { data, size } };
+	zio_ll written = zio_writev(framer->handle, vecs, 2);
+	if (written == ZIO_ERROR)
+		return ZIO_ERROR;
+	if (written != header_size + size)
+		return zio__set_error(framer->handle, "Frame truncated");
 	return ZIO_OK;
 }
 
+ZIODEF zio_result zio_frame_read(ZIOFramer *framer, ZIOFrame *frame)
+{
+	ZIOHandle *handle = framer->handle;
+	frame->data = NULL;
+	frame->size = 0;
+
+	unsigned char header[8];
+	zio_ll header_size = ((framer->flags & ZIOF_CRC32C) ? 8 : 4);
+	zio_ll read_count = zio__read_full(handle, header, header_size);
+	if (read_count == ZIO_ERROR)
+		return ZIO_ERROR;
+	if (read_count == 0)
+		return ZIO_EOF;
+	if (read_count != header_size)
+		return zio__set_error(handle, "Frame truncated");
+
+	zio_ll size = zio__load_le32(header);
+	if (size > framer->max_frame_size)
+		return zio__set_error(handle, "Frame too large");
+
+	if (zio__is_memory(handle))
+	{
+		if (handle->data.mem.end - handle->data.mem.pos < size)
+			return zio__set_error(handle, "Frame truncated");
+		frame->data = handle->data.mem.pos;
+		handle->data.mem.pos += size;
+	}
+	else
+	{
+		// The buffer is a cache, shrink it to fit when over the soft limit
+		int over_soft_limit = zio__memory_over_soft_limit();
+		if (size > framer->buffer_capacity || (over_soft_limit && size < framer->buffer_capacity))
+		{
+			zio_ll capacity = size;
+			if (!over_soft_limit)
+			{
+				// Grow in steps to avoid reallocating for every slightly larger frame
+				capacity = 256;
+				while (capacity < size)
+					capacity *= 2;
+				if (capacity > framer->max_frame_size)
+					capacity = framer->max_frame_size;
+			}
+			if (capacity == 0)
+			{
+				zio__free(framer->buffer);
+				framer->buffer = NULL;
+			}
+			else
+			{
+				char *buffer = (char*)zio__realloc(framer->buffer, capacity);
+				if (!buffer)
+					return zio__set_error(handle, "Out of memory");
+				framer->buffer = buffer;
+			}
+			framer->buffer_capacity = capacity;
+		}
+		read_count = zio__read_full(handle, framer->buffer, size);
+		if (read_count == ZIO_ERROR)
+			return ZIO_ERROR;
+		if (read_count != size)
+			return zio__set_error(handle, "Frame truncated");
+		frame->data = framer->buffer;
+	}
+	frame->size = size;
+
+	if ((framer->flags & ZIOF_CRC32C) && zio_crc32c(0, frame->data, size) != zio__load_le32(header + 4))
+		return zio__set_error(handle, "Frame CRC mismatch");
+	return ZIO_OK;
+}
+#endif // Z_IO_NO_FRAME
+
+// Log sink
+#ifndef Z_IO_NO_LOG
+typedef struct zio__log_block
+{
+	struct zio__log_block *next;
+	zio_ll used;
+} zio__log_block;
+
+typedef struct zio__log_state
+{
+	ZIOHandle *handle;
+	zio_ll block_size;
+	int flush_interval_ms;
+
+	void *volatile full_blocks; // Pushed by writers, taken all at once by the flusher
+
+	zio__mutex writers_lock;
+	ZIOLogWriter *writers; // Registered writers, for taking their partially filled blocks
+
+	zio__mutex free_lock;
+	zio__log_block *free_blocks;
+
+	volatile zio_u64 sequence;
+
+	zio__mutex wake_lock;
+	zio__cond wake;
+	int stop;
+	int failed;
+
+	zio__thread thread;
+} zio__log_state;
+
+static inline char *zio__log_block_data(zio__log_block *block)
+{
+	return (char*)(block + 1);
+}
+
+static void zio__log_flush(zio__log_state *state)
+{
+	zio__log_block *blocks = (zio__log_block*)zio__atomic_exchange_ptr(&state->full_blocks, NULL);
+	if (!blocks)
+		return;
+
+	// Blocks were pushed onto a stack, reverse them to write the oldest first
+	zio__log_block *ordered = NULL;
+	while (blocks)
+	{
+		zio__log_block *next = blocks->next;
+		blocks->next = ordered;
+		ordered = blocks;
+		blocks = next;
+	}
+
+	zio__log_block *block = ordered;
+	zio__log_block *last = NULL;
+	while (block)
+	{
+		ZIOVec vecs[64];
+		int count = 0;
+		zio_ll size = 0;
+		for (; block && count < 64; block = block->next)
+		{
+			vecs[count].data = zio__log_block_data(block);
+			vecs[count].size = block->used;
+			size += block->used;
+			++count;
+			last = block;
+		}
+		if (zio_writev(state->handle, vecs, count) != size)
+			state->failed = 1;
+	}
+
+	// Keep the blocks for reuse, unless over the soft limit
+	if (zio__memory_over_soft_limit())
+	{
+		while (ordered)
+		{
+			zio__log_block *next = ordered->next;
+			zio__free(ordered);
+			ordered = next;
+		}
+		return;
+	}
+
+	for (block = ordered; block; block = block->next)
+		block->used = 0;
+
+	zio__mutex_lock(&state->free_lock);
+	last->next = state->free_blocks;
+	state->free_blocks = ordered;
+	zio__mutex_unlock(&state->free_lock);
+}
+
+static void zio__log_push(zio__log_state *state, zio__log_block *block)
+{
+	void *head;
+	do
+	{
+		head = zio__atomic_load_ptr(&state->full_blocks);
+		block->next = (zio__log_block*)head;
+	} while (!zio__atomic_cas_ptr(&state->full_blocks, head, block));
+}
+
+// Takes the partially filled blocks of all writers that are not appending a record right now
+static void zio__log_collect(zio__log_state *state)
+{
+	zio__mutex_lock(&state->writers_lock);
+	ZIOLogWriter *writer;
+	for (writer = state->writers; writer; writer = writer->next)
+	{
+		zio__log_block *block = (zio__log_block*)zio__atomic_exchange_ptr(&writer->block, NULL);
+		if (!block)
+			continue;
+		if (block->used > 0)
+			zio__log_push(state, block);
+		else
+			zio__atomic_store_ptr(&writer->block, block);
+	}
+	zio__mutex_unlock(&state->writers_lock);
+}
+
+ZIO__THREAD_PROC(zio__log_thread)
+{
+	zio__log_state *state = (zio__log_state*)arg;
+	zio_u64 interval = (zio_u64)state->flush_interval_ms * 1000000ULL;
+	zio_u64 next_collect = zio__time_ns() + interval;
+
+	zio__mutex_lock(&state->wake_lock);
+	while (!state->stop)
+	{
+		zio_u64 now = zio__time_ns();
+		if (!zio__atomic_load_ptr(&state->full_blocks) && now < next_collect)
+			zio__cond_timed_wait(&state->wake, &state->wake_lock, (int)((next_collect - now + 999999ULL) / 1000000ULL));
+		zio__mutex_unlock(&state->wake_lock);
+		now = zio__time_ns();
+		if (now >= next_collect)
+		{
+			zio__log_collect(state);
+			next_collect = now + interval;
+		}
+		zio__log_flush(state);
+		zio__mutex_lock(&state->wake_lock);
+	}
+	zio__mutex_unlock(&state->wake_lock);
+
+	zio__log_flush(state);
+	ZIO__THREAD_RETURN;
+}
+
+ZIODEF zio_result zio_log_sink_begin(ZIOLogSink *sink, ZIOHandle *handle, zio_ll block_size, int flush_interval_ms)
+{
+	sink->state = NULL;
+	if (block_size <= 0)
+		block_size = ZIO_LOG_BLOCK_SIZE;
+	if (block_size <= ZIO_LOG_RECORD_HEADER_SIZE || flush_interval_ms <= 0)
+		return zio__set_error(handle, "Invalid block size or flush interval");
+
+	zio__log_state *state = (zio__log_state*)zio__alloc_zero(sizeof(zio__log_state));
+	if (!state)
+		return zio__set_error(handle, "Out of memory");
+	state->handle = handle;
+	state->block_size = block_size;
+	state->flush_interval_ms = flush_interval_ms;
+	zio__mutex_init(&state->free_lock);
+	zio__mutex_init(&state->writers_lock);
+	zio__mutex_init(&state->wake_lock);
+	zio__cond_init(&state->wake);
+
+	if (!zio__thread_start(&state->thread, zio__log_thread, state))
+	{
+		zio__cond_destroy(&state->wake);
+		zio__mutex_destroy(&state->wake_lock);
+		zio__mutex_destroy(&state->writers_lock);
+		zio__mutex_destroy(&state->free_lock);
+		zio__free(state);
+		return zio__set_error(handle, "Could not start flusher thread");
+	}
+
+	sink->state = state;
+	return ZIO_OK;
+}
+
+ZIODEF zio_result zio_log_sink_end(ZIOLogSink *sink)
+{
+	zio__log_state *state = (zio__log_state*)sink->state;
+
+	zio__mutex_lock(&state->wake_lock);
+	state->stop = 1;
+	zio__cond_signal(&state->wake);
+	zio__mutex_unlock(&state->wake_lock);
+	zio__thread_join(state->thread);
+
+	zio_result result = ZIO_OK;
+	if (state->failed)
+		result = zio__set_error(state->handle, "Log write failed");
+
+	while (state->free_blocks)
+	{
+		zio__log_block *next = state->free_blocks->next;
+		zio__free(state->free_blocks);
+		state->free_blocks = next;
+	}
+	zio__cond_destroy(&state->wake);
+	zio__mutex_destroy(&state->wake_lock);
+	zio__mutex_destroy(&state->writers_lock);
+	zio__mutex_destroy(&state->free_lock);
+	zio__free(state);
+	sink->state = NULL;
+	return result;
+}
+
+ZIODEF void zio_log_writer_begin(ZIOLogWriter *writer, ZIOLogSink *sink)
+{
+	zio__log_state *state = (zio__log_state*)sink->state;
+	writer->sink = sink;
+	writer->block = NULL;
+	writer->prev = NULL;
+
+	zio__mutex_lock(&state->writers_lock);
+	writer->next = state->writers;
+	if (state->writers)
+		state->writers->prev = writer;
+	state->writers = writer;
+	zio__mutex_unlock(&state->writers_lock);
+}
+
+ZIODEF void zio_log_writer_flush(ZIOLogWriter *writer)
+{
+	zio__log_state *state = (zio__log_state*)writer->sink->state;
+	zio__log_block *block = (zio__log_block*)zio__atomic_exchange_ptr(&writer->block, NULL);
+	if (!block)
+		return;
+	if (block->used == 0)
+	{
+		zio__atomic_store_ptr(&writer->block, block);
+		return;
+	}
+	zio__log_push(state, block);
+
+	// Signalling without the lock can miss a waiting flusher, but it wakes up by itself soon after
+	zio__cond_signal(&state->wake);
+}
+
+ZIODEF void zio_log_writer_end(ZIOLogWriter *writer)
+{
+	zio__log_state *state = (zio__log_state*)writer->sink->state;
+	zio__mutex_lock(&state->writers_lock);
+	if (writer->prev)
+		writer->prev->next = writer->next;
+	else
+		state->writers = writer->next;
+	if (writer->next)
+		writer->next->prev = writer->prev;
+	zio__mutex_unlock(&state->writers_lock);
+
+	zio_log_writer_flush(writer);
+	if (writer->block)
+	{
+		// An empty block, give it back
+		zio__log_block *block = (zio__log_block*)writer->block;
+		zio__mutex_lock(&state->free_lock);
+		block->next = state->free_blocks;
+		state->free_blocks = block;
+		zio__mutex_unlock(&state->free_lock);
+	}
+	writer->sink = NULL;
+	writer->block = NULL;
+	writer->prev = NULL;
+	writer->next = NULL;
+}
+
+ZIODEF zio_result zio_log_write(ZIOLogWriter *writer, const void *data, zio_ll size)
+{
+	zio__log_state *state = (zio__log_state*)writer->sink->state;
+	zio_ll record_size = ZIO_LOG_RECORD_HEADER_SIZE + size;
+	if (size < 0 || size > 0xFFFFFFFFLL || record_size > state->block_size)
+		return ZIO_ERROR;
+
+	// Owning the block while appending keeps the flusher from taking it halfway through a record
+	zio__log_block *block = (zio__log_block*)zio__atomic_exchange_ptr(&writer->block, NULL);
+	if (block && block->used + record_size > state->block_size)
+	{
+		zio__log_push(state, block);
+		zio__cond_signal(&state->wake);
+		block = NULL;
+	}
+	if (!block)
+	{
+		zio__mutex_lock(&state->free_lock);
+		block = state->free_blocks;
+		if (block)
+			state->free_blocks = block->next;
+		zio__mutex_unlock(&state->free_lock);
+
+		if (!block)
+		{
+			block = (zio__log_block*)zio__alloc(sizeof(zio__log_block) + state->block_size);
+			if (!block)
+				return ZIO_ERROR;
+		}
+		block->next = NULL;
+		block->used = 0;
+	}
+
+	unsigned char *record = (unsigned char*)zio__log_block_data(block) + block->used;
+	zio_u64 sequence = zio__atomic_fetch_add(&state->sequence, 1);
+	int i;
+	for (i = 0; i < 8; ++i)
+		record[i] = (unsigned char)(sequence >> (i * 8));
+	for (i = 0; i < 4; ++i)
+		record[8 + i] = (unsigned char)((zio_u64)size >> (i * 8));
+	if (size > 0)
+		memcpy(record + ZIO_LOG_RECORD_HEADER_SIZE, data, (size_t)size);
+	block->used += record_size;
+	zio__atomic_store_ptr(&writer->block, block);
+	return ZIO_OK;
+}
+#endif // Z_IO_NO_LOG
+
+// Rotating file handles
+#ifndef Z_IO_NO_ROTATE
+typedef struct zio__rotate_state
+{
+	ZIORotateConfig config;
+	char *filename;
+	char *next_filename;
+	char *rotated_filename;
+	unsigned index;
+
+	FILE *current;
+	zio_ll current_size;
+	time_t current_start;
+
+	void *volatile next; // Opened by the background thread, taken by the writer
+
+	zio__mutex lock;
+	zio__cond wake;
+	FILE *retired; // Handed from the writer to the background thread
+	int stop;
+	int error; // errno of the first failed close
+	int retry_error; // errno of a failed rename or open of the next file, until a retry succeeds
+	int renames; // Renames left of the last rotation, 2 down to 0
+
+	zio__thread thread;
+} zio__rotate_state;
+
+// Moves the retired file aside and the one being written in its place. Returns 0 if a rename
+// failed, then the writer keeps writing to the next file and the rest is tried again later.
+static int zio__rotate_rename(zio__rotate_state *state)
+{
+	if (state->renames == 2)
+	{
+		if (rename(state->filename, state->rotated_filename) != 0)
+		{
+			state->retry_error = errno;
+			return 0;
+		}
+		state->renames = 1;
+	}
+	if (rename(state->next_filename, state->filename) != 0)
+	{
+		state->retry_error = errno;
+		return 0;
+	}
+	state->renames = 0;
+	state->retry_error = 0;
+	return 1;
+}
+
+ZIO__THREAD_PROC(zio__rotate_thread)
+{
+	zio__rotate_state *state = (zio__rotate_state*)arg;
+	// Not whether 'next' is set, the writer may have taken it already
+	int need_next = (state->retry_error != 0);
+
+	zio__mutex_lock(&state->lock);
+	for (;;)
+	{
+		while (!state->stop && !state->retired && !need_next && !state->renames)
+			zio__cond_wait(&state->wake, &state->lock);
+		FILE *retired = state->retired;
+		state->retired = NULL;
+		int stop = state->stop;
+		zio__mutex_unlock(&state->lock);
+
+		if (retired)
+		{
+			if (fclose(retired) != 0 && !state->error)
+				state->error = errno;
+			sprintf(state->rotated_filename, "%s.%u", state->filename, state->index++);
+			state->renames = 2;
+		}
+
+		// The writer is now using the next file, a new one is only opened once that has been renamed
+		int rotated = (state->renames > 0 && zio__rotate_rename(state));
+		if (rotated)
+			need_next = 1;
+		if (need_next && !stop)
+		{
+			FILE *next = fopen(state->next_filename, "wb");
+			if (next)
+			{
+				state->retry_error = 0;
+				zio__atomic_exchange_ptr(&state->next, next);
+				need_next = 0;
+			}
+			else
+			{
+				state->retry_error = errno;
+			}
+		}
+
+		// Called once the next file is ready, so a slow callback does not hold up the next rotation
+		if (rotated && state->config.rotated)
+			state->config.rotated(state->rotated_filename, state->config.user_data);
+		if (stop)
+			break;
+
+		zio__mutex_lock(&state->lock);
+		if (need_next || state->renames)
+		{
+			// Try again in a while
+			zio__cond_timed_wait(&state->wake, &state->lock, 1000);
+		}
+	}
+	ZIO__THREAD_RETURN;
+}
+
+static void zio__rotate_free(zio__rotate_state *state)
+{
+	zio__cond_destroy(&state->wake);
+	zio__mutex_destroy(&state->lock);
+	zio__free(state);
+}
+
+static zio_result zio__rotate_close(ZIOHandle *handle)
+{
+	zio__rotate_state *state = (zio__rotate_state*)handle->data.rotate.state;
+
+	zio__mutex_lock(&state->lock);
+	state->stop = 1;
+	zio__cond_signal(&state->wake);
+	zio__mutex_unlock(&state->lock);
+	zio__thread_join(state->thread);
+
+	FILE *next = (FILE*)zio__atomic_exchange_ptr(&state->next, NULL);
+	if (next)
+	{
+		fclose(next);
+		remove(state->next_filename);
+	}
+
+	// The background thread has stopped, strerror() is only called on the writer's thread
+	int error = (state->error ? state->error : state->retry_error);
+	if (fclose(state->current) != 0)
+		error = errno;
+	zio__rotate_free(state);
+
+	if (error)
+		return zio__set_error(handle, strerror(error));
+	zio__zero_handle(handle);
+	return ZIO_OK;
+}
+static zio_ll zio__rotate_size(ZIOHandle *handle)
+{
+	zio__rotate_state *state = (zio__rotate_state*)handle->data.rotate.state;
+	return state->current_size;
+}
+static zio_ll zio__rotate_seek(ZIOHandle *handle, zio_ll offset, ZIOSeek whence)
+{
+	zio__rotate_state *state = (zio__rotate_state*)handle->data.rotate.state;
+	if (offset != 0 || whence != ZIO_SEEK_CUR)
+		return zio__set_error(handle, "Cannot seek in a rotating file");
+	return state->current_size;
+}
+static zio_ll zio__rotate_read(ZIOHandle *handle, void *destination, zio_ll size)
+{
+	(void)destination;
+	(void)size;
+	return zio__set_error(handle, "Cannot read from a rotating file");
+}
+static zio_ll zio__rotate_write(ZIOHandle *handle, const void *source, zio_ll size)
+{
+	zio__rotate_state *state = (zio__rotate_state*)handle->data.rotate.state;
+
+	if ((state->config.max_size > 0 && state->current_size >= state->config.max_size) ||
+		(state->config.max_seconds > 0 && time(NULL) - state->current_start >= state->config.max_seconds))
+	{
+		FILE *next = (FILE*)zio__atomic_exchange_ptr(&state->next, NULL);
+		if (next)
+		{
+			zio__mutex_lock(&state->lock);
+			state->retired = state->current;
+			zio__cond_signal(&state->wake);
+			zio__mutex_unlock(&state->lock);
+
+			state->current = next;
+			state->current_size = 0;
+			state->current_start = time(NULL);
+		}
+	}
+
+	zio_ll write_count = fwrite(source, 1, size, state->current);
+	state->current_size += write_count;
+	if (write_count == 0 && ferror(state->current))
+		return zio__set_error(handle, strerror(errno));
+	return write_count;
+}
+
+static const ZIOVtable zio__rotate_vtable =
+{
+	zio__rotate_close,
+	zio__rotate_size,
+	zio__rotate_seek,
+	zio__rotate_read,
+	zio__rotate_write,
+	zio__generic_writev,
+};
+
+ZIODEF zio_result zio_open_rotating(ZIOHandle *handle, const ZIORotateConfig *config)
+{
+	zio__zero_handle(handle);
+
+	size_t filename_length = strlen(config->filename);
+	zio__rotate_state *state = (zio__rotate_state*)zio__alloc_zero(sizeof(zio__rotate_state) + (filename_length + 16) * 3);
+	if (!state)
+		return zio__set_error(handle, "Out of memory");
+	state->config = *config;
+	state->filename = (char*)(state + 1);
+	state->next_filename = state->filename + filename_length + 16;
+	state->rotated_filename = state->next_filename + filename_length + 16;
+	memcpy(state->filename, config->filename, filename_length + 1);
+	sprintf(state->next_filename, "%s.next", config->filename);
+	state->config.filename = state->filename;
+	zio__mutex_init(&state->lock);
+	zio__cond_init(&state->wake);
+
+	// Continue after the last rotated file from earlier runs
+	for (state->index = 1;; ++state->index)
+	{
+		sprintf(state->rotated_filename, "%s.%u", state->filename, state->index);
+		FILE *file = fopen(state->rotated_filename, "rb");
+		if (!file)
+			break;
+		fclose(file);
+	}
+
+	state->current = fopen(state->filename, "ab");
+	if (!state->current)
+	{
+		zio__rotate_free(state);
+		return zio__set_error(handle, strerror(errno));
+	}
+	fseek(state->current, 0, SEEK_END);
+	state->current_size = ftell(state->current);
+	state->current_start = time(NULL);
+
+	// Ready for the first rotation, if this fails the background thread tries again
+	state->next = fopen(state->next_filename, "wb");
+	if (!state->next)
+		state->retry_error = errno;
+
+	if (!zio__thread_start(&state->thread, zio__rotate_thread, state))
+	{
+		if (state->next)
+		{
+			fclose((FILE*)state->next);
+			remove(state->next_filename);
+		}
+		fclose(state->current);
+		zio__rotate_free(state);
+		return zio__set_error(handle, "Could not start rotation thread");
+	}
+
+	handle->data.rotate.state = state;
+
+	handle->vtable = &zio__rotate_vtable;
+	return ZIO_OK;
+}
+#endif // Z_IO_NO_ROTATE
+
+// Rate-limited handles
+#ifndef Z_IO_NO_THROTTLE
+ZIODEF void zio_throttle_group_init(ZIOThrottleGroup *group, zio_ll bytes_per_second, zio_ll ops_per_second, int burst_ms)
+{
+	memset(group, 0, sizeof(ZIOThrottleGroup));
+	if (bytes_per_second > 0)
+	{
+		group->byte_cost_num = 1000000000ULL;
+		group->byte_cost_den = (zio_u64)bytes_per_second;
+	}
+	if (ops_per_second > 0)
+		group->op_cost = 1000000000ULL / (zio_u64)ops_per_second;
+	group->burst = (zio_u64)(burst_ms > 0 ? burst_ms : 0) * 1000000ULL;
+}
+
+// Takes 'cost' nanoseconds of budget from 'budget_time' (generic cell rate algorithm).
+// Returns when the budget will be paid back.
+static zio_u64 zio__throttle_take(volatile zio_u64 *budget_time, zio_u64 cost, zio_u64 burst, zio_u64 now)
+{
+	zio_u64 old_time, new_time;
+	do
+	{
+		old_time = zio__atomic_load_u64(budget_time);
+		zio_u64 start = old_time;
+		if (start + burst < now)
+			start = now - burst;
+		new_time = start + cost;
+	} while (!zio__atomic_cas_u64(budget_time, old_time, new_time));
+	return new_time;
+}
+
+static void zio__throttle(ZIOThrottleGroup *group, zio_ll size)
+{
+	zio_u64 now = zio__time_ns();
+	zio_u64 ready = 0;
+
+	if (group->byte_cost_den && size > 0)
+	{
+		zio_u64 bytes = (zio_u64)size;
+		zio_u64 cost = bytes / group->byte_cost_den * group->byte_cost_num + bytes % group->byte_cost_den * group->byte_cost_num / group->byte_cost_den;
+		ready = zio__throttle_take(&group->byte_time, cost, group->burst, now);
+	}
+	if (group->op_cost)
+	{
+		zio_u64 op_ready = zio__throttle_take(&group->op_time, group->op_cost, group->burst, now);
+		if (op_ready > ready)
+			ready = op_ready;
+	}
+
+	if (ready > now)
+		zio__sleep_until_ns(ready);
+}
+
+static zio_result zio__throttle_close(ZIOHandle *handle)
+{
+	zio__zero_handle(handle);
+	return ZIO_OK;
+}
+static zio_ll zio__throttle_size(ZIOHandle *handle)
+{
+	return zio_size(handle->data.throttle.inner);
+}
+static zio_ll zio__throttle_seek(ZIOHandle *handle, zio_ll offset, ZIOSeek whence)
+{
+	zio_ll pos = zio_seek(handle->data.throttle.inner, offset, whence);
+	if (pos == ZIO_ERROR)
+		return zio__set_error(handle, zio_last_error(handle->data.throttle.inner));
+	return pos;
+}
+static zio_ll zio__throttle_read(ZIOHandle *handle, void *destination, zio_ll size)
+{
+	zio__throttle(handle->data.throttle.group, size);
+	zio_ll read_count = zio_read(handle->data.throttle.inner, destination, size);
+	if (read_count == ZIO_ERROR)
+		return zio__set_error(handle, zio_last_error(handle->data.throttle.inner));
+	return read_count;
+}
+static zio_ll zio__throttle_write(ZIOHandle *handle, const void *source, zio_ll size)
+{
+	zio__throttle(handle->data.throttle.group, size);
+	zio_ll write_count = zio_write(handle->data.throttle.inner, source, size);
+	if (write_count == ZIO_ERROR)
+		return zio__set_error(handle, zio_last_error(handle->data.throttle.inner));
+	return write_count;
+}
+static zio_ll zio__throttle_writev(ZIOHandle *handle, const ZIOVec *vecs, int count)
+{
+	zio_ll size = 0;
+	int i;
+	for (i = 0; i < count; ++i)
+		size += vecs[i].size;
+	zio__throttle(handle->data.throttle.group, size);
+	zio_ll write_count = zio_writev(handle->data.throttle.inner, vecs, count);
+	if (write_count == ZIO_ERROR)
+		return zio__set_error(handle, zio_last_error(handle->data.throttle.inner));
+	return write_count;
+}
+
+static const ZIOVtable zio__throttle_vtable =
+{
+	zio__throttle_close,
+	zio__throttle_size,
+	zio__throttle_seek,
+	zio__throttle_read,
+	zio__throttle_write,
+	zio__throttle_writev,
+};
+
+ZIODEF zio_result zio_open_throttled(ZIOHandle *handle, ZIOHandle *inner, ZIOThrottleGroup *group)
+{
+	zio__zero_handle(handle);
+
+	if (!inner || !group)
+		return zio__set_error(handle, "Invalid handle or group");
+
+	handle->data.throttle.inner = inner;
+	handle->data.throttle.group = group;
+
+	handle->vtable = &zio__throttle_vtable;
+	return ZIO_OK;
+}
+#endif // Z_IO_NO_THROTTLE
+
+// Priority I/O scheduler
+#ifndef Z_IO_NO_SCHEDULER
+#define ZIO__SCHED_MAX_MERGE 16
+
+enum
+{
+	ZIO__SCHED_READ,
+	ZIO__SCHED_WRITE,
+	ZIO__SCHED_SIZE,
+};
+
+typedef struct zio__sched_request
+{
+	struct zio__sched_request *next;
+	ZIOHandle *inner;
+	int op;
+	int priority;
+	zio_ll offset;
+	void *buffer;
+	zio_ll size;
+	zio_u64 queued_ns;
+	zio_u64 deadline_ns;
+
+	zio_ll result;
+	const char *error;
+	int done;
+} zio__sched_request;
+
+typedef struct zio__sched_queue
+{
+	zio__sched_request *head;
+	zio__sched_request *tail;
+} zio__sched_queue;
+
+typedef struct zio__sched_state
+{
+	zio__mutex lock;
+	zio__cond work;
+	zio__cond done;
+	int stop;
+
+	zio__sched_queue queues[ZIO_PRIORITY_COUNT];
+	zio_u64 deadline_ns[ZIO_PRIORITY_COUNT];
+	ZIOSchedulerStats stats[ZIO_PRIORITY_COUNT];
+
+	int worker_count;
+	ZIOHandle **busy; // Inner handle each worker is using
+	zio__thread *threads;
+} zio__sched_state;
+
+static int zio__sched_is_busy(zio__sched_state *state, ZIOHandle *inner)
+{
+	int i;
+	for (i = 0; i < state->worker_count; ++i)
+	{
+		if (state->busy[i] == inner)
+			return 1;
+	}
+	return 0;
+}
+
+static void zio__sched_remove(zio__sched_state *state, zio__sched_request *request)
+{
+	zio__sched_queue *queue = &state->queues[request->priority];
+	zio__sched_request *prev = NULL;
+	zio__sched_request *it;
+	for (it = queue->head; it != request; it = it->next)
+		prev = it;
+	if (prev)
+		prev->next = request->next;
+	else
+		queue->head = request->next;
+	if (queue->tail == request)
+		queue->tail = prev;
+	request->next = NULL;
+	--state->stats[request->priority].queued;
+}
+
+// Picks the next request whose handle is not in use. Overdue requests go first, earliest
+// deadline first, otherwise the oldest request of the highest priority.
+static zio__sched_request *zio__sched_pick(zio__sched_state *state, zio_u64 now)
+{
+	zio__sched_request *first[ZIO_PRIORITY_COUNT];
+	zio__sched_request *overdue = NULL;
+	int p;
+	for (p = 0; p < ZIO_PRIORITY_COUNT; ++p)
+	{
+		zio__sched_request *it = state->queues[p].head;
+		while (it && zio__sched_is_busy(state, it->inner))
+			it = it->next;
+		first[p] = it;
+		if (it && it->deadline_ns <= now && (!overdue || it->deadline_ns < overdue->deadline_ns))
+			overdue = it;
+	}
+	if (overdue)
+		return overdue;
+	for (p = 0; p < ZIO_PRIORITY_COUNT; ++p)
+	{
+		if (first[p])
+			return first[p];
+	}
+	return NULL;
+}
+
+// Finds a queued request that continues where 'request' ends
+static zio__sched_request *zio__sched_find_adjacent(zio__sched_state *state, zio__sched_request *request)
+{
+	if (request->op == ZIO__SCHED_SIZE)
+		return NULL;
+	int p;
+	for (p = 0; p < ZIO_PRIORITY_COUNT; ++p)
+	{
+		zio__sched_request *it;
+		for (it = state->queues[p].head; it; it = it->next)
+		{
+			if (it->inner == request->inner && it->op == request->op && it->offset == request->offset + request->size)
+				return it;
+		}
+	}
+	return NULL;
+}
+
+// Gives each request its part of what one read or write of all of them did
+static void zio__sched_split_result(zio__sched_request **batch, int count, zio_ll result)
+{
+	int i;
+	for (i = 0; i < count; ++i)
+	{
+		if (result == ZIO_ERROR)
+		{
+			batch[i]->result = ZIO_ERROR;
+			continue;
+		}
+		batch[i]->result = (result < batch[i]->size ? result : batch[i]->size);
+		result -= batch[i]->result;
+	}
+}
+
+// Serves 'batch' with one seek and one read or write.
+// Returns 0 if reads had to be served one by one, because there was no memory to read them into.
+static int zio__sched_serve(zio__sched_request **batch, int count)
+{
+	ZIOHandle *inner = batch[0]->inner;
+	int coalesced = 1;
+	int i;
+	if (batch[0]->op == ZIO__SCHED_SIZE)
+	{
+		batch[0]->result = zio_size(inner);
+	}
+	else if (zio_seek(inner, batch[0]->offset, ZIO_SEEK_SET) != batch[0]->offset)
+	{
+		zio__sched_split_result(batch, count, ZIO_ERROR);
+	}
+	else if (count == 1)
+	{
+		if (batch[0]->op == ZIO__SCHED_READ)
+			batch[0]->result = zio_read(inner, batch[0]->buffer, batch[0]->size);
+		else
+			batch[0]->result = zio_write(inner, batch[0]->buffer, batch[0]->size);
+	}
+	else if (batch[0]->op == ZIO__SCHED_WRITE)
+	{
+		ZIOVec vecs[ZIO__SCHED_MAX_MERGE];
+		for (i = 0; i < count; ++i)
+		{
+			vecs[i].data = batch[i]->buffer;
+			vecs[i].size = batch[i]->size;
+		}
+		zio__sched_split_result(batch, count, zio_writev(inner, vecs, count));
+	}
+	else
+	{
+		zio_ll total = 0;
+		for (i = 0; i < count; ++i)
+			total += batch[i]->size;
+		char *buffer = (char*)zio__alloc(total);
+		if (buffer)
+		{
+			zio_ll read_count = zio_read(inner, buffer, total);
+			zio__sched_split_result(batch, count, read_count);
+			char *part = buffer;
+			for (i = 0; i < count && read_count != ZIO_ERROR; ++i)
+			{
+				memcpy(batch[i]->buffer, part, (size_t)batch[i]->result);
+				part += batch[i]->size;
+			}
+			zio__free(buffer);
+		}
+		else
+		{
+			// Adjacent reads still continue from where the previous one stopped without seeking
+			coalesced = 0;
+			for (i = 0; i < count; ++i)
+			{
+				batch[i]->result = zio_read(inner, batch[i]->buffer, batch[i]->size);
+				if (batch[i]->result != batch[i]->size)
+					break;
+			}
+			while (++i < count)
+				batch[i]->result = (batch[i - 1]->result == ZIO_ERROR ? ZIO_ERROR : 0);
+		}
+	}
+
+	for (i = 0; i < count; ++i)
+	{
+		if (batch[i]->result == ZIO_ERROR)
+			batch[i]->error = zio_last_error(inner);
+	}
+	return coalesced;
+}
+
+ZIO__THREAD_PROC(zio__sched_thread)
+{
+	zio__sched_state *state = (zio__sched_state*)arg;
+
+	// Each worker finds its own slot in the busy list
+	zio__mutex_lock(&state->lock);
+	int worker = 0;
+	while (state->busy[worker] != (ZIOHandle*)state)
+		++worker;
+	state->busy[worker] = NULL;
+
+	while (!state->stop)
+	{
+		zio__sched_request *request = zio__sched_pick(state, zio__time_ns());
+		if (!request)
+		{
+			zio__cond_wait(&state->work, &state->lock);
+			continue;
+		}
+
+		zio__sched_request *batch[ZIO__SCHED_MAX_MERGE];
+		int count = 0;
+		zio_ll merged_size = request->size;
+		zio__sched_remove(state, request);
+		batch[count++] = request;
+		while (count < ZIO__SCHED_MAX_MERGE && (request = zio__sched_find_adjacent(state, batch[count - 1])) != NULL)
+		{
+			if (request->op == ZIO__SCHED_READ && merged_size + request->size > ZIO_SCHEDULER_MAX_MERGE_READ)
+				break;
+			merged_size += request->size;
+			zio__sched_remove(state, request);
+			batch[count++] = request;
+		}
+		state->busy[worker] = batch[0]->inner;
+		zio__mutex_unlock(&state->lock);
+
+		zio_u64 start = zio__time_ns();
+		int coalesced = zio__sched_serve(batch, count);
+		zio_u64 end = zio__time_ns();
+
+		zio__mutex_lock(&state->lock);
+		int i;
+		for (i = 0; i < count; ++i)
+		{
+			ZIOSchedulerStats *stats = &state->stats[batch[i]->priority];
+			if (i > 0 && coalesced)
+				++stats->merged;
+			zio_u64 wait = start - batch[i]->queued_ns;
+			++stats->completed;
+			stats->total_wait_ns += wait;
+			if (wait > stats->max_wait_ns)
+				stats->max_wait_ns = wait;
+			stats->total_service_ns += end - start;
+			batch[i]->done = 1;
+		}
+		state->busy[worker] = NULL;
+		zio__cond_broadcast(&state->done);
+		// The handle is free again, another worker might have been waiting for it
+		zio__cond_broadcast(&state->work);
+	}
+	zio__mutex_unlock(&state->lock);
+	ZIO__THREAD_RETURN;
+}
+
+static zio_result zio__sched_close(ZIOHandle *handle);
+static zio_ll zio__sched_size(ZIOHandle *handle);
+static zio_ll zio__sched_seek(ZIOHandle *handle, zio_ll offset, ZIOSeek whence);
+static zio_ll zio__sched_read(ZIOHandle *handle, void *destination, zio_ll size);
+static zio_ll zio__sched_write(ZIOHandle *handle, const void *source, zio_ll size);
+
+// One vtable per priority, so the priority does not take up space in the handle
+static const ZIOVtable zio__sched_vtables[ZIO_PRIORITY_COUNT] =
+{
+	{ zio__sched_close, zio__sched_size, zio__sched_seek, zio__sched_read, zio__sched_write, zio__generic_writev },
+	{ zio__sched_close, zio__sched_size, zio__sched_seek, zio__sched_read, zio__sched_write, zio__generic_writev },
+	{ zio__sched_close, zio__sched_size, zio__sched_seek, zio__sched_read, zio__sched_write, zio__generic_writev },
+};
+
+static zio_ll zio__sched_submit(ZIOHandle *handle, int op, void *buffer, zio_ll size)
+{
+	zio__sched_state *state = (zio__sched_state*)handle->data.sched.state;
+	zio__sched_request request;
+	memset(&request, 0, sizeof(request));
+	request.inner = handle->data.sched.inner;
+	request.op = op;
+	request.priority = (int)(handle->vtable - zio__sched_vtables);
+	request.offset = handle->data.sched.pos;
+	request.buffer = buffer;
+	request.size = size;
+	request.queued_ns = zio__time_ns();
+	request.deadline_ns = request.queued_ns + state->deadline_ns[request.priority];
+
+	zio__mutex_lock(&state->lock);
+	zio__sched_queue *queue = &state->queues[request.priority];
+	if (queue->tail)
+		queue->tail->next = &request;
+	else
+		queue->head = &request;
+	queue->tail = &request;
+	++state->stats[request.priority].queued;
+	zio__cond_signal(&state->work);
+
+	while (!request.done)
+		zio__cond_wait(&state->done, &state->lock);
+	zio__mutex_unlock(&state->lock);
+
+	if (request.result == ZIO_ERROR)
+		return zio__set_error(handle, request.error);
+	return request.result;
+}
+
+static zio_result zio__sched_close(ZIOHandle *handle)
+{
+	zio__zero_handle(handle);
+	return ZIO_OK;
+}
+static zio_ll zio__sched_size(ZIOHandle *handle)
+{
+	return zio__sched_submit(handle, ZIO__SCHED_SIZE, NULL, 0);
+}
+static zio_ll zio__sched_seek(ZIOHandle *handle, zio_ll offset, ZIOSeek whence)
+{
+	zio_ll base;
+	switch (whence)
+	{
+	case ZIO_SEEK_SET:
+		base = 0;
+		break;
+	case ZIO_SEEK_CUR:
+		base = handle->data.sched.pos;
+		break;
+	case ZIO_SEEK_END:
+		base = zio__sched_size(handle);
+		if (base == ZIO_ERROR)
+			return ZIO_ERROR;
+		break;
+	default:
+		return zio__set_error(handle, "Invalid whence value");
+	}
+	if (base + offset < 0)
+		return zio__set_error(handle, "Invalid offset");
+	handle->data.sched.pos = base + offset;
+	return handle->data.sched.pos;
+}
+static zio_ll zio__sched_read(ZIOHandle *handle, void *destination, zio_ll size)
+{
+	zio_ll read_count = zio__sched_submit(handle, ZIO__SCHED_READ, destination, size);
+	if (read_count > 0)
+		handle->data.sched.pos += read_count;
+	return read_count;
+}
+static zio_ll zio__sched_write(ZIOHandle *handle, const void *source, zio_ll size)
+{
+	zio_ll write_count = zio__sched_submit(handle, ZIO__SCHED_WRITE, (void*)source, size);
+	if (write_count > 0)
+		handle->data.sched.pos += write_count;
+	return write_count;
+}
+
+static void zio__sched_free(zio__sched_state *state)
+{
+	zio__cond_destroy(&state->done);
+	zio__cond_destroy(&state->work);
+	zio__mutex_destroy(&state->lock);
+	zio__free(state);
+}
+
+ZIODEF zio_result zio_scheduler_begin(ZIOScheduler *scheduler, int worker_count, const int *deadline_ms)
+{
+	static const int default_deadline_ms[ZIO_PRIORITY_COUNT] = { 5, 50, 500 };
+
+	scheduler->state = NULL;
+	if (worker_count <= 0)
+		return ZIO_ERROR;
+	if (!deadline_ms)
+		deadline_ms = default_deadline_ms;
+
+	zio__sched_state *state = (zio__sched_state*)zio__alloc_zero(sizeof(zio__sched_state) + worker_count * (sizeof(ZIOHandle*) + sizeof(zio__thread)));
+	if (!state)
+		return ZIO_ERROR;
+	state->worker_count = worker_count;
+	state->threads = (zio__thread*)(state + 1);
+	state->busy = (ZIOHandle**)(state->threads + worker_count);
+	int i;
+	for (i = 0; i < ZIO_PRIORITY_COUNT; ++i)
+		state->deadline_ns[i] = (zio_u64)deadline_ms[i] * 1000000ULL;
+	zio__mutex_init(&state->lock);
+	zio__cond_init(&state->work);
+	zio__cond_init(&state->done);
+
+	// Workers claim the slots marked with the state pointer
+	for (i = 0; i < worker_count; ++i)
+		state->busy[i] = (ZIOHandle*)state;
+	for (i = 0; i < worker_count; ++i)
+	{
+		if (!zio__thread_start(&state->threads[i], zio__sched_thread, state))
+		{
+			state->worker_count = i;
+			scheduler->state = state;
+			zio_scheduler_end(scheduler);
+			return ZIO_ERROR;
+		}
+	}
+
+	scheduler->state = state;
+	return ZIO_OK;
+}
+
+ZIODEF void zio_scheduler_end(ZIOScheduler *scheduler)
+{
+	zio__sched_state *state = (zio__sched_state*)scheduler->state;
+
+	zio__mutex_lock(&state->lock);
+	state->stop = 1;
+	zio__cond_broadcast(&state->work);
+	zio__mutex_unlock(&state->lock);
+
+	int i;
+	for (i = 0; i < state->worker_count; ++i)
+		zio__thread_join(state->threads[i]);
+	zio__sched_free(state);
+	scheduler->state = NULL;
+}
+
+ZIODEF void zio_scheduler_stats(ZIOScheduler *scheduler, ZIOPriority priority, ZIOSchedulerStats *stats)
+{
+	zio__sched_state *state = (zio__sched_state*)scheduler->state;
+	zio__mutex_lock(&state->lock);
+	*stats = state->stats[priority];
+	zio__mutex_unlock(&state->lock);
+}
+
+ZIODEF zio_result zio_open_scheduled(ZIOHandle *handle, ZIOHandle *inner, ZIOScheduler *scheduler, ZIOPriority priority)
+{
+	zio__zero_handle(handle);
+
+	if (!inner || !scheduler->state || priority < 0 || priority >= ZIO_PRIORITY_COUNT)
+		return zio__set_error(handle, "Invalid handle, scheduler or priority");
+
+	handle->data.sched.inner = inner;
+	handle->data.sched.state = scheduler->state;
+	handle->data.sched.pos = zio_tell(inner);
+	if (handle->data.sched.pos == ZIO_ERROR)
+		return zio__set_error(handle, zio_last_error(inner));
+
+	handle->vtable = &zio__sched_vtables[priority];
+	return ZIO_OK;
+}
+#endif // Z_IO_NO_SCHEDULER
+
+#undef ZIO__THREADS
+#undef ZIO_POSIX
+#undef ZIO_WINDOWS
+
 #endif // Z_IO_IMPLEMENTATION